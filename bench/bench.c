@@ -0,0 +1,539 @@
+// For wait4(), mkdtemp() and clock_gettime() when using strict C99
+#define _DEFAULT_SOURCE
+#define _POSIX_C_SOURCE 200809L
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <jansson.h>
+#include "server.h"
+
+#define MAX_THREAD_COUNTS 16
+
+typedef struct {
+    bench_server_options_t server;
+    int thread_counts[MAX_THREAD_COUNTS];
+    int thread_count_count;
+    int concurrency;
+    const char *bin_dir;
+    const char *output_path;
+    int baseline;
+} bench_options_t;
+
+// What one run of a workload cost, measured from outside the process
+typedef struct {
+    int exit_status;            // Exit code, or 128 + signal
+    long long wall_us;
+    long long user_us;          // CPU time of the process and the children it waited for
+    long long sys_us;
+    long max_rss_kb;
+} run_usage_t;
+
+// What one run achieved, read from the tool's own output
+typedef struct {
+    long ok;
+    long failed;
+    long long bytes;
+    long long p50_us;
+    long long p99_us;
+} run_result_t;
+
+static void print_usage() {
+    printf("Usage: curly_bench [options]\n");
+    printf("Runs curly_parallel, curly --batch and curl + xargs -P against a loopback server\n");
+    printf("and writes one JSON line of results per run.\n");
+    printf("Options:\n");
+    printf("  --files N            : Number of files served (default: 200)\n");
+    printf("  --size B             : Size of every file in bytes (default: 262144)\n");
+    printf("  --latency MS         : Delay the server adds before each response (default: 0)\n");
+    printf("  --error-rate PCT     : Percentage of requests answered with 503 (default: 0)\n");
+    printf("  --threads LIST       : Comma-separated curly_parallel thread counts (default: 1,2,4,8)\n");
+    printf("  -c, --concurrency N  : Transfers in flight for every workload (default: 64)\n");
+    printf("  --bin DIR            : Where curly and curly_parallel are (default: bin)\n");
+    printf("  --no-baseline        : Skip the curl + xargs -P baseline\n");
+    printf("  -o, --output FILE    : Write results to FILE instead of stdout\n");
+    printf("  -h, --help           : Display this help message\n");
+    printf("\nExamples:\n");
+    printf("  curly_bench\n");
+    printf("  curly_bench --files 2000 --size 4096 --threads 1,4 -c 256\n");
+    printf("  curly_bench --latency 20 --error-rate 5 -o results.jsonl\n");
+}
+
+static long long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static long long timeval_us(const struct timeval *tv) {
+    return (long long)tv->tv_sec * 1000000LL + tv->tv_usec;
+}
+
+// Run a program with stdin and stdout redirected to files and measure it.
+// stderr goes to the log so progress output doesn't disturb the results.
+static int run_measured(char *const argv[], const char *stdin_path, const char *stdout_path,
+                        const char *log_path, run_usage_t *usage) {
+    long long start = now_us();
+    pid_t pid = fork();
+    if (pid < 0) {
+        return -1;
+    }
+    if (pid == 0) {
+        int in = open(stdin_path ? stdin_path : "/dev/null", O_RDONLY);
+        int out = open(stdout_path ? stdout_path : "/dev/null", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        int log = open(log_path ? log_path : "/dev/null", O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (in < 0 || out < 0 || log < 0) {
+            _exit(127);
+        }
+        dup2(in, STDIN_FILENO);
+        dup2(out, STDOUT_FILENO);
+        dup2(log, STDERR_FILENO);
+        execvp(argv[0], argv);
+        fprintf(stderr, "Error: Cannot run %s: %s\n", argv[0], strerror(errno));
+        _exit(127);
+    }
+
+    int status = 0;
+    struct rusage rusage;
+    while (wait4(pid, &status, 0, &rusage) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    usage->wall_us = now_us() - start;
+    usage->user_us = timeval_us(&rusage.ru_utime);
+    usage->sys_us = timeval_us(&rusage.ru_stime);
+    usage->max_rss_kb = rusage.ru_maxrss;
+    usage->exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    return 0;
+}
+
+// Remove a directory of downloaded files
+static void remove_dir(const char *path) {
+    DIR *dir = opendir(path);
+    if (!dir) {
+        return;
+    }
+    struct dirent *entry;
+    char file[4096];
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+        unlink(file);
+    }
+    closedir(dir);
+    rmdir(path);
+}
+
+static int compare_long_long(const void *a, const void *b) {
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of a sorted array
+static long long percentile(const long long *sorted, size_t count, double p) {
+    if (count == 0) {
+        return 0;
+    }
+    size_t rank = (size_t)(p / 100.0 * count + 0.999999);
+    if (rank < 1) {
+        rank = 1;
+    }
+    return sorted[(rank > count ? count : rank) - 1];
+}
+
+static void fill_percentiles(run_result_t *result, long long *latencies, size_t count) {
+    qsort(latencies, count, sizeof(long long), compare_long_long);
+    result->p50_us = percentile(latencies, count, 50);
+    result->p99_us = percentile(latencies, count, 99);
+}
+
+// Read the overall summary curly_parallel wrote after the per-transfer lines
+static int read_parallel_stats(const char *path, run_result_t *result) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return -1;
+    }
+    char line[8192];
+    int found = 0;
+    while (fgets(line, sizeof(line), file)) {
+        json_t *object = json_loads(line, 0, NULL);
+        if (!object) {
+            continue;
+        }
+        const char *summary = json_string_value(json_object_get(object, "summary"));
+        if (summary && strcmp(summary, "overall") == 0) {
+            long transfers = (long)json_integer_value(json_object_get(object, "transfers"));
+            result->failed = (long)json_integer_value(json_object_get(object, "failures"));
+            result->ok = transfers - result->failed;
+            result->bytes = json_integer_value(json_object_get(object, "bytes"));
+            json_t *total = json_object_get(object, "total_us");
+            result->p50_us = json_integer_value(json_object_get(total, "p50"));
+            result->p99_us = json_integer_value(json_object_get(total, "p99"));
+            found = 1;
+        }
+        json_decref(object);
+    }
+    fclose(file);
+    return found ? 0 : -1;
+}
+
+// Read batch result lines: {"status": ..., "timing": {...}, "error": ...}
+static int read_batch_results(const char *path, run_result_t *result) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return -1;
+    }
+    size_t capacity = 1024;
+    size_t count = 0;
+    long long *latencies = malloc(capacity * sizeof(long long));
+    char line[65536];
+    while (latencies && fgets(line, sizeof(line), file)) {
+        json_t *object = json_loads(line, 0, NULL);
+        if (!object) {
+            continue;
+        }
+        long status = (long)json_integer_value(json_object_get(object, "status"));
+        json_t *timing = json_object_get(object, "timing");
+        if (json_is_null(json_object_get(object, "error")) && status >= 200 && status < 400) {
+            result->ok++;
+        } else {
+            result->failed++;
+        }
+        result->bytes += json_integer_value(json_object_get(timing, "bytes"));
+        if (timing) {
+            if (count == capacity) {
+                long long *grown = realloc(latencies, capacity * 2 * sizeof(long long));
+                if (!grown) {
+                    json_decref(object);
+                    break;
+                }
+                latencies = grown;
+                capacity *= 2;
+            }
+            latencies[count++] = json_integer_value(json_object_get(timing, "total_us"));
+        }
+        json_decref(object);
+    }
+    fclose(file);
+    if (!latencies) {
+        return -1;
+    }
+    fill_percentiles(result, latencies, count);
+    free(latencies);
+    return 0;
+}
+
+// Read the "%{http_code} %{time_total} %{size_download}" lines curl wrote
+static int read_curl_results(const char *path, run_result_t *result) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return -1;
+    }
+    size_t capacity = 1024;
+    size_t count = 0;
+    long long *latencies = malloc(capacity * sizeof(long long));
+    long status;
+    double seconds;
+    long long bytes;
+    while (latencies && fscanf(file, "%ld %lf %lld", &status, &seconds, &bytes) == 3) {
+        if (status >= 200 && status < 400) {
+            result->ok++;
+        } else {
+            result->failed++;
+        }
+        result->bytes += bytes;
+        if (count == capacity) {
+            long long *grown = realloc(latencies, capacity * 2 * sizeof(long long));
+            if (!grown) {
+                break;
+            }
+            latencies = grown;
+            capacity *= 2;
+        }
+        latencies[count++] = (long long)(seconds * 1e6 + 0.5);
+    }
+    fclose(file);
+    if (!latencies) {
+        return -1;
+    }
+    fill_percentiles(result, latencies, count);
+    free(latencies);
+    return 0;
+}
+
+static void report(FILE *output, const bench_options_t *options, const char *workload, int threads,
+                   const run_usage_t *usage, const run_result_t *result) {
+    json_t *line = json_object();
+    if (!line) {
+        return;
+    }
+    double seconds = usage->wall_us / 1e6;
+    json_object_set_new(line, "workload", json_string(workload));
+    json_object_set_new(line, "threads", json_integer(threads));
+    json_object_set_new(line, "concurrency", json_integer(options->concurrency));
+    json_object_set_new(line, "files", json_integer(options->server.file_count));
+    json_object_set_new(line, "file_size", json_integer((json_int_t)options->server.file_size));
+    json_object_set_new(line, "latency_ms", json_integer(options->server.latency_ms));
+    json_object_set_new(line, "error_rate", json_integer(options->server.error_percent));
+    json_object_set_new(line, "exit_status", json_integer(usage->exit_status));
+    json_object_set_new(line, "ok", json_integer(result->ok));
+    json_object_set_new(line, "failed", json_integer(result->failed));
+    json_object_set_new(line, "bytes", json_integer(result->bytes));
+    json_object_set_new(line, "wall_us", json_integer(usage->wall_us));
+    json_object_set_new(line, "bytes_per_sec", json_integer((json_int_t)(seconds > 0 ? result->bytes / seconds : 0)));
+    json_object_set_new(line, "requests_per_sec",
+                        json_integer((json_int_t)(seconds > 0 ? (result->ok + result->failed) / seconds : 0)));
+    json_object_set_new(line, "p50_us", json_integer(result->p50_us));
+    json_object_set_new(line, "p99_us", json_integer(result->p99_us));
+    json_object_set_new(line, "cpu_user_us", json_integer(usage->user_us));
+    json_object_set_new(line, "cpu_sys_us", json_integer(usage->sys_us));
+    json_object_set_new(line, "max_rss_kb", json_integer(usage->max_rss_kb));
+
+    char *text = json_dumps(line, JSON_COMPACT);
+    if (text) {
+        fprintf(output, "%s\n", text);
+        fflush(output);
+        free(text);
+    }
+    json_decref(line);
+}
+
+// Write the inputs every workload shares: a TSV for curly_parallel, JSONL
+// configs for curly --batch and curl arguments for xargs
+static int write_inputs(const char *dir, int port, const bench_options_t *options) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/files.tsv", dir);
+    FILE *tsv = fopen(path, "w");
+    snprintf(path, sizeof(path), "%s/requests.jsonl", dir);
+    FILE *jsonl = fopen(path, "w");
+    snprintf(path, sizeof(path), "%s/curl.args", dir);
+    FILE *args = fopen(path, "w");
+    int ok = tsv && jsonl && args;
+
+    for (int i = 0; ok && i < options->server.file_count; i++) {
+        fprintf(tsv, "http://127.0.0.1:%d/files/%d\t%s/out/%d\n", port, i, dir, i);
+        fprintf(jsonl, "{\"id\": %d, \"url\": \"http://127.0.0.1:%d/files/%d\"}\n", i, port, i);
+        fprintf(args, "-o %s/out/%d http://127.0.0.1:%d/files/%d\n", dir, i, port, i);
+    }
+
+    if (tsv) {
+        fclose(tsv);
+    }
+    if (jsonl) {
+        fclose(jsonl);
+    }
+    if (args) {
+        fclose(args);
+    }
+    return ok ? 0 : -1;
+}
+
+static int bench_parallel(const char *dir, const bench_options_t *options, int threads, FILE *output) {
+    char program[4096], input[4096], stats[4096], log[4096], thread_arg[16], concurrency_arg[16];
+    snprintf(program, sizeof(program), "%s/curly_parallel", options->bin_dir);
+    snprintf(input, sizeof(input), "%s/files.tsv", dir);
+    snprintf(stats, sizeof(stats), "%s/stats.jsonl", dir);
+    snprintf(log, sizeof(log), "%s/bench.log", dir);
+    snprintf(thread_arg, sizeof(thread_arg), "%d", threads);
+    snprintf(concurrency_arg, sizeof(concurrency_arg), "%d", options->concurrency);
+
+    // No retries, so injected errors cost the same as in the other workloads
+    char *argv[] = {program, "-i", input, "-t", thread_arg, "-c", concurrency_arg,
+                    "--per-host", concurrency_arg, "--retries", "0", "--stats", stats, NULL};
+    run_usage_t usage;
+    run_result_t result = {0};
+    if (run_measured(argv, NULL, NULL, log, &usage) != 0 || read_parallel_stats(stats, &result) != 0) {
+        fprintf(stderr, "Error: curly_parallel run with %d threads failed, see %s\n", threads, log);
+        return -1;
+    }
+    report(output, options, "curly_parallel", threads, &usage, &result);
+
+    char out_dir[4096];
+    snprintf(out_dir, sizeof(out_dir), "%s/out", dir);
+    remove_dir(out_dir);
+    return 0;
+}
+
+static int bench_batch(const char *dir, const bench_options_t *options, FILE *output) {
+    char program[4096], input[4096], results[4096], body_dir[4096], log[4096], concurrency_arg[16];
+    snprintf(program, sizeof(program), "%s/curly", options->bin_dir);
+    snprintf(input, sizeof(input), "%s/requests.jsonl", dir);
+    snprintf(results, sizeof(results), "%s/results.jsonl", dir);
+    snprintf(body_dir, sizeof(body_dir), "%s/out", dir);
+    snprintf(log, sizeof(log), "%s/bench.log", dir);
+    snprintf(concurrency_arg, sizeof(concurrency_arg), "%d", options->concurrency);
+
+    char *argv[] = {program, "--batch", input, "-c", concurrency_arg, "--body-dir", body_dir, NULL};
+    run_usage_t usage;
+    run_result_t result = {0};
+    if (run_measured(argv, NULL, results, log, &usage) != 0 || read_batch_results(results, &result) != 0) {
+        fprintf(stderr, "Error: curly --batch run failed, see %s\n", log);
+        return -1;
+    }
+    report(output, options, "curly_batch", 1, &usage, &result);
+    remove_dir(body_dir);
+    return 0;
+}
+
+static int bench_baseline(const char *dir, const bench_options_t *options, FILE *output) {
+    char input[4096], results[4096], out_dir[4096], log[4096], concurrency_arg[16];
+    snprintf(input, sizeof(input), "%s/curl.args", dir);
+    snprintf(results, sizeof(results), "%s/curl.out", dir);
+    snprintf(out_dir, sizeof(out_dir), "%s/out", dir);
+    snprintf(log, sizeof(log), "%s/bench.log", dir);
+    snprintf(concurrency_arg, sizeof(concurrency_arg), "%d", options->concurrency);
+
+    if (mkdir(out_dir, 0755) != 0 && errno != EEXIST) {
+        return -1;
+    }
+
+    // One curl process per file, as many at once as curly keeps in flight
+    char *argv[] = {"xargs", "-P", concurrency_arg, "-n", "3", "curl", "-sS",
+                    "-w", "%{http_code} %{time_total} %{size_download}\\n", NULL};
+    run_usage_t usage;
+    run_result_t result = {0};
+    if (run_measured(argv, input, results, log, &usage) != 0 || read_curl_results(results, &result) != 0) {
+        fprintf(stderr, "Error: curl baseline failed, see %s\n", log);
+        return -1;
+    }
+    report(output, options, "curl_xargs", options->concurrency, &usage, &result);
+    remove_dir(out_dir);
+    return 0;
+}
+
+static int parse_thread_counts(const char *list, bench_options_t *options) {
+    options->thread_count_count = 0;
+    const char *p = list;
+    while (*p) {
+        char *end;
+        long threads = strtol(p, &end, 10);
+        if (end == p || threads <= 0 || options->thread_count_count == MAX_THREAD_COUNTS) {
+            return -1;
+        }
+        options->thread_counts[options->thread_count_count++] = (int)threads;
+        p = *end == ',' ? end + 1 : end;
+        if (*end != ',' && *end != '\0') {
+            return -1;
+        }
+    }
+    return options->thread_count_count > 0 ? 0 : -1;
+}
+
+int main(int argc, char *argv[]) {
+    bench_options_t options = {
+        .server = {.file_count = 200, .file_size = 262144, .latency_ms = 0, .error_percent = 0},
+        .concurrency = 64,
+        .bin_dir = "bin",
+        .output_path = NULL,
+        .baseline = 1,
+    };
+    parse_thread_counts("1,2,4,8", &options);
+
+    // Parse command line arguments
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+            print_usage();
+            return EXIT_SUCCESS;
+        } else if (strcmp(argv[i], "--files") == 0 && i + 1 < argc) {
+            options.server.file_count = atoi(argv[++i]);
+            if (options.server.file_count <= 0) {
+                fprintf(stderr, "Error: File count must be a positive integer\n");
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            options.server.file_size = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--latency") == 0 && i + 1 < argc) {
+            options.server.latency_ms = atoi(argv[++i]);
+            if (options.server.latency_ms < 0) {
+                fprintf(stderr, "Error: Latency must be a non-negative integer\n");
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--error-rate") == 0 && i + 1 < argc) {
+            options.server.error_percent = atoi(argv[++i]);
+            if (options.server.error_percent < 0 || options.server.error_percent > 100) {
+                fprintf(stderr, "Error: Error rate must be a percentage from 0 to 100\n");
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            if (parse_thread_counts(argv[++i], &options) != 0) {
+                fprintf(stderr, "Error: Thread counts must be a comma-separated list of positive integers\n");
+                return EXIT_FAILURE;
+            }
+        } else if ((strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--concurrency") == 0) && i + 1 < argc) {
+            options.concurrency = atoi(argv[++i]);
+            if (options.concurrency <= 0) {
+                fprintf(stderr, "Error: Concurrency must be a positive integer\n");
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--bin") == 0 && i + 1 < argc) {
+            options.bin_dir = argv[++i];
+        } else if (strcmp(argv[i], "--no-baseline") == 0) {
+            options.baseline = 0;
+        } else if ((strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "--output") == 0) && i + 1 < argc) {
+            options.output_path = argv[++i];
+        } else {
+            fprintf(stderr, "Error: Unknown option: %s\n", argv[i]);
+            print_usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    FILE *output = stdout;
+    if (options.output_path) {
+        output = fopen(options.output_path, "w");
+        if (!output) {
+            fprintf(stderr, "Error: Cannot open output file %s\n", options.output_path);
+            return EXIT_FAILURE;
+        }
+    }
+
+    char dir[] = "/tmp/curly-bench.XXXXXX";
+    if (!mkdtemp(dir)) {
+        fprintf(stderr, "Error: Cannot create a work directory: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    bench_server_t *server = bench_server_start(&options.server);
+    if (!server) {
+        fprintf(stderr, "Error: Cannot start the loopback server\n");
+        rmdir(dir);
+        return EXIT_FAILURE;
+    }
+
+    int failed = write_inputs(dir, bench_server_port(server), &options) != 0;
+    for (int i = 0; !failed && i < options.thread_count_count; i++) {
+        failed = bench_parallel(dir, &options, options.thread_counts[i], output) != 0;
+    }
+    if (!failed) {
+        failed = bench_batch(dir, &options, output) != 0;
+    }
+    if (!failed && options.baseline) {
+        failed = bench_baseline(dir, &options, output) != 0;
+    }
+
+    bench_server_stop(server);
+    if (output != stdout) {
+        fclose(output);
+    }
+
+    // Keep the inputs and the log around when something went wrong
+    if (failed) {
+        return EXIT_FAILURE;
+    }
+    remove_dir(dir);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,350 @@
+// For sockets, nanosleep() and strncasecmp() when using strict C99
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include "server.h"
+
+#define REQUEST_BUFFER_SIZE 8192
+#define BODY_BLOCK_SIZE 65536
+
+struct bench_server {
+    bench_server_options_t options;
+    int listen_fd;
+    int port;
+    pthread_t accept_thread;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t idle;        // Signalled when the last connection closes
+    int connections;            // Open connections
+    unsigned long requests;     // File requests answered
+};
+
+typedef struct {
+    bench_server_t *server;
+    int fd;
+} connection_t;
+
+// Every body is cut from this block, so the server never touches the heap per request
+static char body_block[BODY_BLOCK_SIZE];
+
+static int send_all(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += sent;
+        length -= (size_t)sent;
+    }
+    return 0;
+}
+
+static int send_body(int fd, size_t length) {
+    while (length > 0) {
+        size_t chunk = length < BODY_BLOCK_SIZE ? length : BODY_BLOCK_SIZE;
+        if (send_all(fd, body_block, chunk) != 0) {
+            return -1;
+        }
+        length -= chunk;
+    }
+    return 0;
+}
+
+static void sleep_ms(int ms) {
+    struct timespec delay = {ms / 1000, (long)(ms % 1000) * 1000000L};
+    while (nanosleep(&delay, &delay) != 0 && errno == EINTR) {
+    }
+}
+
+// Count a request and decide whether it gets an injected error. Errors are
+// spread evenly: request n fails when n * percent / 100 ticks over.
+static int next_request_fails(bench_server_t *server) {
+    pthread_mutex_lock(&server->mutex);
+    unsigned long n = server->requests++;
+    pthread_mutex_unlock(&server->mutex);
+
+    int percent = server->options.error_percent;
+    return percent > 0 && (n + 1) * percent / 100 != n * percent / 100;
+}
+
+// Find a header's value in a request head, or NULL
+static const char *find_header(const char *head, const char *name, size_t *length) {
+    size_t name_len = strlen(name);
+    const char *line = strstr(head, "\r\n");
+    while (line && line[2] != '\r') {
+        line += 2;
+        const char *end = strstr(line, "\r\n");
+        if (!end) {
+            return NULL;
+        }
+        if ((size_t)(end - line) > name_len && line[name_len] == ':' && strncasecmp(line, name, name_len) == 0) {
+            const char *value = line + name_len + 1;
+            while (*value == ' ' || *value == '\t') {
+                value++;
+            }
+            *length = (size_t)(end - value);
+            return value;
+        }
+        line = end;
+    }
+    return NULL;
+}
+
+// Answer one request head. Returns non-zero if the connection should close.
+static int handle_request(bench_server_t *server, int fd, const char *head) {
+    char method[16];
+    char path[256];
+    int version_minor = 1;
+    if (sscanf(head, "%15s %255s HTTP/1.%d", method, path, &version_minor) < 2) {
+        const char *bad = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        send_all(fd, bad, strlen(bad));
+        return 1;
+    }
+
+    size_t value_len = 0;
+    const char *connection = find_header(head, "Connection", &value_len);
+    int close_after = version_minor == 0;
+    if (connection && value_len == 5 && strncasecmp(connection, "close", 5) == 0) {
+        close_after = 1;
+    }
+    int head_only = strcmp(method, "HEAD") == 0;
+
+    if (server->options.latency_ms > 0) {
+        sleep_ms(server->options.latency_ms);
+    }
+
+    int status = 200;
+    const char *reason = "OK";
+    size_t body_len = server->options.file_size;
+    char *end = NULL;
+    long index = strncmp(path, "/files/", 7) == 0 ? strtol(path + 7, &end, 10) : -1;
+    if (index < 0 || index >= server->options.file_count || !end || (*end != '\0' && *end != '?')) {
+        status = 404;
+        reason = "Not Found";
+        body_len = 0;
+    } else if (next_request_fails(server)) {
+        status = 503;
+        reason = "Service Unavailable";
+        body_len = 0;
+    }
+
+    char response[256];
+    int response_len = snprintf(response, sizeof(response),
+                                "HTTP/1.1 %d %s\r\n"
+                                "Content-Type: application/octet-stream\r\n"
+                                "Content-Length: %zu\r\n"
+                                "Connection: %s\r\n"
+                                "\r\n",
+                                status, reason, body_len, close_after ? "close" : "keep-alive");
+    if (send_all(fd, response, (size_t)response_len) != 0) {
+        return 1;
+    }
+    if (!head_only && send_body(fd, body_len) != 0) {
+        return 1;
+    }
+    return close_after;
+}
+
+static void *connection_thread(void *arg) {
+    connection_t *conn = arg;
+    bench_server_t *server = conn->server;
+    char buffer[REQUEST_BUFFER_SIZE];
+    size_t filled = 0;
+
+    for (;;) {
+        char *head_end = NULL;
+        buffer[filled] = '\0';
+        while (!(head_end = strstr(buffer, "\r\n\r\n"))) {
+            if (filled == sizeof(buffer) - 1) {
+                goto done;
+            }
+            ssize_t received = recv(conn->fd, buffer + filled, sizeof(buffer) - 1 - filled, 0);
+            if (received < 0 && errno == EINTR) {
+                continue;
+            }
+            if (received <= 0) {
+                goto done;
+            }
+            filled += (size_t)received;
+            buffer[filled] = '\0';
+        }
+
+        head_end[2] = '\0';
+        size_t head_size = (size_t)(head_end + 4 - buffer);
+
+        // Request bodies are read and thrown away
+        size_t value_len = 0;
+        const char *length_value = find_header(buffer, "Content-Length", &value_len);
+        size_t body_left = length_value ? strtoul(length_value, NULL, 10) : 0;
+
+        if (handle_request(server, conn->fd, buffer)) {
+            break;
+        }
+
+        size_t rest = filled - head_size;
+        size_t skip = rest < body_left ? rest : body_left;
+        memmove(buffer, buffer + head_size + skip, rest - skip);
+        filled = rest - skip;
+        body_left -= skip;
+        while (body_left > 0) {
+            char sink[4096];
+            ssize_t received = recv(conn->fd, sink, body_left < sizeof(sink) ? body_left : sizeof(sink), 0);
+            if (received < 0 && errno == EINTR) {
+                continue;
+            }
+            if (received <= 0) {
+                goto done;
+            }
+            body_left -= (size_t)received;
+        }
+    }
+
+done:
+    close(conn->fd);
+    free(conn);
+
+    pthread_mutex_lock(&server->mutex);
+    if (--server->connections == 0) {
+        pthread_cond_broadcast(&server->idle);
+    }
+    pthread_mutex_unlock(&server->mutex);
+    return NULL;
+}
+
+static void *accept_thread(void *arg) {
+    bench_server_t *server = arg;
+
+    for (;;) {
+        int fd = accept(server->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            // The listening socket was shut down
+            break;
+        }
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        connection_t *conn = malloc(sizeof(connection_t));
+        if (!conn) {
+            close(fd);
+            continue;
+        }
+        conn->server = server;
+        conn->fd = fd;
+
+        pthread_mutex_lock(&server->mutex);
+        server->connections++;
+        pthread_mutex_unlock(&server->mutex);
+
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        pthread_attr_setstacksize(&attr, 256 * 1024);
+        if (pthread_create(&thread, &attr, connection_thread, conn) != 0) {
+            close(fd);
+            free(conn);
+            pthread_mutex_lock(&server->mutex);
+            server->connections--;
+            pthread_mutex_unlock(&server->mutex);
+        }
+        pthread_attr_destroy(&attr);
+    }
+    return NULL;
+}
+
+bench_server_t *bench_server_start(const bench_server_options_t *options) {
+    for (size_t i = 0; i < BODY_BLOCK_SIZE; i++) {
+        body_block[i] = (char)('a' + i % 26);
+    }
+
+    bench_server_t *server = calloc(1, sizeof(bench_server_t));
+    if (!server) {
+        return NULL;
+    }
+    server->options = *options;
+    pthread_mutex_init(&server->mutex, NULL);
+    pthread_cond_init(&server->idle, NULL);
+
+    server->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (server->listen_fd < 0) {
+        goto fail;
+    }
+    int one = 1;
+    setsockopt(server->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    socklen_t addr_len = sizeof(addr);
+    if (bind(server->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(server->listen_fd, 1024) != 0 ||
+        getsockname(server->listen_fd, (struct sockaddr *)&addr, &addr_len) != 0) {
+        close(server->listen_fd);
+        goto fail;
+    }
+    server->port = ntohs(addr.sin_port);
+
+    if (pthread_create(&server->accept_thread, NULL, accept_thread, server) != 0) {
+        close(server->listen_fd);
+        goto fail;
+    }
+    return server;
+
+fail:
+    pthread_cond_destroy(&server->idle);
+    pthread_mutex_destroy(&server->mutex);
+    free(server);
+    return NULL;
+}
+
+int bench_server_port(const bench_server_t *server) {
+    return server->port;
+}
+
+unsigned long bench_server_requests(bench_server_t *server) {
+    pthread_mutex_lock(&server->mutex);
+    unsigned long requests = server->requests;
+    pthread_mutex_unlock(&server->mutex);
+    return requests;
+}
+
+void bench_server_stop(bench_server_t *server) {
+    if (!server) {
+        return;
+    }
+
+    shutdown(server->listen_fd, SHUT_RDWR);
+    pthread_join(server->accept_thread, NULL);
+    close(server->listen_fd);
+
+    // Clients have exited by now, so every connection sees EOF shortly
+    pthread_mutex_lock(&server->mutex);
+    while (server->connections > 0) {
+        pthread_cond_wait(&server->idle, &server->mutex);
+    }
+    pthread_mutex_unlock(&server->mutex);
+
+    pthread_cond_destroy(&server->idle);
+    pthread_mutex_destroy(&server->mutex);
+    free(server);
+}
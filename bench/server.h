@@ -0,0 +1,55 @@
+#ifndef CURLY_BENCH_SERVER_H
+#define CURLY_BENCH_SERVER_H
+
+#include <stddef.h>
+
+/**
+ * What the stand-in server serves: /files/0 ... /files/N-1, each a body of
+ * the same size, optionally answering late or with errors.
+ */
+typedef struct {
+    int file_count;             // Number of files served
+    size_t file_size;           // Body size of every file in bytes
+    int latency_ms;             // Delay before each response
+    int error_percent;          // Share of requests answered with 503, spread evenly
+} bench_server_options_t;
+
+/**
+ * HTTP/1.1 server on a loopback port, one thread per connection, with
+ * keep-alive. Only meant to stand in for a real server in benchmarks.
+ */
+typedef struct bench_server bench_server_t;
+
+/**
+ * Start serving on an ephemeral port of 127.0.0.1
+ *
+ * @param options What to serve
+ * @return Running server, or NULL if it could not be started
+ */
+bench_server_t *bench_server_start(const bench_server_options_t *options);
+
+/**
+ * Get the port the server listens on
+ *
+ * @param server Running server
+ * @return Port number
+ */
+int bench_server_port(const bench_server_t *server);
+
+/**
+ * Get the number of file requests answered so far, errors included
+ *
+ * @param server Running server
+ * @return Request count
+ */
+unsigned long bench_server_requests(bench_server_t *server);
+
+/**
+ * Stop listening, wait for open connections to be closed by their clients
+ * and free the server
+ *
+ * @param server Server to stop, may be NULL
+ */
+void bench_server_stop(bench_server_t *server);
+
+#endif /* CURLY_BENCH_SERVER_H */
@@ -22,17 +22,109 @@ typedef enum {
     CURLY_ERROR_MEMORY_ALLOCATION,
     CURLY_ERROR_FILE_OPEN,
     CURLY_ERROR_THREAD_CREATE,
-    CURLY_ERROR_UNKNOWN
+    CURLY_ERROR_UNKNOWN,
+    // Added later; appended so existing codes keep their values
+    CURLY_ERROR_FILE_WRITE,
+    CURLY_ERROR_MISSING_VARIABLE,
+    CURLY_ERROR_SOCKET
 } curly_error_t;
 
+/**
+ * Region that a request's configuration, header strings, body and
+ * response can be allocated from and released in one go. Opaque; see
+ * curly_arena_create().
+ */
+typedef struct curly_arena curly_arena_t;
+
+/**
+ * Set of idle response buffers that buffer sinks reuse instead of growing
+ * a fresh allocation for every response. Opaque and thread-safe; see
+ * curly_buffer_pool_create().
+ */
+typedef struct curly_buffer_pool curly_buffer_pool_t;
+
 /**
  * Structure to hold response data
  */
 typedef struct {
     char *data;
     size_t size;
+    size_t capacity;             // Allocated size of data
+    curly_arena_t *arena;        // Arena holding data, NULL if it is on the heap
+    curly_buffer_pool_t *pool;   // Pool data goes back to when freed, NULL if none
+    void *mapping;               // Mapped cache entry holding data, NULL if none
+    size_t mapping_size;
 } curly_response_t;
 
+/**
+ * Callback receiving response data as it arrives
+ *
+ * @param data Chunk of the response body (not NUL-terminated)
+ * @param size Number of bytes in the chunk
+ * @param userdata User pointer given when the sink was initialized
+ * @return Number of bytes consumed; anything other than size aborts the transfer
+ */
+typedef size_t (*curly_sink_callback_t)(const char *data, size_t size, void *userdata);
+
+/**
+ * Kinds of response sinks
+ */
+typedef enum {
+    CURLY_SINK_BUFFER = 0,  // Collect the body in a curly_response_t
+    CURLY_SINK_FD,          // Write the body to a file descriptor as it arrives
+    CURLY_SINK_CALLBACK     // Hand each chunk of the body to a callback
+} curly_sink_type_t;
+
+/**
+ * Destination for a response body. Initialize with one of the
+ * curly_sink_init_* functions.
+ */
+typedef struct {
+    curly_sink_type_t type;
+    curly_response_t *response;      // CURLY_SINK_BUFFER
+    int fd;                          // CURLY_SINK_FD
+    curly_sink_callback_t callback;  // CURLY_SINK_CALLBACK
+    void *userdata;                  // CURLY_SINK_CALLBACK
+} curly_sink_t;
+
+/**
+ * HTTP versions for the concurrent engines
+ */
+typedef enum {
+    CURLY_HTTP_1 = 0,              // HTTP/1.1, one transfer per connection at a time
+    CURLY_HTTP_2,                  // HTTP/2 where TLS negotiates it (ALPN), HTTP/1.1 otherwise
+    CURLY_HTTP_2_PRIOR_KNOWLEDGE   // HTTP/2 without negotiation, including cleartext h2c
+} curly_http_version_t;
+
+/**
+ * How a file fetched once is given to further destinations
+ */
+typedef enum {
+    CURLY_DEDUP_OFF = 0,    // Fetch every input line on its own
+    CURLY_DEDUP_COPY,       // Reflink where the filesystem can, copy otherwise
+    CURLY_DEDUP_LINK        // Hard link, so the destinations share one inode
+} curly_dedup_mode_t;
+
+/**
+ * When downloaded files are flushed to stable storage
+ */
+typedef enum {
+    CURLY_FSYNC_NONE = 0,   // Leave it to the kernel
+    CURLY_FSYNC_FILE,       // Each file and its directory, before the file is reported done
+    CURLY_FSYNC_BATCH       // Each filesystem written to, once per batch of files and at the end
+} curly_fsync_mode_t;
+
+/**
+ * Bandwidth and request-rate limits. Fields left at 0 do not limit anything.
+ */
+typedef struct {
+    curl_off_t bytes_per_sec;       // Download rate across all transfers
+    double requests_per_sec;        // Rate of new requests across all hosts
+    curl_off_t host_bytes_per_sec;  // Download rate from any one host
+    double host_requests_per_sec;   // Rate of new requests to any one host
+    long burst_ms;                  // How much of a rate may be used at once, in milliseconds
+} curly_rate_limit_t;
+
 /**
  * Structure for HTTP request configuration
  */
@@ -48,9 +140,73 @@ typedef struct {
     int max_redirects;
     int timeout;
     json_t *retry;
+    json_t *cache;         // Response cache directory, or {"dir", "max_age"}; NULL for none
+    json_t *compression;   // Codings to offer: true, "gzip, br" or {"encodings", "decode"}; NULL for none
+    curly_rate_limit_t rate_limit;
     int verbose;
+    curly_arena_t *arena;  // Arena holding url and method, NULL if they are on the heap
+    json_t *source;        // Document the JSON fields are borrowed from when arena is set
 } curly_config_t;
 
+/**
+ * Options for parallel downloads
+ */
+typedef struct {
+    int thread_count;   // Number of event loop threads, 0 for one per CPU
+    int max_transfers;  // Maximum number of concurrent transfers across all threads
+    int max_per_host;   // Maximum number of concurrent transfers to any one host
+    int writer_threads; // Number of threads writing downloaded data to disk
+    int write_buffers;  // Number of 256 KiB buffers queued between network and disk
+    int segments;       // Maximum connections per file, 1 to never split files
+    curl_off_t min_segment_size;  // Smallest range worth its own connection, in bytes
+    const char *journal_path;     // Completion journal for skipping and resuming, NULL for none
+    int revalidate;     // Check journaled files with conditional requests instead of skipping them
+    int retries;        // Extra attempts after a transient failure, 0 to never retry
+    long retry_delay_ms;  // Backoff before the first retry, doubled for each further one
+    curly_rate_limit_t rate_limit;  // Bandwidth and request-rate shaping
+    curly_http_version_t http_version;  // HTTP/2 multiplexes transfers to a host over few connections
+    int max_streams;    // Concurrent HTTP/2 streams per connection
+    const char *stats_path;  // JSONL file receiving each transfer's timing and a summary, NULL for none
+    int summary;        // Print latency percentiles per phase and host to stderr at the end
+    const char *log_path;  // File receiving one TSV result line per download, NULL to print them
+    long progress_interval_ms;  // How often to print a progress line to stderr, 0 for never
+    curly_dedup_mode_t dedup;   // Lines repeating a URL still being fetched share its download
+    const char *store_path;     // Content-addressed store keeping each payload once, NULL for none
+    int preresolve;     // Look up every host of a regular input file concurrently before the first download
+    const char *hosts_path;     // File of URLs or host[:port] names to look up before the run, NULL for none
+    const struct curl_slist *resolve;  // Static "HOST:PORT:ADDRESS[,ADDRESS]" entries, NULL for none
+    int prewarm;        // Connect each loop to the input's hosts before it takes jobs; implies preresolve
+    int in_place;       // Write straight to destinations instead of renaming finished files over them
+    curly_fsync_mode_t fsync_mode;  // When finished files are flushed to disk
+    const char *accept_encoding;  // Codings to ask for and decode, "" for all libcurl can decode; NULL for none
+    int keep_encoded;   // Store coded bodies as sent, named with an extension like .gz; asks for every coding by default
+} curly_parallel_options_t;
+
+/**
+ * Options for batch mode
+ */
+typedef struct {
+    int max_concurrent;    // Maximum number of requests in flight
+    const char *body_dir;  // If set, write response bodies to files in this directory
+    curly_http_version_t http_version;  // HTTP/2 multiplexes requests to a host over few connections
+    int max_streams;       // Concurrent HTTP/2 streams per connection
+    int summary;           // Print latency percentiles per phase and host to stderr at the end
+} curly_batch_options_t;
+
+/**
+ * A request compiled once from a configuration and executed any number of
+ * times with different variables. Opaque; see curly_plan_compile().
+ */
+typedef struct curly_plan curly_plan_t;
+
+/**
+ * Value for a {{name}} placeholder in a compiled request
+ */
+typedef struct {
+    const char *name;
+    const char *value;
+} curly_var_t;
+
 /**
  * Parse JSON configuration and initialize curly_config_t
  *
@@ -60,6 +216,46 @@ typedef struct {
  */
 curly_error_t curly_parse_config(const char *json_str, curly_config_t *config);
 
+/**
+ * Create an arena. Memory is handed out from chunks of chunk_size bytes
+ * and only given back by curly_arena_reset() or curly_arena_destroy().
+ * An arena is not thread-safe; keep one per worker thread.
+ *
+ * @param chunk_size Size of each chunk, 0 for the default of 16 KiB
+ * @return New arena, or NULL if out of memory
+ */
+curly_arena_t *curly_arena_create(size_t chunk_size);
+
+/**
+ * Release everything allocated from an arena so it can be reused. The
+ * chunks are merged into one, up to 1 MiB, so a reused arena settles on
+ * a single allocation.
+ *
+ * @param arena Arena to reset
+ */
+void curly_arena_reset(curly_arena_t *arena);
+
+/**
+ * Destroy an arena and everything allocated from it
+ *
+ * @param arena Arena to destroy, may be NULL
+ */
+void curly_arena_destroy(curly_arena_t *arena);
+
+/**
+ * Parse JSON configuration into an arena. The strings are copied into
+ * the arena and the JSON fields share the parsed document instead of
+ * being deep-copied; requests performed with the config take their header
+ * list and body from the arena too. curly_free_config() only drops the
+ * document; the rest goes when the arena is reset.
+ *
+ * @param json_str JSON string containing configuration
+ * @param config Pointer to config structure to be initialized
+ * @param arena Arena to allocate from
+ * @return CURLY_OK on success, error code otherwise
+ */
+curly_error_t curly_parse_config_arena(const char *json_str, curly_config_t *config, curly_arena_t *arena);
+
 /**
  * Execute a request based on the provided configuration
  *
@@ -69,6 +265,114 @@ curly_error_t curly_parse_config(const char *json_str, curly_config_t *config);
  */
 curly_error_t curly_perform_request(const curly_config_t *config, curly_response_t *response);
 
+/**
+ * Execute a request and stream the response body into a sink. Unlike
+ * curly_perform_request, memory use is constant for fd and callback sinks
+ * and each chunk is delivered as soon as it arrives.
+ *
+ * @param config Request configuration
+ * @param sink Destination for the response body
+ * @return CURLY_OK on success, error code otherwise
+ */
+curly_error_t curly_perform_request_sink(const curly_config_t *config, curly_sink_t *sink);
+
+/**
+ * Compile a request configuration into a plan. The header list, body,
+ * auth and retry policy are built once; {{name}} placeholders in the URL,
+ * header values and string values of the body are filled in by each
+ * curly_plan_execute(). The configuration may be freed afterwards.
+ *
+ * @param config Request configuration
+ * @param plan Receives the plan, freed with curly_plan_free
+ * @return CURLY_OK on success, error code otherwise
+ */
+curly_error_t curly_plan_compile(const curly_config_t *config, curly_plan_t **plan);
+
+/**
+ * Execute a compiled request into a sink. Values are percent-encoded in the
+ * URL, JSON-escaped in the body and inserted as they are in headers, where
+ * line breaks are refused. The connection is kept for the next execution.
+ * A plan runs one request at a time; use one plan per thread.
+ *
+ * @param plan Compiled request
+ * @param vars Values for the placeholders, may be NULL if there are none
+ * @param var_count Number of entries in vars
+ * @param sink Destination for the response body
+ * @return CURLY_OK on success, CURLY_ERROR_MISSING_VARIABLE if a placeholder
+ *         has no valid value, another error code otherwise
+ */
+curly_error_t curly_plan_execute(curly_plan_t *plan, const curly_var_t *vars, size_t var_count, curly_sink_t *sink);
+
+/**
+ * Free a compiled request
+ *
+ * @param plan Plan to free, may be NULL
+ */
+void curly_plan_free(curly_plan_t *plan);
+
+/**
+ * Initialize a sink collecting the response body in memory. The body is
+ * NUL-terminated but may contain NUL bytes; use response->size for its length.
+ *
+ * @param sink Sink to initialize
+ * @param response Response structure to fill, freed with curly_free_response
+ */
+void curly_sink_init_buffer(curly_sink_t *sink, curly_response_t *response);
+
+/**
+ * Initialize a sink collecting the response body in an arena. The body is
+ * released with the arena; curly_free_response() only clears the response.
+ *
+ * @param sink Sink to initialize
+ * @param response Response structure to fill
+ * @param arena Arena to allocate the body from
+ */
+void curly_sink_init_arena(curly_sink_t *sink, curly_response_t *response, curly_arena_t *arena);
+
+/**
+ * Initialize a sink collecting the response body in a buffer taken from a
+ * pool. curly_free_response() hands the buffer back for the next response
+ * instead of freeing it.
+ *
+ * @param sink Sink to initialize
+ * @param response Response structure to fill
+ * @param pool Pool to take the buffer from and return it to
+ */
+void curly_sink_init_pooled(curly_sink_t *sink, curly_response_t *response, curly_buffer_pool_t *pool);
+
+/**
+ * Create a pool of response buffers
+ *
+ * @param max_buffers Most idle buffers kept, 0 for the default of 16
+ * @return New pool, or NULL if out of memory
+ */
+curly_buffer_pool_t *curly_buffer_pool_create(int max_buffers);
+
+/**
+ * Destroy a buffer pool and the buffers it holds. Responses still using
+ * one of its buffers must be freed first.
+ *
+ * @param pool Pool to destroy, may be NULL
+ */
+void curly_buffer_pool_destroy(curly_buffer_pool_t *pool);
+
+/**
+ * Initialize a sink writing the response body to a file descriptor
+ *
+ * @param sink Sink to initialize
+ * @param fd File descriptor to write to (not closed by curly)
+ */
+void curly_sink_init_fd(curly_sink_t *sink, int fd);
+
+/**
+ * Initialize a sink handing each chunk of the response body to a callback
+ *
+ * @param sink Sink to initialize
+ * @param callback Function receiving the data
+ * @param userdata Pointer passed to the callback
+ */
+void curly_sink_init_callback(curly_sink_t *sink, curly_sink_callback_t callback, void *userdata);
+
 /**
  * Free resources allocated for config structure
  *
@@ -92,7 +396,8 @@ void curly_free_response(curly_response_t *response);
 const char *curly_strerror(curly_error_t error);
 
 /**
- * Download file from URL to destination path
+ * Download file from URL to destination path. Transient failures such as
+ * refused connections or HTTP 503 are retried with exponential backoff.
  *
  * @param url URL to download from
  * @param destination Path to save the file to
@@ -100,13 +405,117 @@ const char *curly_strerror(curly_error_t error);
  */
 curly_error_t curly_download_file(const char *url, const char *destination);
 
+/**
+ * Download file from URL to destination path, splitting large files into
+ * byte ranges fetched over concurrent connections. Falls back to a single
+ * connection when the server does not advertise Accept-Ranges: bytes.
+ *
+ * @param url URL to download from
+ * @param destination Path to save the file to
+ * @param segments Maximum number of connections, 1 to never split
+ * @param min_segment_size Smallest range worth its own connection, in bytes
+ * @return CURLY_OK on success, error code otherwise
+ */
+curly_error_t curly_download_file_ex(const char *url, const char *destination, int segments, curl_off_t min_segment_size);
+
 /**
  * Process parallel downloads from TSV input (URL, destination)
  *
- * @param thread_count Number of parallel download threads to use
+ * @param thread_count Number of event loop threads to use
  * @param input_stream Input stream to read TSV data from (typically stdin)
  * @return CURLY_OK on success, error code if initialization fails
  */
 curly_error_t curly_parallel_download(int thread_count, FILE *input_stream);
 
+/**
+ * Initialize parallel download options with default values
+ *
+ * @param options Pointer to options structure to be initialized
+ */
+void curly_parallel_options_init(curly_parallel_options_t *options);
+
+/**
+ * Initialize rate limits that do not limit anything
+ *
+ * @param limit Pointer to limits to be initialized
+ */
+void curly_rate_limit_init(curly_rate_limit_t *limit);
+
+/**
+ * Parse rate limits from JSON, either a bare limits object or a config
+ * holding one under "rate_limit". Fields are "max_rate" and "host_max_rate"
+ * in bytes per second, "max_requests" and "host_max_requests" in requests
+ * per second and "burst" in seconds. Fields the JSON leaves out keep their
+ * current values.
+ *
+ * @param json_str JSON string containing the limits
+ * @param limit Pointer to initialized limits to be updated
+ * @return CURLY_OK on success, error code otherwise
+ */
+curly_error_t curly_parse_rate_limit(const char *json_str, curly_rate_limit_t *limit);
+
+/**
+ * Process parallel downloads from TSV input using the given options.
+ * Each event loop thread drives many transfers at once through a single
+ * curl multi handle, so concurrency is bounded by max_transfers rather
+ * than by the number of threads.
+ *
+ * @param options Parallel download options
+ * @param input_stream Input stream to read TSV data from (typically stdin)
+ * @return CURLY_OK on success, error code if initialization fails
+ */
+curly_error_t curly_parallel_download_ex(const curly_parallel_options_t *options, FILE *input_stream);
+
+/**
+ * Initialize batch options with default values
+ *
+ * @param options Pointer to options structure to be initialized
+ */
+void curly_batch_options_init(curly_batch_options_t *options);
+
+/**
+ * Run newline-delimited JSON request configurations concurrently from a
+ * single process. One JSON result line is written to output per request,
+ * in completion order, with the request's "id" (or its line number), HTTP
+ * status, body (or body path), timing breakdown and error.
+ *
+ * @param options Batch options
+ * @param input Stream of JSON configurations, one per line
+ * @param output Stream to write JSON result lines to
+ * @return CURLY_OK if every request succeeded, CURLY_ERROR_CURL_PERFORM if
+ *         any request failed, other error codes if the batch could not run
+ */
+curly_error_t curly_batch_run(const curly_batch_options_t *options, FILE *input, FILE *output);
+
+/**
+ * Run batch mode as a daemon listening on a Unix domain socket, so callers
+ * don't pay for process startup, DNS lookups and TLS handshakes on every
+ * call. Each connection sends JSON configurations, one per line, and gets
+ * one batch result line back per request, in completion order; the daemon
+ * closes the connection once the client has shut down its sending side and
+ * every result is written. Connections, DNS and TLS sessions stay cached
+ * across clients. Bodies are always inlined, body_dir and summary are
+ * ignored. Runs until SIGINT or SIGTERM, then finishes the requests already
+ * received.
+ *
+ * @param socket_path Path of the socket; a stale socket file is replaced
+ * @param options Batch options; max_concurrent counts requests of all clients
+ * @return CURLY_OK after a clean shutdown, CURLY_ERROR_SOCKET if the socket
+ *         could not be set up or another daemon is listening on it
+ */
+curly_error_t curly_serve(const char *socket_path, const curly_batch_options_t *options);
+
+/**
+ * Send JSON configurations to a curly_serve() daemon and copy its result
+ * lines to output as they arrive
+ *
+ * @param socket_path Path of the daemon's socket
+ * @param input Stream of JSON configurations, one per line
+ * @param output Stream to write JSON result lines to
+ * @return CURLY_OK if every request succeeded, CURLY_ERROR_CURL_PERFORM if
+ *         any request failed, CURLY_ERROR_SOCKET if the daemon could not be
+ *         reached or the connection broke
+ */
+curly_error_t curly_client_run(const char *socket_path, FILE *input, FILE *output);
+
 #endif /* CURLY_H */
@@ -0,0 +1,137 @@
+#include "arena.h"
+
+#define ARENA_ALIGN 16
+#define DEFAULT_CHUNK_SIZE 16384
+#define MAX_RETAINED_SIZE (1024 * 1024)
+
+// A block of arena memory. Allocations are carved from the front.
+typedef struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;  // Usable bytes after the header
+    size_t used;
+} arena_chunk_t;
+
+// Chunk headers are padded so the first allocation is aligned
+#define CHUNK_HEADER ((sizeof(arena_chunk_t) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+struct curly_arena {
+    arena_chunk_t *chunks;  // Chunk being allocated from first
+    size_t chunk_size;
+    char *last;             // Most recent allocation, which may grow in place
+};
+
+static char *chunk_data(arena_chunk_t *chunk) {
+    return (char *)chunk + CHUNK_HEADER;
+}
+
+static arena_chunk_t *add_chunk(curly_arena_t *arena, size_t size) {
+    if (size < arena->chunk_size) {
+        size = arena->chunk_size;
+    }
+
+    arena_chunk_t *chunk = (arena_chunk_t *)malloc(CHUNK_HEADER + size);
+    if (!chunk) {
+        return NULL;
+    }
+    chunk->size = size;
+    chunk->used = 0;
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    return chunk;
+}
+
+curly_arena_t *curly_arena_create(size_t chunk_size) {
+    curly_arena_t *arena = (curly_arena_t *)calloc(1, sizeof(curly_arena_t));
+    if (!arena) {
+        return NULL;
+    }
+    arena->chunk_size = chunk_size > 0 ? chunk_size : DEFAULT_CHUNK_SIZE;
+    return arena;
+}
+
+void *curly_arena_alloc(curly_arena_t *arena, size_t size) {
+    arena_chunk_t *chunk = arena->chunks;
+    size_t offset = chunk ? (chunk->used + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1) : 0;
+
+    if (!chunk || offset > chunk->size || size > chunk->size - offset) {
+        chunk = add_chunk(arena, size);
+        if (!chunk) {
+            return NULL;
+        }
+        offset = 0;
+    }
+
+    chunk->used = offset + size;
+    arena->last = chunk_data(chunk) + offset;
+    return arena->last;
+}
+
+void *curly_arena_grow(curly_arena_t *arena, void *ptr, size_t old_size, size_t new_size) {
+    if (!ptr) {
+        return curly_arena_alloc(arena, new_size);
+    }
+    if (new_size <= old_size) {
+        return ptr;
+    }
+
+    // The newest block can simply take more of its chunk
+    arena_chunk_t *chunk = arena->chunks;
+    if ((char *)ptr == arena->last) {
+        size_t offset = (size_t)((char *)ptr - chunk_data(chunk));
+        if (new_size <= chunk->size - offset) {
+            chunk->used = offset + new_size;
+            return ptr;
+        }
+    }
+
+    void *block = curly_arena_alloc(arena, new_size);
+    if (block) {
+        memcpy(block, ptr, old_size);
+    }
+    return block;
+}
+
+char *curly_arena_strdup(curly_arena_t *arena, const char *str) {
+    if (!str) {
+        return NULL;
+    }
+
+    size_t len = strlen(str) + 1;
+    char *copy = (char *)curly_arena_alloc(arena, len);
+    return copy ? memcpy(copy, str, len) : NULL;
+}
+
+void curly_arena_reset(curly_arena_t *arena) {
+    if (!arena) return;
+
+    arena->last = NULL;
+    if (!arena->chunks) {
+        return;
+    }
+    if (!arena->chunks->next && arena->chunks->size <= MAX_RETAINED_SIZE) {
+        arena->chunks->used = 0;
+        return;
+    }
+
+    // Replace the chunks with a single one big enough for what they held,
+    // so an arena reused for similar work settles on one allocation
+    size_t total = 0;
+    while (arena->chunks) {
+        arena_chunk_t *next = arena->chunks->next;
+        total += arena->chunks->size;
+        free(arena->chunks);
+        arena->chunks = next;
+    }
+    add_chunk(arena, total < MAX_RETAINED_SIZE ? total : MAX_RETAINED_SIZE);
+}
+
+void curly_arena_destroy(curly_arena_t *arena) {
+    if (!arena) return;
+
+    while (arena->chunks) {
+        arena_chunk_t *next = arena->chunks->next;
+        free(arena->chunks);
+        arena->chunks = next;
+    }
+    free(arena);
+}
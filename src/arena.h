@@ -0,0 +1,37 @@
+#ifndef CURLY_ARENA_H
+#define CURLY_ARENA_H
+
+#include "curly.h"
+
+/**
+ * Allocate memory from an arena. The memory lives until the arena is
+ * reset or destroyed and is never freed on its own.
+ *
+ * @param arena Arena to allocate from
+ * @param size Number of bytes
+ * @return Pointer aligned for any type, or NULL if out of memory
+ */
+void *curly_arena_alloc(curly_arena_t *arena, size_t size);
+
+/**
+ * Resize the most recent allocation, in place when the arena has room.
+ * Older allocations are copied to a new block.
+ *
+ * @param arena Arena the block came from
+ * @param ptr Block to resize, or NULL to allocate a new one
+ * @param old_size Current size of the block
+ * @param new_size Requested size
+ * @return Resized block, or NULL if out of memory (ptr stays valid)
+ */
+void *curly_arena_grow(curly_arena_t *arena, void *ptr, size_t old_size, size_t new_size);
+
+/**
+ * Copy a string into an arena
+ *
+ * @param arena Arena to allocate from
+ * @param str String to copy, may be NULL
+ * @return Copy of the string, or NULL if str is NULL or out of memory
+ */
+char *curly_arena_strdup(curly_arena_t *arena, const char *str);
+
+#endif /* CURLY_ARENA_H */
@@ -0,0 +1,427 @@
+#include "curly.h"
+#include "batch.h"
+#include "loop.h"
+#include "request.h"
+#include "retry.h"
+#include "arena.h"
+#include "stats.h"
+#include "share.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define DEFAULT_BATCH_CONCURRENCY 16
+#define MAX_BATCH_CONCURRENCY 4096
+#define DEFAULT_MAX_STREAMS 100
+#define RETRY_BUDGET_RATIO 0.2
+#define RETRY_BUDGET_BURST 100
+
+// A request running on the batch loop. The request itself, its config,
+// header list and body live in one arena; a buffered response comes from
+// the batch's buffer pool.
+typedef struct {
+    curly_loop_transfer_t base;  // Must be first
+    struct curly_batch *batch;
+    curly_arena_t *arena;
+    FILE *output;                // Where the result line goes
+    curly_batch_done_t done;     // Called once the result is written
+    void *done_arg;
+    json_t *id;
+    curly_config_t config;
+    curly_retry_policy_t retry;
+    int attempts;
+    curly_request_t request;
+    curly_sink_t sink;
+    curly_response_t body;
+    int body_fd;
+    char *body_path;
+    char error[CURL_ERROR_SIZE];
+} batch_request_t;
+
+// Batch engine state
+typedef struct curly_batch {
+    const curly_batch_options_t *options;
+    curly_loop_t *loop;
+    curly_share_t *share;          // DNS and TLS session caches for every request
+    curly_retry_budget_t retry_budget;
+    int failures;
+    curly_buffer_pool_t *buffers;  // Response buffers shared by all requests
+    curly_stats_t *stats;          // Latency histograms for the summary, NULL for none
+    curly_arena_t **spare_arenas;  // Arenas of finished requests, ready for reuse
+    int spare_count;
+    int spare_capacity;
+} batch_t;
+
+// Get an arena for a new request, reusing one from a finished request
+static curly_arena_t *take_arena(batch_t *batch) {
+    if (batch->spare_count > 0) {
+        return batch->spare_arenas[--batch->spare_count];
+    }
+    return curly_arena_create(0);
+}
+
+// Keep a finished request's arena for the next one
+static void put_arena(batch_t *batch, curly_arena_t *arena) {
+    if (batch->spare_count == batch->spare_capacity) {
+        int capacity = batch->spare_capacity ? batch->spare_capacity * 2 : 16;
+        curly_arena_t **arenas = (curly_arena_t **)realloc(batch->spare_arenas, capacity * sizeof(curly_arena_t *));
+        if (!arenas) {
+            curly_arena_destroy(arena);
+            return;
+        }
+        batch->spare_arenas = arenas;
+        batch->spare_capacity = capacity;
+    }
+
+    curly_arena_reset(arena);
+    batch->spare_arenas[batch->spare_count++] = arena;
+}
+
+// Write one JSON result line
+static void emit_result(batch_t *batch, FILE *output, json_t *id, long status, json_t *body, const char *body_path, const char *error,
+                        const curly_timing_t *timing) {
+    json_t *result = json_object();
+    if (!result) {
+        json_decref(body);
+        return;
+    }
+
+    json_object_set(result, "id", id ? id : json_null());
+    json_object_set_new(result, "status", json_integer(status));
+    if (body_path) {
+        json_object_set_new(result, "body_path", json_string(body_path));
+    } else {
+        json_object_set_new(result, "body", body ? body : json_null());
+    }
+    if (timing) {
+        json_t *breakdown = json_object();
+        if (breakdown) {
+            curly_timing_to_json(breakdown, timing);
+            json_object_set_new(result, "timing", breakdown);
+        }
+    }
+    json_object_set_new(result, "error", error ? json_string(error) : json_null());
+
+    json_dumpf(result, output, JSON_COMPACT);
+    fputc('\n', output);
+    json_decref(result);
+
+    if (error) {
+        batch->failures++;
+    }
+}
+
+// Release everything owned by a request and tell its owner it is done
+static void free_batch_request(batch_request_t *req) {
+    curly_batch_done_t done = req->done;
+    void *done_arg = req->done_arg;
+
+    if (req->base.easy) curl_easy_cleanup(req->base.easy);
+    if (req->body_fd >= 0) close(req->body_fd);
+    curly_request_cleanup(&req->request);
+    curly_free_config(&req->config);
+    json_decref(req->id);
+    curly_free_response(&req->body);
+    put_arena(req->batch, req->arena);
+
+    if (done) {
+        done(done_arg);
+    }
+}
+
+// Discard what a failed attempt wrote and schedule the request again.
+// Returns 0 if the request will be retried.
+static int retry_batch_request(batch_request_t *req, CURLcode res) {
+    long delay = curly_retry_next(&req->retry, &req->batch->retry_budget, req->base.easy, res, req->attempts);
+    if (delay < 0) {
+        return -1;
+    }
+
+    if (req->body_fd >= 0) {
+        if (ftruncate(req->body_fd, 0) != 0 || lseek(req->body_fd, 0, SEEK_SET) != 0) {
+            return -1;
+        }
+        curly_sink_init_fd(&req->sink, req->body_fd);
+    } else {
+        curly_free_response(&req->body);
+        curly_sink_init_pooled(&req->sink, &req->body, req->batch->buffers);
+    }
+
+    req->error[0] = '\0';
+    req->attempts++;
+    return curly_loop_add_delayed(req->batch->loop, &req->base, delay);
+}
+
+// Host the request ended up at, after any redirects
+static void request_host(CURL *curl, char *host, size_t size) {
+    char *url = NULL;
+    char *name = NULL;
+    CURLU *parsed = curl_url();
+
+    host[0] = '\0';
+    curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &url);
+    if (parsed && url && curl_url_set(parsed, CURLUPART_URL, url, 0) == CURLUE_OK &&
+        curl_url_get(parsed, CURLUPART_HOST, &name, 0) == CURLUE_OK) {
+        snprintf(host, size, "%s", name);
+        curl_free(name);
+    }
+    curl_url_cleanup(parsed);
+}
+
+// Transfer completion callback, invoked by the event loop
+static void batch_request_done(curly_loop_transfer_t *base, CURLcode res) {
+    batch_request_t *req = (batch_request_t *)base;
+    if (retry_batch_request(req, res) == 0) {
+        return;
+    }
+
+    long status = 0;
+    curl_easy_getinfo(req->base.easy, CURLINFO_RESPONSE_CODE, &status);
+
+    const char *error = NULL;
+    json_t *body = NULL;
+
+    if (req->body_fd >= 0) {
+        if (close(req->body_fd) != 0 && res == CURLE_OK) {
+            error = strerror(errno);
+        }
+        req->body_fd = -1;
+    }
+
+    if (res != CURLE_OK) {
+        error = req->error[0] ? req->error : curl_easy_strerror(res);
+    } else if (!req->body_path) {
+        body = json_stringn(req->body.data ? req->body.data : "", req->body.size);
+        if (!body) {
+            error = "Response body is not valid UTF-8, use --body-dir to save it";
+        }
+    }
+
+    curly_timing_t timing;
+    curly_timing_capture(req->base.easy, &timing);
+    if (req->batch->stats) {
+        char host[256];
+        request_host(req->base.easy, host, sizeof(host));
+        curly_stats_record(req->batch->stats, host, &timing, error != NULL);
+    }
+
+    emit_result(req->batch, req->output, req->id, status, body, req->body_path, error, &timing);
+    free_batch_request(req);
+}
+
+void curly_batch_start(curly_batch_t *batch, const char *line, size_t length, unsigned long line_no,
+                       FILE *output, curly_batch_done_t done, void *done_arg) {
+    curly_arena_t *arena = take_arena(batch);
+    batch_request_t *req = arena ? (batch_request_t *)curly_arena_alloc(arena, sizeof(batch_request_t)) : NULL;
+    if (!req) {
+        emit_result(batch, output, NULL, 0, NULL, NULL, curly_strerror(CURLY_ERROR_MEMORY_ALLOCATION), NULL);
+        if (arena) curly_arena_destroy(arena);
+        if (done) done(done_arg);
+        return;
+    }
+    memset(req, 0, sizeof(batch_request_t));
+    req->batch = batch;
+    req->arena = arena;
+    req->output = output;
+    req->done = done;
+    req->done_arg = done_arg;
+    req->base.done = batch_request_done;
+    req->body_fd = -1;
+
+    json_error_t json_error;
+    json_t *root = json_loadb(line, length, 0, &json_error);
+    if (!root) {
+        req->id = json_integer((json_int_t)line_no);
+        emit_result(batch, req->output, req->id, 0, NULL, NULL, json_error.text, NULL);
+        free_batch_request(req);
+        return;
+    }
+
+    // Requests are identified by their "id" field, falling back to the line number
+    json_t *id = json_object_get(root, "id");
+    req->id = id ? json_incref(id) : json_integer((json_int_t)line_no);
+
+    curly_error_t error = curly_config_from_json(root, &req->config, arena);
+    json_decref(root);
+    if (error != CURLY_OK) {
+        emit_result(batch, req->output, req->id, 0, NULL, NULL, curly_strerror(error), NULL);
+        free_batch_request(req);
+        return;
+    }
+    curly_retry_policy_from_json(&req->retry, req->config.retry);
+    req->attempts = 1;
+
+    req->base.easy = curl_easy_init();
+    if (!req->base.easy) {
+        emit_result(batch, req->output, req->id, 0, NULL, NULL, curly_strerror(CURLY_ERROR_CURL_INIT), NULL);
+        free_batch_request(req);
+        return;
+    }
+
+    curly_share_attach(batch->share, req->base.easy);
+    error = curly_request_setup(req->base.easy, &req->config, arena, &req->request);
+    if (error != CURLY_OK) {
+        emit_result(batch, req->output, req->id, 0, NULL, NULL, curly_strerror(error), NULL);
+        free_batch_request(req);
+        return;
+    }
+
+    if (batch->options->body_dir) {
+        int path_len = snprintf(NULL, 0, "%s/%lu.body", batch->options->body_dir, line_no);
+        req->body_path = curly_arena_alloc(arena, path_len + 1);
+        if (req->body_path) {
+            snprintf(req->body_path, path_len + 1, "%s/%lu.body", batch->options->body_dir, line_no);
+            req->body_fd = open(req->body_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        }
+        if (req->body_fd < 0) {
+            emit_result(batch, req->output, req->id, 0, NULL, NULL, curly_strerror(CURLY_ERROR_FILE_OPEN), NULL);
+            free_batch_request(req);
+            return;
+        }
+        curly_sink_init_fd(&req->sink, req->body_fd);
+    } else {
+        curly_sink_init_pooled(&req->sink, &req->body, batch->buffers);
+    }
+    curl_easy_setopt(req->base.easy, CURLOPT_WRITEFUNCTION, curly_sink_write);
+    curl_easy_setopt(req->base.easy, CURLOPT_WRITEDATA, &req->sink);
+    curl_easy_setopt(req->base.easy, CURLOPT_HEADERFUNCTION, curly_sink_header);
+    curl_easy_setopt(req->base.easy, CURLOPT_HEADERDATA, &req->sink);
+    curl_easy_setopt(req->base.easy, CURLOPT_ERRORBUFFER, req->error);
+
+    if (curly_loop_add(batch->loop, &req->base) != 0) {
+        emit_result(batch, req->output, req->id, 0, NULL, NULL, curly_strerror(CURLY_ERROR_CURL_INIT), NULL);
+        free_batch_request(req);
+        return;
+    }
+    curly_retry_budget_deposit(&batch->retry_budget);
+}
+
+void curly_batch_options_init(curly_batch_options_t *options) {
+    if (!options) return;
+
+    memset(options, 0, sizeof(curly_batch_options_t));
+    options->max_concurrent = DEFAULT_BATCH_CONCURRENCY;
+    options->http_version = CURLY_HTTP_1;
+    options->max_streams = DEFAULT_MAX_STREAMS;
+}
+
+curly_batch_t *curly_batch_create(const curly_batch_options_t *options) {
+    batch_t *batch = (batch_t *)calloc(1, sizeof(batch_t));
+    if (!batch) {
+        return NULL;
+    }
+    batch->options = options;
+    curly_retry_budget_init(&batch->retry_budget, RETRY_BUDGET_RATIO, RETRY_BUDGET_BURST);
+    batch->buffers = curly_buffer_pool_create(0);
+    batch->share = curly_share_create(0);
+    batch->loop = curly_loop_create();
+    if (options->summary) {
+        batch->stats = curly_stats_create();
+    }
+    if (!batch->buffers || !batch->share || !batch->loop || (options->summary && !batch->stats)) {
+        curly_batch_destroy(batch);
+        return NULL;
+    }
+
+    // With HTTP/2, open no more connections per host than it takes to carry
+    // max_concurrent streams
+    int max_concurrent = curly_batch_max_concurrent(batch);
+    int max_streams = options->max_streams > 0 ? options->max_streams : DEFAULT_MAX_STREAMS;
+    curly_loop_set_http_version(batch->loop, options->http_version, max_streams,
+                                curly_loop_host_connections(max_concurrent, max_streams));
+
+    return batch;
+}
+
+void curly_batch_destroy(curly_batch_t *batch) {
+    if (!batch) return;
+
+    // Easy handles are gone, so the share can go after the loop
+    curly_loop_destroy(batch->loop);
+    curly_share_destroy(batch->share);
+    for (int i = 0; i < batch->spare_count; i++) {
+        curly_arena_destroy(batch->spare_arenas[i]);
+    }
+    free(batch->spare_arenas);
+    curly_buffer_pool_destroy(batch->buffers);
+    curly_stats_destroy(batch->stats);
+    free(batch);
+}
+
+curly_loop_t *curly_batch_loop(curly_batch_t *batch) {
+    return batch->loop;
+}
+
+int curly_batch_max_concurrent(const curly_batch_t *batch) {
+    int max_concurrent = batch->options->max_concurrent;
+    if (max_concurrent <= 0) {
+        return DEFAULT_BATCH_CONCURRENCY;
+    }
+    return max_concurrent > MAX_BATCH_CONCURRENCY ? MAX_BATCH_CONCURRENCY : max_concurrent;
+}
+
+curly_error_t curly_batch_run(const curly_batch_options_t *options, FILE *input, FILE *output) {
+    if (!options || !input || !output) {
+        return CURLY_ERROR_UNKNOWN;
+    }
+
+    if (options->body_dir && mkdir(options->body_dir, 0755) != 0 && errno != EEXIST) {
+        return CURLY_ERROR_FILE_OPEN;
+    }
+
+    batch_t *batch = curly_batch_create(options);
+    if (!batch) {
+        return CURLY_ERROR_MEMORY_ALLOCATION;
+    }
+    int max_concurrent = curly_batch_max_concurrent(batch);
+
+    char *line = NULL;
+    size_t line_capacity = 0;
+    unsigned long line_no = 0;
+    int eof = 0;
+
+    while (1) {
+        // Keep up to max_concurrent requests in flight. Requests waiting to
+        // be retried hold no connection and do not count.
+        while (!eof && curly_loop_in_flight(batch->loop) < max_concurrent) {
+            ssize_t length = getline(&line, &line_capacity, input);
+            if (length < 0) {
+                eof = 1;
+                break;
+            }
+            line_no++;
+
+            // Skip blank lines
+            while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+                length--;
+            }
+            if (length == 0) {
+                continue;
+            }
+
+            curly_batch_start(batch, line, (size_t)length, line_no, output, NULL, NULL);
+        }
+
+        if (eof && curly_loop_in_flight(batch->loop) == 0 && curly_loop_delayed(batch->loop) == 0) {
+            break;
+        }
+
+        // Hand finished results to the reader before waiting
+        fflush(output);
+        if (curly_loop_run_once(batch->loop, -1) != 0) {
+            fprintf(stderr, "Event loop failed: %s\n", strerror(errno));
+            break;
+        }
+    }
+
+    fflush(output);
+    free(line);
+    if (batch->stats) {
+        curly_stats_print(batch->stats, stderr);
+    }
+    int failures = batch->failures;
+    curly_batch_destroy(batch);
+
+    return failures ? CURLY_ERROR_CURL_PERFORM : CURLY_OK;
+}
@@ -0,0 +1,66 @@
+#ifndef CURLY_BATCH_H
+#define CURLY_BATCH_H
+
+#include "curly.h"
+#include "loop.h"
+
+/**
+ * The engine behind batch mode: one event loop running JSON request configs,
+ * with response buffers, arenas, connections and DNS and TLS session caches
+ * shared by all of them. Each request writes its result line to an output of
+ * its own, so one engine can serve many clients. Owned by one thread.
+ */
+typedef struct curly_batch curly_batch_t;
+
+/**
+ * Called once a request's result line has been written
+ */
+typedef void (*curly_batch_done_t)(void *arg);
+
+/**
+ * Create a batch engine. A body_dir in the options must already exist.
+ *
+ * @param options Batch options, kept by reference
+ * @return New engine, or NULL on failure
+ */
+curly_batch_t *curly_batch_create(const curly_batch_options_t *options);
+
+/**
+ * Destroy a batch engine. Every request must have finished.
+ *
+ * @param batch Engine to destroy, may be NULL
+ */
+void curly_batch_destroy(curly_batch_t *batch);
+
+/**
+ * Get the event loop requests run on, for the owner to drive
+ *
+ * @param batch Batch engine
+ * @return The engine's loop
+ */
+curly_loop_t *curly_batch_loop(curly_batch_t *batch);
+
+/**
+ * Get the number of requests the owner should keep in flight
+ *
+ * @param batch Batch engine
+ * @return Concurrency limit from the options, clamped
+ */
+int curly_batch_max_concurrent(const curly_batch_t *batch);
+
+/**
+ * Parse one JSON config and start its request. Lines that fail to parse or
+ * set up get their error result at once.
+ *
+ * @param batch Batch engine
+ * @param line JSON config, not necessarily NUL-terminated
+ * @param length Length of line
+ * @param line_no Line number, the request's id if the config has none
+ * @param output Stream to write the result line to
+ * @param done Called after the result line is written, may be NULL
+ * @param done_arg Argument passed to done
+ */
+void curly_batch_start(curly_batch_t *batch, const char *line, size_t length, unsigned long line_no,
+                       FILE *output, curly_batch_done_t done, void *done_arg);
+
+#endif /* CURLY_BATCH_H */
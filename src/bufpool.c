@@ -0,0 +1,79 @@
+#include "bufpool.h"
+
+#define DEFAULT_POOL_BUFFERS 16
+
+typedef struct {
+    char *data;
+    size_t capacity;
+} pooled_buffer_t;
+
+struct curly_buffer_pool {
+    pthread_mutex_t lock;
+    pooled_buffer_t *buffers;  // Idle buffers, most recently returned last
+    int count;
+    int max_buffers;
+};
+
+curly_buffer_pool_t *curly_buffer_pool_create(int max_buffers) {
+    if (max_buffers <= 0) {
+        max_buffers = DEFAULT_POOL_BUFFERS;
+    }
+
+    curly_buffer_pool_t *pool = (curly_buffer_pool_t *)calloc(1, sizeof(curly_buffer_pool_t));
+    if (!pool) {
+        return NULL;
+    }
+
+    pool->buffers = (pooled_buffer_t *)calloc((size_t)max_buffers, sizeof(pooled_buffer_t));
+    if (!pool->buffers) {
+        free(pool);
+        return NULL;
+    }
+    pool->max_buffers = max_buffers;
+    pthread_mutex_init(&pool->lock, NULL);
+    return pool;
+}
+
+void curly_buffer_pool_destroy(curly_buffer_pool_t *pool) {
+    if (!pool) return;
+
+    for (int i = 0; i < pool->count; i++) {
+        free(pool->buffers[i].data);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->buffers);
+    free(pool);
+}
+
+char *curly_buffer_pool_take(curly_buffer_pool_t *pool, size_t *capacity) {
+    char *data = NULL;
+    *capacity = 0;
+
+    // The most recently returned buffer is the likeliest to still be cached
+    pthread_mutex_lock(&pool->lock);
+    if (pool->count > 0) {
+        pooled_buffer_t *buffer = &pool->buffers[--pool->count];
+        data = buffer->data;
+        *capacity = buffer->capacity;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return data;
+}
+
+void curly_buffer_pool_give(curly_buffer_pool_t *pool, char *data, size_t capacity) {
+    if (!data) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->count < pool->max_buffers) {
+        pool->buffers[pool->count].data = data;
+        pool->buffers[pool->count].capacity = capacity;
+        pool->count++;
+        data = NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    free(data);
+}
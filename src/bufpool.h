@@ -0,0 +1,24 @@
+#ifndef CURLY_BUFPOOL_H
+#define CURLY_BUFPOOL_H
+
+#include "curly.h"
+
+/**
+ * Take a buffer from a pool
+ *
+ * @param pool Pool to take from
+ * @param capacity Receives the allocated size of the buffer
+ * @return Buffer, or NULL if the pool is empty
+ */
+char *curly_buffer_pool_take(curly_buffer_pool_t *pool, size_t *capacity);
+
+/**
+ * Give a buffer back to a pool. It is freed if the pool is full.
+ *
+ * @param pool Pool to return the buffer to
+ * @param data Buffer, may be NULL
+ * @param capacity Allocated size of the buffer
+ */
+void curly_buffer_pool_give(curly_buffer_pool_t *pool, char *data, size_t capacity);
+
+#endif /* CURLY_BUFPOOL_H */
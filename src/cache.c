@@ -0,0 +1,446 @@
+#include "cache.h"
+#include "output.h"
+#include "request.h"
+#include "sha256.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define CACHE_MAGIC "CURLYC1"
+#define CACHE_REVALIDATE 1  // Cache-Control: no-cache, ask the server every time
+
+// Start of every entry file. The validators follow it and the body starts
+// at body_offset, 8-byte aligned, with a NUL after its last byte.
+typedef struct {
+    char magic[8];
+    int64_t stored_at;
+    int64_t fresh_until;
+    uint64_t body_offset;
+    uint64_t body_size;
+    uint32_t flags;
+    uint32_t etag_length;
+    uint32_t last_modified_length;
+    uint32_t reserved;
+} cache_header_t;
+
+struct curly_cache_lookup {
+    char *path;                 // Entry file
+    long max_age;               // Lifetime of responses that do not give one, in seconds
+    char *map;                  // Mapped entry, NULL if there is none
+    size_t map_size;
+    struct curl_slist *headers; // Request headers plus the validators
+    CURL *curl;
+    curly_sink_t *sink;         // Caller's sink behind the tee
+    int begun;                  // The response has been looked at
+    char *temp;                 // New entry being written, NULL if the response is not stored
+    int fd;
+    cache_header_t header;      // Header of the new entry
+};
+
+// Time from a response header, 0 if it is missing or invalid
+static time_t header_time(CURL *curl, const char *name) {
+    struct curl_header *header;
+    if (curl_easy_header(curl, name, 0, CURLH_HEADER, -1, &header) != CURLHE_OK) {
+        return 0;
+    }
+    time_t value = curl_getdate(header->value, NULL);
+    return value < 0 ? 0 : value;
+}
+
+// Value of a response header, NULL if the server did not send it
+static const char *header_value(CURL *curl, const char *name) {
+    struct curl_header *header;
+    if (curl_easy_header(curl, name, 0, CURLH_HEADER, -1, &header) != CURLHE_OK) {
+        return NULL;
+    }
+    return header->value;
+}
+
+// Work out how long a response stays fresh from its headers. Returns 0
+// if it may be stored, -1 if it must not be.
+static int freshness(CURL *curl, long max_age, cache_header_t *header) {
+    time_t now = time(NULL);
+    long lifetime = -1;
+    header->flags = 0;
+
+    const char *vary = header_value(curl, "Vary");
+    if (vary && strchr(vary, '*')) {
+        return -1;
+    }
+
+    const char *control = header_value(curl, "Cache-Control");
+    while (control && *control) {
+        size_t length = strcspn(control, ",");
+        while (length > 0 && (*control == ' ' || *control == '\t')) {
+            control++;
+            length--;
+        }
+        if (length >= 8 && strncasecmp(control, "no-store", 8) == 0) {
+            return -1;
+        } else if (length >= 8 && strncasecmp(control, "no-cache", 8) == 0) {
+            header->flags |= CACHE_REVALIDATE;
+        } else if (length > 8 && strncasecmp(control, "max-age=", 8) == 0) {
+            lifetime = strtol(control + 8, NULL, 10);
+        }
+        control += length;
+        if (*control == ',') control++;
+    }
+
+    if (lifetime >= 0) {
+        const char *age = header_value(curl, "Age");
+        if (age) {
+            lifetime -= strtol(age, NULL, 10);
+        }
+    } else if (header_value(curl, "Expires")) {
+        // Invalid dates such as "0" mean already expired
+        time_t expires = header_time(curl, "Expires");
+        lifetime = expires > now ? (long)(expires - now) : 0;
+    } else {
+        lifetime = max_age;
+    }
+
+    header->stored_at = (int64_t)now;
+    header->fresh_until = (int64_t)now + (lifetime > 0 ? lifetime : 0);
+    return 0;
+}
+
+// Name an entry after a hash of everything that selects the response
+static char *entry_path(const curly_config_t *config, const char *dir) {
+    json_t *key = json_object();
+    if (!key) {
+        return NULL;
+    }
+    json_object_set_new(key, "method", json_string(config->method));
+    json_object_set_new(key, "url", json_string(config->url));
+    json_object_set(key, "headers", config->headers ? config->headers : json_null());
+    json_object_set(key, "auth", config->auth ? config->auth : json_null());
+    json_object_set(key, "cookies", config->cookies ? config->cookies : json_null());
+    // Kept out of the key when unset, so existing entries stay valid
+    if (config->compression) {
+        json_object_set(key, "compression", config->compression);
+    }
+    char *text = json_dumps(key, JSON_COMPACT | JSON_SORT_KEYS);
+    json_decref(key);
+    if (!text) {
+        return NULL;
+    }
+
+    unsigned char digest[CURLY_SHA256_SIZE];
+    curly_sha256_t ctx;
+    curly_sha256_init(&ctx);
+    curly_sha256_update(&ctx, text, strlen(text));
+    curly_sha256_final(&ctx, digest);
+    free(text);
+
+    size_t size = strlen(dir) + CURLY_SHA256_SIZE * 2 + 2;
+    char *path = (char *)malloc(size);
+    if (path) {
+        int used = snprintf(path, size, "%s/", dir);
+        for (int i = 0; i < CURLY_SHA256_SIZE; i++) {
+            used += snprintf(path + used, size - (size_t)used, "%02x", digest[i]);
+        }
+    }
+    return path;
+}
+
+// Map an existing entry, leaving the lookup without one if it is missing or damaged
+static void map_entry(curly_cache_lookup_t *lookup) {
+    int fd = open(lookup->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(cache_header_t)) {
+        close(fd);
+        return;
+    }
+
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return;
+    }
+
+    const cache_header_t *header = (const cache_header_t *)map;
+    uint64_t size = (uint64_t)st.st_size;
+    if (memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->body_offset < sizeof(cache_header_t) + (uint64_t)header->etag_length +
+                                  header->last_modified_length ||
+        header->body_offset > size || header->body_size >= size - header->body_offset) {
+        munmap(map, (size_t)st.st_size);
+        return;
+    }
+    lookup->map = (char *)map;
+    lookup->map_size = (size_t)st.st_size;
+}
+
+curly_cache_lookup_t *curly_cache_lookup(const curly_config_t *config) {
+    // Only requests that fetch something without changing it are cached
+    if (!config->cache || strcmp(config->method, "GET") != 0 || config->data || config->form) {
+        return NULL;
+    }
+
+    const char *dir = NULL;
+    long max_age = 0;
+    if (json_is_string(config->cache)) {
+        dir = json_string_value(config->cache);
+    } else if (json_is_object(config->cache)) {
+        dir = json_string_value(json_object_get(config->cache, "dir"));
+        json_t *age = json_object_get(config->cache, "max_age");
+        if (json_is_integer(age)) {
+            max_age = (long)json_integer_value(age);
+        }
+    }
+    if (!dir || (mkdir(dir, 0755) != 0 && errno != EEXIST)) {
+        return NULL;
+    }
+
+    curly_cache_lookup_t *lookup = (curly_cache_lookup_t *)calloc(1, sizeof(curly_cache_lookup_t));
+    if (!lookup) {
+        return NULL;
+    }
+    lookup->path = entry_path(config, dir);
+    if (!lookup->path) {
+        free(lookup);
+        return NULL;
+    }
+    lookup->max_age = max_age;
+    lookup->fd = -1;
+    map_entry(lookup);
+    return lookup;
+}
+
+int curly_cache_fresh(const curly_cache_lookup_t *lookup) {
+    if (!lookup->map) {
+        return 0;
+    }
+    const cache_header_t *header = (const cache_header_t *)lookup->map;
+    return !(header->flags & CACHE_REVALIDATE) && header->fresh_until > (int64_t)time(NULL);
+}
+
+curly_error_t curly_cache_deliver(curly_cache_lookup_t *lookup, curly_sink_t *sink) {
+    const cache_header_t *header = (const cache_header_t *)lookup->map;
+    char *body = lookup->map + header->body_offset;
+    size_t size = (size_t)header->body_size;
+
+    // A heap buffer response takes the mapping over instead of a copy; the
+    // entry is only ever replaced by rename, so the mapped body never changes
+    curly_response_t *response = sink->response;
+    if (sink->type == CURLY_SINK_BUFFER && !response->arena && !response->pool && !response->data) {
+        response->data = body;
+        response->size = size;
+        response->capacity = size + 1;
+        response->mapping = lookup->map;
+        response->mapping_size = lookup->map_size;
+        lookup->map = NULL;
+        return CURLY_OK;
+    }
+
+    if (size > 0 && curly_sink_write(body, 1, size, sink) != size) {
+        curly_sink_finish(sink, 0);
+        return CURLY_ERROR_FILE_WRITE;
+    }
+    return curly_sink_finish(sink, 1);
+}
+
+// Write all of data to fd at offset
+static int write_at(int fd, const void *data, size_t size, off_t offset) {
+    const char *bytes = (const char *)data;
+    while (size > 0) {
+        ssize_t put = pwrite(fd, bytes, size, offset);
+        if (put < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        bytes += put;
+        size -= (size_t)put;
+        offset += put;
+    }
+    return 0;
+}
+
+// Give up on the new entry
+static void drop_entry(curly_cache_lookup_t *lookup) {
+    if (lookup->fd >= 0) {
+        close(lookup->fd);
+        lookup->fd = -1;
+    }
+    if (lookup->temp) {
+        unlink(lookup->temp);
+        free(lookup->temp);
+        lookup->temp = NULL;
+    }
+}
+
+// Decide from the status and headers whether the response is stored, and
+// if so start its entry with the validators. Protocols without a status,
+// such as file://, count as 200.
+static void begin_entry(curly_cache_lookup_t *lookup) {
+    lookup->begun = 1;
+
+    long status = 0;
+    curl_easy_getinfo(lookup->curl, CURLINFO_RESPONSE_CODE, &status);
+    if (status == 304) {
+        return;
+    }
+    if ((status != 200 && status != 0) || freshness(lookup->curl, lookup->max_age, &lookup->header) != 0) {
+        // A stale entry that cannot be replaced must not be served again
+        if (status == 200) {
+            unlink(lookup->path);
+        }
+        return;
+    }
+
+    const char *etag = header_value(lookup->curl, "ETag");
+    const char *modified = header_value(lookup->curl, "Last-Modified");
+    cache_header_t *header = &lookup->header;
+    memcpy(header->magic, CACHE_MAGIC, sizeof(header->magic));
+    header->etag_length = etag ? (uint32_t)strlen(etag) : 0;
+    header->last_modified_length = modified ? (uint32_t)strlen(modified) : 0;
+    header->body_offset = (sizeof(cache_header_t) + header->etag_length + header->last_modified_length + 7) & ~(uint64_t)7;
+    header->body_size = 0;
+
+    lookup->temp = curly_output_temp_name(lookup->path);
+    if (!lookup->temp) {
+        return;
+    }
+    lookup->fd = open(lookup->temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (lookup->fd < 0 ||
+        (etag && write_at(lookup->fd, etag, header->etag_length, sizeof(cache_header_t)) != 0) ||
+        (modified && write_at(lookup->fd, modified, header->last_modified_length,
+                              (off_t)(sizeof(cache_header_t) + header->etag_length)) != 0)) {
+        drop_entry(lookup);
+    }
+}
+
+// Callback sink forwarding the body to the caller and copying it into the new entry
+static size_t tee_write(const char *data, size_t size, void *userdata) {
+    curly_cache_lookup_t *lookup = (curly_cache_lookup_t *)userdata;
+    if (!lookup->begun) {
+        begin_entry(lookup);
+    }
+
+    size_t written = curly_sink_write((char *)data, 1, size, lookup->sink);
+    if (written == size && lookup->fd >= 0) {
+        off_t offset = (off_t)(lookup->header.body_offset + lookup->header.body_size);
+        if (write_at(lookup->fd, data, size, offset) == 0) {
+            lookup->header.body_size += size;
+        } else {
+            drop_entry(lookup);
+        }
+    }
+    return written;
+}
+
+// Add a header line to the lookup's list
+static void add_header(curly_cache_lookup_t *lookup, const char *name, const char *value, size_t length) {
+    size_t size = strlen(name) + length + 3;
+    char *line = (char *)malloc(size);
+    if (!line) {
+        return;
+    }
+    snprintf(line, size, "%s: %.*s", name, (int)length, value);
+    struct curl_slist *list = curl_slist_append(lookup->headers, line);
+    if (list) {
+        lookup->headers = list;
+    }
+    free(line);
+}
+
+void curly_cache_prepare(curly_cache_lookup_t *lookup, CURL *curl, const struct curl_slist *headers,
+                         curly_sink_t *sink, curly_sink_t *tee) {
+    lookup->curl = curl;
+    lookup->sink = sink;
+    curly_sink_init_callback(tee, tee_write, lookup);
+
+    if (!lookup->map) {
+        return;
+    }
+
+    // Ask for the body only if it changed since the entry was stored
+    const cache_header_t *header = (const cache_header_t *)lookup->map;
+    if (!header->etag_length && !header->last_modified_length) {
+        return;
+    }
+    for (const struct curl_slist *item = headers; item; item = item->next) {
+        struct curl_slist *list = curl_slist_append(lookup->headers, item->data);
+        if (list) {
+            lookup->headers = list;
+        }
+    }
+    const char *validators = lookup->map + sizeof(cache_header_t);
+    if (header->etag_length) {
+        add_header(lookup, "If-None-Match", validators, header->etag_length);
+    }
+    if (header->last_modified_length) {
+        add_header(lookup, "If-Modified-Since", validators + header->etag_length, header->last_modified_length);
+    }
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, lookup->headers);
+}
+
+// Bring a revalidated entry's freshness up to date from a 304
+static void refresh_entry(curly_cache_lookup_t *lookup) {
+    cache_header_t header = *(const cache_header_t *)lookup->map;
+    if (freshness(lookup->curl, lookup->max_age, &header) != 0) {
+        unlink(lookup->path);
+        return;
+    }
+
+    int fd = open(lookup->path, O_WRONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        write_at(fd, &header, sizeof(header), 0);
+        close(fd);
+    }
+}
+
+curly_error_t curly_cache_complete(curly_cache_lookup_t *lookup, CURL *curl, curly_sink_t *sink, int *delivered) {
+    *delivered = 0;
+    lookup->curl = curl;
+
+    // Empty bodies never reach the tee
+    if (!lookup->begun) {
+        begin_entry(lookup);
+    }
+
+    long status = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+    if (status == 304 && lookup->map) {
+        refresh_entry(lookup);
+        *delivered = 1;
+        return curly_cache_deliver(lookup, sink);
+    }
+
+    if (lookup->fd < 0) {
+        return CURLY_OK;
+    }
+
+    // The NUL after the body lets a mapped body be used as a string
+    static const char terminator = '\0';
+    cache_header_t *header = &lookup->header;
+    int stored = write_at(lookup->fd, &terminator, 1, (off_t)(header->body_offset + header->body_size)) == 0 &&
+                 write_at(lookup->fd, header, sizeof(cache_header_t), 0) == 0;
+    stored = close(lookup->fd) == 0 && stored;
+    lookup->fd = -1;
+    if (stored && rename(lookup->temp, lookup->path) == 0) {
+        free(lookup->temp);
+        lookup->temp = NULL;
+    }
+    return CURLY_OK;
+}
+
+void curly_cache_release(curly_cache_lookup_t *lookup) {
+    if (!lookup) return;
+
+    drop_entry(lookup);
+    if (lookup->map) {
+        munmap(lookup->map, lookup->map_size);
+    }
+    curl_slist_free_all(lookup->headers);
+    free(lookup->path);
+    free(lookup);
+}
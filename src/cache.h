@@ -0,0 +1,81 @@
+#ifndef CURLY_CACHE_H
+#define CURLY_CACHE_H
+
+#include "curly.h"
+
+/**
+ * Persistent HTTP response cache for single requests. Each entry is one
+ * file named by the SHA-256 of the method, URL, headers, auth and cookies
+ * of the request. The file holds a fixed header with the status, validators
+ * and freshness deadline, then the body with a NUL after it, so a hit maps
+ * the file and hands the body out without reading or copying it.
+ *
+ * Only GET requests without a body are cached, and only 200 responses that
+ * do not say no-store or Vary: *. Freshness comes from Cache-Control
+ * max-age (less Age), then Expires, then the configured max_age. Stale
+ * entries are revalidated with If-None-Match and If-Modified-Since.
+ */
+typedef struct curly_cache_lookup curly_cache_lookup_t;
+
+/**
+ * Look a request up in its configured cache
+ *
+ * @param config Request configuration; its "cache" field names the directory
+ * @return Lookup state, or NULL if the request is not cached at all
+ */
+curly_cache_lookup_t *curly_cache_lookup(const curly_config_t *config);
+
+/**
+ * Check whether a stored entry can be used without asking the server
+ *
+ * @param lookup Lookup state
+ * @return Non-zero if a fresh entry was found
+ */
+int curly_cache_fresh(const curly_cache_lookup_t *lookup);
+
+/**
+ * Hand the stored body to a sink and finish it. A buffer sink's response
+ * points into the mapped entry until it is freed.
+ *
+ * @param lookup Lookup state with an entry
+ * @param sink Destination for the body
+ * @return CURLY_OK on success, error code otherwise
+ */
+curly_error_t curly_cache_deliver(curly_cache_lookup_t *lookup, curly_sink_t *sink);
+
+/**
+ * Prepare a request to go to the server: ask for the body only if it
+ * differs from a stored entry, and route the body through a sink that also
+ * writes it to a new entry.
+ *
+ * @param lookup Lookup state
+ * @param curl Configured easy handle
+ * @param headers Header list the handle was configured with, may be NULL
+ * @param sink Caller's sink
+ * @param tee Receives the sink to perform the request into
+ */
+void curly_cache_prepare(curly_cache_lookup_t *lookup, CURL *curl, const struct curl_slist *headers,
+                         curly_sink_t *sink, curly_sink_t *tee);
+
+/**
+ * Finish a request sent with curly_cache_prepare(). A 304 refreshes the
+ * stored entry and delivers its body to the sink; a cacheable response is
+ * stored.
+ *
+ * @param lookup Lookup state
+ * @param curl Easy handle after a successful transfer
+ * @param sink Caller's sink
+ * @param delivered Set to 1 if the stored body was delivered (and the sink
+ *        finished), 0 if the sink holds the response from the network
+ * @return CURLY_OK, or an error from delivering the stored body
+ */
+curly_error_t curly_cache_complete(curly_cache_lookup_t *lookup, CURL *curl, curly_sink_t *sink, int *delivered);
+
+/**
+ * Release a lookup, dropping an unfinished new entry
+ *
+ * @param lookup Lookup state, may be NULL
+ */
+void curly_cache_release(curly_cache_lookup_t *lookup);
+
+#endif /* CURLY_CACHE_H */
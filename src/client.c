@@ -0,0 +1,125 @@
+#include "curly.h"
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Sender thread state: copies the input to the daemon
+typedef struct {
+    int fd;
+    FILE *input;
+    int failed;
+} client_sender_t;
+
+static int send_all(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += sent;
+        length -= (size_t)sent;
+    }
+    return 0;
+}
+
+// Send every input line, then end our side so the daemon knows we're done.
+// Runs beside the reader so neither side blocks on a full socket buffer.
+static void *send_input(void *arg) {
+    client_sender_t *sender = (client_sender_t *)arg;
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+
+    while ((length = getline(&line, &capacity, sender->input)) >= 0) {
+        if (send_all(sender->fd, line, (size_t)length) != 0 ||
+            (length > 0 && line[length - 1] != '\n' && send_all(sender->fd, "\n", 1) != 0)) {
+            sender->failed = 1;
+            break;
+        }
+    }
+    free(line);
+    shutdown(sender->fd, SHUT_WR);
+    return NULL;
+}
+
+static int connect_unix(const char *path) {
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+curly_error_t curly_client_run(const char *socket_path, FILE *input, FILE *output) {
+    if (!socket_path || !input || !output) {
+        return CURLY_ERROR_UNKNOWN;
+    }
+
+    client_sender_t sender;
+    memset(&sender, 0, sizeof(sender));
+    sender.input = input;
+    sender.fd = connect_unix(socket_path);
+    if (sender.fd < 0) {
+        fprintf(stderr, "Cannot connect to %s: %s\n", socket_path, strerror(errno));
+        return CURLY_ERROR_SOCKET;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, send_input, &sender) != 0) {
+        close(sender.fd);
+        return CURLY_ERROR_THREAD_CREATE;
+    }
+
+    // Copy result lines through, noting whether any of them failed
+    int fd = dup(sender.fd);
+    FILE *results = fd >= 0 ? fdopen(fd, "r") : NULL;
+    if (!results && fd >= 0) {
+        close(fd);
+    }
+    int failures = 0;
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    while (results && (length = getline(&line, &capacity, results)) >= 0) {
+        fwrite(line, 1, (size_t)length, output);
+        fflush(output);
+
+        json_t *result = json_loadb(line, (size_t)length, 0, NULL);
+        json_t *error = result ? json_object_get(result, "error") : NULL;
+        if (!result || (error && !json_is_null(error))) {
+            failures++;
+        }
+        json_decref(result);
+    }
+    free(line);
+
+    // The daemon closes the connection once every result is in, so the
+    // sender is done or has failed to send the rest
+    pthread_join(thread, NULL);
+    if (results) {
+        fclose(results);
+    }
+    close(sender.fd);
+
+    if (!results || sender.failed) {
+        return CURLY_ERROR_SOCKET;
+    }
+    return failures ? CURLY_ERROR_CURL_PERFORM : CURLY_OK;
+}
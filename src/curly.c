@@ -1,10 +1,12 @@
 #include "curly.h"
-
-// Structure for storing data received from libcurl
-struct curl_write_data {
-    char *data;
-    size_t size;
-};
+#include "request.h"
+#include "retry.h"
+#include "ratelimit.h"
+#include "arena.h"
+#include "bufpool.h"
+#include "cache.h"
+#include "encoding.h"
+#include <sys/mman.h>
 
 // Custom strdup implementation if not available
 static char *safe_strdup(const char *str) {
@@ -21,33 +23,27 @@ static char *safe_strdup(const char *str) {
     return memcpy(new_str, str, len);
 }
 
-// Callback function for libcurl to write received data
-static size_t write_callback(char *ptr, size_t size, size_t nmemb, void *userdata) {
-    size_t realsize = size * nmemb;
-    struct curl_write_data *write_data = (struct curl_write_data *)userdata;
-
-    char *new_data = realloc(write_data->data, write_data->size + realsize + 1);
-    if (new_data == NULL) {
-        fprintf(stderr, "Failed to allocate memory for response data\n");
-        return 0;  // Signal error to libcurl
-    }
-
-    write_data->data = new_data;
-    memcpy(&(write_data->data[write_data->size]), ptr, realsize);
-    write_data->size += realsize;
-    write_data->data[write_data->size] = '\0';  // Null-terminate the string
+// Copy a string for a config, into its arena if it has one
+static char *config_strdup(const curly_config_t *config, const char *str) {
+    return config->arena ? curly_arena_strdup(config->arena, str) : safe_strdup(str);
+}
 
-    return realsize;
+// Take a JSON field for a config. An arena config shares it with the
+// source document; otherwise the config gets its own copy.
+static json_t *config_json(const curly_config_t *config, json_t *value) {
+    return config->arena ? value : json_deep_copy(value);
 }
 
 // Initialize config with default values
-static void init_config(curly_config_t *config) {
+static void init_config(curly_config_t *config, curly_arena_t *arena) {
     if (config) {
         memset(config, 0, sizeof(curly_config_t));
-        config->method = safe_strdup("GET");  // Default method is GET
+        config->arena = arena;
+        config->method = config_strdup(config, "GET");  // Default method is GET
         config->timeout = 30;  // Default timeout is 30 seconds
         config->follow_redirects = 1;  // Follow redirects by default
         config->max_redirects = 10;  // Maximum 10 redirects by default
+        curly_rate_limit_init(&config->rate_limit);
     }
 }
 
@@ -56,59 +52,86 @@ curly_error_t curly_parse_config(const char *json_str, curly_config_t *config) {
         return CURLY_ERROR_INVALID_JSON;
     }
 
-    // Initialize config with default values
-    init_config(config);
+    return curly_parse_config_arena(json_str, config, NULL);
+}
+
+curly_error_t curly_parse_config_arena(const char *json_str, curly_config_t *config, curly_arena_t *arena) {
+    if (!json_str || !config) {
+        return CURLY_ERROR_INVALID_JSON;
+    }
 
     json_error_t json_error;
     json_t *root = json_loads(json_str, 0, &json_error);
     if (!root) {
+        init_config(config, arena);
         fprintf(stderr, "JSON parse error: %s\n", json_error.text);
         return CURLY_ERROR_INVALID_JSON;
     }
 
+    curly_error_t error = curly_config_from_json(root, config, arena);
+    json_decref(root);
+    return error;
+}
+
+curly_error_t curly_config_from_json(const json_t *root, curly_config_t *config, curly_arena_t *arena) {
+    // Initialize config with default values
+    init_config(config, arena);
+
+    if (!json_is_object(root)) {
+        curly_free_config(config);
+        return CURLY_ERROR_INVALID_JSON;
+    }
+
+    // Fields of an arena config point into the document, so keep it alive
+    if (arena) {
+        config->source = json_incref((json_t *)root);
+    }
+
     // Parse URL (required field)
     json_t *url = json_object_get(root, "url");
     if (!url || !json_is_string(url)) {
-        json_decref(root);
+        curly_free_config(config);
         return CURLY_ERROR_MISSING_URL;
     }
-    config->url = safe_strdup(json_string_value(url));
+    config->url = config_strdup(config, json_string_value(url));
 
     // Parse method (optional, default is GET)
     json_t *method = json_object_get(root, "method");
     if (method && json_is_string(method)) {
-        free(config->method); // Free default value
-        config->method = safe_strdup(json_string_value(method));
+        if (!config->arena) {
+            free(config->method); // Free default value
+        }
+        config->method = config_strdup(config, json_string_value(method));
     }
 
     // Parse headers (optional)
     json_t *headers = json_object_get(root, "headers");
     if (headers && json_is_object(headers)) {
-        config->headers = json_deep_copy(headers);
+        config->headers = config_json(config, headers);
     }
 
     // Parse data (optional)
     json_t *data = json_object_get(root, "data");
     if (data) {
-        config->data = json_deep_copy(data);
+        config->data = config_json(config, data);
     }
 
     // Parse form data (optional)
     json_t *form = json_object_get(root, "form");
     if (form && json_is_object(form)) {
-        config->form = json_deep_copy(form);
+        config->form = config_json(config, form);
     }
 
     // Parse auth (optional)
     json_t *auth = json_object_get(root, "auth");
     if (auth && json_is_object(auth)) {
-        config->auth = json_deep_copy(auth);
+        config->auth = config_json(config, auth);
     }
 
     // Parse cookies (optional)
     json_t *cookies = json_object_get(root, "cookies");
     if (cookies && json_is_object(cookies)) {
-        config->cookies = json_deep_copy(cookies);
+        config->cookies = config_json(config, cookies);
     }
 
     // Parse follow_redirects (optional)
@@ -132,55 +155,109 @@ curly_error_t curly_parse_config(const char *json_str, curly_config_t *config) {
     // Parse retry (optional)
     json_t *retry = json_object_get(root, "retry");
     if (retry && json_is_object(retry)) {
-        config->retry = json_deep_copy(retry);
+        config->retry = config_json(config, retry);
+    }
+
+    // Parse cache (optional)
+    json_t *cache = json_object_get(root, "cache");
+    if (cache && (json_is_string(cache) || json_is_object(cache))) {
+        config->cache = config_json(config, cache);
     }
 
+    // Parse compression (optional)
+    json_t *compression = json_object_get(root, "compression");
+    if (compression && (json_is_true(compression) || json_is_string(compression) || json_is_object(compression))) {
+        config->compression = config_json(config, compression);
+    }
+
+    // Parse rate_limit (optional)
+    curly_rate_limit_from_json(&config->rate_limit, json_object_get(root, "rate_limit"));
+
     // Parse verbose (optional)
     json_t *verbose = json_object_get(root, "verbose");
     if (verbose && json_is_boolean(verbose)) {
         config->verbose = json_is_true(verbose) ? 1 : 0;
     }
 
-    json_decref(root);
     return CURLY_OK;
 }
 
-// Helper to set headers from JSON object
-static CURLcode set_headers(CURL *curl, const json_t *headers) {
-    struct curl_slist *header_list = NULL;
+// Concatenate three strings, into the request's arena if it has one.
+// Strings not from an arena are freed with release_string().
+static char *join_strings(const curly_request_t *request, const char *a, const char *b, const char *c) {
+    size_t a_len = strlen(a);
+    size_t b_len = strlen(b);
+    size_t c_len = strlen(c);
+    size_t len = a_len + b_len + c_len + 1;
+
+    char *str = request->arena ? curly_arena_alloc(request->arena, len) : malloc(len);
+    if (!str) {
+        return NULL;
+    }
+
+    memcpy(str, a, a_len);
+    memcpy(str + a_len, b, b_len);
+    memcpy(str + a_len + b_len, c, c_len + 1);
+    return str;
+}
+
+static void release_string(const curly_request_t *request, char *str) {
+    if (!request->arena) {
+        free(str);
+    }
+}
+
+// Append a header line to the request's header list. With an arena the
+// list nodes come from it as well, and libcurl only ever reads them.
+static CURLcode add_header_line(curly_request_t *request, char *line) {
+    if (!line) {
+        return CURLE_OUT_OF_MEMORY;
+    }
+
+    if (!request->arena) {
+        struct curl_slist *new_list = curl_slist_append(request->headers, line);
+        free(line);
+        if (!new_list) {
+            return CURLE_OUT_OF_MEMORY;
+        }
+        request->headers = new_list;
+        return CURLE_OK;
+    }
+
+    struct curl_slist *node = curly_arena_alloc(request->arena, sizeof(struct curl_slist));
+    if (!node) {
+        return CURLE_OUT_OF_MEMORY;
+    }
+    node->data = line;
+    node->next = NULL;
+
+    struct curl_slist **tail = &request->headers;
+    while (*tail) {
+        tail = &(*tail)->next;
+    }
+    *tail = node;
+    return CURLE_OK;
+}
+
+// Helper to append headers from JSON object
+static CURLcode append_headers(curly_request_t *request, const json_t *headers) {
     const char *key;
     json_t *value;
 
     json_object_foreach((json_t *)headers, key, value) {
         if (json_is_string(value)) {
-            char *header = NULL;
-            int header_len = snprintf(NULL, 0, "%s: %s", key, json_string_value(value));
-            if (header_len < 0) {
-                curl_slist_free_all(header_list);
-                return CURLE_OUT_OF_MEMORY;
-            }
-            
-            header = malloc(header_len + 1);
-            if (!header) {
-                curl_slist_free_all(header_list);
-                return CURLE_OUT_OF_MEMORY;
+            CURLcode res = add_header_line(request, join_strings(request, key, ": ", json_string_value(value)));
+            if (res != CURLE_OK) {
+                return res;
             }
-            
-            snprintf(header, header_len + 1, "%s: %s", key, json_string_value(value));
-            header_list = curl_slist_append(header_list, header);
-            free(header);
         }
     }
 
-    if (header_list) {
-        return curl_easy_setopt(curl, CURLOPT_HTTPHEADER, header_list);
-    }
-    
     return CURLE_OK;
 }
 
-// Helper to set auth options
-static CURLcode set_auth(CURL *curl, const json_t *auth) {
+// Helper to set auth options; bearer tokens are added to the header list
+static CURLcode set_auth(CURL *curl, const json_t *auth, curly_request_t *request) {
     json_t *type = json_object_get(auth, "type");
     if (!type || !json_is_string(type)) {
         return CURLE_BAD_FUNCTION_ARGUMENT;
@@ -194,61 +271,24 @@ static CURLcode set_auth(CURL *curl, const json_t *auth) {
         
         if (username && json_is_string(username) && 
             password && json_is_string(password)) {
-            char *userpass = NULL;
-            int userpass_len = snprintf(NULL, 0, "%s:%s", 
-                                      json_string_value(username), 
-                                      json_string_value(password));
-            
-            if (userpass_len < 0) {
-                return CURLE_OUT_OF_MEMORY;
-            }
-            
-            userpass = malloc(userpass_len + 1);
+            char *userpass = join_strings(request, json_string_value(username), ":",
+                                          json_string_value(password));
             if (!userpass) {
                 return CURLE_OUT_OF_MEMORY;
             }
-            
-            snprintf(userpass, userpass_len + 1, "%s:%s", 
-                    json_string_value(username), 
-                    json_string_value(password));
                     
             CURLcode res = curl_easy_setopt(curl, CURLOPT_HTTPAUTH, CURLAUTH_BASIC);
-            if (res != CURLE_OK) {
-                free(userpass);
-                return res;
+            if (res == CURLE_OK) {
+                res = curl_easy_setopt(curl, CURLOPT_USERPWD, userpass);
             }
-            
-            res = curl_easy_setopt(curl, CURLOPT_USERPWD, userpass);
-            free(userpass);
+            release_string(request, userpass);
             return res;
         }
     } else if (strcmp(auth_type, "bearer") == 0) {
         json_t *token = json_object_get(auth, "token");
         if (token && json_is_string(token)) {
-            char *auth_header = NULL;
-            int header_len = snprintf(NULL, 0, "Authorization: Bearer %s", 
-                                     json_string_value(token));
-            
-            if (header_len < 0) {
-                return CURLE_OUT_OF_MEMORY;
-            }
-            
-            auth_header = malloc(header_len + 1);
-            if (!auth_header) {
-                return CURLE_OUT_OF_MEMORY;
-            }
-            
-            snprintf(auth_header, header_len + 1, "Authorization: Bearer %s", 
-                    json_string_value(token));
-                    
-            struct curl_slist *header_list = curl_slist_append(NULL, auth_header);
-            free(auth_header);
-            
-            if (!header_list) {
-                return CURLE_OUT_OF_MEMORY;
-            }
-            
-            return curl_easy_setopt(curl, CURLOPT_HTTPHEADER, header_list);
+            return add_header_line(request, join_strings(request, "Authorization: Bearer ",
+                                                         json_string_value(token), ""));
         }
     }
     
@@ -270,79 +310,73 @@ static CURLcode set_cookies(CURL *curl, const json_t *cookies) {
     return CURLE_OK;
 }
 
-// Helper to set JSON data for POST/PUT
-static CURLcode set_json_data(CURL *curl, const json_t *data) {
-    char *json_str = json_dumps(data, JSON_COMPACT);
-    if (!json_str) {
-        return CURLE_OUT_OF_MEMORY;
+// Helper to set JSON data for POST/PUT. The serialized body is kept in the
+// request so it can be freed once the transfer is done; with an arena it
+// is serialized straight into the arena.
+static CURLcode set_json_data(CURL *curl, const json_t *data, curly_request_t *request) {
+    // Only objects and arrays can be serialized as a body
+    if (!json_is_object(data) && !json_is_array(data)) {
+        return CURLE_BAD_FUNCTION_ARGUMENT;
+    }
+    
+    char *json_str;
+    if (request->arena) {
+        size_t size = json_dumpb(data, NULL, 0, JSON_COMPACT);
+        json_str = size ? curly_arena_alloc(request->arena, size + 1) : NULL;
+        if (!json_str || json_dumpb(data, json_str, size, JSON_COMPACT) != size) {
+            return CURLE_OUT_OF_MEMORY;
+        }
+        json_str[size] = '\0';
+    } else {
+        json_str = json_dumps(data, JSON_COMPACT);
+        if (!json_str) {
+            return CURLE_OUT_OF_MEMORY;
+        }
     }
     
     CURLcode res = curl_easy_setopt(curl, CURLOPT_POSTFIELDS, json_str);
     if (res != CURLE_OK) {
-        free(json_str);
+        release_string(request, json_str);
         return res;
     }
     
-    // Store the json_str somewhere so it can be freed after the request completes
-    // For now, this is a memory leak in this example
-    
+    request->body = json_str;
     return CURLE_OK;
 }
 
-curly_error_t curly_perform_request(const curly_config_t *config, curly_response_t *response) {
-    if (!config || !response || !config->url) {
-        return CURLY_ERROR_INVALID_JSON;
-    }
-    
-    CURL *curl = curl_easy_init();
-    if (!curl) {
-        return CURLY_ERROR_CURL_INIT;
-    }
-    
-    // Initialize response
-    response->data = malloc(1);
-    if (!response->data) {
-        curl_easy_cleanup(curl);
-        return CURLY_ERROR_MEMORY_ALLOCATION;
-    }
-    response->data[0] = '\0';
-    response->size = 0;
-    
-    struct curl_write_data write_data;
-    write_data.data = malloc(1);
-    if (!write_data.data) {
-        free(response->data);
-        curl_easy_cleanup(curl);
-        return CURLY_ERROR_MEMORY_ALLOCATION;
-    }
-    write_data.data[0] = '\0';
-    write_data.size = 0;
+curly_error_t curly_request_setup(CURL *curl, const curly_config_t *config, curly_arena_t *arena,
+                                  curly_request_t *request) {
+    memset(request, 0, sizeof(curly_request_t));
+    request->arena = arena;
     
     // Set URL
     curl_easy_setopt(curl, CURLOPT_URL, config->url);
     
-    // Set write callback
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &write_data);
-    
     // Set HTTP method
     if (strcmp(config->method, "GET") != 0) {
         curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, config->method);
     }
     
     // Set headers if provided
-    if (config->headers) {
-        set_headers(curl, config->headers);
+    if (config->headers && append_headers(request, config->headers) == CURLE_OUT_OF_MEMORY) {
+        curly_request_cleanup(request);
+        return CURLY_ERROR_MEMORY_ALLOCATION;
     }
     
     // Set data if provided (for POST, PUT, etc.)
-    if (config->data) {
-        set_json_data(curl, config->data);
+    if (config->data && set_json_data(curl, config->data, request) == CURLE_OUT_OF_MEMORY) {
+        curly_request_cleanup(request);
+        return CURLY_ERROR_MEMORY_ALLOCATION;
     }
     
     // Set auth if provided
-    if (config->auth) {
-        set_auth(curl, config->auth);
+    if (config->auth && set_auth(curl, config->auth, request) == CURLE_OUT_OF_MEMORY) {
+        curly_request_cleanup(request);
+        return CURLY_ERROR_MEMORY_ALLOCATION;
+    }
+    
+    if (request->headers) {
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, request->headers);
     }
     
     // Set cookies if provided
@@ -350,41 +384,209 @@ curly_error_t curly_perform_request(const curly_config_t *config, curly_response
         set_cookies(curl, config->cookies);
     }
     
+    // Offer compressed responses if asked to
+    if (config->compression && curly_encoding_setup_json(curl, config->compression) != CURLY_OK) {
+        curly_request_cleanup(request);
+        return CURLY_ERROR_MEMORY_ALLOCATION;
+    }
+    
     // Set follow_redirects
-    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, config->follow_redirects);
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, (long)config->follow_redirects);
     
     // Set max_redirects if follow_redirects is enabled
     if (config->follow_redirects) {
-        curl_easy_setopt(curl, CURLOPT_MAXREDIRS, config->max_redirects);
+        curl_easy_setopt(curl, CURLOPT_MAXREDIRS, (long)config->max_redirects);
     }
     
     // Set timeout
-    curl_easy_setopt(curl, CURLOPT_TIMEOUT, config->timeout);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, (long)config->timeout);
+    
+    // A single transfer is shaped by libcurl itself, to the tighter of the
+    // overall and per-host bandwidth limits
+    curl_off_t max_rate = config->rate_limit.bytes_per_sec;
+    if (config->rate_limit.host_bytes_per_sec > 0 &&
+        (max_rate <= 0 || config->rate_limit.host_bytes_per_sec < max_rate)) {
+        max_rate = config->rate_limit.host_bytes_per_sec;
+    }
+    if (max_rate > 0) {
+        curl_easy_setopt(curl, CURLOPT_MAX_RECV_SPEED_LARGE, max_rate);
+    }
     
     // Set verbose mode
-    curl_easy_setopt(curl, CURLOPT_VERBOSE, config->verbose);
+    curl_easy_setopt(curl, CURLOPT_VERBOSE, (long)config->verbose);
     
-    // Perform the request
-    CURLcode curl_res = curl_easy_perform(curl);
+    return CURLY_OK;
+}
+
+void curly_request_cleanup(curly_request_t *request) {
+    if (!request) return;
     
-    if (curl_res != CURLE_OK) {
-        fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(curl_res));
-        free(write_data.data);
+    // Arena requests are released with their arena
+    if (!request->arena) {
+        curl_slist_free_all(request->headers);
+        free(request->body);
+    }
+    memset(request, 0, sizeof(curly_request_t));
+}
+
+curly_error_t curly_perform_request(const curly_config_t *config, curly_response_t *response) {
+    if (!config || !response || !config->url) {
+        return CURLY_ERROR_INVALID_JSON;
+    }
+    
+    curly_sink_t sink;
+    curly_sink_init_buffer(&sink, response);
+    
+    return curly_perform_request_sink(config, &sink);
+}
+
+// Write callback state for a request that may be retried. The body of a
+// response that is going to be retried never reaches the caller's sink.
+typedef struct {
+    curly_sink_t *sink;
+    CURL *curl;
+    const curly_retry_policy_t *policy;
+    int attempt;
+    int checked;     // Status of this attempt has been looked at
+    int discard;     // This attempt's body is being thrown away
+    long delay;      // Delay before the next attempt if discarding
+    int delivered;   // Data has reached the sink
+} retry_write_t;
+
+// libcurl write callback forwarding to the sink unless the attempt will be retried
+static size_t retry_write(char *ptr, size_t size, size_t nmemb, void *userdata) {
+    retry_write_t *state = (retry_write_t *)userdata;
+
+    // The headers are complete by the first write, so decide now
+    if (!state->checked) {
+        long status = 0;
+        curl_off_t retry_after = 0;
+        curl_easy_getinfo(state->curl, CURLINFO_RESPONSE_CODE, &status);
+        curl_easy_getinfo(state->curl, CURLINFO_RETRY_AFTER, &retry_after);
+
+        state->delay = -1;
+        if (curly_retry_is_retryable(CURLE_OK, status)) {
+            state->delay = curly_retry_delay(state->policy, state->attempt, retry_after);
+        }
+        state->discard = state->delay >= 0;
+        state->checked = 1;
+    }
+
+    if (state->discard) {
+        return size * nmemb;
+    }
+
+    state->delivered = 1;
+    return curly_sink_write(ptr, size, nmemb, state->sink);
+}
+
+CURLcode curly_request_perform(CURL *curl, const curly_retry_policy_t *policy, curly_sink_t *sink) {
+    // Stream the body into the sink
+    retry_write_t state;
+    memset(&state, 0, sizeof(state));
+    state.sink = sink;
+    state.curl = curl;
+    state.policy = policy;
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, retry_write);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &state);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, curly_sink_header);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, sink);
+    
+    // Perform the request, retrying transient failures as long as nothing
+    // has been handed to the sink yet
+    CURLcode curl_res;
+    for (;;) {
+        state.attempt++;
+        state.checked = 0;
+        state.discard = 0;
+        curl_res = curl_easy_perform(curl);
+        
+        if (state.delivered) {
+            break;
+        }
+        
+        long delay = state.discard ? state.delay : curly_retry_next(policy, NULL, curl, curl_res, state.attempt);
+        if (delay < 0) {
+            break;
+        }
+        curly_retry_sleep(delay);
+    }
+    
+    return curl_res;
+}
+
+curly_error_t curly_perform_request_sink(const curly_config_t *config, curly_sink_t *sink) {
+    if (!config || !sink || !config->url) {
+        return CURLY_ERROR_INVALID_JSON;
+    }
+    
+    // A fresh cached response is served without touching the network
+    curly_cache_lookup_t *cache = curly_cache_lookup(config);
+    if (cache && curly_cache_fresh(cache)) {
+        curly_error_t error = curly_cache_deliver(cache, sink);
+        curly_cache_release(cache);
+        return error;
+    }
+    
+    CURL *curl = curl_easy_init();
+    if (!curl) {
+        curly_cache_release(cache);
+        return CURLY_ERROR_CURL_INIT;
+    }
+    
+    // Apply the configuration
+    curly_request_t request;
+    curly_error_t error = curly_request_setup(curl, config, config->arena, &request);
+    if (error != CURLY_OK) {
         curl_easy_cleanup(curl);
-        return CURLY_ERROR_CURL_PERFORM;
+        curly_cache_release(cache);
+        return error;
     }
     
-    // Copy the response data
-    response->data = write_data.data;
-    response->size = write_data.size;
+    curly_retry_policy_t policy;
+    curly_retry_policy_from_json(&policy, config->retry);
+    
+    // With a cache the body also goes to a new entry, and a stale entry is
+    // revalidated instead of fetched again
+    curly_sink_t tee;
+    if (cache) {
+        curly_cache_prepare(cache, curl, request.headers, sink, &tee);
+    }
+    
+    CURLcode curl_res = curly_request_perform(curl, &policy, cache ? &tee : sink);
+    
+    int delivered = 0;
+    if (cache && curl_res == CURLE_OK) {
+        error = curly_cache_complete(cache, curl, sink, &delivered);
+    }
     
     curl_easy_cleanup(curl);
-    return CURLY_OK;
+    curly_request_cleanup(&request);
+    curly_cache_release(cache);
+    
+    if (delivered) {
+        return error;
+    }
+    
+    if (curl_res != CURLE_OK) {
+        fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(curl_res));
+        curly_sink_finish(sink, 0);
+        return CURLY_ERROR_CURL_PERFORM;
+    }
+    
+    return curly_sink_finish(sink, 1);
 }
 
 void curly_free_config(curly_config_t *config) {
     if (!config) return;
     
+    // An arena config owns nothing but its reference to the document
+    if (config->arena) {
+        if (config->source) json_decref(config->source);
+        memset(config, 0, sizeof(curly_config_t));
+        return;
+    }
+    
     free(config->url);
     free(config->method);
     
@@ -394,6 +596,8 @@ void curly_free_config(curly_config_t *config) {
     if (config->auth) json_decref(config->auth);
     if (config->cookies) json_decref(config->cookies);
     if (config->retry) json_decref(config->retry);
+    if (config->cache) json_decref(config->cache);
+    if (config->compression) json_decref(config->compression);
     
     // Reset the structure to all zeros
     memset(config, 0, sizeof(curly_config_t));
@@ -402,9 +606,19 @@ void curly_free_config(curly_config_t *config) {
 void curly_free_response(curly_response_t *response) {
     if (!response) return;
     
-    free(response->data);
+    // Arena bodies are released with their arena
+    if (response->mapping) {
+        munmap(response->mapping, response->mapping_size);
+    } else if (response->pool) {
+        curly_buffer_pool_give(response->pool, response->data, response->capacity);
+    } else if (!response->arena) {
+        free(response->data);
+    }
     response->data = NULL;
     response->size = 0;
+    response->capacity = 0;
+    response->mapping = NULL;
+    response->mapping_size = 0;
 }
 
 const char *curly_strerror(curly_error_t error) {
@@ -425,6 +639,12 @@ const char *curly_strerror(curly_error_t error) {
             return "Failed to open file";
         case CURLY_ERROR_THREAD_CREATE:
             return "Failed to create thread";
+        case CURLY_ERROR_FILE_WRITE:
+            return "Failed to write file";
+        case CURLY_ERROR_MISSING_VARIABLE:
+            return "Missing or invalid template variable";
+        case CURLY_ERROR_SOCKET:
+            return "Socket error";
         case CURLY_ERROR_UNKNOWN:
         default:
             return "Unknown error";
@@ -0,0 +1,345 @@
+#include "dedup.h"
+#include "output.h"
+#include "sha256.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+#define COPY_BUFFER_SIZE (256 * 1024)
+
+// A file waiting to be added by the store's thread
+typedef struct store_entry {
+    char *path;
+    curly_store_done_t done;
+    void *arg;
+    struct store_entry *next;
+} store_entry_t;
+
+struct curly_store {
+    char *path;
+    curly_dedup_mode_t mode;
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;        // Signalled when a file is queued or the store closes
+    store_entry_t *head;
+    store_entry_t *tail;
+    int closing;
+};
+
+// Write a copy of source to the new file at path, sharing its blocks when
+// the filesystem can. Without may_copy, a filesystem that can't share them
+// fails with EOPNOTSUPP instead of copying the bytes.
+static int clone_file(const char *source, const char *path, int may_copy) {
+    int in = open(source, O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
+        return -1;
+    }
+    int out = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (out < 0) {
+        close(in);
+        return -1;
+    }
+
+    int result = -1;
+#if defined(__linux__) && defined(FICLONE)
+    if (ioctl(out, FICLONE, in) == 0) {
+        result = 0;
+    }
+#endif
+
+    if (result != 0 && !may_copy) {
+        errno = EOPNOTSUPP;
+    }
+    char *buffer = result == 0 || !may_copy ? NULL : (char *)malloc(COPY_BUFFER_SIZE);
+    if (buffer) {
+        ssize_t got;
+        result = 0;
+        while ((got = read(in, buffer, COPY_BUFFER_SIZE)) != 0) {
+            if (got < 0) {
+                if (errno == EINTR) continue;
+                result = -1;
+                break;
+            }
+            for (ssize_t written = 0; written < got;) {
+                ssize_t put = write(out, buffer + written, (size_t)(got - written));
+                if (put < 0) {
+                    if (errno == EINTR) continue;
+                    result = -1;
+                    break;
+                }
+                written += put;
+            }
+            if (result != 0) break;
+        }
+        free(buffer);
+    }
+
+    int saved = errno;
+    close(in);
+    if (close(out) != 0 && result == 0) {
+        saved = errno;
+        result = -1;
+    }
+    if (result != 0) {
+        unlink(path);
+        errno = saved;
+    }
+    return result;
+}
+
+// Place source at destination as curly_dedup_place() does, falling back to
+// a byte copy only with may_copy
+static int place_file(const char *source, const char *destination, curly_dedup_mode_t mode, int may_copy) {
+    // Renaming a link over the file it links to would do nothing
+    struct stat from, to;
+    if (stat(source, &from) != 0) {
+        return -1;
+    }
+    if (stat(destination, &to) == 0 && from.st_dev == to.st_dev && from.st_ino == to.st_ino) {
+        return 0;
+    }
+
+    char *temp = curly_output_temp_name(destination);
+    if (!temp) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    // Links fail across filesystems, for directories over the link limit and
+    // on filesystems without them; a clone or copy still works there
+    int placed = mode == CURLY_DEDUP_LINK && link(source, temp) == 0;
+    if (!placed && clone_file(source, temp, may_copy) != 0) {
+        int saved = errno;
+        free(temp);
+        errno = saved;
+        return -1;
+    }
+    if (rename(temp, destination) != 0) {
+        int saved = errno;
+        unlink(temp);
+        free(temp);
+        errno = saved;
+        return -1;
+    }
+    free(temp);
+    return 0;
+}
+
+int curly_dedup_place(const char *source, const char *destination, curly_dedup_mode_t mode) {
+    return place_file(source, destination, mode, 1);
+}
+
+// Check whether files in a directory can be reflink clones of each other
+static int can_clone(const char *dir) {
+    size_t size = strlen(dir) + 8;
+    char *probe = (char *)malloc(size);
+    if (!probe) {
+        return 0;
+    }
+    snprintf(probe, size, "%s/.probe", dir);
+    char *source = curly_output_temp_name(probe);
+    char *clone = curly_output_temp_name(probe);
+
+    int ok = 0;
+    int fd = source && clone ? open(source, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644) : -1;
+    if (fd >= 0) {
+        ok = write(fd, "", 1) == 1;
+        close(fd);
+        ok = ok && clone_file(source, clone, 0) == 0;
+        unlink(clone);
+        unlink(source);
+    }
+    free(source);
+    free(clone);
+    free(probe);
+    return ok;
+}
+
+// Add queued files until the store closes and the queue is empty
+static void *store_thread(void *arg) {
+    curly_store_t *store = (curly_store_t *)arg;
+
+    pthread_mutex_lock(&store->mutex);
+    for (;;) {
+        while (!store->head && !store->closing) {
+            pthread_cond_wait(&store->cond, &store->mutex);
+        }
+        store_entry_t *entry = store->head;
+        if (!entry) {
+            break;
+        }
+        store->head = entry->next;
+        if (!store->head) {
+            store->tail = NULL;
+        }
+        pthread_mutex_unlock(&store->mutex);
+
+        int result = curly_store_add(store, entry->path);
+        entry->done(entry->path, result, entry->arg);
+        free(entry->path);
+        free(entry);
+
+        pthread_mutex_lock(&store->mutex);
+    }
+    pthread_mutex_unlock(&store->mutex);
+    return NULL;
+}
+
+curly_store_t *curly_store_open(const char *path, curly_dedup_mode_t mode) {
+    if (!path || (mkdir(path, 0755) != 0 && errno != EEXIST)) {
+        return NULL;
+    }
+
+    // Byte copies would keep every payload twice
+    if (mode != CURLY_DEDUP_LINK && !can_clone(path)) {
+        errno = EOPNOTSUPP;
+        return NULL;
+    }
+
+    curly_store_t *store = (curly_store_t *)calloc(1, sizeof(curly_store_t));
+    if (!store) {
+        return NULL;
+    }
+    store->path = strdup(path);
+    if (!store->path) {
+        free(store);
+        return NULL;
+    }
+    store->mode = mode == CURLY_DEDUP_LINK ? CURLY_DEDUP_LINK : CURLY_DEDUP_COPY;
+
+    pthread_mutex_init(&store->mutex, NULL);
+    pthread_cond_init(&store->cond, NULL);
+    if (pthread_create(&store->thread, NULL, store_thread, store) != 0) {
+        pthread_cond_destroy(&store->cond);
+        pthread_mutex_destroy(&store->mutex);
+        free(store->path);
+        free(store);
+        return NULL;
+    }
+    return store;
+}
+
+void curly_store_close(curly_store_t *store) {
+    if (!store) return;
+
+    pthread_mutex_lock(&store->mutex);
+    store->closing = 1;
+    pthread_cond_signal(&store->cond);
+    pthread_mutex_unlock(&store->mutex);
+    pthread_join(store->thread, NULL);
+
+    pthread_cond_destroy(&store->cond);
+    pthread_mutex_destroy(&store->mutex);
+    free(store->path);
+    free(store);
+}
+
+// Hash a file's content
+static int hash_file(const char *path, unsigned char digest[CURLY_SHA256_SIZE]) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    char *buffer = (char *)malloc(COPY_BUFFER_SIZE);
+    if (!buffer) {
+        close(fd);
+        return -1;
+    }
+
+    curly_sha256_t ctx;
+    curly_sha256_init(&ctx);
+    ssize_t got;
+    while ((got = read(fd, buffer, COPY_BUFFER_SIZE)) != 0) {
+        if (got < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        curly_sha256_update(&ctx, buffer, (size_t)got);
+    }
+    free(buffer);
+    close(fd);
+    if (got < 0) {
+        return -1;
+    }
+
+    curly_sha256_final(&ctx, digest);
+    return 0;
+}
+
+int curly_store_add(curly_store_t *store, const char *path) {
+    unsigned char digest[CURLY_SHA256_SIZE];
+    if (hash_file(path, digest) != 0) {
+        return -1;
+    }
+
+    // <store>/ab/cdef... keeps directories small
+    char hex[CURLY_SHA256_SIZE * 2 + 1];
+    for (int i = 0; i < CURLY_SHA256_SIZE; i++) {
+        snprintf(hex + i * 2, 3, "%02x", digest[i]);
+    }
+    size_t size = strlen(store->path) + sizeof(hex) + 3;
+    char *object = (char *)malloc(size);
+    if (!object) {
+        return -1;
+    }
+    snprintf(object, size, "%s/%.2s", store->path, hex);
+    if (mkdir(object, 0755) != 0 && errno != EEXIST) {
+        free(object);
+        return -1;
+    }
+    snprintf(object, size, "%s/%.2s/%s", store->path, hex, hex + 2);
+
+    // A byte copy would not save anything, so files the store can't link
+    // or clone, such as ones on another filesystem, are left as they are
+    int result;
+    if (access(object, F_OK) == 0) {
+        // Known content: share the stored object
+        result = place_file(object, path, store->mode, 0);
+    } else if (store->mode == CURLY_DEDUP_LINK && link(path, object) == 0) {
+        result = 0;
+    } else if (store->mode == CURLY_DEDUP_LINK && errno == EEXIST) {
+        // Another thread or run stored the same content first
+        result = place_file(object, path, store->mode, 0);
+    } else {
+        // A clone is renamed into place whole, so an identical object
+        // stored meanwhile is just replaced
+        result = place_file(path, object, store->mode, 0);
+    }
+    if (result != 0 && errno == EOPNOTSUPP) {
+        result = 0;
+    }
+
+    free(object);
+    return result;
+}
+
+int curly_store_submit(curly_store_t *store, const char *path, curly_store_done_t done, void *arg) {
+    store_entry_t *entry = (store_entry_t *)calloc(1, sizeof(store_entry_t));
+    if (!entry) {
+        return -1;
+    }
+    entry->path = strdup(path);
+    if (!entry->path) {
+        free(entry);
+        return -1;
+    }
+    entry->done = done;
+    entry->arg = arg;
+
+    pthread_mutex_lock(&store->mutex);
+    if (store->tail) {
+        store->tail->next = entry;
+    } else {
+        store->head = entry;
+    }
+    store->tail = entry;
+    pthread_cond_signal(&store->cond);
+    pthread_mutex_unlock(&store->mutex);
+    return 0;
+}
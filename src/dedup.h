@@ -0,0 +1,80 @@
+#ifndef CURLY_DEDUP_H
+#define CURLY_DEDUP_H
+
+#include "curly.h"
+
+/**
+ * Make destination hold the same content as source, replacing it
+ * atomically. CURLY_DEDUP_LINK makes it a hard link to source where the
+ * filesystem allows one; otherwise it becomes a reflink clone where the
+ * filesystem supports them, or a plain copy.
+ *
+ * @param source Finished file
+ * @param destination Path to fill; its directory must exist
+ * @param mode CURLY_DEDUP_LINK or CURLY_DEDUP_COPY
+ * @return 0 on success, -1 on failure with errno set
+ */
+int curly_dedup_place(const char *source, const char *destination, curly_dedup_mode_t mode);
+
+/**
+ * Content-addressed store. Each distinct payload is kept once under the
+ * hex SHA-256 of its content, as <dir>/ab/cdef...; files added with the same
+ * content are replaced by links or clones of that object.
+ */
+typedef struct curly_store curly_store_t;
+
+/**
+ * Called from the store's thread once a submitted file has been added
+ *
+ * @param path File that was added
+ * @param result As returned by curly_store_add()
+ * @param arg Argument given to curly_store_submit()
+ */
+typedef void (*curly_store_done_t)(const char *path, int result, void *arg);
+
+/**
+ * Open a store, creating its directory if needed. Objects and files are
+ * only ever tied together by links or reflinks, since byte copies would
+ * keep every payload twice.
+ *
+ * @param path Store directory
+ * @param mode CURLY_DEDUP_LINK for hard links, falling back to reflinks
+ *        where a link is impossible; CURLY_DEDUP_COPY for reflinks only
+ * @return New store, or NULL on failure; errno is EOPNOTSUPP for
+ *         CURLY_DEDUP_COPY on a filesystem without reflinks
+ */
+curly_store_t *curly_store_open(const char *path, curly_dedup_mode_t mode);
+
+/**
+ * Close a store, waiting for the files submitted to it first
+ *
+ * @param store Store to close, may be NULL
+ */
+void curly_store_close(curly_store_t *store);
+
+/**
+ * Add a finished file. If the store holds the same content already, the
+ * file is replaced by a link or clone of that object; otherwise it becomes
+ * the object for its content. A file that can be neither linked nor cloned,
+ * such as one on another filesystem, is left as it is. Safe to call from
+ * several threads.
+ *
+ * @param store Store
+ * @param path File to add
+ * @return 0 on success, -1 on failure (the file is left as it was)
+ */
+int curly_store_add(curly_store_t *store, const char *path);
+
+/**
+ * Queue a finished file to be added by the store's own thread, so hashing
+ * it never holds up the caller. Files are added in the order submitted.
+ *
+ * @param store Store
+ * @param path File to add, copied
+ * @param done Called once the file has been added
+ * @param arg Passed to done
+ * @return 0 if queued, -1 if out of memory
+ */
+int curly_store_submit(curly_store_t *store, const char *path, curly_store_done_t done, void *arg);
+
+#endif /* CURLY_DEDUP_H */
@@ -0,0 +1,188 @@
+#include "encoding.h"
+#include <ctype.h>
+#include <strings.h>
+
+#define MAX_CODING_LENGTH 24
+#define CODING_SEPARATORS ", \t"
+
+// Feature bits of older libcurl builds that predate a decoder
+#ifndef CURL_VERSION_BROTLI
+#define CURL_VERSION_BROTLI 0
+#endif
+#ifndef CURL_VERSION_ZSTD
+#define CURL_VERSION_ZSTD 0
+#endif
+
+typedef struct {
+    const char *name;
+    const char *extension;
+    int feature;  // libcurl feature bit needed to decode it
+    int offered;  // Part of the default offer
+} coding_t;
+
+static const coding_t codings[] = {
+    {"gzip", ".gz", CURL_VERSION_LIBZ, 1},
+    {"deflate", ".zz", CURL_VERSION_LIBZ, 1},
+    {"br", ".br", CURL_VERSION_BROTLI, 1},
+    {"zstd", ".zst", CURL_VERSION_ZSTD, 1},
+    {"x-gzip", ".gz", CURL_VERSION_LIBZ, 0},
+};
+
+#define CODING_COUNT (sizeof(codings) / sizeof(codings[0]))
+
+// Find a known coding by name, NULL if there is none
+static const coding_t *find_coding(const char *name, size_t length) {
+    for (size_t i = 0; i < CODING_COUNT; i++) {
+        if (strlen(codings[i].name) == length && strncasecmp(codings[i].name, name, length) == 0) {
+            return &codings[i];
+        }
+    }
+    return NULL;
+}
+
+// Check that a coding name is a plain token, safe in a header and a file name
+static int valid_coding(const char *name, size_t length) {
+    if (length == 0 || length > MAX_CODING_LENGTH) {
+        return 0;
+    }
+    for (size_t i = 0; i < length; i++) {
+        if (!isalnum((unsigned char)name[i]) && name[i] != '-' && name[i] != '_') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int is_identity(const char *name, size_t length) {
+    return length == 8 && strncasecmp(name, "identity", 8) == 0;
+}
+
+// Append a coding to an Accept-Encoding value being built
+static void append_coding(char *accept, size_t *used, const char *name, size_t length) {
+    if (*used > 0) {
+        memcpy(accept + *used, ", ", 2);
+        *used += 2;
+    }
+    memcpy(accept + *used, name, length);
+    *used += length;
+    accept[*used] = '\0';
+}
+
+char *curly_encoding_accept(const char *requested, int decode) {
+    long features = curl_version_info(CURLVERSION_NOW)->features;
+
+    // Each coding kept takes at most its name and a separator
+    size_t size = 64 + (requested ? strlen(requested) * 2 : 0);
+    char *accept = (char *)malloc(size);
+    if (!accept) {
+        return NULL;
+    }
+    accept[0] = '\0';
+    size_t used = 0;
+
+    if (!requested || !*requested) {
+        for (size_t i = 0; i < CODING_COUNT; i++) {
+            if (codings[i].offered && (!decode || (features & codings[i].feature))) {
+                append_coding(accept, &used, codings[i].name, strlen(codings[i].name));
+            }
+        }
+        return accept;
+    }
+
+    const char *p = requested;
+    while (*p) {
+        p += strspn(p, CODING_SEPARATORS);
+        size_t length = strcspn(p, CODING_SEPARATORS);
+        if (length == 0) {
+            break;
+        }
+
+        // Without decoding, any coding can be passed through as it is
+        const coding_t *coding = find_coding(p, length);
+        int usable = decode ? (coding && (features & coding->feature)) : valid_coding(p, length);
+        if (usable && !is_identity(p, length)) {
+            append_coding(accept, &used, p, length);
+        }
+        p += length;
+    }
+    return accept;
+}
+
+void curly_encoding_setup(CURL *curl, const char *accept, int decode) {
+    // An empty string would have libcurl offer everything it can decode
+    if (!accept || !*accept) {
+        return;
+    }
+    curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, accept);
+    curl_easy_setopt(curl, CURLOPT_HTTP_CONTENT_DECODING, decode ? 1L : 0L);
+}
+
+curly_error_t curly_encoding_setup_json(CURL *curl, const json_t *compression) {
+    const char *requested = NULL;
+    int decode = 1;
+
+    if (!compression || json_is_false(compression)) {
+        return CURLY_OK;
+    } else if (json_is_string(compression)) {
+        requested = json_string_value(compression);
+    } else if (json_is_object(compression)) {
+        json_t *encodings = json_object_get(compression, "encodings");
+        if (encodings && json_is_string(encodings)) {
+            requested = json_string_value(encodings);
+        }
+        json_t *decode_json = json_object_get(compression, "decode");
+        if (decode_json && json_is_boolean(decode_json)) {
+            decode = json_is_true(decode_json) ? 1 : 0;
+        }
+    } else if (!json_is_true(compression)) {
+        return CURLY_OK;
+    }
+
+    // libcurl keeps its own copy of the value
+    char *accept = curly_encoding_accept(requested, decode);
+    if (!accept) {
+        return CURLY_ERROR_MEMORY_ALLOCATION;
+    }
+    curly_encoding_setup(curl, accept, decode);
+    free(accept);
+    return CURLY_OK;
+}
+
+int curly_encoding_suffix(const char *content_encoding, char *suffix, size_t size) {
+    if (size == 0) {
+        return -1;
+    }
+    suffix[0] = '\0';
+    if (!content_encoding) {
+        return 0;
+    }
+
+    // Codings are listed in the order they were applied
+    size_t used = 0;
+    const char *p = content_encoding;
+    while (*p) {
+        p += strspn(p, CODING_SEPARATORS);
+        size_t length = strcspn(p, CODING_SEPARATORS);
+        if (length == 0) {
+            break;
+        }
+
+        if (!is_identity(p, length)) {
+            if (!valid_coding(p, length)) {
+                suffix[0] = '\0';
+                return -1;
+            }
+
+            const coding_t *coding = find_coding(p, length);
+            int added = coding ? snprintf(suffix + used, size - used, "%s", coding->extension)
+                               : snprintf(suffix + used, size - used, ".%.*s", (int)length, p);
+            if (added < 0 || (size_t)added >= size - used) {
+                suffix[0] = '\0';
+                return -1;
+            }
+            used += (size_t)added;
+        }
+        p += length;
+    }
+    return used > 0 ? 1 : 0;
+}
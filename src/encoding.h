@@ -0,0 +1,65 @@
+#ifndef CURLY_ENCODING_H
+#define CURLY_ENCODING_H
+
+#include "curly.h"
+
+#define CURLY_ENCODING_SUFFIX_SIZE 32  // Room for an extension chain like ".gz.br"
+
+/**
+ * Content codings offered to servers. A response may be decoded by libcurl
+ * on the fly, or kept as the server sent it and stored under an extension
+ * naming its coding, which saves decompressing data only to compress it
+ * again for archival.
+ */
+
+/**
+ * Build an Accept-Encoding value from the codings asked for. When decoding,
+ * codings this libcurl cannot decode are left out, since a response in one
+ * would fail the transfer.
+ *
+ * @param requested Codings separated by commas or spaces; NULL or "" for
+ *        gzip, deflate, br and zstd
+ * @param decode Set when responses will be decoded on the fly
+ * @return Heap string for CURLOPT_ACCEPT_ENCODING, empty if no coding is
+ *         left; NULL if out of memory
+ */
+char *curly_encoding_accept(const char *requested, int decode);
+
+/**
+ * Offer codings on a handle
+ *
+ * @param curl Handle to set up
+ * @param accept Accept-Encoding value, NULL or "" to leave the handle as
+ *        it is
+ * @param decode Decode responses on the fly instead of passing the encoded
+ *        bytes through
+ */
+void curly_encoding_setup(CURL *curl, const char *accept, int decode);
+
+/**
+ * Offer the codings of a request config's "compression" field: true for
+ * every coding, a string of codings, or {"encodings", "decode"} where
+ * decode defaults to true
+ *
+ * @param curl Handle to set up
+ * @param compression Field value, NULL or false for none
+ * @return CURLY_OK, or CURLY_ERROR_MEMORY_ALLOCATION
+ */
+curly_error_t curly_encoding_setup_json(CURL *curl, const json_t *compression);
+
+/**
+ * Work out the file extension for a Content-Encoding value, one extension
+ * per coding in the order they were applied: "gzip" gives ".gz" and
+ * "gzip, br" gives ".gz.br". Codings without a well-known extension use
+ * their own name.
+ *
+ * @param content_encoding Header value, may be NULL
+ * @param suffix Receives the extension, "" when the body is not encoded
+ * @param size Size of suffix, CURLY_ENCODING_SUFFIX_SIZE is enough for
+ *        any sensible chain
+ * @return 1 if the body is encoded, 0 if not, -1 if the value is malformed
+ *         or its extension does not fit
+ */
+int curly_encoding_suffix(const char *content_encoding, char *suffix, size_t size);
+
+#endif /* CURLY_ENCODING_H */
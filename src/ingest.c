@@ -0,0 +1,165 @@
+#include "ingest.h"
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define INGEST_BLOCK_SIZE (1024 * 1024)  // Bytes read at a time from a pipe
+
+struct curly_ingest {
+    FILE *input;
+
+    // The unread input is [pos, end). For a mapped file that is the rest of
+    // the mapping; otherwise it is the part of buffer not yet scanned.
+    const char *pos;
+    const char *end;
+
+    void *map;          // Whole-file mapping, NULL when streaming
+    size_t map_size;
+
+    char *buffer;       // Streaming buffer, grown for lines longer than it
+    size_t capacity;
+    int eof;
+    int failed;         // A read failed; reported once, then the input ends
+};
+
+// Map a regular file from its current position, or return -1 to stream it
+static int map_input(curly_ingest_t *ingest) {
+    int fd = fileno(ingest->input);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0) {
+        return -1;
+    }
+
+    off_t offset = ftello(ingest->input);
+    if (offset < 0 || offset >= st.st_size) {
+        return -1;
+    }
+
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    posix_madvise(map, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+
+    ingest->map = map;
+    ingest->map_size = (size_t)st.st_size;
+    ingest->pos = (const char *)map + offset;
+    ingest->end = (const char *)map + st.st_size;
+    return 0;
+}
+
+curly_ingest_t *curly_ingest_open(FILE *input) {
+    if (!input) {
+        return NULL;
+    }
+
+    curly_ingest_t *ingest = (curly_ingest_t *)calloc(1, sizeof(curly_ingest_t));
+    if (!ingest) {
+        return NULL;
+    }
+    ingest->input = input;
+
+    if (map_input(ingest) != 0) {
+        ingest->buffer = (char *)malloc(INGEST_BLOCK_SIZE);
+        if (!ingest->buffer) {
+            free(ingest);
+            return NULL;
+        }
+        ingest->capacity = INGEST_BLOCK_SIZE;
+        ingest->pos = ingest->buffer;
+        ingest->end = ingest->buffer;
+    }
+    return ingest;
+}
+
+// Keep the unscanned tail and read another block after it, growing the
+// buffer when the tail already fills it. Returns 0 once nothing more came.
+static int refill(curly_ingest_t *ingest) {
+    if (ingest->eof || !ingest->buffer) {
+        return 0;
+    }
+
+    size_t kept = (size_t)(ingest->end - ingest->pos);
+    if (kept > 0 && ingest->pos != ingest->buffer) {
+        memmove(ingest->buffer, ingest->pos, kept);
+    }
+    if (ingest->capacity - kept < INGEST_BLOCK_SIZE / 2) {
+        char *grown = (char *)realloc(ingest->buffer, ingest->capacity * 2);
+        if (!grown) {
+            ingest->failed = 1;
+            ingest->eof = 1;
+            return 0;
+        }
+        ingest->buffer = grown;
+        ingest->capacity *= 2;
+    }
+
+    size_t got = fread(ingest->buffer + kept, 1, ingest->capacity - kept, ingest->input);
+    if (got == 0) {
+        ingest->eof = 1;
+        if (ferror(ingest->input)) {
+            ingest->failed = 1;
+        }
+    }
+    ingest->pos = ingest->buffer;
+    ingest->end = ingest->buffer + kept + got;
+    return got > 0;
+}
+
+int curly_ingest_next(curly_ingest_t *ingest, curly_tsv_line_t *line) {
+    memset(line, 0, sizeof(*line));
+
+    for (;;) {
+        // memchr is vectorized by the C library, so finding the line end
+        // costs a fraction of a byte-by-byte scan
+        size_t avail = (size_t)(ingest->end - ingest->pos);
+        const char *newline = (const char *)memchr(ingest->pos, '\n', avail);
+        if (!newline && refill(ingest)) {
+            continue;
+        }
+        if (!newline && ingest->failed == 1) {
+            ingest->failed = 2;
+            ingest->pos = ingest->end;
+            return -1;
+        }
+
+        // The last line may lack its newline
+        const char *start = ingest->pos;
+        const char *stop = newline ? newline : ingest->end;
+        if (start == stop) {
+            if (!newline) {
+                return 0;
+            }
+            ingest->pos = newline + 1;
+            continue;
+        }
+        ingest->pos = newline ? newline + 1 : ingest->end;
+
+        const char *tab = (const char *)memchr(start, '\t', (size_t)(stop - start));
+        if (!tab) {
+            line->url = start;
+            line->url_length = (size_t)(stop - start);
+            return -1;
+        }
+        line->url = start;
+        line->url_length = (size_t)(tab - start);
+        line->destination = tab + 1;
+        line->destination_length = (size_t)(stop - tab - 1);
+        return 1;
+    }
+}
+
+int curly_ingest_mapped(const curly_ingest_t *ingest) {
+    return ingest->map != NULL;
+}
+
+void curly_ingest_close(curly_ingest_t *ingest) {
+    if (!ingest) return;
+
+    if (ingest->map) {
+        munmap(ingest->map, ingest->map_size);
+    }
+    free(ingest->buffer);
+    free(ingest);
+}
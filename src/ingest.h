@@ -0,0 +1,61 @@
+#ifndef CURLY_INGEST_H
+#define CURLY_INGEST_H
+
+#include "curly.h"
+
+/**
+ * Reader for TSV download manifests. Regular files are mapped into memory
+ * and scanned in place; pipes and terminals are read in large blocks.
+ * Lines have no length limit, and fields are returned as pointers into the
+ * reader's memory, so nothing is copied per line.
+ */
+typedef struct curly_ingest curly_ingest_t;
+
+/**
+ * One manifest line. The fields are not NUL-terminated and stay valid until
+ * the next call to curly_ingest_next().
+ */
+typedef struct {
+    const char *url;
+    size_t url_length;
+    const char *destination;
+    size_t destination_length;
+} curly_tsv_line_t;
+
+/**
+ * Start reading a manifest at the stream's current position
+ *
+ * @param input Stream to read; it must not be read otherwise until the
+ *        reader is closed
+ * @return New reader, or NULL on failure
+ */
+curly_ingest_t *curly_ingest_open(FILE *input);
+
+/**
+ * Read the next non-empty line, splitting it at its first tab
+ *
+ * @param ingest Reader
+ * @param line Receives the fields. For a line without a tab, url and
+ *        url_length give the whole line and destination is NULL.
+ * @return 1 for a line, 0 at the end of the input, -1 for a line without a
+ *         tab or a read error (then url is NULL)
+ */
+int curly_ingest_next(curly_ingest_t *ingest, curly_tsv_line_t *line);
+
+/**
+ * Check whether a reader maps its input. A mapped input is left at its
+ * starting position, so another reader can go over it again.
+ *
+ * @param ingest Reader
+ * @return Non-zero if the input is mapped
+ */
+int curly_ingest_mapped(const curly_ingest_t *ingest);
+
+/**
+ * Close a reader, unmapping or freeing its memory. The stream stays open.
+ *
+ * @param ingest Reader to close, may be NULL
+ */
+void curly_ingest_close(curly_ingest_t *ingest);
+
+#endif /* CURLY_INGEST_H */
@@ -0,0 +1,290 @@
+#include "journal.h"
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#define JOURNAL_INITIAL_SLOTS 1024
+
+// A loaded record. The strings live in the same allocation.
+typedef struct {
+    char *destination;
+    curly_journal_entry_t entry;
+    char data[];
+} journal_record_t;
+
+struct curly_journal {
+    journal_record_t **slots;  // Open-addressing hash table keyed by destination
+    size_t slot_count;
+    size_t record_count;
+    FILE *file;
+    pthread_mutex_t mutex;
+};
+
+// FNV-1a hash of a destination path
+static size_t hash_path(const char *path) {
+    uint64_t hash = 14695981039346656037ULL;
+    while (*path) {
+        hash ^= (unsigned char)*path++;
+        hash *= 1099511628211ULL;
+    }
+    return (size_t)hash;
+}
+
+// Find the slot holding destination, or the empty slot where it belongs
+static journal_record_t **find_slot(journal_record_t **slots, size_t slot_count, const char *destination) {
+    size_t index = hash_path(destination) & (slot_count - 1);
+    while (slots[index] && strcmp(slots[index]->destination, destination) != 0) {
+        index = (index + 1) & (slot_count - 1);
+    }
+    return &slots[index];
+}
+
+// Double the table once it is more than half full
+static int grow_table(curly_journal_t *journal) {
+    size_t slot_count = journal->slot_count * 2;
+    journal_record_t **slots = (journal_record_t **)calloc(slot_count, sizeof(journal_record_t *));
+    if (!slots) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < journal->slot_count; i++) {
+        if (journal->slots[i]) {
+            *find_slot(slots, slot_count, journal->slots[i]->destination) = journal->slots[i];
+        }
+    }
+
+    free(journal->slots);
+    journal->slots = slots;
+    journal->slot_count = slot_count;
+    return 0;
+}
+
+// Copy a record into one allocation
+static journal_record_t *create_record(const char *destination, const curly_journal_entry_t *entry) {
+    size_t destination_len = strlen(destination) + 1;
+    size_t etag_len = entry->etag ? strlen(entry->etag) + 1 : 0;
+    size_t modified_len = entry->last_modified ? strlen(entry->last_modified) + 1 : 0;
+    size_t suffix_len = entry->suffix ? strlen(entry->suffix) + 1 : 0;
+
+    journal_record_t *record = (journal_record_t *)malloc(sizeof(journal_record_t) + destination_len + etag_len +
+                                                          modified_len + suffix_len);
+    if (!record) {
+        return NULL;
+    }
+
+    char *p = record->data;
+    record->destination = memcpy(p, destination, destination_len);
+    p += destination_len;
+
+    record->entry = *entry;
+    record->entry.etag = etag_len ? memcpy(p, entry->etag, etag_len) : NULL;
+    p += etag_len;
+    record->entry.last_modified = modified_len ? memcpy(p, entry->last_modified, modified_len) : NULL;
+    p += modified_len;
+    record->entry.suffix = suffix_len ? memcpy(p, entry->suffix, suffix_len) : NULL;
+
+    return record;
+}
+
+// Insert a record, replacing any earlier one for the same destination
+static int insert_record(curly_journal_t *journal, const char *destination, const curly_journal_entry_t *entry) {
+    if ((journal->record_count + 1) * 2 > journal->slot_count && grow_table(journal) != 0) {
+        return -1;
+    }
+
+    journal_record_t *record = create_record(destination, entry);
+    if (!record) {
+        return -1;
+    }
+
+    journal_record_t **slot = find_slot(journal->slots, journal->slot_count, destination);
+    if (*slot) {
+        free(*slot);
+    } else {
+        journal->record_count++;
+    }
+    *slot = record;
+    return 0;
+}
+
+// Parse one journal line in place. Returns 0 on success, -1 if malformed.
+static int parse_line(char *line, const char **destination, curly_journal_entry_t *entry) {
+    char *fields[5];
+    char *p = line;
+
+    for (int i = 0; i < 4; i++) {
+        char *tab = strchr(p, '\t');
+        if (!tab) {
+            return -1;
+        }
+        *tab = '\0';
+        fields[i] = p;
+        p = tab + 1;
+    }
+    fields[4] = p;
+
+    char *newline = strchr(fields[4], '\n');
+    if (newline) {
+        *newline = '\0';
+    }
+
+    entry->suffix = NULL;
+    if (strncmp(fields[0], "complete", 8) == 0 && (fields[0][8] == '\0' || fields[0][8] == '.')) {
+        entry->state = CURLY_JOURNAL_COMPLETE;
+        entry->suffix = fields[0][8] ? fields[0] + 8 : NULL;
+    } else if (strcmp(fields[0], "partial") == 0) {
+        entry->state = CURLY_JOURNAL_PARTIAL;
+    } else {
+        return -1;
+    }
+
+    char *end;
+    entry->size = (curl_off_t)strtoll(fields[1], &end, 10);
+    if (*end != '\0' || entry->size < 0 || fields[4][0] == '\0') {
+        return -1;
+    }
+
+    entry->etag = strcmp(fields[2], "-") == 0 ? NULL : fields[2];
+    entry->last_modified = strcmp(fields[3], "-") == 0 ? NULL : fields[3];
+    *destination = fields[4];
+    return 0;
+}
+
+// Write one record as a journal line
+static int write_record(FILE *file, const char *destination, const curly_journal_entry_t *entry) {
+    int complete = entry->state == CURLY_JOURNAL_COMPLETE;
+    int result = fprintf(file, "%s%s\t%" CURL_FORMAT_CURL_OFF_T "\t%s\t%s\t%s\n",
+                         complete ? "complete" : "partial",
+                         complete && entry->suffix ? entry->suffix : "",
+                         entry->size,
+                         entry->etag ? entry->etag : "-",
+                         entry->last_modified ? entry->last_modified : "-",
+                         destination);
+    return result < 0 ? -1 : 0;
+}
+
+// Load every record from an existing journal
+static int load_journal(curly_journal_t *journal, const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    char *line = NULL;
+    size_t capacity = 0;
+    int result = 0;
+
+    while (getline(&line, &capacity, file) >= 0) {
+        const char *destination;
+        curly_journal_entry_t entry;
+
+        // Skip lines torn by an interrupted run
+        if (parse_line(line, &destination, &entry) != 0) {
+            continue;
+        }
+
+        if (insert_record(journal, destination, &entry) != 0) {
+            result = -1;
+            break;
+        }
+    }
+
+    free(line);
+    fclose(file);
+    return result;
+}
+
+// Rewrite the journal with one line per destination
+static int compact_journal(curly_journal_t *journal, const char *path) {
+    size_t path_len = strlen(path);
+    char *tmp_path = (char *)malloc(path_len + 5);
+    if (!tmp_path) {
+        return -1;
+    }
+    memcpy(tmp_path, path, path_len);
+    memcpy(tmp_path + path_len, ".tmp", 5);
+
+    FILE *file = fopen(tmp_path, "w");
+    if (!file) {
+        free(tmp_path);
+        return -1;
+    }
+
+    int result = 0;
+    for (size_t i = 0; i < journal->slot_count && result == 0; i++) {
+        journal_record_t *record = journal->slots[i];
+        if (record) {
+            result = write_record(file, record->destination, &record->entry);
+        }
+    }
+
+    if (fclose(file) != 0 || result != 0 || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        result = -1;
+    }
+
+    free(tmp_path);
+    return result;
+}
+
+curly_journal_t *curly_journal_open(const char *path) {
+    if (!path) {
+        return NULL;
+    }
+
+    curly_journal_t *journal = (curly_journal_t *)calloc(1, sizeof(curly_journal_t));
+    if (!journal) {
+        return NULL;
+    }
+
+    journal->slot_count = JOURNAL_INITIAL_SLOTS;
+    journal->slots = (journal_record_t **)calloc(journal->slot_count, sizeof(journal_record_t *));
+    if (!journal->slots ||
+        load_journal(journal, path) != 0 ||
+        compact_journal(journal, path) != 0) {
+        curly_journal_close(journal);
+        return NULL;
+    }
+
+    journal->file = fopen(path, "a");
+    if (!journal->file) {
+        curly_journal_close(journal);
+        return NULL;
+    }
+
+    pthread_mutex_init(&journal->mutex, NULL);
+    return journal;
+}
+
+void curly_journal_close(curly_journal_t *journal) {
+    if (!journal) return;
+
+    if (journal->file) {
+        fclose(journal->file);
+        pthread_mutex_destroy(&journal->mutex);
+    }
+
+    for (size_t i = 0; journal->slots && i < journal->slot_count; i++) {
+        free(journal->slots[i]);
+    }
+    free(journal->slots);
+    free(journal);
+}
+
+const curly_journal_entry_t *curly_journal_lookup(const curly_journal_t *journal, const char *destination) {
+    journal_record_t *record = *find_slot(journal->slots, journal->slot_count, destination);
+    return record ? &record->entry : NULL;
+}
+
+int curly_journal_record(curly_journal_t *journal, const char *destination, const curly_journal_entry_t *entry) {
+    pthread_mutex_lock(&journal->mutex);
+
+    // Flush each line so an interrupted run still leaves a usable journal
+    int result = write_record(journal->file, destination, entry);
+    if (fflush(journal->file) != 0) {
+        result = -1;
+    }
+
+    pthread_mutex_unlock(&journal->mutex);
+    return result;
+}
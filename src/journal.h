@@ -0,0 +1,73 @@
+#ifndef CURLY_JOURNAL_H
+#define CURLY_JOURNAL_H
+
+#include "curly.h"
+
+/**
+ * Completion journal for parallel downloads. Each line records the state of
+ * one destination file together with the validators the server sent for
+ * it, so a later run can skip, revalidate or resume the download:
+ *
+ *   state \t size \t etag \t last_modified \t destination
+ *
+ * Missing validators are written as "-". A complete file stored under an
+ * extension, such as a body kept compressed, has the extension appended to
+ * its state, as in "complete.gz". The journal is append-only while a
+ * run is in progress; later lines override earlier ones, and the file is
+ * compacted when it is next opened.
+ */
+typedef struct curly_journal curly_journal_t;
+
+typedef enum {
+    CURLY_JOURNAL_COMPLETE,  // The file was downloaded in full
+    CURLY_JOURNAL_PARTIAL    // The file holds the first size bytes of the body
+} curly_journal_state_t;
+
+/**
+ * A journal record
+ */
+typedef struct {
+    curly_journal_state_t state;
+    curl_off_t size;
+    const char *etag;           // NULL if the server sent none
+    const char *last_modified;  // NULL if the server sent none
+    const char *suffix;         // Extension the file is stored under, NULL for none
+} curly_journal_entry_t;
+
+/**
+ * Load a journal, compact it and open it for appending. A missing file is
+ * created.
+ *
+ * @param path Journal file path
+ * @return New journal, or NULL on failure
+ */
+curly_journal_t *curly_journal_open(const char *path);
+
+/**
+ * Close a journal
+ *
+ * @param journal Journal to close
+ */
+void curly_journal_close(curly_journal_t *journal);
+
+/**
+ * Look up what a previous run recorded for a destination. Only records
+ * loaded by curly_journal_open() are visible.
+ *
+ * @param journal Journal
+ * @param destination Destination path
+ * @return Record, or NULL if there is none
+ */
+const curly_journal_entry_t *curly_journal_lookup(const curly_journal_t *journal, const char *destination);
+
+/**
+ * Append a record. Safe to call from any thread.
+ *
+ * @param journal Journal
+ * @param destination Destination path
+ * @param entry Record to append
+ * @return 0 on success, -1 on failure
+ */
+int curly_journal_record(curly_journal_t *journal, const char *destination, const curly_journal_entry_t *entry);
+
+#endif /* CURLY_JOURNAL_H */
@@ -0,0 +1,503 @@
+#include "loop.h"
+#include <errno.h>
+#include <stdint.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#define LOOP_USE_EPOLL 1
+#endif
+
+#define MAX_EVENTS 256
+
+// A pending timer
+typedef struct {
+    long long due_ms;  // Absolute monotonic time it fires at
+    void (*fire)(curly_loop_t *loop, void *arg);
+    void *arg;
+} loop_timer_t;
+
+// An owner's descriptor waiting to become writable
+typedef struct {
+    int fd;
+    void (*ready)(curly_loop_t *loop, void *arg);
+    void *arg;
+} loop_watch_t;
+
+struct curly_loop {
+    CURLM *multi;
+    int in_flight;
+    int still_running;
+    loop_timer_t *timers;  // Binary min-heap ordered by due_ms
+    int timer_count;
+    int timer_capacity;
+    long http_version;  // CURL_HTTP_VERSION_* applied to added transfers, 0 to leave them alone
+    loop_watch_t *watches;  // Few, so found by a linear scan
+    int watch_count;
+    int watch_capacity;
+#ifdef LOOP_USE_EPOLL
+    int epoll_fd;
+    int wake_fd;
+    long long deadline_ms;  // Absolute monotonic time of libcurl's timeout, -1 if none
+#endif
+};
+
+// Current monotonic time in milliseconds
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+#ifdef LOOP_USE_EPOLL
+// libcurl callback: start, update or stop watching a socket
+static int socket_callback(CURL *easy, curl_socket_t s, int what, void *userp, void *socketp) {
+    (void)easy;
+    curly_loop_t *loop = (curly_loop_t *)userp;
+
+    if (what == CURL_POLL_REMOVE) {
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, s, NULL);
+        return 0;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.data.fd = s;
+    if (what & CURL_POLL_IN) {
+        ev.events |= EPOLLIN;
+    }
+    if (what & CURL_POLL_OUT) {
+        ev.events |= EPOLLOUT;
+    }
+
+    // socketp marks sockets we have already registered with epoll
+    int op = socketp ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (epoll_ctl(loop->epoll_fd, op, s, &ev) != 0) {
+        // The descriptor may have been closed and reused behind our back
+        op = (errno == EEXIST) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+        if (epoll_ctl(loop->epoll_fd, op, s, &ev) != 0) {
+            return -1;
+        }
+    }
+
+    if (!socketp) {
+        curl_multi_assign(loop->multi, s, loop);
+    }
+
+    return 0;
+}
+
+// libcurl callback: (re)arm the single timeout libcurl wants
+static int timer_callback(CURLM *multi, long timeout_ms, void *userp) {
+    (void)multi;
+    curly_loop_t *loop = (curly_loop_t *)userp;
+    loop->deadline_ms = (timeout_ms < 0) ? -1 : now_ms() + timeout_ms;
+    return 0;
+}
+#endif
+
+// Hand finished transfers back to their owners
+static void dispatch_completions(curly_loop_t *loop) {
+    CURLMsg *msg;
+    int pending;
+
+    while ((msg = curl_multi_info_read(loop->multi, &pending)) != NULL) {
+        if (msg->msg != CURLMSG_DONE) {
+            continue;
+        }
+
+        CURL *easy = msg->easy_handle;
+        CURLcode result = msg->data.result;
+        curly_loop_transfer_t *xfer = NULL;
+        curl_easy_getinfo(easy, CURLINFO_PRIVATE, (char **)&xfer);
+
+        curl_multi_remove_handle(loop->multi, easy);
+        loop->in_flight--;
+
+        if (xfer && xfer->done) {
+            xfer->done(xfer, result);
+        }
+    }
+}
+
+// Remove the earliest timer from the heap
+static loop_timer_t pop_timer(curly_loop_t *loop) {
+    loop_timer_t *timers = loop->timers;
+    loop_timer_t first = timers[0];
+    loop_timer_t last = timers[--loop->timer_count];
+    int i = 0;
+
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= loop->timer_count) {
+            break;
+        }
+        if (child + 1 < loop->timer_count && timers[child + 1].due_ms < timers[child].due_ms) {
+            child++;
+        }
+        if (last.due_ms <= timers[child].due_ms) {
+            break;
+        }
+        timers[i] = timers[child];
+        i = child;
+    }
+    timers[i] = last;
+
+    return first;
+}
+
+// Fire every timer that has come due
+static void fire_due_timers(curly_loop_t *loop) {
+    long long now = loop->timer_count ? now_ms() : 0;
+
+    while (loop->timer_count && loop->timers[0].due_ms <= now) {
+        loop_timer_t timer = pop_timer(loop);
+        timer.fire(loop, timer.arg);
+    }
+}
+
+// Timer callback starting a delayed transfer
+static void start_delayed_transfer(curly_loop_t *loop, void *arg) {
+    curly_loop_transfer_t *xfer = (curly_loop_transfer_t *)arg;
+    if (curly_loop_add(loop, xfer) != 0 && xfer->done) {
+        xfer->done(xfer, CURLE_FAILED_INIT);
+    }
+}
+
+// Shorten a wait so that it ends when the next timer is due
+static long bound_wait(const curly_loop_t *loop, long max_wait_ms) {
+    if (!loop->timer_count) {
+        return max_wait_ms;
+    }
+
+    long long wait = loop->timers[0].due_ms - now_ms();
+    if (wait < 0) {
+        wait = 0;
+    }
+    return (max_wait_ms >= 0 && max_wait_ms < wait) ? max_wait_ms : (long)wait;
+}
+
+curly_loop_t *curly_loop_create(void) {
+    curly_loop_t *loop = (curly_loop_t *)calloc(1, sizeof(curly_loop_t));
+    if (!loop) {
+        return NULL;
+    }
+
+    loop->multi = curl_multi_init();
+    if (!loop->multi) {
+        free(loop);
+        return NULL;
+    }
+
+#ifdef LOOP_USE_EPOLL
+    loop->deadline_ms = -1;
+    loop->wake_fd = -1;
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->epoll_fd < 0 || loop->wake_fd < 0) {
+        curly_loop_destroy(loop);
+        return NULL;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = loop->wake_fd;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &ev) != 0) {
+        curly_loop_destroy(loop);
+        return NULL;
+    }
+
+    curl_multi_setopt(loop->multi, CURLMOPT_SOCKETFUNCTION, socket_callback);
+    curl_multi_setopt(loop->multi, CURLMOPT_SOCKETDATA, loop);
+    curl_multi_setopt(loop->multi, CURLMOPT_TIMERFUNCTION, timer_callback);
+    curl_multi_setopt(loop->multi, CURLMOPT_TIMERDATA, loop);
+#endif
+
+    return loop;
+}
+
+void curly_loop_destroy(curly_loop_t *loop) {
+    if (!loop) return;
+
+    if (loop->multi) {
+        curl_multi_cleanup(loop->multi);
+    }
+
+#ifdef LOOP_USE_EPOLL
+    if (loop->epoll_fd >= 0) close(loop->epoll_fd);
+    if (loop->wake_fd >= 0) close(loop->wake_fd);
+#endif
+
+    free(loop->timers);
+    free(loop->watches);
+    free(loop);
+}
+
+void curly_loop_set_http_version(curly_loop_t *loop, curly_http_version_t version,
+                                 long max_streams, long max_host_connections) {
+    switch (version) {
+        case CURLY_HTTP_2:
+            loop->http_version = CURL_HTTP_VERSION_2TLS;
+            break;
+        case CURLY_HTTP_2_PRIOR_KNOWLEDGE:
+            loop->http_version = CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE;
+            break;
+        default:
+            loop->http_version = 0;
+            return;
+    }
+
+    curl_multi_setopt(loop->multi, CURLMOPT_PIPELINING, (long)CURLPIPE_MULTIPLEX);
+    if (max_streams > 0) {
+        curl_multi_setopt(loop->multi, CURLMOPT_MAX_CONCURRENT_STREAMS, max_streams);
+    }
+    if (max_host_connections > 0) {
+        curl_multi_setopt(loop->multi, CURLMOPT_MAX_HOST_CONNECTIONS, max_host_connections);
+    }
+}
+
+long curly_loop_host_connections(long transfers, long max_streams) {
+    if (max_streams <= 0) {
+        max_streams = 1;
+    }
+    long connections = (transfers + max_streams - 1) / max_streams;
+    return connections > 0 ? connections : 1;
+}
+
+// Check whether a transfer may become a stream on a shared connection.
+// Without prior knowledge only TLS negotiates HTTP/2, and waiting for a
+// cleartext connection to multiplex would run a host's transfers one by one.
+static int can_multiplex(const curly_loop_t *loop, CURL *easy) {
+    if (loop->http_version == CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE) {
+        return 1;
+    }
+    char *url = NULL;
+    curl_easy_getinfo(easy, CURLINFO_EFFECTIVE_URL, &url);
+    return url && strncasecmp(url, "https://", 8) == 0;
+}
+
+int curly_loop_add(curly_loop_t *loop, curly_loop_transfer_t *xfer) {
+    curl_easy_setopt(xfer->easy, CURLOPT_PRIVATE, xfer);
+    if (loop->http_version) {
+        curl_easy_setopt(xfer->easy, CURLOPT_HTTP_VERSION, loop->http_version);
+        curl_easy_setopt(xfer->easy, CURLOPT_PIPEWAIT, can_multiplex(loop, xfer->easy) ? 1L : 0L);
+    }
+    if (curl_multi_add_handle(loop->multi, xfer->easy) != CURLM_OK) {
+        return -1;
+    }
+
+    loop->in_flight++;
+    return 0;
+}
+
+void curly_loop_finish(curly_loop_t *loop, curly_loop_transfer_t *xfer, CURLcode result) {
+    curl_multi_remove_handle(loop->multi, xfer->easy);
+    loop->in_flight--;
+
+    if (xfer->done) {
+        xfer->done(xfer, result);
+    }
+}
+
+int curly_loop_add_delayed(curly_loop_t *loop, curly_loop_transfer_t *xfer, long delay_ms) {
+    return curly_loop_add_timer(loop, delay_ms, start_delayed_transfer, xfer);
+}
+
+int curly_loop_add_timer(curly_loop_t *loop, long delay_ms, void (*fire)(curly_loop_t *loop, void *arg), void *arg) {
+    if (loop->timer_count == loop->timer_capacity) {
+        int capacity = loop->timer_capacity ? loop->timer_capacity * 2 : 16;
+        loop_timer_t *timers = (loop_timer_t *)realloc(loop->timers, capacity * sizeof(loop_timer_t));
+        if (!timers) {
+            return -1;
+        }
+        loop->timers = timers;
+        loop->timer_capacity = capacity;
+    }
+
+    // Sift the new timer up from the bottom of the heap
+    long long due_ms = now_ms() + (delay_ms > 0 ? delay_ms : 0);
+    int i = loop->timer_count++;
+    while (i > 0 && loop->timers[(i - 1) / 2].due_ms > due_ms) {
+        loop->timers[i] = loop->timers[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    loop->timers[i].due_ms = due_ms;
+    loop->timers[i].fire = fire;
+    loop->timers[i].arg = arg;
+
+    return 0;
+}
+
+static loop_watch_t *find_watch(curly_loop_t *loop, int fd) {
+    for (int i = 0; i < loop->watch_count; i++) {
+        if (loop->watches[i].fd == fd) {
+            return &loop->watches[i];
+        }
+    }
+    return NULL;
+}
+
+int curly_loop_watch_writable(curly_loop_t *loop, int fd, void (*ready)(curly_loop_t *loop, void *arg), void *arg) {
+    if (find_watch(loop, fd)) {
+        return -1;
+    }
+    if (loop->watch_count == loop->watch_capacity) {
+        int capacity = loop->watch_capacity ? loop->watch_capacity * 2 : 8;
+        loop_watch_t *watches = (loop_watch_t *)realloc(loop->watches, capacity * sizeof(loop_watch_t));
+        if (!watches) {
+            return -1;
+        }
+        loop->watches = watches;
+        loop->watch_capacity = capacity;
+    }
+
+#ifdef LOOP_USE_EPOLL
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLOUT;
+    ev.data.fd = fd;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        return -1;
+    }
+#endif
+
+    loop_watch_t *watch = &loop->watches[loop->watch_count++];
+    watch->fd = fd;
+    watch->ready = ready;
+    watch->arg = arg;
+    return 0;
+}
+
+void curly_loop_unwatch(curly_loop_t *loop, int fd) {
+    loop_watch_t *watch = find_watch(loop, fd);
+    if (!watch) {
+        return;
+    }
+#ifdef LOOP_USE_EPOLL
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+    *watch = loop->watches[--loop->watch_count];
+}
+
+#ifdef LOOP_USE_EPOLL
+int curly_loop_run_once(curly_loop_t *loop, long max_wait_ms) {
+    max_wait_ms = bound_wait(loop, max_wait_ms);
+
+    long long wait = -1;
+    if (loop->deadline_ms >= 0) {
+        wait = loop->deadline_ms - now_ms();
+        if (wait < 0) {
+            wait = 0;
+        }
+    }
+    if (max_wait_ms >= 0 && (wait < 0 || max_wait_ms < wait)) {
+        wait = max_wait_ms;
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    int count = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, (int)wait);
+    if (count < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+        count = 0;
+    }
+
+    for (int i = 0; i < count; i++) {
+        int fd = events[i].data.fd;
+
+        if (fd == loop->wake_fd) {
+            uint64_t value;
+            while (read(loop->wake_fd, &value, sizeof(value)) > 0) {
+                // Drain the counter
+            }
+            continue;
+        }
+
+        // The ready function may unwatch, so nothing of the watch is kept
+        loop_watch_t *watch = loop->watch_count ? find_watch(loop, fd) : NULL;
+        if (watch) {
+            watch->ready(loop, watch->arg);
+            continue;
+        }
+
+        int flags = 0;
+        if (events[i].events & EPOLLIN) flags |= CURL_CSELECT_IN;
+        if (events[i].events & EPOLLOUT) flags |= CURL_CSELECT_OUT;
+        if (events[i].events & (EPOLLERR | EPOLLHUP)) flags |= CURL_CSELECT_ERR;
+
+        curl_multi_socket_action(loop->multi, fd, flags, &loop->still_running);
+    }
+
+    if (loop->deadline_ms >= 0 && now_ms() >= loop->deadline_ms) {
+        loop->deadline_ms = -1;
+        curl_multi_socket_action(loop->multi, CURL_SOCKET_TIMEOUT, 0, &loop->still_running);
+    }
+
+    dispatch_completions(loop);
+    fire_due_timers(loop);
+    return 0;
+}
+
+void curly_loop_wake(curly_loop_t *loop) {
+    uint64_t one = 1;
+    ssize_t written = write(loop->wake_fd, &one, sizeof(one));
+    (void)written;  // EAGAIN means a wakeup is already pending
+}
+#else
+int curly_loop_run_once(curly_loop_t *loop, long max_wait_ms) {
+    if (curl_multi_perform(loop->multi, &loop->still_running) != CURLM_OK) {
+        return -1;
+    }
+    dispatch_completions(loop);
+
+    max_wait_ms = bound_wait(loop, max_wait_ms);
+    int timeout = (max_wait_ms < 0 || max_wait_ms > 1000) ? 1000 : (int)max_wait_ms;
+    int watch_count = loop->watch_count;
+    struct curl_waitfd *extra = NULL;
+    if (watch_count) {
+        extra = (struct curl_waitfd *)calloc((size_t)watch_count, sizeof(struct curl_waitfd));
+        if (!extra) {
+            return -1;
+        }
+        for (int i = 0; i < watch_count; i++) {
+            extra[i].fd = loop->watches[i].fd;
+            extra[i].events = CURL_WAIT_POLLOUT;
+        }
+    }
+    if (curl_multi_poll(loop->multi, extra, (unsigned int)watch_count, timeout, NULL) != CURLM_OK) {
+        free(extra);
+        return -1;
+    }
+    for (int i = 0; i < watch_count; i++) {
+        loop_watch_t *watch = extra[i].revents ? find_watch(loop, extra[i].fd) : NULL;
+        if (watch) {
+            watch->ready(loop, watch->arg);
+        }
+    }
+    free(extra);
+
+    if (curl_multi_perform(loop->multi, &loop->still_running) != CURLM_OK) {
+        return -1;
+    }
+    dispatch_completions(loop);
+    fire_due_timers(loop);
+    return 0;
+}
+
+void curly_loop_wake(curly_loop_t *loop) {
+    curl_multi_wakeup(loop->multi);
+}
+#endif
+
+int curly_loop_in_flight(const curly_loop_t *loop) {
+    return loop->in_flight;
+}
+
+int curly_loop_delayed(const curly_loop_t *loop) {
+    return loop->timer_count;
+}
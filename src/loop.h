@@ -0,0 +1,169 @@
+#ifndef CURLY_LOOP_H
+#define CURLY_LOOP_H
+
+#include "curly.h"
+
+/**
+ * Event loop driving many concurrent transfers through a single curl multi
+ * handle. On Linux the loop waits on epoll and dispatches readiness with
+ * curl_multi_socket_action(); elsewhere it falls back to curl_multi_poll().
+ *
+ * A loop is owned by exactly one thread. Only curly_loop_wake() may be called
+ * from other threads.
+ */
+typedef struct curly_loop curly_loop_t;
+
+/**
+ * A transfer managed by the loop. Owners embed this as the first member of
+ * their own transfer structure; the loop stores it as CURLOPT_PRIVATE and
+ * calls done() once the transfer has finished and been removed from the
+ * multi handle.
+ */
+typedef struct curly_loop_transfer {
+    CURL *easy;
+    void (*done)(struct curly_loop_transfer *xfer, CURLcode result);
+    void *owner;  // Free for the owner's use
+} curly_loop_transfer_t;
+
+/**
+ * Create a new event loop
+ *
+ * @return New loop, or NULL on failure
+ */
+curly_loop_t *curly_loop_create(void);
+
+/**
+ * Destroy an event loop. The owner must have drained all transfers first.
+ *
+ * @param loop Loop to destroy
+ */
+void curly_loop_destroy(curly_loop_t *loop);
+
+/**
+ * Choose the HTTP version for transfers added to the loop from now on. With
+ * HTTP/2, transfers to the same host wait for a connection that is already
+ * being set up and share it as streams instead of opening their own.
+ *
+ * @param loop Loop to configure
+ * @param version HTTP version
+ * @param max_streams Concurrent streams per connection, 0 for libcurl's default
+ * @param max_host_connections Connections per host, 0 for no limit. Transfers
+ *        beyond it wait inside libcurl for a connection or stream to free up.
+ */
+void curly_loop_set_http_version(curly_loop_t *loop, curly_http_version_t version,
+                                 long max_streams, long max_host_connections);
+
+/**
+ * Work out how many connections to a host carry a number of concurrent
+ * transfers as HTTP/2 streams
+ *
+ * @param transfers Concurrent transfers
+ * @param max_streams Concurrent streams per connection, 0 or less for one each
+ * @return Connections needed, at least 1
+ */
+long curly_loop_host_connections(long transfers, long max_streams);
+
+/**
+ * Start a transfer on the loop
+ *
+ * @param loop Loop to add the transfer to
+ * @param xfer Transfer with a fully configured easy handle
+ * @return 0 on success, -1 on failure
+ */
+int curly_loop_add(curly_loop_t *loop, curly_loop_transfer_t *xfer);
+
+/**
+ * Start a transfer on the loop once a delay has passed. Until then the
+ * transfer is not in flight and holds no connection; if starting it fails,
+ * its done() callback receives CURLE_FAILED_INIT.
+ *
+ * @param loop Loop to add the transfer to
+ * @param xfer Transfer with a fully configured easy handle
+ * @param delay_ms Delay in milliseconds
+ * @return 0 on success, -1 on failure
+ */
+int curly_loop_add_delayed(curly_loop_t *loop, curly_loop_transfer_t *xfer, long delay_ms);
+
+/**
+ * Finish a transfer early, as if libcurl had completed it with the given
+ * result. For transfers libcurl can no longer finish by itself, such as one
+ * whose write callback failed while curl_easy_pause() resumed it. Must not be
+ * called from within a libcurl callback.
+ *
+ * @param loop Loop running the transfer
+ * @param xfer Transfer to finish
+ * @param result Result passed to done()
+ */
+void curly_loop_finish(curly_loop_t *loop, curly_loop_transfer_t *xfer, CURLcode result);
+
+/**
+ * Call a function from the loop thread once a delay has passed. The loop
+ * stays responsive meanwhile; this is how owners pace work without
+ * sleeping.
+ *
+ * @param loop Loop to run the timer on
+ * @param delay_ms Delay in milliseconds
+ * @param fire Function to call
+ * @param arg Argument passed to fire
+ * @return 0 on success, -1 on failure
+ */
+int curly_loop_add_timer(curly_loop_t *loop, long delay_ms, void (*fire)(curly_loop_t *loop, void *arg), void *arg);
+
+/**
+ * Call a function from the loop thread whenever a descriptor of the owner's
+ * can be written to, until curly_loop_unwatch(). Lets owners write to slow
+ * peers without blocking the transfers.
+ *
+ * @param loop Loop to watch on
+ * @param fd Descriptor to watch, not one of libcurl's
+ * @param ready Function to call while the descriptor is writable
+ * @param arg Argument passed to ready
+ * @return 0 on success, -1 on failure
+ */
+int curly_loop_watch_writable(curly_loop_t *loop, int fd, void (*ready)(curly_loop_t *loop, void *arg), void *arg);
+
+/**
+ * Stop watching a descriptor. Safe to call from its ready function and for
+ * descriptors that are not watched.
+ *
+ * @param loop Loop the descriptor is watched on
+ * @param fd Descriptor to stop watching
+ */
+void curly_loop_unwatch(curly_loop_t *loop, int fd);
+
+/**
+ * Wait for socket activity, timeouts or a wakeup and dispatch it. Finished
+ * transfers have their done() callbacks invoked and timers that have come
+ * due fire before this returns.
+ *
+ * @param loop Loop to run
+ * @param max_wait_ms Upper bound on the time spent waiting, -1 for no bound
+ * @return 0 on success, -1 on failure
+ */
+int curly_loop_run_once(curly_loop_t *loop, long max_wait_ms);
+
+/**
+ * Interrupt a blocked curly_loop_run_once(). Safe to call from any thread.
+ *
+ * @param loop Loop to wake
+ */
+void curly_loop_wake(curly_loop_t *loop);
+
+/**
+ * Get the number of transfers currently running on the loop
+ *
+ * @param loop Loop to query
+ * @return Number of transfers in flight
+ */
+int curly_loop_in_flight(const curly_loop_t *loop);
+
+/**
+ * Get the number of timers that have not fired yet, including transfers
+ * waiting to be started by curly_loop_add_delayed()
+ *
+ * @param loop Loop to query
+ * @return Number of pending timers
+ */
+int curly_loop_delayed(const curly_loop_t *loop);
+
+#endif /* CURLY_LOOP_H */
@@ -1,19 +1,143 @@
+// For fmemopen() and open_memstream() when using strict C99
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include "curly.h"
 
 #define MAX_JSON_SIZE 4096
 
 static void print_usage() {
     printf("Usage: curly [options] <json_file | json_string>\n");
+    printf("       curly --batch <jsonl_file | -> [batch options]\n");
+    printf("       curly --serve SOCKET [batch options]\n");
     printf("Options:\n");
     printf("  -f, --file     : Treat input as a file path\n");
     printf("  -s, --string   : Treat input as a JSON string\n");
     printf("  -h, --help     : Display this help message\n");
+    printf("  --cache DIR    : Cache GET responses in DIR unless the config sets \"cache\"\n");
+    printf("  --cache-max-age SECONDS: Keep responses without caching headers fresh this long\n");
+    printf("  --compressed   : Ask for a compressed response and decode it, unless the config sets\n");
+    printf("                   \"compression\"\n");
+    printf("\nBatch options:\n");
+    printf("  -b, --batch FILE       : Run one JSON config per line of FILE ('-' for stdin)\n");
+    printf("  -c, --concurrency N    : Maximum number of requests in flight (default: 16)\n");
+    printf("  --body-dir DIR         : Save response bodies in DIR instead of inlining them\n");
+    printf("  --http2                : Multiplex requests over HTTP/2 where TLS negotiates it\n");
+    printf("  --http2-prior-knowledge: Speak HTTP/2 without negotiation, also over http:// (h2c)\n");
+    printf("  --max-streams N        : Concurrent HTTP/2 streams per connection (default: 100)\n");
+    printf("  --summary              : Print latency percentiles per phase and host to stderr\n");
+    printf("\nDaemon options:\n");
+    printf("  --serve SOCKET         : Run batch requests from clients of a Unix socket, keeping\n");
+    printf("                           connections, DNS and TLS sessions warm between them\n");
+    printf("  --connect SOCKET       : Send the request or batch to a --serve daemon instead\n");
     printf("\nExamples:\n");
     printf("  curly -f request.json\n");
     printf("  curly -s '{\"url\":\"https://httpbin.org/get\"}'\n");
+    printf("  curly --cache ~/.cache/curly -f request.json\n");
+    printf("  curly --batch requests.jsonl -c 32 > results.jsonl\n");
+    printf("  curly --batch requests.jsonl -c 500 --http2 > results.jsonl\n");
+    printf("  curly --batch requests.jsonl --summary > results.jsonl\n");
+    printf("  curly --serve /tmp/curly.sock -c 64 &\n");
+    printf("  curly --connect /tmp/curly.sock -f request.json\n");
+    printf("  curly --connect /tmp/curly.sock --batch requests.jsonl > results.jsonl\n");
+}
+
+// Run batch mode, locally or through a daemon, and report the outcome
+static int run_batch(const char *path, const curly_batch_options_t *options, const char *socket_path) {
+    FILE *input = stdin;
+    if (strcmp(path, "-") != 0) {
+        input = fopen(path, "r");
+        if (!input) {
+            fprintf(stderr, "Error: Unable to open file %s\n", path);
+            return EXIT_FAILURE;
+        }
+    }
+    
+    curly_error_t error;
+    if (socket_path) {
+        error = curly_client_run(socket_path, input, stdout);
+    } else {
+        curl_global_init(CURL_GLOBAL_ALL);
+        error = curly_batch_run(options, input, stdout);
+        curl_global_cleanup();
+    }
+    
+    if (input != stdin) {
+        fclose(input);
+    }
+    
+    if (error == CURLY_ERROR_CURL_PERFORM) {
+        fprintf(stderr, "Error: One or more batch requests failed\n");
+        return EXIT_FAILURE;
+    } else if (error != CURLY_OK) {
+        fprintf(stderr, "Error: %s\n", curly_strerror(error));
+        return EXIT_FAILURE;
+    }
+    
+    return EXIT_SUCCESS;
+}
+
+// Run the daemon until it is signalled to stop
+static int run_serve(const char *socket_path, const curly_batch_options_t *options) {
+    curl_global_init(CURL_GLOBAL_ALL);
+    curly_error_t error = curly_serve(socket_path, options);
+    curl_global_cleanup();
+    
+    if (error != CURLY_OK) {
+        fprintf(stderr, "Error: %s\n", curly_strerror(error));
+        return EXIT_FAILURE;
+    }
+    
+    return EXIT_SUCCESS;
+}
+
+// Send one config to a daemon and print the body, as if it had run here
+static int run_client_request(const char *socket_path, const char *json_str) {
+    // The daemon reads one config per line
+    json_error_t json_error;
+    json_t *root = json_loads(json_str, 0, &json_error);
+    char *line = root ? json_dumps(root, JSON_COMPACT) : NULL;
+    json_decref(root);
+    if (!line) {
+        fprintf(stderr, "Error: %s\n", curly_strerror(CURLY_ERROR_INVALID_JSON));
+        return EXIT_FAILURE;
+    }
+    
+    char *results = NULL;
+    size_t results_size = 0;
+    FILE *input = fmemopen(line, strlen(line), "r");
+    FILE *output = open_memstream(&results, &results_size);
+    curly_error_t error = CURLY_ERROR_MEMORY_ALLOCATION;
+    if (input && output) {
+        error = curly_client_run(socket_path, input, output);
+    }
+    if (input) fclose(input);
+    if (output) fclose(output);
+    free(line);
+    
+    json_t *result = (results && results_size > 0) ? json_loads(results, 0, NULL) : NULL;
+    free(results);
+    if (!result) {
+        fprintf(stderr, "Error: %s\n", curly_strerror(error == CURLY_OK ? CURLY_ERROR_SOCKET : error));
+        return EXIT_FAILURE;
+    }
+    
+    const char *message = json_string_value(json_object_get(result, "error"));
+    json_t *body = json_object_get(result, "body");
+    if (message) {
+        fprintf(stderr, "Error: %s\n", message);
+    } else if (json_is_string(body)) {
+        fwrite(json_string_value(body), 1, json_string_length(body), stdout);
+        if (isatty(STDOUT_FILENO)) {
+            printf("\n");
+        }
+    }
+    json_decref(result);
+    
+    return message ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
 static char *read_file(const char *filepath) {
@@ -63,6 +187,15 @@ int main(int argc, char *argv[]) {
     
     int is_file = 0;
     char *input = NULL;
+    const char *batch_path = NULL;
+    const char *serve_path = NULL;
+    const char *connect_path = NULL;
+    const char *cache_dir = NULL;
+    long cache_max_age = 0;
+    int compressed = 0;
+    curly_batch_options_t batch_options;
+    
+    curly_batch_options_init(&batch_options);
     
     // Parse command line arguments
     for (int i = 1; i < argc; i++) {
@@ -81,6 +214,50 @@ int main(int argc, char *argv[]) {
                 input = argv[i + 1];
                 i++;
             }
+        } else if ((strcmp(argv[i], "-b") == 0 || strcmp(argv[i], "--batch") == 0) && i + 1 < argc) {
+            batch_path = argv[i + 1];
+            i++;
+        } else if ((strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--concurrency") == 0) && i + 1 < argc) {
+            batch_options.max_concurrent = atoi(argv[i + 1]);
+            if (batch_options.max_concurrent <= 0) {
+                fprintf(stderr, "Error: Concurrency must be a positive integer\n");
+                return EXIT_FAILURE;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--body-dir") == 0 && i + 1 < argc) {
+            batch_options.body_dir = argv[i + 1];
+            i++;
+        } else if (strcmp(argv[i], "--http2") == 0) {
+            batch_options.http_version = CURLY_HTTP_2;
+        } else if (strcmp(argv[i], "--http2-prior-knowledge") == 0) {
+            batch_options.http_version = CURLY_HTTP_2_PRIOR_KNOWLEDGE;
+        } else if (strcmp(argv[i], "--max-streams") == 0 && i + 1 < argc) {
+            batch_options.max_streams = atoi(argv[i + 1]);
+            if (batch_options.max_streams <= 0) {
+                fprintf(stderr, "Error: Stream count must be a positive integer\n");
+                return EXIT_FAILURE;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--summary") == 0) {
+            batch_options.summary = 1;
+        } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            serve_path = argv[i + 1];
+            i++;
+        } else if (strcmp(argv[i], "--connect") == 0 && i + 1 < argc) {
+            connect_path = argv[i + 1];
+            i++;
+        } else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+            cache_dir = argv[i + 1];
+            i++;
+        } else if (strcmp(argv[i], "--cache-max-age") == 0 && i + 1 < argc) {
+            cache_max_age = atol(argv[i + 1]);
+            if (cache_max_age < 0) {
+                fprintf(stderr, "Error: Cache max age must not be negative\n");
+                return EXIT_FAILURE;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--compressed") == 0) {
+            compressed = 1;
         } else if (input == NULL) {
             // Default to treating as a file if no option specified
             is_file = 1;
@@ -88,6 +265,14 @@ int main(int argc, char *argv[]) {
         }
     }
     
+    if (serve_path) {
+        return run_serve(serve_path, &batch_options);
+    }
+    
+    if (batch_path) {
+        return run_batch(batch_path, &batch_options, connect_path);
+    }
+    
     // Validate input
     if (input == NULL) {
         fprintf(stderr, "Error: No input provided\n");
@@ -113,11 +298,17 @@ int main(int argc, char *argv[]) {
         memcpy(json_str, input, len);
     }
     
+    if (connect_path) {
+        int status = run_client_request(connect_path, json_str);
+        free(json_str);
+        return status;
+    }
+    
     // Initialize libcurl
     curl_global_init(CURL_GLOBAL_ALL);
     
     curly_config_t config;
-    curly_response_t response;
+    curly_sink_t sink;
     
     // Parse JSON config
     curly_error_t error = curly_parse_config(json_str, &config);
@@ -128,8 +319,21 @@ int main(int argc, char *argv[]) {
         return EXIT_FAILURE;
     }
     
-    // Perform the request
-    error = curly_perform_request(&config, &response);
+    // A cache set in the config wins over the command line
+    if (cache_dir && !config.cache) {
+        config.cache = json_object();
+        json_object_set_new(config.cache, "dir", json_string(cache_dir));
+        json_object_set_new(config.cache, "max_age", json_integer(cache_max_age));
+    }
+    
+    // So does a compression setting
+    if (compressed && !config.compression) {
+        config.compression = json_true();
+    }
+    
+    // Perform the request, streaming the body to stdout as it arrives
+    curly_sink_init_fd(&sink, STDOUT_FILENO);
+    error = curly_perform_request_sink(&config, &sink);
     if (error != CURLY_OK) {
         fprintf(stderr, "Error: %s\n", curly_strerror(error));
         curly_free_config(&config);
@@ -138,12 +342,13 @@ int main(int argc, char *argv[]) {
         return EXIT_FAILURE;
     }
     
-    // Print the response
-    printf("%s\n", response.data);
+    // Finish the line on a terminal; pipes get the body unchanged
+    if (isatty(STDOUT_FILENO)) {
+        printf("\n");
+    }
     
     // Clean up
     curly_free_config(&config);
-    curly_free_response(&response);
     free(json_str);
     curl_global_cleanup();
     
@@ -7,24 +7,124 @@
 #include <unistd.h>
 #include "curly.h"
 
+#define MAX_JSON_SIZE 4096
+#define PROGRESS_INTERVAL_MS 1000L
+
 static void print_usage() {
     printf("Usage: curly_parallel [options]\n");
     printf("Options:\n");
-    printf("  -t, --threads N  : Number of parallel download threads (default: 4, max: 64)\n");
-    printf("  -i, --input FILE : Read TSV data from FILE instead of stdin\n");
-    printf("  -h, --help       : Display this help message\n");
+    printf("  -t, --threads N      : Number of event loop threads (default: 4, max: 64, 0: one per CPU)\n");
+    printf("  -c, --concurrency N  : Maximum number of simultaneous downloads (default: 256)\n");
+    printf("  --per-host N         : Maximum simultaneous downloads from one host (default: 8);\n");
+    printf("                         with HTTP/2, connections per host and event loop\n");
+    printf("  --http2              : Multiplex downloads over HTTP/2 where TLS negotiates it\n");
+    printf("  --http2-prior-knowledge : Speak HTTP/2 without negotiation, also over http:// (h2c)\n");
+    printf("  --max-streams N      : Concurrent HTTP/2 streams per connection (default: 100)\n");
+    printf("  --writers N          : Number of disk writer threads (default: 2)\n");
+    printf("  --write-buffers N    : Number of 256 KiB write buffers (default: 64)\n");
+    printf("  --segments N         : Split large files into up to N ranges (default: 1)\n");
+    printf("  --min-segment-size B : Smallest range worth its own connection (default: 33554432)\n");
+    printf("  --journal FILE       : Record finished files in FILE; reruns revalidate or resume them\n");
+    printf("  --skip-complete      : Skip files the journal lists as complete without asking the server\n");
+    printf("  --retries N          : Retry transient failures up to N times (default: 2)\n");
+    printf("  --retry-delay MS     : Backoff before the first retry, doubled for each further one (default: 1000)\n");
+    printf("  --max-rate B         : Limit the total download rate to B bytes per second\n");
+    printf("  --host-max-rate B    : Limit the download rate from each host to B bytes per second\n");
+    printf("  --max-requests N     : Start at most N requests per second in total\n");
+    printf("  --host-max-requests N: Start at most N requests per second to each host\n");
+    printf("  --burst SECONDS      : How much of a rate may be used at once (default: 1)\n");
+    printf("  --rate-limit FILE    : Read limits from the \"rate_limit\" object of a JSON file\n");
+    printf("  --stats FILE         : Write each transfer's timing breakdown to FILE as JSON lines,\n");
+    printf("                         followed by percentile summaries overall and per host\n");
+    printf("  --summary            : Print latency percentiles per phase and host to stderr\n");
+    printf("  --dedup MODE         : How lines repeating a URL being fetched get the file: copy (reflink\n");
+    printf("                         where possible, default), link (hard link) or off (fetch again)\n");
+    printf("  --store DIR          : Keep each distinct payload once in DIR, keyed by SHA-256, and link\n");
+    printf("                         or clone downloads to it as --dedup says\n");
+    printf("  --log FILE           : Write one result line per download to FILE instead of printing it:\n");
+    printf("                         downloaded|unchanged|skipped|failed, URL, destination[, error]\n");
+    printf("  --progress           : Print files/s, MB/s, in-flight, failures and ETA to stderr every\n");
+    printf("                         second; without --log only failures are printed besides\n");
+    printf("  --in-place           : Write straight to destinations instead of renaming finished files\n");
+    printf("                         over them\n");
+    printf("  --fsync MODE         : Flush finished files to disk: none (default), file (each file and\n");
+    printf("                         its directory) or batch (each filesystem every 1024 files)\n");
+    printf("  --compressed         : Ask for gzip, deflate, br or zstd bodies and decode them on the fly\n");
+    printf("  --encodings LIST     : Ask for only these codings, e.g. \"gzip,zstd\"; implies --compressed\n");
+    printf("                         unless --keep-encoded is given\n");
+    printf("  --keep-encoded       : Store coded bodies as sent, adding .gz, .zz, .br or .zst to the\n");
+    printf("                         destination\n");
+    printf("  --preresolve         : Look up every host of the input file concurrently before the first\n");
+    printf("                         download and pin the addresses\n");
+    printf("  --hosts FILE         : Also look up the URLs or host[:port] names listed in FILE\n");
+    printf("  --resolve H:P:ADDR   : Pin host H, port P to ADDR[,ADDR] without a lookup (repeatable)\n");
+    printf("  --prewarm            : Open a connection to every host before taking jobs; implies --preresolve\n");
+    printf("  -i, --input FILE     : Read TSV data from FILE instead of stdin\n");
+    printf("  -h, --help           : Display this help message\n");
     printf("\nInput format (TSV):\n");
     printf("  Each line should contain a URL and destination path separated by a tab:\n");
     printf("  <URL>\\t<destination_path>\\n\n");
     printf("Examples:\n");
     printf("  cat urls.tsv | curly_parallel -t 8\n");
     printf("  curly_parallel -i urls.tsv -t 16\n");
+    printf("  curly_parallel -i urls.tsv -t 0 -c 2000\n");
+    printf("  curly_parallel -i releases.tsv --segments 8\n");
+    printf("  curly_parallel -i nightly.tsv --journal nightly.journal\n");
+    printf("  curly_parallel -i mirror.tsv --retries 5 --retry-delay 500\n");
+    printf("  curly_parallel -i mirror.tsv --max-rate 10000000 --host-max-requests 2\n");
+    printf("  curly_parallel -i cdn.tsv -c 2000 --http2 --per-host 2\n");
+    printf("  curly_parallel -i mirror.tsv --stats timings.jsonl --summary\n");
+    printf("  curly_parallel -i mirror.tsv --log results.tsv --progress\n");
+    printf("  curly_parallel -i datasets.tsv --dedup link --store /srv/objects\n");
+    printf("  curly_parallel -i archive.tsv --fsync batch\n");
+    printf("  curly_parallel -i logs.tsv --keep-encoded --encodings zstd,gzip\n");
+    printf("  curly_parallel -i batch.tsv --prewarm --resolve cdn.example.com:443:10.0.0.5\n");
+}
+
+static char *read_file(const char *filepath) {
+    FILE *file = fopen(filepath, "r");
+    if (!file) {
+        fprintf(stderr, "Error: Unable to open file %s\n", filepath);
+        return NULL;
+    }
+    
+    fseek(file, 0, SEEK_END);
+    long file_size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    
+    if (file_size <= 0 || file_size > MAX_JSON_SIZE) {
+        fprintf(stderr, "Error: File size is invalid or too large\n");
+        fclose(file);
+        return NULL;
+    }
+    
+    char *buffer = malloc(file_size + 1);
+    if (!buffer) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        fclose(file);
+        return NULL;
+    }
+    
+    size_t read_size = fread(buffer, 1, file_size, file);
+    buffer[read_size] = '\0';
+    fclose(file);
+    
+    if (read_size != (size_t)file_size) {
+        fprintf(stderr, "Error: Failed to read entire file\n");
+        free(buffer);
+        return NULL;
+    }
+    
+    return buffer;
 }
 
 int main(int argc, char *argv[]) {
-    int thread_count = 4;
+    curly_parallel_options_t options;
     FILE *input_file = stdin;
     int custom_input = 0;
+    struct curl_slist *resolve = NULL;
+    
+    curly_parallel_options_init(&options);
     
     // Parse command line arguments
     for (int i = 1; i < argc; i++) {
@@ -32,12 +132,196 @@ int main(int argc, char *argv[]) {
             print_usage();
             return EXIT_SUCCESS;
         } else if ((strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "--threads") == 0) && i + 1 < argc) {
-            thread_count = atoi(argv[i + 1]);
-            if (thread_count <= 0) {
-                fprintf(stderr, "Error: Thread count must be a positive integer\n");
+            options.thread_count = atoi(argv[i + 1]);
+            if (options.thread_count < 0) {
+                fprintf(stderr, "Error: Thread count must be a non-negative integer\n");
+                return EXIT_FAILURE;
+            }
+            i++;
+        } else if ((strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--concurrency") == 0) && i + 1 < argc) {
+            options.max_transfers = atoi(argv[i + 1]);
+            if (options.max_transfers <= 0) {
+                fprintf(stderr, "Error: Concurrency must be a positive integer\n");
+                return EXIT_FAILURE;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--per-host") == 0 && i + 1 < argc) {
+            options.max_per_host = atoi(argv[i + 1]);
+            if (options.max_per_host <= 0) {
+                fprintf(stderr, "Error: Per-host limit must be a positive integer\n");
+                return EXIT_FAILURE;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--http2") == 0) {
+            options.http_version = CURLY_HTTP_2;
+        } else if (strcmp(argv[i], "--http2-prior-knowledge") == 0) {
+            options.http_version = CURLY_HTTP_2_PRIOR_KNOWLEDGE;
+        } else if (strcmp(argv[i], "--max-streams") == 0 && i + 1 < argc) {
+            options.max_streams = atoi(argv[i + 1]);
+            if (options.max_streams <= 0) {
+                fprintf(stderr, "Error: Stream count must be a positive integer\n");
+                return EXIT_FAILURE;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--writers") == 0 && i + 1 < argc) {
+            options.writer_threads = atoi(argv[i + 1]);
+            if (options.writer_threads <= 0) {
+                fprintf(stderr, "Error: Writer count must be a positive integer\n");
+                return EXIT_FAILURE;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--write-buffers") == 0 && i + 1 < argc) {
+            options.write_buffers = atoi(argv[i + 1]);
+            if (options.write_buffers <= 0) {
+                fprintf(stderr, "Error: Write buffer count must be a positive integer\n");
+                return EXIT_FAILURE;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--segments") == 0 && i + 1 < argc) {
+            options.segments = atoi(argv[i + 1]);
+            if (options.segments <= 0) {
+                fprintf(stderr, "Error: Segment count must be a positive integer\n");
+                return EXIT_FAILURE;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--min-segment-size") == 0 && i + 1 < argc) {
+            options.min_segment_size = (curl_off_t)strtoll(argv[i + 1], NULL, 10);
+            if (options.min_segment_size <= 0) {
+                fprintf(stderr, "Error: Minimum segment size must be a positive integer\n");
+                return EXIT_FAILURE;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--journal") == 0 && i + 1 < argc) {
+            options.journal_path = argv[i + 1];
+            i++;
+        } else if (strcmp(argv[i], "--skip-complete") == 0) {
+            options.revalidate = 0;
+        } else if (strcmp(argv[i], "--retries") == 0 && i + 1 < argc) {
+            options.retries = atoi(argv[i + 1]);
+            if (options.retries < 0) {
+                fprintf(stderr, "Error: Retry count must be a non-negative integer\n");
+                return EXIT_FAILURE;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--retry-delay") == 0 && i + 1 < argc) {
+            options.retry_delay_ms = atol(argv[i + 1]);
+            if (options.retry_delay_ms <= 0) {
+                fprintf(stderr, "Error: Retry delay must be a positive integer\n");
+                return EXIT_FAILURE;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--max-rate") == 0 && i + 1 < argc) {
+            options.rate_limit.bytes_per_sec = (curl_off_t)strtoll(argv[i + 1], NULL, 10);
+            if (options.rate_limit.bytes_per_sec <= 0) {
+                fprintf(stderr, "Error: Rate limit must be a positive integer\n");
+                return EXIT_FAILURE;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--host-max-rate") == 0 && i + 1 < argc) {
+            options.rate_limit.host_bytes_per_sec = (curl_off_t)strtoll(argv[i + 1], NULL, 10);
+            if (options.rate_limit.host_bytes_per_sec <= 0) {
+                fprintf(stderr, "Error: Rate limit must be a positive integer\n");
+                return EXIT_FAILURE;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--max-requests") == 0 && i + 1 < argc) {
+            options.rate_limit.requests_per_sec = strtod(argv[i + 1], NULL);
+            if (options.rate_limit.requests_per_sec <= 0) {
+                fprintf(stderr, "Error: Request rate must be a positive number\n");
+                return EXIT_FAILURE;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--host-max-requests") == 0 && i + 1 < argc) {
+            options.rate_limit.host_requests_per_sec = strtod(argv[i + 1], NULL);
+            if (options.rate_limit.host_requests_per_sec <= 0) {
+                fprintf(stderr, "Error: Request rate must be a positive number\n");
+                return EXIT_FAILURE;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--burst") == 0 && i + 1 < argc) {
+            options.rate_limit.burst_ms = (long)(strtod(argv[i + 1], NULL) * 1000);
+            if (options.rate_limit.burst_ms <= 0) {
+                fprintf(stderr, "Error: Burst must be a positive number of seconds\n");
+                return EXIT_FAILURE;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--rate-limit") == 0 && i + 1 < argc) {
+            char *json_str = read_file(argv[i + 1]);
+            if (!json_str) {
+                return EXIT_FAILURE;
+            }
+            curly_error_t error = curly_parse_rate_limit(json_str, &options.rate_limit);
+            free(json_str);
+            if (error != CURLY_OK) {
+                fprintf(stderr, "Error: Invalid rate limit file %s: %s\n", argv[i + 1], curly_strerror(error));
+                return EXIT_FAILURE;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc) {
+            options.stats_path = argv[i + 1];
+            i++;
+        } else if (strcmp(argv[i], "--summary") == 0) {
+            options.summary = 1;
+        } else if (strcmp(argv[i], "--dedup") == 0 && i + 1 < argc) {
+            if (strcmp(argv[i + 1], "copy") == 0) {
+                options.dedup = CURLY_DEDUP_COPY;
+            } else if (strcmp(argv[i + 1], "link") == 0) {
+                options.dedup = CURLY_DEDUP_LINK;
+            } else if (strcmp(argv[i + 1], "off") == 0) {
+                options.dedup = CURLY_DEDUP_OFF;
+            } else {
+                fprintf(stderr, "Error: --dedup must be copy, link or off\n");
+                return EXIT_FAILURE;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--store") == 0 && i + 1 < argc) {
+            options.store_path = argv[i + 1];
+            i++;
+        } else if (strcmp(argv[i], "--log") == 0 && i + 1 < argc) {
+            options.log_path = argv[i + 1];
+            i++;
+        } else if (strcmp(argv[i], "--progress") == 0) {
+            options.progress_interval_ms = PROGRESS_INTERVAL_MS;
+        } else if (strcmp(argv[i], "--in-place") == 0) {
+            options.in_place = 1;
+        } else if (strcmp(argv[i], "--fsync") == 0 && i + 1 < argc) {
+            if (strcmp(argv[i + 1], "none") == 0) {
+                options.fsync_mode = CURLY_FSYNC_NONE;
+            } else if (strcmp(argv[i + 1], "file") == 0) {
+                options.fsync_mode = CURLY_FSYNC_FILE;
+            } else if (strcmp(argv[i + 1], "batch") == 0) {
+                options.fsync_mode = CURLY_FSYNC_BATCH;
+            } else {
+                fprintf(stderr, "Error: --fsync must be none, file or batch\n");
+                return EXIT_FAILURE;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--compressed") == 0) {
+            if (!options.accept_encoding) {
+                options.accept_encoding = "";
+            }
+        } else if (strcmp(argv[i], "--encodings") == 0 && i + 1 < argc) {
+            options.accept_encoding = argv[i + 1];
+            i++;
+        } else if (strcmp(argv[i], "--keep-encoded") == 0) {
+            options.keep_encoded = 1;
+        } else if (strcmp(argv[i], "--preresolve") == 0) {
+            options.preresolve = 1;
+        } else if (strcmp(argv[i], "--hosts") == 0 && i + 1 < argc) {
+            options.hosts_path = argv[i + 1];
+            i++;
+        } else if (strcmp(argv[i], "--resolve") == 0 && i + 1 < argc) {
+            struct curl_slist *entries = curl_slist_append(resolve, argv[i + 1]);
+            if (!entries) {
+                fprintf(stderr, "Error: Memory allocation failed\n");
+                curl_slist_free_all(resolve);
                 return EXIT_FAILURE;
             }
+            resolve = entries;
+            options.resolve = resolve;
             i++;
+        } else if (strcmp(argv[i], "--prewarm") == 0) {
+            options.prewarm = 1;
         } else if ((strcmp(argv[i], "-i") == 0 || strcmp(argv[i], "--input") == 0) && i + 1 < argc) {
             input_file = fopen(argv[i + 1], "r");
             if (!input_file) {
@@ -61,12 +345,13 @@ int main(int argc, char *argv[]) {
     }
     
     // Process parallel downloads
-    curly_error_t error = curly_parallel_download(thread_count, input_file);
+    curly_error_t error = curly_parallel_download_ex(&options, input_file);
     
     // Close input file if it's not stdin
     if (custom_input) {
         fclose(input_file);
     }
+    curl_slist_free_all(resolve);
     
     if (error != CURLY_OK) {
         fprintf(stderr, "Error: %s\n", curly_strerror(error));
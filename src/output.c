@@ -0,0 +1,523 @@
+// For syncfs() on Linux
+#define _GNU_SOURCE
+
+#include "output.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define MAX_OUTPUT_PATH 4096
+#define INITIAL_DIR_SLOTS 256
+#define MAX_SYNC_DEVICES 16
+#define SYNC_BATCH_FILES 1024  // Files committed between batched syncs
+
+// A directory known to exist
+typedef struct {
+    int fd;          // Cached descriptor, -1 once the cache is full
+    size_t length;
+    char path[];
+} output_dir_t;
+
+struct curly_output {
+    pthread_mutex_t mutex;
+    output_dir_t **slots;  // Open-addressing table keyed by path
+    size_t slot_count;
+    size_t dir_count;
+    int open_count;        // Cached descriptors
+    int max_open;
+    curly_fsync_mode_t fsync_mode;
+    int sync_fds[MAX_SYNC_DEVICES];  // A cached directory on each filesystem written to
+    dev_t sync_devices[MAX_SYNC_DEVICES];
+    int sync_count;
+    size_t unsynced;       // Files committed since the last batched sync
+};
+
+static unsigned temp_counter = 0;  // Accessed atomically
+
+// FNV-1a hash of a path
+static size_t hash_path(const char *path, size_t length) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)path[i];
+        hash *= 1099511628211ULL;
+    }
+    return (size_t)hash;
+}
+
+// Find the slot holding a directory, or the empty slot where it belongs
+static output_dir_t **find_dir_slot(output_dir_t **slots, size_t slot_count, const char *path, size_t length) {
+    size_t index = hash_path(path, length) & (slot_count - 1);
+    while (slots[index] && (slots[index]->length != length || memcmp(slots[index]->path, path, length) != 0)) {
+        index = (index + 1) & (slot_count - 1);
+    }
+    return &slots[index];
+}
+
+// Double the directory table
+static int grow_dir_table(curly_output_t *output) {
+    size_t slot_count = output->slot_count * 2;
+    output_dir_t **slots = (output_dir_t **)calloc(slot_count, sizeof(output_dir_t *));
+    if (!slots) {
+        return -1;
+    }
+    for (size_t i = 0; i < output->slot_count; i++) {
+        output_dir_t *dir = output->slots[i];
+        if (dir) {
+            *find_dir_slot(slots, slot_count, dir->path, dir->length) = dir;
+        }
+    }
+    free(output->slots);
+    output->slots = slots;
+    output->slot_count = slot_count;
+    return 0;
+}
+
+// Remember a directory's filesystem for batched syncs. Called with the mutex held.
+static void track_device(curly_output_t *output, int fd) {
+    struct stat st;
+    if (output->sync_count == MAX_SYNC_DEVICES || fstat(fd, &st) != 0) {
+        return;
+    }
+    for (int i = 0; i < output->sync_count; i++) {
+        if (output->sync_devices[i] == st.st_dev) {
+            return;
+        }
+    }
+    output->sync_fds[output->sync_count] = fd;
+    output->sync_devices[output->sync_count] = st.st_dev;
+    output->sync_count++;
+}
+
+// Look up a directory: its cached descriptor, -1 if it exists but has
+// none, or -2 if it is not known
+static int cached_dir(curly_output_t *output, const char *path, size_t length) {
+    pthread_mutex_lock(&output->mutex);
+    output_dir_t *dir = *find_dir_slot(output->slots, output->slot_count, path, length);
+    int fd = dir ? dir->fd : -2;
+    pthread_mutex_unlock(&output->mutex);
+    return fd;
+}
+
+// Record a directory just opened. Returns the descriptor to use, which is
+// the caller's to close if *owned is set.
+static int cache_dir(curly_output_t *output, const char *path, size_t length, int fd, int *owned) {
+    *owned = 1;
+    pthread_mutex_lock(&output->mutex);
+
+    output_dir_t **slot = find_dir_slot(output->slots, output->slot_count, path, length);
+    if (*slot && (*slot)->fd >= 0) {
+        // Another thread got there first
+        int cached = (*slot)->fd;
+        pthread_mutex_unlock(&output->mutex);
+        close(fd);
+        *owned = 0;
+        return cached;
+    }
+
+    if (!*slot && (output->dir_count + 1) * 2 > output->slot_count) {
+        if (grow_dir_table(output) == 0) {
+            slot = find_dir_slot(output->slots, output->slot_count, path, length);
+        } else {
+            slot = NULL;
+        }
+    }
+    if (slot && !*slot) {
+        output_dir_t *dir = (output_dir_t *)malloc(sizeof(output_dir_t) + length + 1);
+        if (dir) {
+            dir->fd = -1;
+            dir->length = length;
+            memcpy(dir->path, path, length);
+            dir->path[length] = '\0';
+            *slot = dir;
+            output->dir_count++;
+        }
+    }
+    if (slot && *slot && output->open_count < output->max_open) {
+        (*slot)->fd = fd;
+        output->open_count++;
+        *owned = 0;
+        if (output->fsync_mode == CURLY_FSYNC_BATCH) {
+            track_device(output, fd);
+        }
+    }
+
+    pthread_mutex_unlock(&output->mutex);
+    return fd;
+}
+
+// Length of the directory part of path[0..length): 0 for ".", 1 for "/"
+// in an absolute path, and trailing slashes are left out
+static size_t parent_length(const char *path, size_t length) {
+    size_t end = length;
+    while (end > 0 && path[end - 1] != '/') {
+        end--;
+    }
+    if (end == 0) {
+        return 0;
+    }
+    while (end > 0 && path[end - 1] == '/') {
+        end--;
+    }
+    return end == 0 ? 1 : end;
+}
+
+// Open the directory path[0..length), creating it and any missing parents.
+// Only the components below the deepest directory already known are
+// created. The path is modified while this runs but restored.
+static int open_dir(curly_output_t *output, char *path, size_t length, int *owned) {
+    // Walk up to the deepest directory known to exist
+    size_t end = length;
+    int fd;
+    for (;;) {
+        int root = end == 0 || (end == 1 && path[0] == '/');
+        fd = end == 0 ? cached_dir(output, ".", 1) : cached_dir(output, path, end);
+        if (fd != -2 || root) {
+            break;
+        }
+        end = parent_length(path, end);
+    }
+
+    *owned = 0;
+    if (fd < 0) {
+        char saved = path[end];
+        path[end] = '\0';
+        int opened = open(end == 0 ? "." : path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        path[end] = saved;
+        if (opened < 0) {
+            return -1;
+        }
+        fd = end == 0 ? cache_dir(output, ".", 1, opened, owned) : cache_dir(output, path, end, opened, owned);
+    }
+
+    // Create the rest, one component at a time
+    while (end < length) {
+        size_t start = end;
+        while (start < length && path[start] == '/') {
+            start++;
+        }
+        size_t stop = start;
+        while (stop < length && path[stop] != '/') {
+            stop++;
+        }
+
+        char saved = path[stop];
+        path[stop] = '\0';
+        if (mkdirat(fd, path + start, 0755) != 0 && errno != EEXIST) {
+            path[stop] = saved;
+            int error = errno;
+            if (*owned) close(fd);
+            errno = error;
+            return -1;
+        }
+        int child = openat(fd, path + start, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        path[stop] = saved;
+
+        int error = errno;
+        if (*owned) close(fd);
+        if (child < 0) {
+            errno = error;
+            return -1;
+        }
+        fd = cache_dir(output, path, stop, child, owned);
+        end = stop;
+    }
+    return fd;
+}
+
+curly_output_t *curly_output_create(curly_fsync_mode_t fsync_mode, int max_dir_fds) {
+    curly_output_t *output = (curly_output_t *)calloc(1, sizeof(curly_output_t));
+    if (!output) {
+        return NULL;
+    }
+    output->slot_count = INITIAL_DIR_SLOTS;
+    output->slots = (output_dir_t **)calloc(output->slot_count, sizeof(output_dir_t *));
+    if (!output->slots) {
+        free(output);
+        return NULL;
+    }
+    output->max_open = max_dir_fds > 0 ? max_dir_fds : 0;
+    output->fsync_mode = fsync_mode;
+    pthread_mutex_init(&output->mutex, NULL);
+    return output;
+}
+
+// Flush every filesystem written to, or all of them if none is known
+static void sync_devices(const int *fds, int count) {
+#ifdef __linux__
+    for (int i = 0; i < count; i++) {
+        syncfs(fds[i]);
+    }
+    if (count > 0) {
+        return;
+    }
+#else
+    (void)fds;
+    (void)count;
+#endif
+    sync();
+}
+
+void curly_output_destroy(curly_output_t *output) {
+    if (!output) return;
+
+    if (output->unsynced > 0) {
+        sync_devices(output->sync_fds, output->sync_count);
+    }
+    for (size_t i = 0; i < output->slot_count; i++) {
+        if (output->slots[i]) {
+            if (output->slots[i]->fd >= 0) {
+                close(output->slots[i]->fd);
+            }
+            free(output->slots[i]);
+        }
+    }
+    pthread_mutex_destroy(&output->mutex);
+    free(output->slots);
+    free(output);
+}
+
+// Copy a path for open_dir() and find where its last component starts
+static int split_path(const char *path, char *copy, size_t *dir_length, size_t *name_start) {
+    size_t length = strlen(path);
+    if (length == 0 || length >= MAX_OUTPUT_PATH) {
+        errno = length ? ENAMETOOLONG : ENOENT;
+        return -1;
+    }
+    memcpy(copy, path, length + 1);
+
+    *name_start = length;
+    while (*name_start > 0 && path[*name_start - 1] != '/') {
+        (*name_start)--;
+    }
+    *dir_length = parent_length(copy, length);
+    return 0;
+}
+
+int curly_output_mkdirs(curly_output_t *output, const char *path) {
+    char copy[MAX_OUTPUT_PATH];
+    size_t dir_length, name_start;
+    if (split_path(path, copy, &dir_length, &name_start) != 0) {
+        return -1;
+    }
+
+    int owned;
+    int fd = open_dir(output, copy, dir_length, &owned);
+    if (fd < 0) {
+        return -1;
+    }
+    if (owned) {
+        close(fd);
+    }
+    return 0;
+}
+
+// Forget a file's directory and temporary name
+static void release_file(curly_output_file_t *file) {
+    if (file->own_dir) {
+        close(file->dir_fd);
+    }
+    free(file->temp);
+    file->dir_fd = -1;
+    file->own_dir = 0;
+    file->name = NULL;
+    file->temp = NULL;
+    file->suffix = NULL;
+    file->part = 0;
+}
+
+char *curly_output_temp_name(const char *path) {
+    const char *slash = strrchr(path, '/');
+    int dir_length = slash ? (int)(slash - path + 1) : 0;
+    size_t size = (size_t)dir_length + 48;
+    char *name = (char *)malloc(size);
+    if (name) {
+        unsigned id = __atomic_add_fetch(&temp_counter, 1, __ATOMIC_RELAXED);
+        snprintf(name, size, "%.*s.curly-%ld-%u", dir_length, path, (long)getpid(), id);
+    }
+    return name;
+}
+
+// Find the directory of a path for a file to be opened in, creating it if
+// needed. Returns 0, or -1 with errno set.
+static int open_file_dir(curly_output_t *output, const char *path, curly_output_file_t *file) {
+    memset(file, 0, sizeof(curly_output_file_t));
+    file->dir_fd = -1;
+
+    char copy[MAX_OUTPUT_PATH];
+    size_t dir_length, name_start;
+    if (split_path(path, copy, &dir_length, &name_start) != 0) {
+        return -1;
+    }
+    if (!path[name_start]) {
+        errno = EISDIR;
+        return -1;
+    }
+
+    int dir_fd = open_dir(output, copy, dir_length, &file->own_dir);
+    if (dir_fd < 0) {
+        return -1;
+    }
+    file->dir_fd = dir_fd;
+    file->name = path + name_start;
+    return 0;
+}
+
+int curly_output_open(curly_output_t *output, const char *path, int flags, int in_place,
+                      curly_output_file_t *file) {
+    if (open_file_dir(output, path, file) != 0) {
+        return -1;
+    }
+
+    int fd;
+    if (in_place) {
+        fd = openat(file->dir_fd, file->name, flags | O_CLOEXEC, 0644);
+    } else {
+        file->temp = curly_output_temp_name(file->name);
+        if (!file->temp) {
+            curly_output_discard(output, file, 0);
+            errno = ENOMEM;
+            return -1;
+        }
+        fd = openat(file->dir_fd, file->temp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    }
+
+    if (fd < 0) {
+        int error = errno;
+        free(file->temp);
+        file->temp = NULL;
+        curly_output_discard(output, file, 0);
+        errno = error;
+    }
+    return fd;
+}
+
+// Get the side name of a file, NULL if out of memory
+static char *part_name(const char *name) {
+    size_t size = strlen(name) + sizeof(CURLY_OUTPUT_PART_SUFFIX);
+    char *part = (char *)malloc(size);
+    if (part) {
+        snprintf(part, size, "%s%s", name, CURLY_OUTPUT_PART_SUFFIX);
+    }
+    return part;
+}
+
+int curly_output_open_part(curly_output_t *output, const char *path, int flags, curly_output_file_t *file) {
+    if (open_file_dir(output, path, file) != 0) {
+        return -1;
+    }
+
+    file->temp = part_name(file->name);
+    if (!file->temp) {
+        curly_output_discard(output, file, 0);
+        errno = ENOMEM;
+        return -1;
+    }
+    file->part = 1;
+
+    int fd = openat(file->dir_fd, file->temp, flags | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        int error = errno;
+        release_file(file);
+        errno = error;
+    }
+    return fd;
+}
+
+int curly_output_keep_part(curly_output_t *output, curly_output_file_t *file) {
+    if (!file->name) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (file->part) {
+        release_file(file);
+        return 0;
+    }
+
+    char *part = part_name(file->name);
+    const char *from = file->temp ? file->temp : file->name;
+    if (!part || renameat(file->dir_fd, from, file->dir_fd, part) != 0) {
+        int error = part ? errno : ENOMEM;
+        free(part);
+        curly_output_discard(output, file, 1);
+        errno = error;
+        return -1;
+    }
+    free(part);
+    release_file(file);
+    return 0;
+}
+
+int curly_output_commit(curly_output_t *output, curly_output_file_t *file) {
+    if (!file->name) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // A suffix renames even a file written in place
+    char named[MAX_OUTPUT_PATH];
+    const char *name = file->name;
+    if (file->suffix && *file->suffix) {
+        int length = snprintf(named, sizeof(named), "%s%s", file->name, file->suffix);
+        if (length < 0 || (size_t)length >= sizeof(named)) {
+            curly_output_discard(output, file, 0);
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        name = named;
+    }
+
+    const char *from = file->temp ? file->temp : file->name;
+    if (from != name && renameat(file->dir_fd, from, file->dir_fd, name) != 0) {
+        int error = errno;
+        if (file->temp) {
+            unlinkat(file->dir_fd, file->temp, 0);
+        }
+        release_file(file);
+        errno = error;
+        return -1;
+    }
+
+    if (output->fsync_mode == CURLY_FSYNC_FILE) {
+        // The new name is only durable once its directory is
+        if (fsync(file->dir_fd) != 0) {
+            int error = errno;
+            release_file(file);
+            errno = error;
+            return -1;
+        }
+    } else if (output->fsync_mode == CURLY_FSYNC_BATCH) {
+        int fds[MAX_SYNC_DEVICES];
+        int count = 0;
+        int due = 0;
+        pthread_mutex_lock(&output->mutex);
+        if (++output->unsynced >= SYNC_BATCH_FILES) {
+            output->unsynced = 0;
+            count = output->sync_count;
+            memcpy(fds, output->sync_fds, (size_t)count * sizeof(int));
+            due = 1;
+        }
+        pthread_mutex_unlock(&output->mutex);
+        if (due) {
+            sync_devices(fds, count);
+        }
+    }
+
+    release_file(file);
+    return 0;
+}
+
+void curly_output_discard(curly_output_t *output, curly_output_file_t *file, int remove) {
+    (void)output;
+    if (!file->name) {
+        return;
+    }
+
+    if (file->temp && (!file->part || remove)) {
+        unlinkat(file->dir_fd, file->temp, 0);
+    } else if (!file->temp && remove) {
+        unlinkat(file->dir_fd, file->name, 0);
+    }
+    release_file(file);
+}
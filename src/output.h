@@ -0,0 +1,132 @@
+#ifndef CURLY_OUTPUT_H
+#define CURLY_OUTPUT_H
+
+#include "curly.h"
+
+/**
+ * Filesystem output layer. Directories are created once per run and kept
+ * open in a cache shared by all threads, so files are created with openat()
+ * against a cached descriptor instead of walking and creating every path
+ * component again. New files are written under a temporary name next to
+ * the destination and renamed over it when complete, so readers never see
+ * a partial file. Safe to use from several threads.
+ */
+typedef struct curly_output curly_output_t;
+
+/**
+ * A file opened through the output layer
+ */
+typedef struct {
+    int dir_fd;        // Directory holding the file
+    int own_dir;       // Set when dir_fd is not cached and is closed with the file
+    const char *name;  // Destination name within the directory, borrowed from the path; NULL once released
+    char *temp;        // Temporary name renamed over name on commit, NULL when writing in place
+    const char *suffix;  // Appended to name on commit, borrowed; NULL for none
+    int part;          // Set when temp is the side file of a resumed prefix, kept when discarded
+} curly_output_file_t;
+
+#define CURLY_OUTPUT_PART_SUFFIX ".part"  // Side name of an unfinished file kept to be resumed
+
+/**
+ * Name a temporary file next to a path, in the same directory, as
+ * ".curly-<pid>-<n>". The name's length doesn't depend on the path's own
+ * name, so it fits wherever that name does.
+ *
+ * @param path Path the temporary file will replace; with no directory, the
+ *        name has none either
+ * @return Heap string, or NULL if out of memory
+ */
+char *curly_output_temp_name(const char *path);
+
+/**
+ * Create an output layer
+ *
+ * @param fsync_mode When committed files are flushed to stable storage
+ * @param max_dir_fds Most directory descriptors to keep open; further
+ *        directories are remembered as existing but opened for each use
+ * @return New output layer, or NULL if out of memory
+ */
+curly_output_t *curly_output_create(curly_fsync_mode_t fsync_mode, int max_dir_fds);
+
+/**
+ * Flush outstanding batched syncs, close the cached directories and
+ * destroy the output layer
+ *
+ * @param output Output layer to destroy, may be NULL
+ */
+void curly_output_destroy(curly_output_t *output);
+
+/**
+ * Create the directory of a path, and any missing parents
+ *
+ * @param output Output layer
+ * @param path File path whose directory is needed
+ * @return 0 on success, -1 on failure with errno set
+ */
+int curly_output_mkdirs(curly_output_t *output, const char *path);
+
+/**
+ * Create the directory of a path and open a file for writing there. Unless
+ * in_place is set, the file is a new temporary file that replaces path on
+ * curly_output_commit().
+ *
+ * @param output Output layer
+ * @param path Destination path, which must outlive the file
+ * @param flags open() flags when writing in place; a temporary file is
+ *        always created new
+ * @param in_place Write to path itself
+ * @param file Receives the file's state
+ * @return Open descriptor, or -1 on failure with errno set
+ */
+int curly_output_open(curly_output_t *output, const char *path, int flags, int in_place,
+                      curly_output_file_t *file);
+
+/**
+ * Create the directory of a path and open the side file an unfinished
+ * download keeps its prefix in, path plus CURLY_OUTPUT_PART_SUFFIX, to
+ * continue it. Like a temporary file it replaces path on
+ * curly_output_commit(), but it is kept when discarded without remove.
+ *
+ * @param output Output layer
+ * @param path Destination path, which must outlive the file
+ * @param flags open() flags for the side file
+ * @param file Receives the file's state
+ * @return Open descriptor, or -1 on failure with errno set
+ */
+int curly_output_open_part(curly_output_t *output, const char *path, int flags, curly_output_file_t *file);
+
+/**
+ * Keep an unfinished file under its side name, path plus
+ * CURLY_OUTPUT_PART_SUFFIX, so a later run can resume it, and release it.
+ * Whatever was at the destination stays there.
+ *
+ * @param output Output layer
+ * @param file File to keep
+ * @return 0 on success, -1 on failure with errno set (the file is removed)
+ */
+int curly_output_keep_part(curly_output_t *output, curly_output_file_t *file);
+
+/**
+ * Make a finished file visible at its destination, plus its suffix if one
+ * was set, and release it. Its descriptor should already be closed. With CURLY_FSYNC_FILE, the caller
+ * syncs the file before closing it and the directory is synced here.
+ *
+ * @param output Output layer
+ * @param file File to commit
+ * @return 0 on success, -1 on failure with errno set (the temporary file
+ *         is removed; a file written in place keeps its name)
+ */
+int curly_output_commit(curly_output_t *output, curly_output_file_t *file);
+
+/**
+ * Give up on a file and release it. A temporary file is removed, leaving
+ * whatever was at the destination before; a side file opened to resume is
+ * only removed with remove.
+ *
+ * @param output Output layer
+ * @param file File to discard; does nothing once released
+ * @param remove Also remove a file written in place
+ */
+void curly_output_discard(curly_output_t *output, curly_output_file_t *file, int remove);
+
+#endif /* CURLY_OUTPUT_H */
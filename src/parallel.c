@@ -1,406 +1,2766 @@
 #include "curly.h"
+#include "loop.h"
+#include "share.h"
+#include "writer.h"
+#include "journal.h"
+#include "retry.h"
+#include "ratelimit.h"
+#include "stats.h"
+#include "report.h"
+#include "ingest.h"
+#include "dedup.h"
+#include "resolve.h"
+#include "output.h"
+#include "encoding.h"
+#include "queue.h"
 #include <pthread.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/stat.h>
-#include <libgen.h>
+#include <sys/resource.h>
 #include <errno.h>
+#include <stdint.h>
+#include <strings.h>
+#include <ctype.h>
 
-#define MAX_LINE_LENGTH 4096
+#define MAX_PATH_LENGTH 4096
 #define DEFAULT_THREAD_COUNT 4
 #define MAX_THREAD_COUNT 64
+#define DEFAULT_MAX_TRANSFERS 256
+#define MAX_TRANSFER_COUNT 65536
+#define DEFAULT_WRITER_THREADS 2
+#define MAX_WRITER_THREADS 64
+#define DEFAULT_WRITE_BUFFERS 64
+#define MAX_WRITE_BUFFERS 65536
+#define WRITE_BUFFER_SIZE (256 * 1024)
+#define DEFAULT_SEGMENTS 1
+#define MAX_SEGMENTS 64
+#define DEFAULT_MIN_SEGMENT_SIZE ((curl_off_t)32 * 1024 * 1024)
+#define DEFAULT_RETRIES 2
+#define DEFAULT_RETRY_DELAY_MS 1000L
+#define RETRY_BUDGET_RATIO 0.2
+#define RETRY_BUDGET_BURST 100
+#define DEFAULT_MAX_PER_HOST 8
+#define DEFAULT_MAX_STREAMS 100
+#define HOST_TABLE_INITIAL_SLOTS 256
+#define MAX_HOST_KEY_LENGTH 256
+#define PARKED_JOBS_PER_TRANSFER 4
+#define URL_TABLE_INITIAL_BUCKETS 1024
+#define RESOLVE_THREADS 32
+#define PREWARM_TIMEOUT_MS 5000L
+#define MAX_OUTPUT_DIR_FDS 1024
 
-// Structure to hold a download job
-typedef struct {
-    char url[MAX_LINE_LENGTH];
-    char destination[MAX_LINE_LENGTH];
+#define JOB_BATCH_SIZE 32
+#define JOB_BLOCK_SIZE (64 * 1024)
+
+// A block of job records. The reader fills it front to back, and it is
+// freed once the reader has moved on and every job in it has finished.
+typedef struct job_block {
+    int refs;     // Accessed atomically: one per live job, plus one while the reader fills it
+    size_t used;
+    size_t size;
+    char data[];
+} job_block_t;
+
+// A download job, a variable-length record in a job block. The URL and
+// destination follow the record.
+typedef struct download_job {
+    char *url;
+    char *destination;
+    struct download_job *next;  // Link in a host lane, or in the followers of another job
+    struct download_job *followers;  // Later lines with the same URL, given a copy when done
+    struct download_job *next_url;   // Link in a URL table bucket
+    size_t url_hash;
+    job_block_t *block;
+    char data[];
 } download_job_t;
 
-// Structure for thread pool and job queue
-typedef struct {
-    download_job_t *jobs;
-    size_t capacity;
-    size_t size;
-    size_t read_index;
-    size_t write_index;
-    int shutdown;
-    pthread_mutex_t mutex;
-    pthread_cond_t not_empty;
-    pthread_cond_t not_full;
-} job_queue_t;
+struct parallel_engine;
+struct download_host;
+
+// Jobs one loop holds back for a host until the host has a free slot.
+// Lanes with jobs form a ring that the loop serves round-robin.
+typedef struct host_lane {
+    struct download_host *host;
+    download_job_t *head;
+    download_job_t *tail;
+    struct host_lane *next_ready;
+    int ready;  // Set while the lane is in the loop's ring
+} host_lane_t;
+
+// A server, identified by "host[:port]", and its share of the transfers
+typedef struct download_host {
+    int in_flight;      // Transfers holding a slot, accessed atomically
+    uint64_t waiters;   // Bit per loop with jobs waiting for a slot, accessed atomically
+    host_lane_t *lanes; // One per loop, each only touched by its loop
+    curly_rate_bucket_t byte_rate;     // Bandwidth shared by the host's transfers
+    curly_rate_bucket_t request_rate;  // Pace of new requests to the host
+    const struct curl_slist *resolve;  // Pinned addresses, NULL to let libcurl resolve it
+    char name[];
+} download_host_t;
+
+// Engine-wide table of hosts. Entries live until the engine is destroyed.
+typedef struct {
+    pthread_mutex_t mutex;
+    download_host_t **slots;  // Open-addressing hash table keyed by name
+    size_t slot_count;
+    size_t host_count;
+} host_table_t;
+
+// Jobs whose URL is being fetched, so later lines repeating it can share the
+// download. Chained, since jobs leave the table as they finish.
+typedef struct {
+    pthread_mutex_t mutex;
+    download_job_t **buckets;
+    size_t bucket_count;
+    size_t job_count;
+} url_table_t;
+
+// A destination file, owned by the writer once the transfer is done with it
+typedef struct {
+    curly_wfile_t base;  // Must be first
+    download_job_t *job;
+    struct parallel_engine *engine;
+    CURLcode result;
+    curl_off_t resume_from;  // Bytes kept from an earlier run
+    int conditional;         // Revalidating a file an earlier run completed
+    int touched;             // Set once the earlier contents may have been changed
+    int split;               // Set when ranges are fetched over several connections
+    int unchanged;           // Set when the server reported the file unchanged
+    int encoded;             // Set when the body has a content coding
+    int stripe;              // Reporter counter stripe of the loop that started it
+    curly_output_file_t target;  // Where the file is written and committed
+    char suffix[CURLY_ENCODING_SUFFIX_SIZE];  // Extension of the body's coding, "" for none
+    char *etag;
+    char *last_modified;
+} download_file_t;
+
+// A download running on an event loop
+typedef struct download_transfer {
+    curly_loop_transfer_t base;  // Must be first
+    download_file_t *file;
+    download_host_t *host; // Host whose slot this transfer holds
+    curly_wbuf_t *buffer;  // Buffer being filled, NULL until data arrives
+    curl_off_t offset;     // File offset of the buffer's first byte
+    curl_off_t end;        // File offset where this transfer's range ends, -1 for the whole body
+    int started;           // Set once the first data has been seen
+    int paused;            // Set while waiting for a free write buffer
+    int throttled;         // Set while held back by a bandwidth limit
+    int range_done;        // Set when the transfer was cut off at the end of its range
+    curl_off_t skip;       // Bytes of a whole body to drop before the range starts
+    int primary;           // Set for the transfer that started the download
+    int attempts;          // Attempts made at this transfer's part of the file
+    struct curl_slist *headers;
+    struct download_transfer *next_free;
+    struct download_transfer *next_paused;
+    struct download_transfer *next_pending;
+} download_transfer_t;
+
+// Event loop thread and its share of the transfer budget
+typedef struct {
+    pthread_t thread;
+    curly_loop_t *loop;
+    int max_transfers;
+    int hungry;  // Set (atomically) while the loop waits for new jobs
+    int starved;  // Set (atomically) while paused transfers wait for write buffers
+    download_transfer_t *free_transfers;  // Finished transfers kept for reuse
+    download_transfer_t *paused;  // Transfers to resume once buffers are free
+    download_transfer_t *pending;  // Range transfers waiting to be added to the loop
+    host_lane_t *ready_head;  // Ring of lanes with jobs, served round-robin
+    host_lane_t *ready_tail;
+    int ready_count;
+    int parked;       // Jobs held in lanes
+    int max_parked;   // Stop taking jobs from the queue beyond this many
+    int index;
+    int warming;      // Warm-up requests still running
+    download_host_t *last_host;  // Host of the last job taken, checked before the table
+    long long gate_due_ns;  // When jobs held back by a request rate are tried again, 0 if none are
+    struct parallel_engine *engine;
+} download_loop_t;
+
+// Parallel download engine
+typedef struct parallel_engine {
+    curly_queue_t queue;
+    download_loop_t *loops;
+    int loop_count;
+    int lane_count;  // Loops the engine was sized for, fixed before any starts
+    host_table_t hosts;
+    url_table_t urls;      // Used unless dedup is off
+    curly_dedup_mode_t dedup;
+    curly_store_t *store;  // Content-addressed store, NULL for none
+    int max_per_host;
+    curly_share_t *share;
+    curly_writer_t *writer;
+    curly_journal_t *journal;
+    int revalidate;
+    int segments;
+    curl_off_t min_segment_size;
+    curly_retry_policy_t retry;
+    curly_retry_budget_t retry_budget;
+    curly_rate_limit_t rate_limit;
+    curly_rate_bucket_t byte_rate;     // Bandwidth shared by all transfers
+    curly_rate_bucket_t request_rate;  // Pace of new requests to all hosts
+    int shape_bytes;     // Set when any bandwidth limit applies
+    int shape_requests;  // Set when any request-rate limit applies
+    curly_stats_t *stats;  // Latency histograms, NULL unless requested
+    FILE *stats_output;    // Per-transfer timing records, NULL for none
+    curly_reporter_t *reporter;  // Results and progress; one stripe per loop plus the reader
+    const curly_resolver_t *resolver;  // Hosts resolved before the run, NULL for none
+    int prewarm;         // Loops connect to the resolver's hosts before taking jobs
+    curly_output_t *output;  // Directory cache and commit of finished files
+    int in_place;        // Write destinations directly instead of through temporary files
+    int sync_files;      // Flush each file before closing it
+    char *accept_encoding;  // Codings offered on fresh requests, NULL or "" for none
+    int keep_encoded;    // Store coded bodies as sent, named with the coding's extension
+} parallel_engine_t;
+
+static void release_block(job_block_t *block) {
+    if (__atomic_sub_fetch(&block->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(block);
+    }
+}
+
+// Free a job, and its block with the block's last job
+static void release_job(void *job) {
+    release_block(((download_job_t *)job)->block);
+}
+
+// Copy a manifest line into a job record at the end of the reader's block,
+// starting a new block when it is full. Lines longer than a block get a
+// block of their own.
+static download_job_t *create_job(job_block_t **current, const curly_tsv_line_t *line) {
+    size_t size = sizeof(download_job_t) + line->url_length + 1 + line->destination_length + 1;
+    size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    
+    job_block_t *block = *current;
+    if (!block || block->size - block->used < size) {
+        size_t capacity = JOB_BLOCK_SIZE - sizeof(job_block_t);
+        if (capacity < size) {
+            capacity = size;
+        }
+        job_block_t *fresh = (job_block_t *)malloc(sizeof(job_block_t) + capacity);
+        if (!fresh) {
+            return NULL;
+        }
+        fresh->refs = 1;
+        fresh->used = 0;
+        fresh->size = capacity;
+        if (block) {
+            release_block(block);
+        }
+        *current = block = fresh;
+    }
+    
+    download_job_t *job = (download_job_t *)(block->data + block->used);
+    block->used += size;
+    __atomic_add_fetch(&block->refs, 1, __ATOMIC_RELAXED);
+    
+    job->block = block;
+    job->followers = NULL;
+    job->next_url = NULL;
+    job->url = job->data;
+    job->destination = job->data + line->url_length + 1;
+    memcpy(job->url, line->url, line->url_length);
+    job->url[line->url_length] = '\0';
+    memcpy(job->destination, line->destination, line->destination_length);
+    job->destination[line->destination_length] = '\0';
+    return job;
+}
+
+// Destroy job queue, freeing any jobs left in it
+static void destroy_job_queue(curly_queue_t *queue) {
+    void *item;
+    while (curly_queue_try_pop(queue, &item, 1) == 1) {
+        download_job_t *job = (download_job_t *)item;
+        while (job->followers) {
+            download_job_t *follower = job->followers;
+            job->followers = follower->next;
+            release_job(follower);
+        }
+        release_job(job);
+    }
+    
+    curly_queue_destroy(queue);
+}
+
+// Extract the lowercased "host[:port]" of a URL into key
+static void url_host(const char *url, char *key, size_t size) {
+    const char *start = strstr(url, "://");
+    start = start ? start + 3 : url;
+    const char *end = start + strcspn(start, "/?#");
+    
+    // Skip any user info
+    for (const char *p = start; p < end; p++) {
+        if (*p == '@') {
+            start = p + 1;
+        }
+    }
+    
+    size_t length = (size_t)(end - start);
+    if (length >= size) {
+        length = size - 1;
+    }
+    for (size_t i = 0; i < length; i++) {
+        key[i] = (char)tolower((unsigned char)start[i]);
+    }
+    key[length] = '\0';
+}
+
+// FNV-1a hash of a host name or URL
+static size_t hash_string(const char *name) {
+    uint64_t hash = 14695981039346656037ULL;
+    while (*name) {
+        hash ^= (unsigned char)*name++;
+        hash *= 1099511628211ULL;
+    }
+    return (size_t)hash;
+}
+
+// Find the slot holding a host, or the empty slot where it belongs
+static download_host_t **find_host_slot(download_host_t **slots, size_t slot_count, const char *name) {
+    size_t index = hash_string(name) & (slot_count - 1);
+    while (slots[index] && strcmp(slots[index]->name, name) != 0) {
+        index = (index + 1) & (slot_count - 1);
+    }
+    return &slots[index];
+}
+
+static int init_host_table(host_table_t *table) {
+    memset(table, 0, sizeof(host_table_t));
+    table->slot_count = HOST_TABLE_INITIAL_SLOTS;
+    table->slots = (download_host_t **)calloc(table->slot_count, sizeof(download_host_t *));
+    if (!table->slots) {
+        return -1;
+    }
+    
+    if (pthread_mutex_init(&table->mutex, NULL) != 0) {
+        free(table->slots);
+        return -1;
+    }
+    return 0;
+}
+
+static void destroy_host_table(host_table_t *table) {
+    for (size_t i = 0; i < table->slot_count; i++) {
+        if (table->slots[i]) {
+            free(table->slots[i]->lanes);
+            free(table->slots[i]);
+        }
+    }
+    free(table->slots);
+    pthread_mutex_destroy(&table->mutex);
+}
+
+// Double the table once it is more than half full
+static int grow_host_table(host_table_t *table) {
+    size_t slot_count = table->slot_count * 2;
+    download_host_t **slots = (download_host_t **)calloc(slot_count, sizeof(download_host_t *));
+    if (!slots) {
+        return -1;
+    }
+    
+    for (size_t i = 0; i < table->slot_count; i++) {
+        if (table->slots[i]) {
+            *find_host_slot(slots, slot_count, table->slots[i]->name) = table->slots[i];
+        }
+    }
+    
+    free(table->slots);
+    table->slots = slots;
+    table->slot_count = slot_count;
+    return 0;
+}
+
+static int init_url_table(url_table_t *table) {
+    memset(table, 0, sizeof(url_table_t));
+    table->bucket_count = URL_TABLE_INITIAL_BUCKETS;
+    table->buckets = (download_job_t **)calloc(table->bucket_count, sizeof(download_job_t *));
+    if (!table->buckets) {
+        return -1;
+    }
+    
+    if (pthread_mutex_init(&table->mutex, NULL) != 0) {
+        free(table->buckets);
+        return -1;
+    }
+    return 0;
+}
+
+// The jobs themselves belong to the queue, the loops or the reporter
+static void destroy_url_table(url_table_t *table) {
+    free(table->buckets);
+    pthread_mutex_destroy(&table->mutex);
+}
+
+// Double the buckets once there are more jobs than buckets
+static void grow_url_table(url_table_t *table) {
+    size_t bucket_count = table->bucket_count * 2;
+    download_job_t **buckets = (download_job_t **)calloc(bucket_count, sizeof(download_job_t *));
+    if (!buckets) {
+        return; // Longer chains still work
+    }
+    
+    for (size_t i = 0; i < table->bucket_count; i++) {
+        download_job_t *job = table->buckets[i];
+        while (job) {
+            download_job_t *next = job->next_url;
+            download_job_t **bucket = &buckets[job->url_hash & (bucket_count - 1)];
+            job->next_url = *bucket;
+            *bucket = job;
+            job = next;
+        }
+    }
+    
+    free(table->buckets);
+    table->buckets = buckets;
+    table->bucket_count = bucket_count;
+}
+
+// Attach a new job to the job already fetching its URL and return 1, or
+// register it as the one fetching the URL and return 0
+static int claim_url(parallel_engine_t *engine, download_job_t *job) {
+    url_table_t *table = &engine->urls;
+    job->url_hash = hash_string(job->url);
+    
+    pthread_mutex_lock(&table->mutex);
+    download_job_t **bucket = &table->buckets[job->url_hash & (table->bucket_count - 1)];
+    for (download_job_t *fetching = *bucket; fetching; fetching = fetching->next_url) {
+        if (fetching->url_hash == job->url_hash && strcmp(fetching->url, job->url) == 0) {
+            job->next = fetching->followers;
+            fetching->followers = job;
+            pthread_mutex_unlock(&table->mutex);
+            return 1;
+        }
+    }
+    
+    job->next_url = *bucket;
+    *bucket = job;
+    if (++table->job_count > table->bucket_count) {
+        grow_url_table(table);
+    }
+    pthread_mutex_unlock(&table->mutex);
+    return 0;
+}
+
+// Take a finished job out of the URL table so no more lines join it, and
+// return the ones that did
+static download_job_t *take_followers(parallel_engine_t *engine, download_job_t *job) {
+    if (engine->dedup == CURLY_DEDUP_OFF) {
+        return NULL;
+    }
+    
+    url_table_t *table = &engine->urls;
+    pthread_mutex_lock(&table->mutex);
+    download_job_t **link = &table->buckets[job->url_hash & (table->bucket_count - 1)];
+    while (*link && *link != job) {
+        link = &(*link)->next_url;
+    }
+    if (*link) {
+        *link = job->next_url;
+        table->job_count--;
+    }
+    download_job_t *followers = job->followers;
+    job->followers = NULL;
+    pthread_mutex_unlock(&table->mutex);
+    return followers;
+}
+
+// Find or add the host a job's URL points at. Returns NULL only when out of
+// memory, in which case the job is not subject to a per-host limit.
+static download_host_t *lookup_host(download_loop_t *dl, const char *url) {
+    char name[MAX_HOST_KEY_LENGTH];
+    url_host(url, name, sizeof(name));
+    
+    // Inputs are often grouped by host, so try the last one first
+    if (dl->last_host && strcmp(dl->last_host->name, name) == 0) {
+        return dl->last_host;
+    }
+    
+    parallel_engine_t *engine = dl->engine;
+    host_table_t *table = &engine->hosts;
+    pthread_mutex_lock(&table->mutex);
+    
+    download_host_t **slot = find_host_slot(table->slots, table->slot_count, name);
+    download_host_t *host = *slot;
+    
+    if (!host && ((table->host_count + 1) * 2 <= table->slot_count || grow_host_table(table) == 0)) {
+        size_t name_len = strlen(name) + 1;
+        host = (download_host_t *)calloc(1, sizeof(download_host_t) + name_len);
+        if (host) {
+            host->lanes = (host_lane_t *)calloc(engine->lane_count, sizeof(host_lane_t));
+            if (!host->lanes) {
+                free(host);
+                host = NULL;
+            }
+        }
+        
+        if (host) {
+            memcpy(host->name, name, name_len);
+            curly_rate_bucket_init(&host->byte_rate, (double)engine->rate_limit.host_bytes_per_sec,
+                                   engine->rate_limit.burst_ms);
+            curly_rate_bucket_init(&host->request_rate, engine->rate_limit.host_requests_per_sec,
+                                   engine->rate_limit.burst_ms);
+            for (int i = 0; i < engine->lane_count; i++) {
+                host->lanes[i].host = host;
+            }
+            if (engine->resolver) {
+                host->resolve = curly_resolver_find(engine->resolver, url);
+            }
+            *find_host_slot(table->slots, table->slot_count, name) = host;
+            table->host_count++;
+        }
+    }
+    
+    pthread_mutex_unlock(&table->mutex);
+    
+    if (host) {
+        dl->last_host = host;
+    }
+    return host;
+}
+
+// Take one of a host's transfer slots. Returns non-zero on success.
+static int acquire_host_slot(parallel_engine_t *engine, download_host_t *host) {
+    if (!host) {
+        return 1;
+    }
+    
+    int in_flight = __atomic_load_n(&host->in_flight, __ATOMIC_SEQ_CST);
+    do {
+        if (in_flight >= engine->max_per_host) {
+            return 0;
+        }
+    } while (!__atomic_compare_exchange_n(&host->in_flight, &in_flight, in_flight + 1, 1,
+                                          __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+    return 1;
+}
+
+// Take a host slot for a loop, asking to be woken when one frees up if none
+// is available. Returns non-zero on success.
+static int acquire_host_slot_or_wait(download_loop_t *dl, download_host_t *host) {
+    if (acquire_host_slot(dl->engine, host)) {
+        return 1;
+    }
+    
+    // Flag the loop, then check again so a slot released meanwhile is not missed
+    __atomic_or_fetch(&host->waiters, (uint64_t)1 << dl->index, __ATOMIC_SEQ_CST);
+    return acquire_host_slot(dl->engine, host);
+}
+
+// Give a host slot back and wake the loops waiting for one
+static void release_host_slot(parallel_engine_t *engine, download_host_t *host) {
+    if (!host) {
+        return;
+    }
+    
+    __atomic_sub_fetch(&host->in_flight, 1, __ATOMIC_SEQ_CST);
+    
+    if (__atomic_load_n(&host->waiters, __ATOMIC_SEQ_CST)) {
+        uint64_t waiters = __atomic_exchange_n(&host->waiters, 0, __ATOMIC_SEQ_CST);
+        for (int i = 0; i < engine->lane_count; i++) {
+            if (waiters & ((uint64_t)1 << i)) {
+                curly_loop_wake(engine->loops[i].loop);
+            }
+        }
+    }
+}
+
+// How long a host's transfers must stop receiving to keep within the
+// bandwidth limits, in milliseconds
+static long byte_delay(parallel_engine_t *engine, download_host_t *host, long long now) {
+    long delay = curly_rate_bucket_delay(&engine->byte_rate, now);
+    if (host) {
+        long host_delay = curly_rate_bucket_delay(&host->byte_rate, now);
+        if (host_delay > delay) {
+            delay = host_delay;
+        }
+    }
+    return delay;
+}
+
+// Charge received bytes to the bandwidth limits
+static void take_bytes(parallel_engine_t *engine, download_host_t *host, size_t bytes, long long now) {
+    curly_rate_bucket_take(&engine->byte_rate, (double)bytes, now);
+    if (host) {
+        curly_rate_bucket_take(&host->byte_rate, (double)bytes, now);
+    }
+}
+
+// How long a new request to a host must wait to keep within the request
+// rates, in milliseconds. With no host only the overall rate counts.
+static long request_delay(parallel_engine_t *engine, download_host_t *host, long long now) {
+    long delay = curly_rate_bucket_delay(&engine->request_rate, now);
+    if (host) {
+        long host_delay = curly_rate_bucket_delay(&host->request_rate, now);
+        if (host_delay > delay) {
+            delay = host_delay;
+        }
+    }
+    return delay;
+}
+
+// Charge a new request to the request rates
+static void take_request(parallel_engine_t *engine, download_host_t *host, long long now) {
+    curly_rate_bucket_take(&engine->request_rate, 1, now);
+    if (host) {
+        curly_rate_bucket_take(&host->request_rate, 1, now);
+    }
+}
+
+// Timer callback: held-back jobs may be tried again. Firing is what wakes
+// the loop, whose next pass does the rest.
+static void open_request_gate(curly_loop_t *loop, void *arg) {
+    download_loop_t *dl = (download_loop_t *)arg;
+    (void)loop;
+    dl->gate_due_ns = 0;
+}
+
+// Check whether a request to a host may start now under the request rates.
+// If not, a timer brings the loop back once it may.
+static int request_allowed(download_loop_t *dl, download_host_t *host) {
+    parallel_engine_t *engine = dl->engine;
+    if (!engine->shape_requests) {
+        return 1;
+    }
+    
+    long long now = curly_rate_now_ns();
+    long delay = request_delay(engine, host, now);
+    if (delay == 0) {
+        return 1;
+    }
+    
+    // One timer per loop is enough, unless this wait ends sooner
+    long long due = now + (long long)delay * 1000000;
+    if ((!dl->gate_due_ns || due < dl->gate_due_ns) &&
+        curly_loop_add_timer(dl->loop, delay, open_request_gate, dl) == 0) {
+        dl->gate_due_ns = due;
+    }
+    return 0;
+}
+
+// Callback function for writing data to a file
+static size_t write_file_callback(void *ptr, size_t size, size_t nmemb, void *stream) {
+    FILE *file = (FILE *)stream;
+    return fwrite(ptr, size, nmemb, file);
+}
+
+// Create the destination's directory and open a temporary file next to
+// it, renamed over the destination once the download is complete
+static FILE *open_destination(curly_output_t *output, const char *destination, curly_output_file_t *target) {
+    int fd = curly_output_open(output, destination, 0, 0, target);
+    if (fd < 0) {
+        return NULL;
+    }
+    
+    FILE *file = fdopen(fd, "wb");
+    if (!file) {
+        close(fd);
+        curly_output_discard(output, target, 1);
+    }
+    return file;
+}
+
+// Set the curl options shared by every file download
+static void setup_download_handle(CURL *curl, const char *url) {
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+}
+
+// Download a file from URL to destination
+curly_error_t curly_download_file(const char *url, const char *destination) {
+    if (!url || !destination) {
+        return CURLY_ERROR_INVALID_JSON;
+    }
+    
+    // Make sure the directory exists and open a file next to the destination
+    curly_output_t *output = curly_output_create(CURLY_FSYNC_NONE, 0);
+    if (!output) {
+        return CURLY_ERROR_MEMORY_ALLOCATION;
+    }
+    curly_output_file_t target;
+    FILE *file = open_destination(output, destination, &target);
+    if (!file) {
+        curly_output_destroy(output);
+        return CURLY_ERROR_FILE_OPEN;
+    }
+    
+    // Initialize curl
+    CURL *curl = curl_easy_init();
+    if (!curl) {
+        fclose(file);
+        curly_output_discard(output, &target, 1);
+        curly_output_destroy(output);
+        return CURLY_ERROR_CURL_INIT;
+    }
+    
+    setup_download_handle(curl, url);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_file_callback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, file);
+    
+    curly_retry_policy_t policy;
+    curly_retry_policy_init(&policy);
+    policy.max_attempts = DEFAULT_RETRIES + 1;
+    policy.delay_ms = DEFAULT_RETRY_DELAY_MS;
+    
+    // Perform the request, starting over after transient failures
+    CURLcode res;
+    for (int attempt = 1; ; attempt++) {
+        res = curl_easy_perform(curl);
+        if (res == CURLE_OK) {
+            break;
+        }
+        
+        long delay = curly_retry_next(&policy, NULL, curl, res, attempt);
+        if (delay < 0 || fflush(file) != 0 || ftruncate(fileno(file), 0) != 0) {
+            break;
+        }
+        rewind(file);
+        curly_retry_sleep(delay);
+    }
+    
+    // Clean up
+    curl_easy_cleanup(curl);
+    curly_error_t result = CURLY_OK;
+    if (fclose(file) != 0) {
+        result = CURLY_ERROR_FILE_WRITE;
+    }
+    if (res != CURLE_OK) {
+        result = CURLY_ERROR_CURL_PERFORM;
+    }
+    
+    // Only a complete file replaces the destination
+    if (result != CURLY_OK) {
+        curly_output_discard(output, &target, 1);
+    } else if (curly_output_commit(output, &target) != 0) {
+        result = CURLY_ERROR_FILE_WRITE;
+    }
+    curly_output_destroy(output);
+    
+    return result;
+}
+
+// Work out how many ranges a response may be split into, 1 if it should not be
+static int segment_count(CURL *curl, int segments, curl_off_t min_segment_size, curl_off_t *length) {
+    long status = 0;
+    curl_off_t size = -1;
+    struct curl_header *header;
+    
+    if (segments <= 1) {
+        return 1;
+    }
+    
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+    curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &size);
+    if (status != 200 || size <= 0) {
+        return 1;
+    }
+    
+    // Only split when the server says it honours byte ranges
+    if (curl_easy_header(curl, "Accept-Ranges", 0, CURLH_HEADER, -1, &header) != CURLHE_OK ||
+        strcasecmp(header->value, "bytes") != 0) {
+        return 1;
+    }
+    
+    curl_off_t count = size / (min_segment_size > 0 ? min_segment_size : 1);
+    if (count > segments) {
+        count = segments;
+    }
+    
+    *length = size;
+    return count > 1 ? (int)count : 1;
+}
+
+// Byte range [start, end) of one of count segments
+static void segment_range(curl_off_t length, int count, int index, curl_off_t *start, curl_off_t *end) {
+    curl_off_t size = length / count;
+    *start = size * index;
+    *end = (index == count - 1) ? length : *start + size;
+}
+
+// Ask for the byte range [start, end) only
+static void set_segment_range(CURL *curl, curl_off_t start, curl_off_t end) {
+    char range[64];
+    snprintf(range, sizeof(range), "%" CURL_FORMAT_CURL_OFF_T "-%" CURL_FORMAT_CURL_OFF_T, start, end - 1);
+    curl_easy_setopt(curl, CURLOPT_RANGE, range);
+}
+
+// Check that a ranged request got a partial response rather than the whole body
+static int range_accepted(CURL *curl) {
+    long status = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+    return status == 206;
+}
+
+// One range of a blocking segmented download
+typedef struct {
+    CURL *curl;
+    int fd;
+    curl_off_t offset;  // Next file offset to write
+    curl_off_t end;
+    curl_off_t skip;  // Bytes of a whole body to drop before the range starts
+    int started;
+    int range_done;   // Set when the body was cut off at the end of the range
+} file_segment_t;
+
+// Callback writing a range straight to its offset in the file
+static size_t segment_write_callback(char *ptr, size_t size, size_t nmemb, void *userdata) {
+    file_segment_t *segment = (file_segment_t *)userdata;
+    size_t realsize = size * nmemb;
+    size_t written = 0;
+    
+    // A server that ignores the range sends the whole body instead, of
+    // which only the range is kept
+    if (!segment->started) {
+        segment->started = 1;
+        if (!range_accepted(segment->curl)) {
+            segment->skip = segment->offset;
+        }
+    }
+    
+    size_t dropped = segment->skip < (curl_off_t)realsize ? (size_t)segment->skip : realsize;
+    segment->skip -= (curl_off_t)dropped;
+    ptr += dropped;
+    
+    // Stop at the end of the range
+    size_t wanted = realsize - dropped;
+    if ((curl_off_t)wanted > segment->end - segment->offset) {
+        wanted = (size_t)(segment->end - segment->offset);
+        segment->range_done = 1;
+    }
+    
+    while (written < wanted) {
+        ssize_t result = pwrite(segment->fd, ptr + written, wanted - written, (off_t)(segment->offset + written));
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 0;
+        }
+        written += (size_t)result;
+    }
+    
+    // Returning short makes libcurl abort the transfer
+    segment->offset += (curl_off_t)wanted;
+    return dropped + wanted;
+}
+
+// Add one handle per range to the multi handle and run them to completion
+static curly_error_t run_segments(CURLM *multi, CURL **handles, file_segment_t *segments, int count,
+                                  const char *url, int fd, curl_off_t length) {
+    for (int i = 0; i < count; i++) {
+        handles[i] = curl_easy_init();
+        if (!handles[i]) {
+            return CURLY_ERROR_CURL_INIT;
+        }
+        
+        segments[i].curl = handles[i];
+        segments[i].fd = fd;
+        segment_range(length, count, i, &segments[i].offset, &segments[i].end);
+        
+        setup_download_handle(handles[i], url);
+        set_segment_range(handles[i], segments[i].offset, segments[i].end);
+        curl_easy_setopt(handles[i], CURLOPT_WRITEFUNCTION, segment_write_callback);
+        curl_easy_setopt(handles[i], CURLOPT_WRITEDATA, &segments[i]);
+        curl_easy_setopt(handles[i], CURLOPT_PRIVATE, &segments[i]);
+        if (curl_multi_add_handle(multi, handles[i]) != CURLM_OK) {
+            return CURLY_ERROR_CURL_INIT;
+        }
+    }
+    
+    int running = 1;
+    while (running) {
+        if (curl_multi_perform(multi, &running) != CURLM_OK) {
+            return CURLY_ERROR_CURL_PERFORM;
+        }
+        if (running && curl_multi_poll(multi, NULL, 0, 1000, NULL) != CURLM_OK) {
+            return CURLY_ERROR_CURL_PERFORM;
+        }
+    }
+    
+    CURLMsg *msg;
+    int pending;
+    while ((msg = curl_multi_info_read(multi, &pending)) != NULL) {
+        if (msg->msg != CURLMSG_DONE || msg->data.result == CURLE_OK) {
+            continue;
+        }
+        
+        // A segment cut off at the end of its range has its part
+        file_segment_t *segment = NULL;
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&segment);
+        if (msg->data.result != CURLE_WRITE_ERROR || !segment || !segment->range_done) {
+            return CURLY_ERROR_CURL_PERFORM;
+        }
+    }
+    
+    // Every range must have arrived in full
+    for (int i = 0; i < count; i++) {
+        if (segments[i].offset != segments[i].end) {
+            return CURLY_ERROR_CURL_PERFORM;
+        }
+    }
+    
+    return CURLY_OK;
+}
+
+// Fetch count ranges of url concurrently into destination
+static curly_error_t download_segments(const char *url, const char *destination, curl_off_t length, int count) {
+    curly_output_t *output = curly_output_create(CURLY_FSYNC_NONE, 0);
+    if (!output) {
+        return CURLY_ERROR_MEMORY_ALLOCATION;
+    }
+    
+    curly_output_file_t target;
+    int fd = curly_output_open(output, destination, 0, 0, &target);
+    if (fd < 0) {
+        curly_output_destroy(output);
+        return CURLY_ERROR_FILE_OPEN;
+    }
+    
+    CURLM *multi = curl_multi_init();
+    CURL **handles = (CURL **)calloc(count, sizeof(CURL *));
+    file_segment_t *segments = (file_segment_t *)calloc(count, sizeof(file_segment_t));
+    
+    curly_error_t result;
+    if (!multi) {
+        result = CURLY_ERROR_CURL_INIT;
+    } else if (!handles || !segments) {
+        result = CURLY_ERROR_MEMORY_ALLOCATION;
+    } else {
+        result = run_segments(multi, handles, segments, count, url, fd, length);
+    }
+    
+    // Clean up
+    for (int i = 0; handles && i < count && handles[i]; i++) {
+        curl_multi_remove_handle(multi, handles[i]);
+        curl_easy_cleanup(handles[i]);
+    }
+    curl_multi_cleanup(multi);
+    free(handles);
+    free(segments);
+    
+    if (close(fd) != 0 && result == CURLY_OK) {
+        result = CURLY_ERROR_FILE_WRITE;
+    }
+    
+    // Only a complete file replaces the destination
+    if (result != CURLY_OK) {
+        curly_output_discard(output, &target, 1);
+    } else if (curly_output_commit(output, &target) != 0) {
+        result = CURLY_ERROR_FILE_WRITE;
+    }
+    curly_output_destroy(output);
+    
+    return result;
+}
+
+curly_error_t curly_download_file_ex(const char *url, const char *destination, int segments, curl_off_t min_segment_size) {
+    if (!url || !destination) {
+        return CURLY_ERROR_INVALID_JSON;
+    }
+    
+    if (segments <= 1) {
+        return curly_download_file(url, destination);
+    }
+    if (segments > MAX_SEGMENTS) {
+        segments = MAX_SEGMENTS;
+    }
+    
+    // Fetch the headers first to find out whether the file can be split
+    CURL *probe = curl_easy_init();
+    if (!probe) {
+        return CURLY_ERROR_CURL_INIT;
+    }
+    
+    setup_download_handle(probe, url);
+    curl_easy_setopt(probe, CURLOPT_NOBODY, 1L);
+    
+    curl_off_t length = 0;
+    int count = 1;
+    char *effective_url = NULL;
+    
+    if (curl_easy_perform(probe) == CURLE_OK) {
+        count = segment_count(probe, segments, min_segment_size, &length);
+        
+        // Skip the redirects when fetching the ranges
+        char *location = NULL;
+        curl_easy_getinfo(probe, CURLINFO_EFFECTIVE_URL, &location);
+        effective_url = location ? strdup(location) : NULL;
+    }
+    curl_easy_cleanup(probe);
+    
+    // Fall back to a single connection when ranges are not an option
+    curly_error_t result;
+    if (count > 1 && effective_url) {
+        result = download_segments(effective_url, destination, length, count);
+    } else {
+        result = curly_download_file(url, destination);
+    }
+    
+    free(effective_url);
+    return result;
+}
+
+// Get the path a file is stored at: its destination plus the extension of
+// a body kept encoded. Returns a heap string, or NULL if out of memory.
+static char *stored_path(const char *destination, const char *suffix) {
+    size_t length = strlen(destination) + strlen(suffix) + 1;
+    char *path = (char *)malloc(length);
+    if (path) {
+        snprintf(path, length, "%s%s", destination, suffix);
+    }
+    return path;
+}
+
+// Hand the outcome of a download to the reporter, which frees the job.
+// Lines that shared the download get a link or copy of the file, or its
+// failure, and the journal entry of a finished file if there is one. A
+// file stored encoded is shared under the same extension.
+static void report_download(parallel_engine_t *engine, int stripe, download_job_t *job, const char *suffix,
+                            curly_result_kind_t kind, curly_error_t result, const curly_journal_entry_t *entry) {
+    download_job_t *follower = take_followers(engine, job);
+    char *source = (follower && suffix) ? stored_path(job->destination, suffix) : NULL;
+    while (follower) {
+        download_job_t *next = follower->next;
+        curly_result_kind_t follower_kind = kind;
+        curly_error_t follower_result = result;
+        
+        curly_reporter_started(engine->reporter, stripe);
+        if (kind != CURLY_RESULT_FAILED) {
+            char *destination = suffix ? stored_path(follower->destination, suffix) : follower->destination;
+            if (!destination || (suffix && !source) ||
+                curly_output_mkdirs(engine->output, destination) != 0 ||
+                curly_dedup_place(source ? source : job->destination, destination, engine->dedup) != 0) {
+                follower_kind = CURLY_RESULT_FAILED;
+                follower_result = CURLY_ERROR_FILE_WRITE;
+            } else {
+                follower_kind = CURLY_RESULT_DOWNLOADED;
+                if (entry && curly_journal_record(engine->journal, follower->destination, entry) != 0) {
+                    fprintf(stderr, "Failed to update journal for %s\n", follower->destination);
+                }
+            }
+            if (destination != follower->destination) {
+                free(destination);
+            }
+        }
+        curly_reporter_result(engine->reporter, stripe, follower_kind, follower_result, follower->url,
+                              follower->destination, follower);
+        follower = next;
+    }
+    free(source);
+    
+    curly_reporter_result(engine->reporter, stripe, kind, result, job->url, job->destination, job);
+}
+
+// Get a transfer with a ready easy handle, reusing a finished one when possible
+static download_transfer_t *acquire_transfer(download_loop_t *dl) {
+    download_transfer_t *xfer = dl->free_transfers;
+    if (xfer) {
+        dl->free_transfers = xfer->next_free;
+        return xfer;
+    }
+    
+    xfer = (download_transfer_t *)malloc(sizeof(download_transfer_t));
+    if (!xfer) {
+        return NULL;
+    }
+    
+    xfer->base.easy = curl_easy_init();
+    if (!xfer->base.easy) {
+        free(xfer);
+        return NULL;
+    }
+    xfer->headers = NULL;
+    curly_share_attach(dl->engine->share, xfer->base.easy);
+    
+    return xfer;
+}
+
+// Return a transfer to the loop's free list. Resetting the handle clears its
+// options but keeps it attached to the share object.
+static void release_transfer(download_loop_t *dl, download_transfer_t *xfer) {
+    curl_easy_reset(xfer->base.easy);
+    curl_slist_free_all(xfer->headers);
+    xfer->headers = NULL;
+    xfer->next_free = dl->free_transfers;
+    dl->free_transfers = xfer;
+}
+
+// Free every pooled transfer and its easy handle
+static void free_transfers(download_loop_t *dl) {
+    while (dl->free_transfers) {
+        download_transfer_t *xfer = dl->free_transfers;
+        dl->free_transfers = xfer->next_free;
+        curl_easy_cleanup(xfer->base.easy);
+        free(xfer);
+    }
+}
+
+static void download_done(curly_loop_transfer_t *base, CURLcode res);
+static size_t download_write_callback(char *ptr, size_t size, size_t nmemb, void *userdata);
+
+// Take a write buffer, asking to be woken if the pool is empty
+static curly_wbuf_t *take_write_buffer(download_loop_t *dl) {
+    curly_writer_t *writer = dl->engine->writer;
+    curly_wbuf_t *buffer = curly_writer_get_buffer(writer);
+    if (buffer) {
+        return buffer;
+    }
+    
+    // Flag the loop, then check again so a buffer returned meanwhile is not missed
+    __atomic_store_n(&dl->starved, 1, __ATOMIC_SEQ_CST);
+    buffer = curly_writer_get_buffer(writer);
+    if (buffer) {
+        __atomic_store_n(&dl->starved, 0, __ATOMIC_SEQ_CST);
+    }
+    return buffer;
+}
+
+// Queue the transfer's current buffer for writing
+static void flush_write_buffer(download_loop_t *dl, download_transfer_t *xfer) {
+    curly_wbuf_t *buffer = xfer->buffer;
+    xfer->buffer = NULL;
+    
+    if (buffer->length == 0) {
+        curly_writer_put_buffer(dl->engine->writer, buffer);
+        return;
+    }
+    
+    xfer->offset += (curl_off_t)buffer->length;
+    curly_writer_submit(dl->engine->writer, &xfer->file->base, buffer, xfer->offset - (curl_off_t)buffer->length);
+}
+
+// Record the first failure among the transfers writing a file
+static void fail_download_file(download_file_t *file, CURLcode res) {
+    if (file->result == CURLE_OK) {
+        file->result = res;
+    }
+}
+
+// Prepare a transfer for a new job or range
+static void init_transfer(download_loop_t *dl, download_transfer_t *xfer, download_file_t *file,
+                          curl_off_t offset, curl_off_t end) {
+    xfer->base.done = download_done;
+    xfer->base.owner = dl;
+    xfer->file = file;
+    xfer->host = NULL;
+    xfer->buffer = NULL;
+    xfer->offset = offset;
+    xfer->end = end;
+    xfer->started = 0;
+    xfer->paused = 0;
+    xfer->range_done = 0;
+    xfer->skip = 0;
+    xfer->primary = (end < 0);
+    xfer->attempts = 1;
+    
+    curl_easy_setopt(xfer->base.easy, CURLOPT_WRITEFUNCTION, download_write_callback);
+    curl_easy_setopt(xfer->base.easy, CURLOPT_WRITEDATA, xfer);
+}
+
+// Split a large download into ranges. The running transfer keeps the first
+// range and the others are fetched over extra connections on the same loop,
+// as far as the host has slots to spare. libcurl refuses new handles from
+// inside its callbacks, so the extra transfers are only queued here and
+// started by the loop thread.
+static void split_download(download_loop_t *dl, download_transfer_t *xfer, curl_off_t length, int count) {
+    char *url = NULL;
+    curl_easy_getinfo(xfer->base.easy, CURLINFO_EFFECTIVE_URL, &url);
+    
+    int slots = 1;
+    while (slots < count && acquire_host_slot(dl->engine, xfer->host)) {
+        slots++;
+    }
+    count = slots;
+    if (count < 2) {
+        return;
+    }
+    
+    curl_off_t start;
+    segment_range(length, count, 0, &start, &xfer->end);
+    xfer->file->split = 1;
+    
+    for (int i = 1; i < count; i++) {
+        curl_off_t end;
+        segment_range(length, count, i, &start, &end);
+        
+        download_transfer_t *segment = acquire_transfer(dl);
+        if (!segment) {
+            // Give back the slots of the ranges that will not start
+            for (; i < count; i++) {
+                release_host_slot(dl->engine, xfer->host);
+            }
+            fail_download_file(xfer->file, CURLE_OUT_OF_MEMORY);
+            return;
+        }
+        
+        curly_wfile_retain(&xfer->file->base);
+        init_transfer(dl, segment, xfer->file, start, end);
+        segment->host = xfer->host;
+        setup_download_handle(segment->base.easy, url);
+        set_segment_range(segment->base.easy, start, end);
+        
+        segment->next_pending = dl->pending;
+        dl->pending = segment;
+        
+        if (dl->engine->shape_requests) {
+            take_request(dl->engine, xfer->host, curly_rate_now_ns());
+        }
+    }
+}
+
+// Add the range transfers queued by split_download() to the loop
+static void start_pending_transfers(download_loop_t *dl) {
+    while (dl->pending) {
+        download_transfer_t *xfer = dl->pending;
+        dl->pending = xfer->next_pending;
+        
+        if (curly_loop_add(dl->loop, &xfer->base) != 0) {
+            download_done(&xfer->base, CURLE_FAILED_INIT);
+        }
+    }
+}
+
+// Let a paused transfer receive again. Data libcurl held back is handed to
+// the write callback right away, and libcurl leaves it to us to finish the
+// transfer if the callback ends it there.
+static void resume_transfer(curly_loop_t *loop, download_transfer_t *xfer) {
+    CURLcode res = curl_easy_pause(xfer->base.easy, CURLPAUSE_CONT);
+    if (res != CURLE_OK) {
+        curly_loop_finish(loop, &xfer->base, res);
+    }
+}
+
+// Timer callback: a transfer held back by a bandwidth limit may receive again
+static void resume_throttled_transfer(curly_loop_t *loop, void *arg) {
+    download_transfer_t *xfer = (download_transfer_t *)arg;
+    
+    // The transfer may have finished, or even been reused, in the meantime;
+    // an early resume only costs another look at the limits
+    if (xfer->throttled) {
+        xfer->throttled = 0;
+        resume_transfer(loop, xfer);
+    }
+}
+
+// Note the content coding of a fresh response. A body libcurl decodes has
+// its own size and no byte ranges to resume or split by; one kept as sent
+// is committed under its coding's extension.
+static void note_encoding(parallel_engine_t *engine, download_file_t *file, CURL *curl) {
+    struct curl_header *header;
+    const char *value = NULL;
+    if (curl_easy_header(curl, "Content-Encoding", 0, CURLH_HEADER, -1, &header) == CURLHE_OK) {
+        value = header->value;
+    }
+    
+    int encoded = curly_encoding_suffix(value, file->suffix, sizeof(file->suffix));
+    file->encoded = encoded != 0;
+    if (!engine->keep_encoded || encoded < 0) {
+        file->suffix[0] = '\0';
+    }
+    file->target.suffix = file->suffix[0] ? file->suffix : NULL;
+}
+
+// Callback copying received data into write buffers. It never blocks: if
+// the pool cannot hold the whole chunk, or the data runs ahead of the
+// bandwidth limits, the transfer is paused instead.
+static size_t download_write_callback(char *ptr, size_t size, size_t nmemb, void *userdata) {
+    download_transfer_t *xfer = (download_transfer_t *)userdata;
+    download_loop_t *dl = (download_loop_t *)xfer->base.owner;
+    parallel_engine_t *engine = dl->engine;
+    curly_writer_t *writer = engine->writer;
+    size_t realsize = size * nmemb;
+    
+    // Abort the transfer once the disk has failed us
+    if (curly_wfile_error(&xfer->file->base)) {
+        return 0;
+    }
+    
+    // Over a bandwidth limit, pause until a loop timer says the data may come
+    long long now = 0;
+    if (engine->shape_bytes) {
+        now = curly_rate_now_ns();
+        long delay = byte_delay(engine, xfer->host, now);
+        if (delay > 0 && curly_loop_add_timer(dl->loop, delay, resume_throttled_transfer, xfer) == 0) {
+            xfer->throttled = 1;
+            return CURL_WRITEFUNC_PAUSE;
+        }
+    }
+    
+    if (!xfer->started) {
+        xfer->started = 1;
+        
+        if (!xfer->primary) {
+            // A server that ignores the range sends the whole body instead,
+            // of which only the range is kept. Continuing with If-Range, a
+            // whole body means the file has changed since it was split.
+            if (!range_accepted(xfer->base.easy)) {
+                if (xfer->headers) {
+                    return 0;
+                }
+                xfer->skip = xfer->offset;
+            }
+        } else {
+            download_file_t *file = xfer->file;
+            
+            // Unless the server continues where an earlier run or attempt
+            // stopped, a full body replaces whatever the file held
+            if (file->resume_from == 0 || !range_accepted(xfer->base.easy)) {
+                if ((!file->touched || file->resume_from > 0) && curly_wfile_truncate(&file->base) != 0) {
+                    return 0;
+                }
+                xfer->offset = 0;
+                file->resume_from = 0;
+            }
+            file->touched = 1;
+            
+            // Only a body from the start was asked for in a coding
+            if (xfer->offset == 0 && engine->accept_encoding) {
+                note_encoding(engine, file, xfer->base.easy);
+            }
+            int decoded = file->encoded && !engine->keep_encoded;
+            
+            // Reserve the space up front when the size is known
+            curl_off_t length = -1;
+            curl_easy_getinfo(xfer->base.easy, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+            if (length > WRITE_BUFFER_SIZE && !decoded) {
+                curly_writer_preallocate(writer, &file->base, xfer->offset + length);
+            }
+            
+            // A coded body comes over one connection
+            int count = file->encoded ? 1 :
+                        segment_count(xfer->base.easy, engine->segments, engine->min_segment_size, &length);
+            if (count > 1) {
+                split_download(dl, xfer, length, count);
+            }
+        }
+    }
+    
+    // Drop what comes before the range, taking it off skip only once the
+    // chunk is accepted since a paused chunk is delivered again
+    size_t dropped = xfer->skip < (curl_off_t)realsize ? (size_t)xfer->skip : realsize;
+    ptr += dropped;
+    
+    // Stop at the end of this transfer's range
+    size_t wanted = realsize - dropped;
+    if (xfer->end >= 0) {
+        curl_off_t remaining = xfer->end - xfer->offset - (xfer->buffer ? (curl_off_t)xfer->buffer->length : 0);
+        if ((curl_off_t)wanted > remaining) {
+            wanted = (size_t)remaining;
+        }
+    }
+    
+    // Reserve every buffer the chunk needs so it is taken whole or not at all
+    curly_wbuf_t *spare = NULL;
+    curly_wbuf_t **spare_tail = &spare;
+    size_t room = xfer->buffer ? xfer->buffer->capacity - xfer->buffer->length : 0;
+    
+    while (room < wanted) {
+        curly_wbuf_t *buffer = take_write_buffer(dl);
+        if (!buffer) {
+            while (spare) {
+                curly_wbuf_t *next = spare->next;
+                curly_writer_put_buffer(writer, spare);
+                spare = next;
+            }
+            
+            // Don't sit on a partly filled buffer while others wait for one
+            if (xfer->buffer) {
+                flush_write_buffer(dl, xfer);
+            }
+            
+            if (!xfer->paused) {
+                xfer->paused = 1;
+                xfer->next_paused = dl->paused;
+                dl->paused = xfer;
+            }
+            return CURL_WRITEFUNC_PAUSE;
+        }
+        
+        *spare_tail = buffer;
+        spare_tail = &buffer->next;
+        room += buffer->capacity;
+    }
+    
+    // Fill the current buffer, queueing each one as it fills up
+    size_t copied = 0;
+    while (copied < wanted) {
+        if (!xfer->buffer) {
+            xfer->buffer = spare;
+            spare = spare->next;
+            xfer->buffer->next = NULL;
+        }
+        
+        curly_wbuf_t *buffer = xfer->buffer;
+        size_t chunk = buffer->capacity - buffer->length;
+        if (chunk > wanted - copied) {
+            chunk = wanted - copied;
+        }
+        memcpy(buffer->data + buffer->length, ptr + copied, chunk);
+        buffer->length += chunk;
+        copied += chunk;
+        
+        if (buffer->length == buffer->capacity) {
+            flush_write_buffer(dl, xfer);
+        }
+    }
+    
+    xfer->skip -= (curl_off_t)dropped;
+    if (engine->shape_bytes) {
+        take_bytes(engine, xfer->host, dropped + wanted, now);
+    }
+    curly_reporter_bytes(engine->reporter, dl->index, wanted);
+    
+    // Returning short makes libcurl abort the transfer, which done() expects
+    if (dropped + wanted < realsize) {
+        xfer->range_done = 1;
+    }
+    return dropped + wanted;
+}
+
+// Resume paused transfers once the writer has returned buffers
+static void resume_paused_transfers(download_loop_t *dl) {
+    if (!dl->paused || __atomic_load_n(&dl->starved, __ATOMIC_SEQ_CST)) {
+        return;
+    }
+    
+    // Transfers that pause again re-add themselves to the list
+    download_transfer_t *xfer = dl->paused;
+    dl->paused = NULL;
+    
+    while (xfer) {
+        download_transfer_t *next = xfer->next_paused;
+        xfer->paused = 0;
+        resume_transfer(dl->loop, xfer);
+        xfer = next;
+    }
+}
+
+// Writer callback: wake loops whose transfers wait for buffers
+static void notify_starved_loops(void *arg) {
+    parallel_engine_t *engine = (parallel_engine_t *)arg;
+    
+    for (int i = 0; i < engine->loop_count; i++) {
+        download_loop_t *dl = &engine->loops[i];
+        if (__atomic_load_n(&dl->starved, __ATOMIC_SEQ_CST) &&
+            __atomic_exchange_n(&dl->starved, 0, __ATOMIC_SEQ_CST)) {
+            curly_loop_wake(dl->loop);
+        }
+    }
+}
+
+// Size of a file on disk, -1 if it cannot be read
+static curl_off_t file_size(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? (curl_off_t)st.st_size : -1;
+}
+
+// Record a finished or partial file in the journal. A complete file stored
+// under an extension is recorded under its destination, with the extension.
+static void journal_download(download_file_t *file, const char *path, curly_journal_state_t state, curl_off_t size,
+                             const char *suffix, curly_journal_entry_t *recorded) {
+    curly_journal_entry_t entry;
+    entry.state = state;
+    entry.size = size;
+    entry.etag = file->etag;
+    entry.last_modified = file->last_modified;
+    entry.suffix = suffix;
+    if (recorded) {
+        *recorded = entry;
+    }
+    
+    if (curly_journal_record(file->engine->journal, path, &entry) != 0) {
+        fprintf(stderr, "Failed to update journal for %s\n", path);
+    }
+}
+
+// Journal and report a file committed to its destination, then free it
+static void finish_download(download_file_t *file) {
+    // A body kept encoded was committed under its coding's extension
+    const char *suffix = file->suffix[0] ? file->suffix : NULL;
+    char *stored = suffix ? stored_path(file->job->destination, suffix) : NULL;
+    const char *path = stored ? stored : file->job->destination;
+    
+    curly_journal_entry_t entry;
+    curly_journal_t *journal = file->engine->journal;
+    if (journal) {
+        journal_download(file, file->job->destination, CURLY_JOURNAL_COMPLETE, file_size(path), suffix, &entry);
+    }
+    report_download(file->engine, file->stripe, file->job, suffix, CURLY_RESULT_DOWNLOADED, CURLY_OK,
+                    journal ? &entry : NULL);
+    free(stored);
+    
+    free(file->etag);
+    free(file->last_modified);
+    free(file);
+}
+
+// Store callback: a finished file has been added to the store
+static void download_file_stored(const char *path, int result, void *arg) {
+    if (result != 0) {
+        fprintf(stderr, "Failed to add %s to the store\n", path);
+    }
+    finish_download((download_file_t *)arg);
+}
+
+// Writer callback: the file has been closed. A finished file replaces its
+// destination; otherwise the destination keeps what it held before.
+static void download_file_complete(curly_wfile_t *base) {
+    download_file_t *file = (download_file_t *)base;
+    curly_journal_t *journal = file->engine->journal;
+    curly_output_t *output = file->engine->output;
+    curly_error_t result = CURLY_OK;
+    
+    if (curly_wfile_error(base)) {
+        result = CURLY_ERROR_FILE_WRITE;
+    } else if (file->result != CURLE_OK) {
+        result = CURLY_ERROR_CURL_PERFORM;
+    }
+    
+    if (result == CURLY_OK && file->unchanged) {
+        curly_output_discard(output, &file->target, 0);
+        report_download(file->engine, file->stripe, file->job, NULL, CURLY_RESULT_UNCHANGED, result, NULL);
+    } else if (result == CURLY_OK && curly_output_commit(output, &file->target) != 0) {
+        report_download(file->engine, file->stripe, file->job, NULL, CURLY_RESULT_FAILED, CURLY_ERROR_FILE_WRITE, NULL);
+    } else if (result == CURLY_OK) {
+        // Identical content fetched before is kept once. Hashing a file takes
+        // a while, so the store does it on its own thread and the download is
+        // finished from there, before lines sharing it get their copies.
+        curly_store_t *store = file->engine->store;
+        if (store) {
+            char *path = stored_path(file->job->destination, file->suffix);
+            int submitted = path && curly_store_submit(store, path, download_file_stored, file) == 0;
+            if (!submitted) {
+                fprintf(stderr, "Failed to add %s to the store\n", path ? path : file->job->destination);
+            }
+            free(path);
+            if (submitted) {
+                return;
+            }
+        }
+        finish_download(file);
+        return;
+    } else {
+        if (!file->touched) {
+            // Nothing was written, so what an earlier run left is still valid
+            curly_output_discard(output, &file->target, 0);
+        } else if (journal && result == CURLY_ERROR_CURL_PERFORM && !file->split && !file->encoded &&
+                   !file->conditional && (file->etag || file->last_modified)) {
+            // Keep the received prefix under the side name so the next run
+            // can resume it; the destination keeps what it held. A complete
+            // file being revalidated keeps its journal entry as it was.
+            char *part = stored_path(file->job->destination, CURLY_OUTPUT_PART_SUFFIX);
+            if (!part) {
+                curly_output_discard(output, &file->target, 1);
+            } else if (curly_output_keep_part(output, &file->target) == 0) {
+                curl_off_t size = file_size(part);
+                if (size > 0) {
+                    journal_download(file, part, CURLY_JOURNAL_PARTIAL, size, NULL, NULL);
+                } else {
+                    unlink(part);
+                }
+            }
+            free(part);
+        } else {
+            // If download failed, remove the partially downloaded file
+            curly_output_discard(output, &file->target, 1);
+        }
+        report_download(file->engine, file->stripe, file->job, NULL, CURLY_RESULT_FAILED, result, NULL);
+    }
+    
+    free(file->etag);
+    free(file->last_modified);
+    free(file);
+}
+
+// Add "name: value" to a header list
+static void append_header(struct curl_slist **headers, const char *name, const char *value) {
+    size_t length = strlen(name) + strlen(value) + 3;
+    char *header = (char *)malloc(length);
+    if (!header) {
+        return;
+    }
+    
+    snprintf(header, length, "%s: %s", name, value);
+    struct curl_slist *list = curl_slist_append(*headers, header);
+    if (list) {
+        *headers = list;
+    }
+    free(header);
+}
+
+// Copy a response header, NULL if the server did not send it
+static char *copy_header(CURL *curl, const char *name) {
+    struct curl_header *header;
+    if (curl_easy_header(curl, name, 0, CURLH_HEADER, -1, &header) != CURLHE_OK) {
+        return NULL;
+    }
+    return strdup(header->value);
+}
+
+// Keep the validators of a full or partial response to check later ones against
+static void capture_validators(download_transfer_t *xfer) {
+    download_file_t *file = xfer->file;
+    
+    free(file->etag);
+    free(file->last_modified);
+    file->etag = copy_header(xfer->base.easy, "ETag");
+    file->last_modified = copy_header(xfer->base.easy, "Last-Modified");
+}
 
-// Thread pool context
-typedef struct {
-    pthread_t *threads;
-    int thread_count;
-    job_queue_t queue;
-    int active_threads;
-    pthread_mutex_t active_mutex;
-} thread_pool_t;
-
-// Global thread pool
-static thread_pool_t pool;
-
-// Function declarations for static functions
-static void destroy_thread_pool(void);
-
-// Initialize job queue
-static int init_job_queue(job_queue_t *queue, size_t capacity) {
-    queue->jobs = (download_job_t *)malloc(capacity * sizeof(download_job_t));
-    if (!queue->jobs) {
-        return -1;
+// Note what the server said about the file as a whole
+static void finish_primary_transfer(download_transfer_t *xfer) {
+    download_file_t *file = xfer->file;
+    long status = 0;
+    long unmet = 0;
+    
+    curl_easy_getinfo(xfer->base.easy, CURLINFO_RESPONSE_CODE, &status);
+    curl_easy_getinfo(xfer->base.easy, CURLINFO_CONDITION_UNMET, &unmet);
+    
+    if (status == 304 || unmet) {
+        file->unchanged = 1;
+        return;
     }
     
-    queue->capacity = capacity;
-    queue->size = 0;
-    queue->read_index = 0;
-    queue->write_index = 0;
-    queue->shutdown = 0;
+    if (status == 200 || status == 206) {
+        capture_validators(xfer);
+    }
     
-    if (pthread_mutex_init(&queue->mutex, NULL) != 0) {
-        free(queue->jobs);
-        return -1;
+    // An empty body still replaces the earlier contents
+    if (status == 200 && !xfer->started && !file->touched) {
+        if (ftruncate(file->base.fd, 0) != 0) {
+            fail_download_file(file, CURLE_WRITE_ERROR);
+        }
+        file->touched = 1;
     }
+}
+
+// Point a transfer that already received data at the rest of its part of
+// the file. If-Range makes sure the pieces all come from the same version.
+// Returns 0 on success, -1 if the rest cannot be requested on its own.
+static int continue_transfer(download_transfer_t *xfer) {
+    download_file_t *file = xfer->file;
+    CURL *curl = xfer->base.easy;
     
-    if (pthread_cond_init(&queue->not_empty, NULL) != 0) {
-        pthread_mutex_destroy(&queue->mutex);
-        free(queue->jobs);
+    // Decoded bytes don't line up with the server's ranges, and a body
+    // compressed on the fly need not come out the same twice
+    if (file->encoded) {
         return -1;
     }
     
-    if (pthread_cond_init(&queue->not_full, NULL) != 0) {
-        pthread_cond_destroy(&queue->not_empty);
-        pthread_mutex_destroy(&queue->mutex);
-        free(queue->jobs);
+    if (xfer->primary) {
+        capture_validators(xfer);
+    }
+    
+    const char *validator = file->etag ? file->etag : file->last_modified;
+    if (!validator) {
         return -1;
     }
     
+    if (xfer->end >= 0) {
+        // A range keeps its end; the rest is just another range
+        set_segment_range(curl, xfer->offset, xfer->end);
+        xfer->primary = 0;
+    } else {
+        // An unsplit download resumes like one an earlier run left behind
+        struct curl_header *header;
+        if (curl_easy_header(curl, "Accept-Ranges", 0, CURLH_HEADER, -1, &header) != CURLHE_OK ||
+            strcasecmp(header->value, "bytes") != 0) {
+            return -1;
+        }
+        
+        char range[32];
+        snprintf(range, sizeof(range), "%" CURL_FORMAT_CURL_OFF_T "-", xfer->offset);
+        curl_easy_setopt(curl, CURLOPT_RANGE, range);
+        curl_easy_setopt(curl, CURLOPT_TIMECONDITION, (long)CURL_TIMECOND_NONE);
+        file->resume_from = xfer->offset;
+    }
+    
+    // The rest has to come without a coding, like the start did
+    curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, NULL);
+    
+    // Conditions of the first attempt no longer apply
+    curl_slist_free_all(xfer->headers);
+    xfer->headers = NULL;
+    append_header(&xfer->headers, "If-Range", validator);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, xfer->headers);
+    
+    xfer->started = 0;
+    xfer->skip = 0;
     return 0;
 }
 
-// Destroy job queue
-static void destroy_job_queue(job_queue_t *queue) {
-    pthread_mutex_lock(&queue->mutex);
-    queue->shutdown = 1;
-    pthread_cond_broadcast(&queue->not_empty);
-    pthread_cond_broadcast(&queue->not_full);
-    pthread_mutex_unlock(&queue->mutex);
+// Record the timing of a finished transfer in the statistics and the
+// per-transfer results stream
+static void record_transfer(download_transfer_t *xfer, CURLcode res) {
+    parallel_engine_t *engine = xfer->file->engine;
+    const char *host = xfer->host ? xfer->host->name : "";
+    
+    curly_timing_t timing;
+    curly_timing_capture(xfer->base.easy, &timing);
+    curly_stats_record(engine->stats, host, &timing, res != CURLE_OK);
+    
+    if (!engine->stats_output) {
+        return;
+    }
     
-    pthread_cond_destroy(&queue->not_empty);
-    pthread_cond_destroy(&queue->not_full);
-    pthread_mutex_destroy(&queue->mutex);
-    free(queue->jobs);
-    queue->jobs = NULL;
+    json_t *record = json_object();
+    if (!record) {
+        return;
+    }
+    json_object_set_new(record, "url", json_string(xfer->file->job->url));
+    json_object_set_new(record, "destination", json_string(xfer->file->job->destination));
+    json_object_set_new(record, "host", json_string(host));
+    json_object_set_new(record, "status", json_integer(timing.status));
+    json_object_set_new(record, "attempts", json_integer(xfer->attempts));
+    json_object_set_new(record, "segment", json_boolean(xfer->file->split));
+    curly_timing_to_json(record, &timing);
+    json_object_set_new(record, "error", res == CURLE_OK ? json_null() : json_string(curl_easy_strerror(res)));
+    curly_stats_write_line(record, engine->stats_output);
+    json_decref(record);
 }
 
-// Add job to queue
-static int enqueue_job(job_queue_t *queue, const char *url, const char *destination) {
-    pthread_mutex_lock(&queue->mutex);
+// Fetch a file again from the start when the server refuses the range an
+// earlier run or attempt stopped at, as it does once the file has shrunk.
+// Returns 0 if the transfer will be restarted.
+static int restart_transfer(download_loop_t *dl, download_transfer_t *xfer, CURLcode res) {
+    download_file_t *file = xfer->file;
+    CURL *curl = xfer->base.easy;
     
-    while (queue->size == queue->capacity && !queue->shutdown) {
-        pthread_cond_wait(&queue->not_full, &queue->mutex);
+    long status = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+    if (res != CURLE_HTTP_RETURNED_ERROR || status != 416 || xfer->end >= 0 || file->resume_from == 0 ||
+        file->result != CURLE_OK || curly_wfile_error(&file->base)) {
+        return -1;
     }
     
-    if (queue->shutdown) {
-        pthread_mutex_unlock(&queue->mutex);
+    // Nothing of what the file holds is worth keeping now
+    if (curly_wfile_truncate(&file->base) != 0) {
         return -1;
     }
+    file->touched = 1;
+    file->resume_from = 0;
+    
+    curl_easy_setopt(curl, CURLOPT_RANGE, NULL);
+    curl_slist_free_all(xfer->headers);
+    xfer->headers = NULL;
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, NULL);
     
-    // Add job to queue
-    strncpy(queue->jobs[queue->write_index].url, url, MAX_LINE_LENGTH - 1);
-    queue->jobs[queue->write_index].url[MAX_LINE_LENGTH - 1] = '\0';
+    xfer->offset = 0;
+    xfer->started = 0;
+    xfer->skip = 0;
+    xfer->range_done = 0;
+    return curly_loop_add_delayed(dl->loop, &xfer->base, 0);
+}
+
+// Schedule another attempt at a failed transfer on this loop's timers, so
+// the backoff holds neither a thread nor a connection. Returns 0 if the
+// transfer will be retried.
+static int retry_download(download_loop_t *dl, download_transfer_t *xfer, CURLcode res) {
+    parallel_engine_t *engine = dl->engine;
+    download_file_t *file = xfer->file;
     
-    strncpy(queue->jobs[queue->write_index].destination, destination, MAX_LINE_LENGTH - 1);
-    queue->jobs[queue->write_index].destination[MAX_LINE_LENGTH - 1] = '\0';
+    // Don't bother once the file as a whole has failed
+    if (res == CURLE_OK || file->result != CURLE_OK || curly_wfile_error(&file->base)) {
+        return -1;
+    }
     
-    queue->write_index = (queue->write_index + 1) % queue->capacity;
-    queue->size++;
+    long delay = curly_retry_next(&engine->retry, &engine->retry_budget, xfer->base.easy, res, xfer->attempts);
+    if (delay < 0 || (xfer->started && continue_transfer(xfer) != 0)) {
+        return -1;
+    }
     
-    pthread_cond_signal(&queue->not_empty);
-    pthread_mutex_unlock(&queue->mutex);
+    // A retry is a new request as far as the request rates go
+    if (engine->shape_requests) {
+        long long now = curly_rate_now_ns();
+        long rate_wait = request_delay(engine, xfer->host, now);
+        if (rate_wait > delay) {
+            delay = rate_wait;
+        }
+        take_request(engine, xfer->host, now);
+    }
     
-    return 0;
+    xfer->range_done = 0;
+    xfer->attempts++;
+    return curly_loop_add_delayed(dl->loop, &xfer->base, delay);
 }
 
-// Get job from queue
-static int dequeue_job(job_queue_t *queue, download_job_t *job) {
-    pthread_mutex_lock(&queue->mutex);
+// Transfer completion callback, invoked by the event loop
+static void download_done(curly_loop_transfer_t *base, CURLcode res) {
+    download_transfer_t *xfer = (download_transfer_t *)base;
+    download_loop_t *dl = (download_loop_t *)xfer->base.owner;
+    download_file_t *file = xfer->file;
     
-    while (queue->size == 0 && !queue->shutdown) {
-        pthread_cond_wait(&queue->not_empty, &queue->mutex);
+    // A transfer cut off at the end of its range has finished its part
+    if (res == CURLE_WRITE_ERROR && xfer->range_done) {
+        res = CURLE_OK;
     }
     
-    if (queue->shutdown && queue->size == 0) {
-        pthread_mutex_unlock(&queue->mutex);
-        return -1;
+    if (xfer->paused) {
+        download_transfer_t **link = &dl->paused;
+        while (*link != xfer) {
+            link = &(*link)->next_paused;
+        }
+        *link = xfer->next_paused;
+        xfer->paused = 0;
+    }
+    xfer->throttled = 0;
+    
+    // Hand the tail of the data to the writer, which closes the file and
+    // reports the result once everything queued has been written. Even after
+    // a failure the data is kept, since a journaled file may be resumed.
+    if (xfer->buffer) {
+        flush_write_buffer(dl, xfer);
     }
     
-    // Get job from queue
-    memcpy(job, &queue->jobs[queue->read_index], sizeof(download_job_t));
-    queue->read_index = (queue->read_index + 1) % queue->capacity;
-    queue->size--;
+    // A range must arrive in full
+    if (res == CURLE_OK && xfer->end >= 0 && xfer->offset != xfer->end) {
+        res = CURLE_PARTIAL_FILE;
+    }
     
-    pthread_cond_signal(&queue->not_full);
-    pthread_mutex_unlock(&queue->mutex);
+    if (restart_transfer(dl, xfer, res) == 0 || retry_download(dl, xfer, res) == 0) {
+        return;
+    }
     
-    return 0;
+    if (xfer->primary) {
+        finish_primary_transfer(xfer);
+    }
+    
+    if (dl->engine->stats) {
+        record_transfer(xfer, res);
+    }
+    
+    fail_download_file(file, res);
+    release_host_slot(dl->engine, xfer->host);
+    xfer->file = NULL;
+    xfer->host = NULL;
+    release_transfer(dl, xfer);
+    curly_wfile_release(dl->engine->writer, &file->base);
 }
 
-// Create directory for file if it doesn't exist
-static int ensure_directory_exists(const char *path) {
-    char *path_copy = strdup(path);
-    if (!path_copy) {
-        return -1;
+// Find what an earlier run recorded for a job, if the file on disk still matches it
+static const curly_journal_entry_t *previous_download(parallel_engine_t *engine, const download_job_t *job) {
+    if (!engine->journal) {
+        return NULL;
+    }
+    
+    // A prefix kept under the side name is newer than any complete file
+    char *part = stored_path(job->destination, CURLY_OUTPUT_PART_SUFFIX);
+    const curly_journal_entry_t *entry = part ? curly_journal_lookup(engine->journal, part) : NULL;
+    if (entry && (entry->state != CURLY_JOURNAL_PARTIAL || file_size(part) != entry->size)) {
+        entry = NULL;
+    }
+    free(part);
+    if (entry) {
+        return entry;
     }
     
-    char *dir = dirname(path_copy);
+    // A body kept encoded is on disk under its coding's extension
+    entry = curly_journal_lookup(engine->journal, job->destination);
+    if (!entry || entry->state != CURLY_JOURNAL_COMPLETE) {
+        return NULL;
+    }
+    char *stored = entry->suffix ? stored_path(job->destination, entry->suffix) : NULL;
+    curl_off_t size = file_size(stored ? stored : job->destination);
+    free(stored);
+    return size == entry->size ? entry : NULL;
+}
+
+// Check whether a file shares its contents with other hard links
+static int has_other_links(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 && st.st_nlink > 1;
+}
+
+// Create the destination's directory and open a file for the writer. New
+// contents go to a temporary file renamed over the destination when done,
+// so a file an earlier run completed is kept until a new version has fully
+// arrived; a prefix being resumed is continued in its side file, which is
+// renamed the same way. The file takes ownership of the job on success.
+static download_file_t *open_download_file(parallel_engine_t *engine, download_job_t *job,
+                                           const curly_journal_entry_t *previous, curly_error_t *error) {
+    download_file_t *file = (download_file_t *)calloc(1, sizeof(download_file_t));
+    if (!file) {
+        *error = CURLY_ERROR_MEMORY_ALLOCATION;
+        return NULL;
+    }
+    file->job = job;
+    file->engine = engine;
+    file->result = CURLE_OK;
     
-    // Create directories recursively
-    char tmp[MAX_LINE_LENGTH];
-    char *p = NULL;
-    size_t len;
+    // Revalidating or resuming needs something to check the file against
+    if (previous && (previous->etag || previous->last_modified)) {
+        if (previous->state == CURLY_JOURNAL_COMPLETE) {
+            file->conditional = 1;
+        } else if (previous->size > 0) {
+            file->resume_from = previous->size;
+        }
+    }
     
-    snprintf(tmp, sizeof(tmp), "%s", dir);
-    len = strlen(tmp);
+    // Writing in place through a hard link would change every file sharing
+    // it, the dedup siblings and the store's object among them. Such a file
+    // is replaced instead.
+    int in_place = engine->in_place && engine->dedup != CURLY_DEDUP_LINK && !has_other_links(job->destination);
     
-    if (len > 0 && tmp[len - 1] == '/') {
-        tmp[len - 1] = 0;
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+    if (!file->conditional && file->resume_from == 0) {
+        flags |= O_TRUNC;
+        file->touched = 1;
     }
     
-    for (p = tmp + 1; *p; p++) {
-        if (*p == '/') {
-            *p = 0;
-            mkdir(tmp, 0755);
-            *p = '/';
-        }
+    // A prefix kept from an earlier run is continued under its side name
+    int fd = file->resume_from > 0 ? curly_output_open_part(engine->output, job->destination, flags, &file->target) :
+             curly_output_open(engine->output, job->destination, flags, in_place, &file->target);
+    if (fd < 0) {
+        *error = CURLY_ERROR_FILE_OPEN;
+        free(file);
+        return NULL;
     }
     
-    int result = mkdir(tmp, 0755);
-    free(path_copy);
+    if (curly_wfile_init(&file->base, fd, download_file_complete) != 0) {
+        *error = CURLY_ERROR_MEMORY_ALLOCATION;
+        close(fd);
+        curly_output_discard(engine->output, &file->target, file->touched);
+        free(file);
+        return NULL;
+    }
+    file->base.sync = engine->sync_files;
     
-    // It's OK if directory already exists
-    return (result == 0 || errno == EEXIST) ? 0 : -1;
+    return file;
 }
 
-// Callback function for writing data to a file
-static size_t write_file_callback(void *ptr, size_t size, size_t nmemb, void *stream) {
-    FILE *file = (FILE *)stream;
-    return fwrite(ptr, size, nmemb, file);
+// Ask the server to skip unchanged files and continue partial ones
+static void set_validators(download_transfer_t *xfer, const curly_journal_entry_t *previous) {
+    download_file_t *file = xfer->file;
+    CURL *curl = xfer->base.easy;
+    
+    if (file->conditional) {
+        if (previous->etag) {
+            append_header(&xfer->headers, "If-None-Match", previous->etag);
+        }
+        if (previous->last_modified) {
+            time_t modified = curl_getdate(previous->last_modified, NULL);
+            if (modified >= 0) {
+                curl_easy_setopt(curl, CURLOPT_TIMECONDITION, (long)CURL_TIMECOND_IFMODSINCE);
+                curl_easy_setopt(curl, CURLOPT_TIMEVALUE_LARGE, (curl_off_t)modified);
+            }
+        }
+    } else if (file->resume_from > 0) {
+        // If-Range makes the server send the whole file if it has changed
+        char range[32];
+        snprintf(range, sizeof(range), "%" CURL_FORMAT_CURL_OFF_T "-", file->resume_from);
+        curl_easy_setopt(curl, CURLOPT_RANGE, range);
+        append_header(&xfer->headers, "If-Range", previous->etag ? previous->etag : previous->last_modified);
+    }
+    
+    if (xfer->headers) {
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, xfer->headers);
+    }
 }
 
-// Download a file from URL to destination
-curly_error_t curly_download_file(const char *url, const char *destination) {
-    if (!url || !destination) {
-        return CURLY_ERROR_INVALID_JSON;
+// Start downloading a job on the given loop, taking ownership of the job and
+// of the host slot it was granted
+static void start_download(download_loop_t *dl, download_job_t *job, download_host_t *host) {
+    const curly_journal_entry_t *previous = previous_download(dl->engine, job);
+    curly_reporter_started(dl->engine->reporter, dl->index);
+    
+    // Trust the journal outright when revalidation is off
+    if (previous && previous->state == CURLY_JOURNAL_COMPLETE && !dl->engine->revalidate) {
+        release_host_slot(dl->engine, host);
+        report_download(dl->engine, dl->index, job, NULL, CURLY_RESULT_SKIPPED, CURLY_OK, NULL);
+        return;
     }
     
-    // Make sure the directory exists
-    if (ensure_directory_exists(destination) != 0) {
-        return CURLY_ERROR_FILE_OPEN;
+    download_transfer_t *xfer = acquire_transfer(dl);
+    if (!xfer) {
+        release_host_slot(dl->engine, host);
+        report_download(dl->engine, dl->index, job, NULL, CURLY_RESULT_FAILED, CURLY_ERROR_CURL_INIT, NULL);
+        return;
     }
     
-    // Open the destination file
-    FILE *file = fopen(destination, "wb");
+    curly_error_t error;
+    download_file_t *file = open_download_file(dl->engine, job, previous, &error);
     if (!file) {
-        return CURLY_ERROR_FILE_OPEN;
+        release_host_slot(dl->engine, host);
+        release_transfer(dl, xfer);
+        report_download(dl->engine, dl->index, job, NULL, CURLY_RESULT_FAILED, error, NULL);
+        return;
     }
+    file->stripe = dl->index;
     
-    // Initialize curl
-    CURL *curl = curl_easy_init();
-    if (!curl) {
-        fclose(file);
-        return CURLY_ERROR_CURL_INIT;
+    init_transfer(dl, xfer, file, file->resume_from, -1);
+    xfer->host = host;
+    setup_download_handle(xfer->base.easy, job->url);
+    if (host && host->resolve) {
+        curl_easy_setopt(xfer->base.easy, CURLOPT_RESOLVE, host->resolve);
     }
     
-    // Set curl options
-    curl_easy_setopt(curl, CURLOPT_URL, url);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_file_callback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, file);
-    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+    // A resumed file continues in the coding it started in, which is none
+    if (file->resume_from == 0) {
+        curly_encoding_setup(xfer->base.easy, dl->engine->accept_encoding, !dl->engine->keep_encoded);
+    }
+    set_validators(xfer, previous);
+    curly_retry_budget_deposit(&dl->engine->retry_budget);
+    if (dl->engine->shape_requests) {
+        take_request(dl->engine, host, curly_rate_now_ns());
+    }
+    
+    if (curly_loop_add(dl->loop, &xfer->base) != 0) {
+        download_done(&xfer->base, CURLE_FAILED_INIT);
+    }
+}
+
+// Put a lane at the back of the loop's ring
+static void push_ready_lane(download_loop_t *dl, host_lane_t *lane) {
+    lane->next_ready = NULL;
+    if (dl->ready_tail) {
+        dl->ready_tail->next_ready = lane;
+    } else {
+        dl->ready_head = lane;
+    }
+    dl->ready_tail = lane;
+}
+
+// Take the lane at the front of the loop's ring
+static host_lane_t *pop_ready_lane(download_loop_t *dl) {
+    host_lane_t *lane = dl->ready_head;
+    dl->ready_head = lane->next_ready;
+    if (!dl->ready_head) {
+        dl->ready_tail = NULL;
+    }
+    return lane;
+}
+
+// Hold a job back until its host has a free slot
+static void park_job(download_loop_t *dl, host_lane_t *lane, download_job_t *job) {
+    job->next = NULL;
+    if (lane->tail) {
+        lane->tail->next = job;
+    } else {
+        lane->head = job;
+    }
+    lane->tail = job;
+    dl->parked++;
     
-    // Perform the request
-    CURLcode res = curl_easy_perform(curl);
+    if (!lane->ready) {
+        lane->ready = 1;
+        dl->ready_count++;
+        push_ready_lane(dl, lane);
+    }
+}
+
+// Start held-back jobs, one host at a time in turn, while the loop and the
+// hosts have free slots and the request rates allow
+static void start_parked_jobs(download_loop_t *dl) {
+    int blocked = 0;  // Lanes tried in a row whose host was full or too fast
     
-    // Clean up
-    curl_easy_cleanup(curl);
-    fclose(file);
+    while (dl->ready_head && blocked < dl->ready_count &&
+           curly_loop_in_flight(dl->loop) < dl->max_transfers) {
+        host_lane_t *lane = pop_ready_lane(dl);
+        
+        if (!request_allowed(dl, lane->host) || !acquire_host_slot_or_wait(dl, lane->host)) {
+            push_ready_lane(dl, lane);
+            blocked++;
+            continue;
+        }
+        blocked = 0;
+        
+        download_job_t *job = lane->head;
+        lane->head = job->next;
+        dl->parked--;
+        
+        if (lane->head) {
+            push_ready_lane(dl, lane);
+        } else {
+            lane->tail = NULL;
+            lane->ready = 0;
+            dl->ready_count--;
+        }
+        
+        start_download(dl, job, lane->host);
+    }
+}
+
+// Start a job taken from the queue, or hold it back behind earlier jobs
+// for the same host or until the host has a free slot and may take
+// another request
+static void take_job(download_loop_t *dl, download_job_t *job) {
+    download_host_t *host = lookup_host(dl, job->url);
+    if (!host) {
+        start_download(dl, job, NULL);
+        return;
+    }
     
-    if (res != CURLE_OK) {
-        // If download failed, remove the partially downloaded file
-        unlink(destination);
-        return CURLY_ERROR_CURL_PERFORM;
+    host_lane_t *lane = &host->lanes[dl->index];
+    if (lane->head || !request_allowed(dl, host) || !acquire_host_slot_or_wait(dl, host)) {
+        park_job(dl, lane, job);
+        return;
     }
     
-    return CURLY_OK;
+    start_download(dl, job, host);
+}
+
+// Finish a warm-up request. Its connection stays in the loop's cache and
+// its TLS session in the share.
+static void warm_done(curly_loop_transfer_t *base, CURLcode res) {
+    (void)res;
+    download_loop_t *dl = (download_loop_t *)base->owner;
+    dl->warming--;
+    release_transfer(dl, (download_transfer_t *)base);
+}
+
+// Throw away anything a warm-up request receives
+static size_t discard_callback(char *ptr, size_t size, size_t nmemb, void *userdata) {
+    (void)ptr;
+    (void)userdata;
+    return size * nmemb;
+}
+
+// Connect to the input's hosts before taking jobs, with a HEAD request for
+// the first URL of each. Loops start at different hosts, so with more
+// hosts than transfer slots each loop warms its own share of them.
+static void warm_connections(download_loop_t *dl) {
+    parallel_engine_t *engine = dl->engine;
+    size_t count = curly_resolver_host_count(engine->resolver);
+    size_t wanted = count < (size_t)dl->max_transfers ? count : (size_t)dl->max_transfers;
+    size_t first = count * (size_t)dl->index / (size_t)engine->lane_count;
+    
+    for (size_t i = 0; i < wanted; i++) {
+        download_transfer_t *xfer = acquire_transfer(dl);
+        if (!xfer) {
+            break;
+        }
+        const char *url = curly_resolver_host_url(engine->resolver, (first + i) % count);
+        CURL *curl = xfer->base.easy;
+        xfer->base.done = warm_done;
+        xfer->base.owner = dl;
+        curl_easy_setopt(curl, CURLOPT_URL, url);
+        curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, discard_callback);
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, PREWARM_TIMEOUT_MS);
+        const struct curl_slist *resolve = curly_resolver_find(engine->resolver, url);
+        if (resolve) {
+            curl_easy_setopt(curl, CURLOPT_RESOLVE, resolve);
+        }
+        if (curly_loop_add(dl->loop, &xfer->base) != 0) {
+            release_transfer(dl, xfer);
+            continue;
+        }
+        dl->warming++;
+    }
+    
+    while (dl->warming > 0) {
+        if (curly_loop_run_once(dl->loop, -1) != 0) {
+            fprintf(stderr, "Event loop failed: %s\n", strerror(errno));
+            break;
+        }
+    }
 }
 
-// Worker thread function
-static void *download_worker(void *arg) {
-    (void)arg; // Unused
-    download_job_t job;
+// Event loop thread: keep up to max_transfers downloads running until the queue drains
+static void *download_loop_thread(void *arg) {
+    download_loop_t *dl = (download_loop_t *)arg;
+    curly_queue_t *queue = &dl->engine->queue;
+    void *jobs[JOB_BATCH_SIZE];
+    int drained = 0;
+    
+    if (dl->engine->prewarm) {
+        warm_connections(dl);
+    }
     
     while (1) {
-        // Get a job from the queue
-        if (dequeue_job(&pool.queue, &job) != 0) {
-            break; // Queue is shut down
+        // Jobs held back for busy hosts go before new ones
+        start_parked_jobs(dl);
+        
+        // Top up this loop's share of transfers, a batch at a time. Jobs for
+        // busy hosts are held back, which lets the loop look further ahead
+        // in the queue for other hosts, up to max_parked jobs.
+        // Nothing can start while the overall request rate is used up, so
+        // the queue is left to the other loops meanwhile.
+        while (!drained && curly_loop_in_flight(dl->loop) < dl->max_transfers &&
+               dl->parked < dl->max_parked && request_allowed(dl, NULL)) {
+            int wanted = dl->max_transfers - curly_loop_in_flight(dl->loop);
+            if (wanted > dl->max_parked - dl->parked) {
+                wanted = dl->max_parked - dl->parked;
+            }
+            if (wanted > JOB_BATCH_SIZE) {
+                wanted = JOB_BATCH_SIZE;
+            }
+            
+            int got = curly_queue_pop(queue, jobs, wanted);
+            
+            if (got == 0) {
+                // Ask the reader for a wakeup, then check again so none is missed
+                __atomic_store_n(&dl->hungry, 1, __ATOMIC_SEQ_CST);
+                got = curly_queue_pop(queue, jobs, wanted);
+                if (got == 0) {
+                    break;
+                }
+                __atomic_store_n(&dl->hungry, 0, __ATOMIC_SEQ_CST);
+            }
+            
+            if (got < 0) {
+                drained = 1;
+                break;
+            }
+            
+            for (int i = 0; i < got; i++) {
+                take_job(dl, jobs[i]);
+            }
         }
         
-        // Download the file
-        curly_error_t result = curly_download_file(job.url, job.destination);
+        // Transfers backing off before a retry and held-back jobs keep the loop alive
+        if (drained && curly_loop_in_flight(dl->loop) == 0 && curly_loop_delayed(dl->loop) == 0 &&
+            dl->parked == 0) {
+            break;
+        }
         
-        // Print status message
-        if (result == CURLY_OK) {
-            printf("Downloaded %s -> %s\n", job.url, job.destination);
-        } else {
-            fprintf(stderr, "Failed to download %s: %s\n", job.url, curly_strerror(result));
+        if (curly_loop_run_once(dl->loop, -1) != 0) {
+            fprintf(stderr, "Event loop failed: %s\n", strerror(errno));
+            break;
         }
+        
+        start_pending_transfers(dl);
+        resume_paused_transfers(dl);
     }
     
-    // Decrease active thread count
-    pthread_mutex_lock(&pool.active_mutex);
-    pool.active_threads--;
-    pthread_mutex_unlock(&pool.active_mutex);
-    
+    free_transfers(dl);
     return NULL;
 }
 
-// Initialize thread pool
-static curly_error_t init_thread_pool(int thread_count) {
+// Wake one loop that is waiting for work
+static void wake_hungry_loop(parallel_engine_t *engine) {
+    for (int i = 0; i < engine->loop_count; i++) {
+        download_loop_t *dl = &engine->loops[i];
+        if (__atomic_load_n(&dl->hungry, __ATOMIC_SEQ_CST) &&
+            __atomic_exchange_n(&dl->hungry, 0, __ATOMIC_SEQ_CST)) {
+            curly_loop_wake(dl->loop);
+            return;
+        }
+    }
+}
+
+// Make sure we may keep enough descriptors open for every transfer and its
+// socket, plus the cached output directories. Returns how many directories
+// may be kept open within the limit.
+static int raise_fd_limit(int max_transfers) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0) {
+        return 0;
+    }
+    
+    rlim_t needed = (rlim_t)max_transfers * 2 + 64;
+    rlim_t wanted = needed + MAX_OUTPUT_DIR_FDS;
+    if (limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < wanted) {
+        limit.rlim_cur = (limit.rlim_max == RLIM_INFINITY || wanted < limit.rlim_max) ? wanted : limit.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &limit) != 0) {
+            getrlimit(RLIMIT_NOFILE, &limit);
+        }
+    }
+    
+    if (limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur >= wanted) {
+        return MAX_OUTPUT_DIR_FDS;
+    }
+    return limit.rlim_cur > needed ? (int)(limit.rlim_cur - needed) : 0;
+}
+
+// Stop and free the event loops
+static void destroy_engine(parallel_engine_t *engine) {
+    // Signal all loops to finish the remaining jobs and exit
+    curly_queue_shutdown(&engine->queue);
+    
+    for (int i = 0; i < engine->loop_count; i++) {
+        curly_loop_wake(engine->loops[i].loop);
+    }
+    
+    // Wait for all loops to finish
+    for (int i = 0; i < engine->loop_count; i++) {
+        pthread_join(engine->loops[i].thread, NULL);
+    }
+    
+    // Flush outstanding writes. The writer may still wake loops until then,
+    // and the store finishes the files handed to it before the journal goes.
+    curly_writer_destroy(engine->writer);
+    curly_store_close(engine->store);
+    curly_output_destroy(engine->output);
+    curly_journal_close(engine->journal);
+    free(engine->accept_encoding);
+    
+    for (int i = 0; i < engine->loop_count; i++) {
+        curly_loop_destroy(engine->loops[i].loop);
+    }
+    
+    free(engine->loops);
+    destroy_host_table(&engine->hosts);
+    destroy_job_queue(&engine->queue);
+    destroy_url_table(&engine->urls);
+    curly_share_destroy(engine->share);
+}
+
+// Create the job queue and start the event loop threads
+static curly_error_t init_engine(parallel_engine_t *engine, const curly_parallel_options_t *options,
+                                 curly_stats_t *stats, FILE *stats_output, curly_reporter_t *reporter,
+                                 const curly_resolver_t *resolver) {
+    int thread_count = options->thread_count;
+    int max_transfers = options->max_transfers;
+    
     if (thread_count <= 0) {
-        thread_count = DEFAULT_THREAD_COUNT;
-    } else if (thread_count > MAX_THREAD_COUNT) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        thread_count = (cpus > 0) ? (int)cpus : DEFAULT_THREAD_COUNT;
+    }
+    if (thread_count > MAX_THREAD_COUNT) {
         thread_count = MAX_THREAD_COUNT;
     }
     
+    if (max_transfers <= 0) {
+        max_transfers = DEFAULT_MAX_TRANSFERS;
+    } else if (max_transfers > MAX_TRANSFER_COUNT) {
+        max_transfers = MAX_TRANSFER_COUNT;
+    }
+    if (thread_count > max_transfers) {
+        thread_count = max_transfers;
+    }
+    
+    int writer_threads = options->writer_threads;
+    if (writer_threads <= 0) {
+        writer_threads = DEFAULT_WRITER_THREADS;
+    } else if (writer_threads > MAX_WRITER_THREADS) {
+        writer_threads = MAX_WRITER_THREADS;
+    }
+    
+    int write_buffers = options->write_buffers;
+    if (write_buffers <= 0) {
+        write_buffers = DEFAULT_WRITE_BUFFERS;
+    } else if (write_buffers > MAX_WRITE_BUFFERS) {
+        write_buffers = MAX_WRITE_BUFFERS;
+    }
+    
+    int max_per_host = options->max_per_host;
+    if (max_per_host <= 0) {
+        max_per_host = DEFAULT_MAX_PER_HOST;
+    } else if (max_per_host > MAX_TRANSFER_COUNT) {
+        max_per_host = MAX_TRANSFER_COUNT;
+    }
+    
+    // With HTTP/2 the per-host limit counts connections per loop, each
+    // carrying up to max_streams transfers
+    int max_streams = options->max_streams > 0 ? options->max_streams : DEFAULT_MAX_STREAMS;
+    int host_slots = max_per_host;
+    if (options->http_version != CURLY_HTTP_1) {
+        long long slots = (long long)max_per_host * max_streams;
+        host_slots = slots > MAX_TRANSFER_COUNT ? MAX_TRANSFER_COUNT : (int)slots;
+    }
+    
+    int segments = options->segments;
+    if (segments <= 0) {
+        segments = DEFAULT_SEGMENTS;
+    } else if (segments > MAX_SEGMENTS) {
+        segments = MAX_SEGMENTS;
+    }
+    
+    int dir_fds = raise_fd_limit(max_transfers * segments);
+    
+    memset(engine, 0, sizeof(parallel_engine_t));
+    engine->segments = segments;
+    engine->max_per_host = host_slots;
+    engine->lane_count = thread_count;
+    engine->revalidate = options->revalidate;
+    engine->min_segment_size = options->min_segment_size > 0 ? options->min_segment_size : DEFAULT_MIN_SEGMENT_SIZE;
+    engine->stats = stats;
+    engine->stats_output = stats_output;
+    engine->reporter = reporter;
+    engine->resolver = resolver;
+    engine->prewarm = resolver && options->prewarm;
+    engine->in_place = options->in_place;
+    engine->sync_files = options->fsync_mode == CURLY_FSYNC_FILE;
+    
+    // Transient failures are retried on the loops' timers
+    curly_retry_policy_init(&engine->retry);
+    engine->retry.max_attempts = (options->retries > 0 ? options->retries : 0) + 1;
+    engine->retry.delay_ms = options->retry_delay_ms > 0 ? options->retry_delay_ms : DEFAULT_RETRY_DELAY_MS;
+    curly_retry_budget_init(&engine->retry_budget, RETRY_BUDGET_RATIO, RETRY_BUDGET_BURST);
+    
+    // Bandwidth and request rates are shaped by buckets shared by the loops,
+    // plus one of each per host
+    engine->rate_limit = options->rate_limit;
+    if (engine->rate_limit.burst_ms <= 0) {
+        curly_rate_limit_t defaults;
+        curly_rate_limit_init(&defaults);
+        engine->rate_limit.burst_ms = defaults.burst_ms;
+    }
+    curly_rate_bucket_init(&engine->byte_rate, (double)engine->rate_limit.bytes_per_sec, engine->rate_limit.burst_ms);
+    curly_rate_bucket_init(&engine->request_rate, engine->rate_limit.requests_per_sec, engine->rate_limit.burst_ms);
+    engine->shape_bytes = engine->rate_limit.bytes_per_sec > 0 || engine->rate_limit.host_bytes_per_sec > 0;
+    engine->shape_requests = engine->rate_limit.requests_per_sec > 0 || engine->rate_limit.host_requests_per_sec > 0;
+    
     // Initialize job queue
-    if (init_job_queue(&pool.queue, thread_count * 2) != 0) {
+    if (curly_queue_init(&engine->queue, (size_t)max_transfers) != 0) {
+        return CURLY_ERROR_MEMORY_ALLOCATION;
+    }
+    
+    // Hosts and their in-flight counts are tracked across all loops
+    if (init_host_table(&engine->hosts) != 0) {
+        destroy_job_queue(&engine->queue);
+        return CURLY_ERROR_MEMORY_ALLOCATION;
+    }
+    if (init_url_table(&engine->urls) != 0) {
+        destroy_host_table(&engine->hosts);
+        destroy_job_queue(&engine->queue);
+        return CURLY_ERROR_MEMORY_ALLOCATION;
+    }
+    
+    // Share DNS and TLS sessions across loops. Connections can only
+    // be shared when a single thread drives every transfer.
+    engine->share = curly_share_create(thread_count == 1);
+    if (!engine->share) {
+        destroy_host_table(&engine->hosts);
+        destroy_url_table(&engine->urls);
+        destroy_job_queue(&engine->queue);
+        return CURLY_ERROR_CURL_INIT;
+    }
+    
+    engine->loops = (download_loop_t *)calloc(thread_count, sizeof(download_loop_t));
+    if (!engine->loops) {
+        destroy_host_table(&engine->hosts);
+        destroy_url_table(&engine->urls);
+        destroy_job_queue(&engine->queue);
+        curly_share_destroy(engine->share);
         return CURLY_ERROR_MEMORY_ALLOCATION;
     }
     
-    // Initialize active threads mutex
-    if (pthread_mutex_init(&pool.active_mutex, NULL) != 0) {
-        destroy_job_queue(&pool.queue);
-        return CURLY_ERROR_THREAD_CREATE;
+    // Earlier runs' results decide which downloads can be skipped or resumed
+    if (options->journal_path) {
+        engine->journal = curly_journal_open(options->journal_path);
+        if (!engine->journal) {
+            free(engine->loops);
+            destroy_host_table(&engine->hosts);
+            destroy_url_table(&engine->urls);
+            destroy_job_queue(&engine->queue);
+            curly_share_destroy(engine->share);
+            return CURLY_ERROR_FILE_OPEN;
+        }
+    }
+    
+    // Repeated URLs share a download; identical payloads share storage
+    engine->dedup = options->dedup;
+    if (options->store_path) {
+        engine->store = curly_store_open(options->store_path, options->dedup == CURLY_DEDUP_LINK ?
+                                         CURLY_DEDUP_LINK : CURLY_DEDUP_COPY);
+        if (!engine->store && errno == EOPNOTSUPP) {
+            fprintf(stderr, "The store at %s needs dedup link mode, its filesystem has no reflinks\n",
+                    options->store_path);
+        }
+        if (!engine->store) {
+            curly_journal_close(engine->journal);
+            free(engine->loops);
+            destroy_host_table(&engine->hosts);
+            destroy_url_table(&engine->urls);
+            destroy_job_queue(&engine->queue);
+            curly_share_destroy(engine->share);
+            return CURLY_ERROR_FILE_OPEN;
+        }
+    }
+    
+    // Directories are created once and kept open for the run
+    engine->output = curly_output_create(options->fsync_mode, dir_fds);
+    if (!engine->output) {
+        curly_store_close(engine->store);
+        curly_journal_close(engine->journal);
+        free(engine->loops);
+        destroy_host_table(&engine->hosts);
+        destroy_url_table(&engine->urls);
+        destroy_job_queue(&engine->queue);
+        curly_share_destroy(engine->share);
+        return CURLY_ERROR_MEMORY_ALLOCATION;
     }
     
-    // Allocate thread array
-    pool.threads = (pthread_t *)malloc(thread_count * sizeof(pthread_t));
-    if (!pool.threads) {
-        destroy_job_queue(&pool.queue);
-        pthread_mutex_destroy(&pool.active_mutex);
+    // Disk writes happen on their own threads, fed from a bounded buffer pool
+    engine->writer = curly_writer_create(writer_threads, write_buffers, WRITE_BUFFER_SIZE);
+    if (!engine->writer) {
+        curly_output_destroy(engine->output);
+        curly_store_close(engine->store);
+        curly_journal_close(engine->journal);
+        free(engine->loops);
+        destroy_host_table(&engine->hosts);
+        destroy_url_table(&engine->urls);
+        destroy_job_queue(&engine->queue);
+        curly_share_destroy(engine->share);
         return CURLY_ERROR_MEMORY_ALLOCATION;
     }
+    curly_writer_set_notify(engine->writer, notify_starved_loops, engine);
     
-    pool.thread_count = thread_count;
-    pool.active_threads = thread_count;
+    // Codings are offered on fresh requests; keeping them as sent needs no
+    // decoder, so every known one can be offered then
+    engine->keep_encoded = options->keep_encoded;
+    if (options->accept_encoding || options->keep_encoded) {
+        engine->accept_encoding = curly_encoding_accept(options->accept_encoding, !options->keep_encoded);
+        if (!engine->accept_encoding) {
+            destroy_engine(engine);
+            return CURLY_ERROR_MEMORY_ALLOCATION;
+        }
+        if (!*engine->accept_encoding) {
+            fprintf(stderr, "None of the requested encodings can be used; asking for none\n");
+        }
+    }
     
-    // Create worker threads
+    // Create event loops, splitting the transfer budget between them
     for (int i = 0; i < thread_count; i++) {
-        if (pthread_create(&pool.threads[i], NULL, download_worker, NULL) != 0) {
-            // Clean up on failure
-            pool.thread_count = i; // Only join threads that were created
-            destroy_thread_pool();
-            return CURLY_ERROR_THREAD_CREATE;
+        download_loop_t *dl = &engine->loops[i];
+        dl->engine = engine;
+        dl->index = i;
+        dl->max_transfers = max_transfers / thread_count + (i < max_transfers % thread_count ? 1 : 0);
+        dl->max_parked = dl->max_transfers * PARKED_JOBS_PER_TRANSFER;
+        dl->loop = curly_loop_create();
+        if (dl->loop) {
+            curly_loop_set_http_version(dl->loop, options->http_version, max_streams, max_per_host);
         }
+        
+        if (!dl->loop || pthread_create(&dl->thread, NULL, download_loop_thread, dl) != 0) {
+            curly_error_t error = dl->loop ? CURLY_ERROR_THREAD_CREATE : CURLY_ERROR_CURL_INIT;
+            curly_loop_destroy(dl->loop);
+            engine->loop_count = i; // Only join loops that were started
+            destroy_engine(engine);
+            return error;
+        }
+        
+        engine->loop_count = i + 1;
     }
     
     return CURLY_OK;
 }
 
-// Destroy thread pool
-static void destroy_thread_pool(void) {
-    // Signal all threads to exit and wait for them
-    destroy_job_queue(&pool.queue);
-    
-    // Join all threads
-    for (int i = 0; i < pool.thread_count; i++) {
-        pthread_join(pool.threads[i], NULL);
-    }
+void curly_parallel_options_init(curly_parallel_options_t *options) {
+    if (!options) return;
     
-    free(pool.threads);
-    pthread_mutex_destroy(&pool.active_mutex);
+    memset(options, 0, sizeof(curly_parallel_options_t));
+    options->thread_count = DEFAULT_THREAD_COUNT;
+    options->max_transfers = DEFAULT_MAX_TRANSFERS;
+    options->writer_threads = DEFAULT_WRITER_THREADS;
+    options->write_buffers = DEFAULT_WRITE_BUFFERS;
+    options->revalidate = 1;
+    options->segments = DEFAULT_SEGMENTS;
+    options->min_segment_size = DEFAULT_MIN_SEGMENT_SIZE;
+    options->max_per_host = DEFAULT_MAX_PER_HOST;
+    options->retries = DEFAULT_RETRIES;
+    options->retry_delay_ms = DEFAULT_RETRY_DELAY_MS;
+    curly_rate_limit_init(&options->rate_limit);
+    options->http_version = CURLY_HTTP_1;
+    options->max_streams = DEFAULT_MAX_STREAMS;
+    options->dedup = CURLY_DEDUP_COPY;
 }
 
-// Parse a line of TSV data (URL, destination)
-static int parse_tsv_line(char *line, char *url, char *destination) {
-    char *tab = strchr(line, '\t');
-    if (!tab) {
-        return -1; // No tab found
+// Collect the hosts to resolve before the run: static entries, a host list
+// and, for a regular input file, every URL in it. The input is mapped, so
+// scanning it leaves the stream where the download pass starts.
+static curly_error_t prepare_resolver(const curly_parallel_options_t *options, FILE *input_stream,
+                                      curly_resolver_t **resolver) {
+    *resolver = NULL;
+    if (!options->preresolve && !options->prewarm && !options->hosts_path && !options->resolve) {
+        return CURLY_OK;
     }
     
-    *tab = '\0'; // Split the line at the tab
+    curly_resolver_t *hosts = curly_resolver_create();
+    if (!hosts) {
+        return CURLY_ERROR_MEMORY_ALLOCATION;
+    }
     
-    // Trim trailing newline from destination
-    char *newline = strchr(tab + 1, '\n');
-    if (newline) {
-        *newline = '\0';
+    for (const struct curl_slist *item = options->resolve; item; item = item->next) {
+        if (curly_resolver_add_static(hosts, item->data) != 0) {
+            fprintf(stderr, "Invalid resolve entry: %s\n", item->data);
+        }
     }
     
-    // Copy URL and destination
-    strncpy(url, line, MAX_LINE_LENGTH - 1);
-    url[MAX_LINE_LENGTH - 1] = '\0';
+    curly_tsv_line_t line;
+    int status;
+    if (options->hosts_path) {
+        FILE *list = fopen(options->hosts_path, "r");
+        curly_ingest_t *ingest = list ? curly_ingest_open(list) : NULL;
+        if (!ingest) {
+            if (list) fclose(list);
+            curly_resolver_destroy(hosts);
+            return CURLY_ERROR_FILE_OPEN;
+        }
+        // Lines are bare URLs or names; a tab would end one like in a manifest
+        while ((status = curly_ingest_next(ingest, &line)) != 0) {
+            if (line.url) {
+                curly_resolver_add_url(hosts, line.url, line.url_length);
+            }
+        }
+        curly_ingest_close(ingest);
+        fclose(list);
+    }
     
-    strncpy(destination, tab + 1, MAX_LINE_LENGTH - 1);
-    destination[MAX_LINE_LENGTH - 1] = '\0';
+    if (options->preresolve || options->prewarm) {
+        curly_ingest_t *ingest = curly_ingest_open(input_stream);
+        if (ingest && curly_ingest_mapped(ingest)) {
+            while ((status = curly_ingest_next(ingest, &line)) != 0) {
+                if (status > 0) {
+                    curly_resolver_add_url(hosts, line.url, line.url_length);
+                }
+            }
+        } else if (ingest) {
+            fprintf(stderr, "Input is not a regular file; only listed hosts are resolved up front\n");
+        }
+        curly_ingest_close(ingest);
+    }
     
-    return 0;
+    size_t failed = curly_resolver_run(hosts, RESOLVE_THREADS);
+    if (failed > 0) {
+        fprintf(stderr, "Failed to resolve %zu host%s up front\n", failed, failed == 1 ? "" : "s");
+    }
+    *resolver = hosts;
+    return CURLY_OK;
 }
 
 // Process parallel downloads from TSV input
 curly_error_t curly_parallel_download(int thread_count, FILE *input_stream) {
-    if (!input_stream) {
+    curly_parallel_options_t options;
+    curly_parallel_options_init(&options);
+    options.thread_count = thread_count;
+    
+    return curly_parallel_download_ex(&options, input_stream);
+}
+
+curly_error_t curly_parallel_download_ex(const curly_parallel_options_t *options, FILE *input_stream) {
+    if (!options || !input_stream) {
         return CURLY_ERROR_UNKNOWN;
     }
     
     // Initialize curl global
     curl_global_init(CURL_GLOBAL_ALL);
     
-    // Initialize thread pool
-    curly_error_t result = init_thread_pool(thread_count);
+    // Timing is only collected when someone is going to look at it
+    curly_stats_t *stats = NULL;
+    FILE *stats_output = NULL;
+    if (options->stats_path || options->summary) {
+        stats = curly_stats_create();
+        if (!stats) {
+            curl_global_cleanup();
+            return CURLY_ERROR_MEMORY_ALLOCATION;
+        }
+    }
+    if (options->stats_path) {
+        stats_output = fopen(options->stats_path, "w");
+        if (!stats_output) {
+            curly_stats_destroy(stats);
+            curl_global_cleanup();
+            return CURLY_ERROR_FILE_OPEN;
+        }
+    }
+    
+    // Results and progress are written by one reporter thread. Every loop
+    // counts into its own stripe; the last one is the reader's.
+    FILE *log = NULL;
+    if (options->log_path) {
+        log = fopen(options->log_path, "w");
+    }
+    curly_reporter_t *reporter = NULL;
+    if (!options->log_path || log) {
+        reporter = curly_reporter_create(MAX_THREAD_COUNT + 1, log, options->progress_interval_ms, release_job);
+    }
+    if (!reporter) {
+        if (log) fclose(log);
+        if (stats_output) fclose(stats_output);
+        curly_stats_destroy(stats);
+        curl_global_cleanup();
+        return options->log_path && !log ? CURLY_ERROR_FILE_OPEN : CURLY_ERROR_THREAD_CREATE;
+    }
+    
+    // Hosts are resolved concurrently before any loop needs them
+    curly_resolver_t *resolver;
+    curly_error_t result = prepare_resolver(options, input_stream, &resolver);
+    
+    // Start the event loops
+    parallel_engine_t engine;
+    if (result == CURLY_OK) {
+        result = init_engine(&engine, options, stats, stats_output, reporter, resolver);
+    }
     if (result != CURLY_OK) {
+        curly_resolver_destroy(resolver);
+        curly_reporter_destroy(reporter);
+        if (log) fclose(log);
+        if (stats_output) fclose(stats_output);
+        curly_stats_destroy(stats);
         curl_global_cleanup();
         return result;
     }
     
-    // Read TSV data from input stream
-    char line[MAX_LINE_LENGTH];
-    char url[MAX_LINE_LENGTH];
-    char destination[MAX_LINE_LENGTH];
+    // Read TSV data from the input, mapped when it is a regular file, and
+    // pack the jobs into blocks
+    curly_ingest_t *ingest = curly_ingest_open(input_stream);
+    if (!ingest) {
+        result = CURLY_ERROR_MEMORY_ALLOCATION;
+    }
+    job_block_t *block = NULL;
+    curly_tsv_line_t line;
+    int status;
     
-    while (fgets(line, sizeof(line), input_stream)) {
-        // Skip empty lines
-        if (line[0] == '\n' || line[0] == '\0') {
+    while (ingest && (status = curly_ingest_next(ingest, &line)) != 0) {
+        if (status < 0) {
+            if (line.url) {
+                fprintf(stderr, "Invalid input line: %.*s\n", (int)line.url_length, line.url);
+            } else {
+                fprintf(stderr, "Failed to read input: %s\n", strerror(errno));
+                result = CURLY_ERROR_FILE_OPEN;
+            }
             continue;
         }
         
-        // Parse TSV line
-        if (parse_tsv_line(line, url, destination) != 0) {
-            fprintf(stderr, "Invalid input line: %s\n", line);
+        download_job_t *job = create_job(&block, &line);
+        if (!job) {
+            fprintf(stderr, "Failed to download %.*s: %s\n", (int)line.url_length, line.url,
+                    curly_strerror(CURLY_ERROR_MEMORY_ALLOCATION));
             continue;
         }
         
-        // Add download job to queue
-        enqueue_job(&pool.queue, url, destination);
+        // A URL already being fetched is not fetched again
+        if (engine.dedup != CURLY_DEDUP_OFF && claim_url(&engine, job)) {
+            curly_reporter_queued(reporter, MAX_THREAD_COUNT);
+            continue;
+        }
+        
+        // Add download job to queue and make sure an idle loop picks it up
+        if (curly_queue_push(&engine.queue, job) == 0) {
+            curly_reporter_queued(reporter, MAX_THREAD_COUNT);
+            wake_hungry_loop(&engine);
+        } else {
+            download_job_t *follower = take_followers(&engine, job);
+            while (follower) {
+                download_job_t *next = follower->next;
+                release_job(follower);
+                follower = next;
+            }
+            release_job(job);
+        }
+    }
+    if (block) {
+        release_block(block);
     }
+    curly_ingest_close(ingest);
+    curly_reporter_input_done(reporter);
     
-    // Wait for all jobs to complete
-    pthread_mutex_lock(&pool.queue.mutex);
-    pool.queue.shutdown = 1;
-    pthread_cond_broadcast(&pool.queue.not_empty);
-    pthread_mutex_unlock(&pool.queue.mutex);
+    // Wait for all jobs to complete and clean up
+    destroy_engine(&engine);
+    curly_resolver_destroy(resolver);
+    curl_global_cleanup();
     
-    // Wait for all threads to finish
-    int active;
-    do {
-        sleep(1); // Check every second
-        pthread_mutex_lock(&pool.active_mutex);
-        active = pool.active_threads;
-        pthread_mutex_unlock(&pool.active_mutex);
-    } while (active > 0);
+    // Every result is in once the writer and the store are done with the last file
+    curly_reporter_destroy(reporter);
+    if (log && fclose(log) != 0) {
+        fprintf(stderr, "Failed to write %s\n", options->log_path);
+    }
     
-    // Clean up
-    destroy_thread_pool();
-    curl_global_cleanup();
+    // Summarize the run once every transfer has been recorded
+    if (stats_output) {
+        curly_stats_write_json(stats, stats_output);
+        if (fclose(stats_output) != 0) {
+            fprintf(stderr, "Failed to write %s\n", options->stats_path);
+        }
+    }
+    if (options->summary) {
+        curly_stats_print(stats, stderr);
+    }
+    curly_stats_destroy(stats);
     
-    return CURLY_OK;
-}
\ No newline at end of file
+    return result;
+}
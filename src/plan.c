@@ -0,0 +1,495 @@
+#include "curly.h"
+#include "request.h"
+#include "retry.h"
+
+// How a variable's value is written into the rendered text
+typedef enum {
+    ESCAPE_HEADER = 0,  // As it is, refusing line breaks
+    ESCAPE_URL,         // Percent-encoded except for unreserved characters
+    ESCAPE_JSON         // Escaped for the inside of a JSON string
+} escape_t;
+
+// A stretch of literal text, or a variable reference when var >= 0
+typedef struct {
+    const char *text;
+    size_t length;
+    int var;
+} segment_t;
+
+// A string split at its placeholders. The literal text is not copied; it
+// points into the string the template was compiled from.
+typedef struct {
+    segment_t *segments;
+    int segment_count;
+    int var_count;    // Number of variable segments
+    escape_t escape;
+} template_t;
+
+// Growable buffer a template is rendered into, reused across executions
+typedef struct {
+    char *data;
+    size_t capacity;
+} scratch_t;
+
+// Variable name, pointing into the compiled strings
+typedef struct {
+    const char *name;
+    size_t length;
+} var_name_t;
+
+struct curly_plan {
+    CURL *curl;                  // Kept between executions so connections are reused
+    curly_request_t request;     // Prebuilt header list and serialized body
+    curly_retry_policy_t policy;
+    char *url;
+    template_t url_template;
+    template_t body_template;
+    template_t *header_templates;     // One per header line
+    struct curl_slist *header_nodes;  // Header list handed to libcurl when headers have variables
+    int header_count;
+    int headers_templated;
+    var_name_t *var_names;
+    int var_count;
+    const char **values;         // Values of the current execution, by variable index
+    scratch_t url_scratch;
+    scratch_t header_scratch;
+    scratch_t body_scratch;
+};
+
+static int is_name_char(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+           c == '_' || c == '-' || c == '.';
+}
+
+static int is_unreserved(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+           c == '-' || c == '.' || c == '_' || c == '~';
+}
+
+// Index of a variable, registering it on first use
+static int intern_var(curly_plan_t *plan, const char *name, size_t length) {
+    for (int i = 0; i < plan->var_count; i++) {
+        if (plan->var_names[i].length == length && memcmp(plan->var_names[i].name, name, length) == 0) {
+            return i;
+        }
+    }
+
+    var_name_t *names = (var_name_t *)realloc(plan->var_names, (plan->var_count + 1) * sizeof(var_name_t));
+    if (!names) {
+        return -1;
+    }
+    plan->var_names = names;
+    names[plan->var_count].name = name;
+    names[plan->var_count].length = length;
+    return plan->var_count++;
+}
+
+// Append a segment, merging literal text with the literal before it
+static int add_segment(template_t *tmpl, const char *text, size_t length, int var) {
+    if (var < 0 && length == 0) {
+        return 0;
+    }
+
+    segment_t *last = tmpl->segment_count > 0 ? &tmpl->segments[tmpl->segment_count - 1] : NULL;
+    if (var < 0 && last && last->var < 0 && last->text + last->length == text) {
+        last->length += length;
+        return 0;
+    }
+
+    segment_t *segments = (segment_t *)realloc(tmpl->segments, (tmpl->segment_count + 1) * sizeof(segment_t));
+    if (!segments) {
+        return -1;
+    }
+    tmpl->segments = segments;
+    segments[tmpl->segment_count].text = text;
+    segments[tmpl->segment_count].length = length;
+    segments[tmpl->segment_count].var = var;
+    tmpl->segment_count++;
+    if (var >= 0) {
+        tmpl->var_count++;
+    }
+    return 0;
+}
+
+// Split a string at its {{name}} placeholders. Braces that do not enclose
+// a valid name are kept as literal text.
+static int compile_template(curly_plan_t *plan, template_t *tmpl, const char *text, escape_t escape) {
+    memset(tmpl, 0, sizeof(template_t));
+    tmpl->escape = escape;
+
+    const char *literal = text;
+    const char *p = text;
+    while ((p = strstr(p, "{{")) != NULL) {
+        const char *name = p + 2;
+        const char *end = name;
+        while (is_name_char(*end)) {
+            end++;
+        }
+
+        if (end == name || end[0] != '}' || end[1] != '}') {
+            p++;
+            continue;
+        }
+
+        int var = intern_var(plan, name, (size_t)(end - name));
+        if (var < 0 ||
+            add_segment(tmpl, literal, (size_t)(p - literal), -1) != 0 ||
+            add_segment(tmpl, name, (size_t)(end - name), var) != 0) {
+            return -1;
+        }
+        p = literal = end + 2;
+    }
+
+    return add_segment(tmpl, literal, strlen(literal), -1);
+}
+
+// Length of a value once escaped, or -1 if it may not be used
+static long escaped_length(const char *value, escape_t escape) {
+    long length = 0;
+    for (const unsigned char *c = (const unsigned char *)value; *c; c++) {
+        switch (escape) {
+            case ESCAPE_HEADER:
+                if (*c == '\r' || *c == '\n') {
+                    return -1;
+                }
+                length++;
+                break;
+            case ESCAPE_URL:
+                length += is_unreserved(*c) ? 1 : 3;
+                break;
+            case ESCAPE_JSON:
+                if (*c == '"' || *c == '\\' || *c == '\n' || *c == '\r' || *c == '\t') {
+                    length += 2;
+                } else if (*c < 0x20) {
+                    length += 6;
+                } else {
+                    length++;
+                }
+                break;
+        }
+    }
+    return length;
+}
+
+static char *write_escaped(char *out, const char *value, escape_t escape) {
+    static const char hex[] = "0123456789ABCDEF";
+
+    for (const unsigned char *c = (const unsigned char *)value; *c; c++) {
+        if (escape == ESCAPE_URL && !is_unreserved(*c)) {
+            *out++ = '%';
+            *out++ = hex[*c >> 4];
+            *out++ = hex[*c & 0x0F];
+        } else if (escape == ESCAPE_JSON && (*c == '"' || *c == '\\')) {
+            *out++ = '\\';
+            *out++ = (char)*c;
+        } else if (escape == ESCAPE_JSON && *c < 0x20) {
+            *out++ = '\\';
+            if (*c == '\n') {
+                *out++ = 'n';
+            } else if (*c == '\r') {
+                *out++ = 'r';
+            } else if (*c == '\t') {
+                *out++ = 't';
+            } else {
+                memcpy(out, "u00", 3);
+                out += 3;
+                *out++ = hex[*c >> 4];
+                *out++ = hex[*c & 0x0F];
+            }
+        } else {
+            *out++ = (char)*c;
+        }
+    }
+    return out;
+}
+
+// Length of a rendered template, not counting the terminator, or -1 if a
+// value may not be used
+static long rendered_length(const curly_plan_t *plan, const template_t *tmpl) {
+    long length = 0;
+    for (int i = 0; i < tmpl->segment_count; i++) {
+        const segment_t *segment = &tmpl->segments[i];
+        if (segment->var < 0) {
+            length += (long)segment->length;
+            continue;
+        }
+
+        long value_length = escaped_length(plan->values[segment->var], tmpl->escape);
+        if (value_length < 0) {
+            return -1;
+        }
+        length += value_length;
+    }
+    return length;
+}
+
+// Write a rendered template and its terminator; out must be large enough
+static char *render(const curly_plan_t *plan, const template_t *tmpl, char *out) {
+    for (int i = 0; i < tmpl->segment_count; i++) {
+        const segment_t *segment = &tmpl->segments[i];
+        if (segment->var < 0) {
+            memcpy(out, segment->text, segment->length);
+            out += segment->length;
+        } else {
+            out = write_escaped(out, plan->values[segment->var], tmpl->escape);
+        }
+    }
+    *out++ = '\0';
+    return out;
+}
+
+static int reserve(scratch_t *scratch, size_t size) {
+    if (size <= scratch->capacity) {
+        return 0;
+    }
+
+    size_t capacity = scratch->capacity ? scratch->capacity : 256;
+    while (capacity < size) {
+        capacity *= 2;
+    }
+
+    char *data = (char *)realloc(scratch->data, capacity);
+    if (!data) {
+        return -1;
+    }
+    scratch->data = data;
+    scratch->capacity = capacity;
+    return 0;
+}
+
+// Look up the value of every variable the plan uses
+static curly_error_t bind_values(curly_plan_t *plan, const curly_var_t *vars, size_t var_count) {
+    for (int i = 0; i < plan->var_count; i++) {
+        const var_name_t *name = &plan->var_names[i];
+        plan->values[i] = NULL;
+
+        for (size_t j = 0; j < var_count; j++) {
+            if (vars[j].name && vars[j].value &&
+                strncmp(vars[j].name, name->name, name->length) == 0 && vars[j].name[name->length] == '\0') {
+                plan->values[i] = vars[j].value;
+                break;
+            }
+        }
+
+        if (!plan->values[i]) {
+            return CURLY_ERROR_MISSING_VARIABLE;
+        }
+    }
+    return CURLY_OK;
+}
+
+static curly_error_t apply_url(curly_plan_t *plan) {
+    long length = rendered_length(plan, &plan->url_template);
+    if (length < 0) {
+        return CURLY_ERROR_MISSING_VARIABLE;
+    }
+    if (reserve(&plan->url_scratch, (size_t)length + 1) != 0) {
+        return CURLY_ERROR_MEMORY_ALLOCATION;
+    }
+
+    render(plan, &plan->url_template, plan->url_scratch.data);
+    curl_easy_setopt(plan->curl, CURLOPT_URL, plan->url_scratch.data);
+    return CURLY_OK;
+}
+
+// Render every templated header line into one buffer and point the
+// header list at it. libcurl reads the list during the transfer and never
+// frees it, so the nodes are reused as they are.
+static curly_error_t apply_headers(curly_plan_t *plan) {
+    size_t total = 0;
+    for (int i = 0; i < plan->header_count; i++) {
+        if (plan->header_templates[i].var_count > 0) {
+            long length = rendered_length(plan, &plan->header_templates[i]);
+            if (length < 0) {
+                return CURLY_ERROR_MISSING_VARIABLE;
+            }
+            total += (size_t)length + 1;
+        }
+    }
+    if (reserve(&plan->header_scratch, total) != 0) {
+        return CURLY_ERROR_MEMORY_ALLOCATION;
+    }
+
+    char *out = plan->header_scratch.data;
+    for (int i = 0; i < plan->header_count; i++) {
+        if (plan->header_templates[i].var_count > 0) {
+            plan->header_nodes[i].data = out;
+            out = render(plan, &plan->header_templates[i], out);
+        }
+    }
+    return CURLY_OK;
+}
+
+static curly_error_t apply_body(curly_plan_t *plan) {
+    long length = rendered_length(plan, &plan->body_template);
+    if (length < 0) {
+        return CURLY_ERROR_MISSING_VARIABLE;
+    }
+    if (reserve(&plan->body_scratch, (size_t)length + 1) != 0) {
+        return CURLY_ERROR_MEMORY_ALLOCATION;
+    }
+
+    render(plan, &plan->body_template, plan->body_scratch.data);
+    curl_easy_setopt(plan->curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)length);
+    curl_easy_setopt(plan->curl, CURLOPT_POSTFIELDS, plan->body_scratch.data);
+    return CURLY_OK;
+}
+
+// Compile the header lines of the prebuilt list. If any has a variable,
+// libcurl is given a copy of the list whose templated lines are filled
+// in by each execution.
+static int compile_headers(curly_plan_t *plan) {
+    for (struct curl_slist *node = plan->request.headers; node; node = node->next) {
+        plan->header_count++;
+    }
+    if (plan->header_count == 0) {
+        return 0;
+    }
+
+    plan->header_templates = (template_t *)calloc(plan->header_count, sizeof(template_t));
+    if (!plan->header_templates) {
+        return -1;
+    }
+
+    int index = 0;
+    for (struct curl_slist *node = plan->request.headers; node; node = node->next, index++) {
+        if (compile_template(plan, &plan->header_templates[index], node->data, ESCAPE_HEADER) != 0) {
+            return -1;
+        }
+        if (plan->header_templates[index].var_count > 0) {
+            plan->headers_templated = 1;
+        }
+    }
+
+    if (!plan->headers_templated) {
+        return 0;
+    }
+
+    plan->header_nodes = (struct curl_slist *)calloc(plan->header_count, sizeof(struct curl_slist));
+    if (!plan->header_nodes) {
+        return -1;
+    }
+
+    index = 0;
+    for (struct curl_slist *node = plan->request.headers; node; node = node->next, index++) {
+        plan->header_nodes[index].data = node->data;
+        plan->header_nodes[index].next = node->next ? &plan->header_nodes[index + 1] : NULL;
+    }
+    curl_easy_setopt(plan->curl, CURLOPT_HTTPHEADER, plan->header_nodes);
+    return 0;
+}
+
+curly_error_t curly_plan_compile(const curly_config_t *config, curly_plan_t **plan) {
+    if (!config || !plan || !config->url) {
+        return CURLY_ERROR_INVALID_JSON;
+    }
+    *plan = NULL;
+
+    curly_plan_t *compiled = (curly_plan_t *)calloc(1, sizeof(curly_plan_t));
+    if (!compiled) {
+        return CURLY_ERROR_MEMORY_ALLOCATION;
+    }
+
+    compiled->curl = curl_easy_init();
+    if (!compiled->curl) {
+        free(compiled);
+        return CURLY_ERROR_CURL_INIT;
+    }
+
+    // Everything that does not vary is applied to the handle once
+    curly_error_t error = curly_request_setup(compiled->curl, config, NULL, &compiled->request);
+    if (error != CURLY_OK) {
+        curl_easy_cleanup(compiled->curl);
+        free(compiled);
+        return error;
+    }
+    curly_retry_policy_from_json(&compiled->policy, config->retry);
+
+    compiled->url = malloc(strlen(config->url) + 1);
+    if (!compiled->url) {
+        curly_plan_free(compiled);
+        return CURLY_ERROR_MEMORY_ALLOCATION;
+    }
+    strcpy(compiled->url, config->url);
+
+    if (compile_template(compiled, &compiled->url_template, compiled->url, ESCAPE_URL) != 0 ||
+        compile_headers(compiled) != 0 ||
+        (compiled->request.body &&
+         compile_template(compiled, &compiled->body_template, compiled->request.body, ESCAPE_JSON) != 0)) {
+        curly_plan_free(compiled);
+        return CURLY_ERROR_MEMORY_ALLOCATION;
+    }
+
+    if (compiled->var_count > 0) {
+        compiled->values = (const char **)calloc(compiled->var_count, sizeof(const char *));
+        if (!compiled->values) {
+            curly_plan_free(compiled);
+            return CURLY_ERROR_MEMORY_ALLOCATION;
+        }
+    }
+
+    *plan = compiled;
+    return CURLY_OK;
+}
+
+curly_error_t curly_plan_execute(curly_plan_t *plan, const curly_var_t *vars, size_t var_count, curly_sink_t *sink) {
+    if (!plan || !sink) {
+        return CURLY_ERROR_INVALID_JSON;
+    }
+
+    // Only the parts with placeholders are rendered again
+    curly_error_t error = bind_values(plan, vars, var_count);
+    if (error == CURLY_OK && plan->url_template.var_count > 0) {
+        error = apply_url(plan);
+    }
+    if (error == CURLY_OK && plan->headers_templated) {
+        error = apply_headers(plan);
+    }
+    if (error == CURLY_OK && plan->body_template.var_count > 0) {
+        error = apply_body(plan);
+    }
+    if (error != CURLY_OK) {
+        return error;
+    }
+
+    CURLcode curl_res = curly_request_perform(plan->curl, &plan->policy, sink);
+    if (curl_res != CURLE_OK) {
+        fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(curl_res));
+        curly_sink_finish(sink, 0);
+        return CURLY_ERROR_CURL_PERFORM;
+    }
+
+    return curly_sink_finish(sink, 1);
+}
+
+static void free_template(template_t *tmpl) {
+    free(tmpl->segments);
+    memset(tmpl, 0, sizeof(template_t));
+}
+
+void curly_plan_free(curly_plan_t *plan) {
+    if (!plan) return;
+
+    if (plan->curl) {
+        curl_easy_cleanup(plan->curl);
+    }
+    curly_request_cleanup(&plan->request);
+
+    free_template(&plan->url_template);
+    free_template(&plan->body_template);
+    if (plan->header_templates) {
+        for (int i = 0; i < plan->header_count; i++) {
+            free_template(&plan->header_templates[i]);
+        }
+        free(plan->header_templates);
+    }
+
+    free(plan->header_nodes);
+    free(plan->var_names);
+    free(plan->values);
+    free(plan->url);
+    free(plan->url_scratch.data);
+    free(plan->header_scratch.data);
+    free(plan->body_scratch.data);
+    free(plan);
+}
@@ -0,0 +1,155 @@
+#include "queue.h"
+#include <stdlib.h>
+#include <string.h>
+
+int curly_queue_init(curly_queue_t *queue, size_t capacity) {
+    size_t size = 2;
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    memset(queue, 0, sizeof(curly_queue_t));
+    queue->slots = (curly_queue_slot_t *)malloc(size * sizeof(curly_queue_slot_t));
+    if (!queue->slots) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < size; i++) {
+        queue->slots[i].sequence = i;
+        queue->slots[i].item = NULL;
+    }
+    queue->mask = size - 1;
+
+    if (pthread_mutex_init(&queue->mutex, NULL) != 0) {
+        free(queue->slots);
+        return -1;
+    }
+
+    if (pthread_cond_init(&queue->not_full, NULL) != 0) {
+        pthread_mutex_destroy(&queue->mutex);
+        free(queue->slots);
+        return -1;
+    }
+
+    return 0;
+}
+
+int curly_queue_try_push(curly_queue_t *queue, void *item) {
+    size_t pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+
+    while (1) {
+        curly_queue_slot_t *slot = &queue->slots[pos & queue->mask];
+        size_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+
+        if (sequence == pos) {
+            if (__atomic_compare_exchange_n(&queue->enqueue_pos, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                slot->item = item;
+                __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+                return 0;
+            }
+        } else if (sequence < pos) {
+            return -1;  // The slot still holds an item from the previous lap
+        } else {
+            pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+int curly_queue_try_pop(curly_queue_t *queue, void **items, int max) {
+    size_t pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+    int ready;
+
+    while (1) {
+        // Count the consecutive ready slots from pos
+        ready = 0;
+        while (ready < max) {
+            curly_queue_slot_t *slot = &queue->slots[(pos + ready) & queue->mask];
+            if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != pos + ready + 1) {
+                break;
+            }
+            ready++;
+        }
+
+        if (ready == 0) {
+            size_t current = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+            if (current == pos) {
+                return 0;
+            }
+            pos = current;  // Another consumer got there first
+            continue;
+        }
+
+        if (__atomic_compare_exchange_n(&queue->dequeue_pos, &pos, pos + ready, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            for (int i = 0; i < ready; i++) {
+                curly_queue_slot_t *slot = &queue->slots[(pos + i) & queue->mask];
+                items[i] = slot->item;
+                __atomic_store_n(&slot->sequence, pos + i + queue->mask + 1, __ATOMIC_RELEASE);
+            }
+            break;
+        }
+    }
+
+    // Slots were freed; let a sleeping producer continue
+    if (__atomic_load_n(&queue->writer_waiting, __ATOMIC_SEQ_CST) &&
+        __atomic_exchange_n(&queue->writer_waiting, 0, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&queue->mutex);
+        pthread_cond_broadcast(&queue->not_full);
+        pthread_mutex_unlock(&queue->mutex);
+    }
+
+    return ready;
+}
+
+int curly_queue_push(curly_queue_t *queue, void *item) {
+    while (1) {
+        if (__atomic_load_n(&queue->shutdown, __ATOMIC_SEQ_CST)) {
+            return -1;
+        }
+        if (curly_queue_try_push(queue, item) == 0) {
+            return 0;
+        }
+
+        // Announce that we are waiting, then check again so no wakeup is missed
+        pthread_mutex_lock(&queue->mutex);
+        __atomic_store_n(&queue->writer_waiting, 1, __ATOMIC_SEQ_CST);
+        if (curly_queue_try_push(queue, item) == 0) {
+            pthread_mutex_unlock(&queue->mutex);
+            return 0;
+        }
+        if (!__atomic_load_n(&queue->shutdown, __ATOMIC_SEQ_CST)) {
+            pthread_cond_wait(&queue->not_full, &queue->mutex);
+        }
+        pthread_mutex_unlock(&queue->mutex);
+    }
+}
+
+int curly_queue_pop(curly_queue_t *queue, void **items, int max) {
+    int count = curly_queue_try_pop(queue, items, max);
+    if (count > 0) {
+        return count;
+    }
+
+    // Everything pushed before shutdown is visible once shutdown is
+    if (__atomic_load_n(&queue->shutdown, __ATOMIC_SEQ_CST)) {
+        count = curly_queue_try_pop(queue, items, max);
+        return count > 0 ? count : -1;
+    }
+
+    return 0;
+}
+
+void curly_queue_shutdown(curly_queue_t *queue) {
+    pthread_mutex_lock(&queue->mutex);
+    __atomic_store_n(&queue->shutdown, 1, __ATOMIC_SEQ_CST);
+    pthread_cond_broadcast(&queue->not_full);
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+void curly_queue_destroy(curly_queue_t *queue) {
+    pthread_cond_destroy(&queue->not_full);
+    pthread_mutex_destroy(&queue->mutex);
+    free(queue->slots);
+    queue->slots = NULL;
+}
@@ -0,0 +1,97 @@
+#ifndef CURLY_QUEUE_H
+#define CURLY_QUEUE_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#define CURLY_QUEUE_CACHE_LINE 64
+
+// Ring slot; sequence tells producers and consumers whose turn it is
+typedef struct {
+    size_t sequence;  // Accessed atomically
+    void *item;
+} curly_queue_slot_t;
+
+/**
+ * Bounded lock-free multi-producer/multi-consumer queue of pointers. The
+ * mutex and condition variable are only used to put a producer to sleep
+ * while the queue is full; consumers never block.
+ */
+typedef struct {
+    curly_queue_slot_t *slots;
+    size_t mask;
+    char pad0[CURLY_QUEUE_CACHE_LINE];
+    size_t enqueue_pos;  // Accessed atomically
+    char pad1[CURLY_QUEUE_CACHE_LINE];
+    size_t dequeue_pos;  // Accessed atomically
+    char pad2[CURLY_QUEUE_CACHE_LINE];
+    int shutdown;        // Accessed atomically
+    int writer_waiting;  // Set (atomically) while a producer sleeps on not_full
+    pthread_mutex_t mutex;
+    pthread_cond_t not_full;
+} curly_queue_t;
+
+/**
+ * Initialize a queue
+ *
+ * @param queue Queue to initialize
+ * @param capacity Number of items it holds, rounded up to a power of two
+ * @return 0 on success, -1 on failure
+ */
+int curly_queue_init(curly_queue_t *queue, size_t capacity);
+
+/**
+ * Add an item without blocking
+ *
+ * @param queue Queue
+ * @param item Item to add
+ * @return 0 on success, -1 if the queue is full
+ */
+int curly_queue_try_push(curly_queue_t *queue, void *item);
+
+/**
+ * Take up to max items in one claim without blocking. Wakes a producer
+ * sleeping in curly_queue_push() if any were taken.
+ *
+ * @param queue Queue
+ * @param items Receives the items, in queue order
+ * @param max Most items to take
+ * @return Number of items taken
+ */
+int curly_queue_try_pop(curly_queue_t *queue, void **items, int max);
+
+/**
+ * Add an item, sleeping while the queue is full
+ *
+ * @param queue Queue
+ * @param item Item to add
+ * @return 0 on success, -1 after shutdown
+ */
+int curly_queue_push(curly_queue_t *queue, void *item);
+
+/**
+ * Take up to max items without blocking
+ *
+ * @param queue Queue
+ * @param items Receives the items, in queue order
+ * @param max Most items to take
+ * @return Number of items taken, or -1 if the queue is empty and shut down
+ */
+int curly_queue_pop(curly_queue_t *queue, void **items, int max);
+
+/**
+ * Shut a queue down. Later pushes fail, a sleeping producer is woken,
+ * and pops drain what is left before reporting the end.
+ *
+ * @param queue Queue
+ */
+void curly_queue_shutdown(curly_queue_t *queue);
+
+/**
+ * Free a queue. Items still in it are not freed; take them out first.
+ *
+ * @param queue Queue
+ */
+void curly_queue_destroy(curly_queue_t *queue);
+
+#endif /* CURLY_QUEUE_H */
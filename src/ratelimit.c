@@ -0,0 +1,96 @@
+#include "ratelimit.h"
+#include <time.h>
+
+#define DEFAULT_BURST_MS 1000L
+
+// Read a non-negative rate from a JSON integer or real
+static double json_rate(const json_t *value, double fallback) {
+    if (json_is_number(value) && json_number_value(value) >= 0) {
+        return json_number_value(value);
+    }
+    return fallback;
+}
+
+void curly_rate_bucket_init(curly_rate_bucket_t *bucket, double rate, long burst_ms) {
+    bucket->tat_ns = 0;
+    bucket->ns_per_unit = rate > 0 ? 1e9 / rate : 0;
+    bucket->burst_ns = burst_ms > 0 ? (long long)burst_ms * 1000000 : 0;
+}
+
+int curly_rate_bucket_active(const curly_rate_bucket_t *bucket) {
+    return bucket->ns_per_unit > 0;
+}
+
+long curly_rate_bucket_delay(const curly_rate_bucket_t *bucket, long long now_ns) {
+    if (bucket->ns_per_unit <= 0) {
+        return 0;
+    }
+
+    long long tat = __atomic_load_n(&bucket->tat_ns, __ATOMIC_RELAXED);
+    long long wait = tat - bucket->burst_ns - now_ns;
+    if (wait <= 0) {
+        return 0;
+    }
+
+    // Round up so the caller never comes back too early
+    return (long)((wait + 999999) / 1000000);
+}
+
+void curly_rate_bucket_take(curly_rate_bucket_t *bucket, double units, long long now_ns) {
+    if (bucket->ns_per_unit <= 0) {
+        return;
+    }
+
+    long long cost = (long long)(units * bucket->ns_per_unit);
+    long long tat = __atomic_load_n(&bucket->tat_ns, __ATOMIC_RELAXED);
+    long long next;
+
+    do {
+        // Unused capacity does not pile up beyond the burst
+        next = (tat > now_ns ? tat : now_ns) + cost;
+    } while (!__atomic_compare_exchange_n(&bucket->tat_ns, &tat, next, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+long long curly_rate_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void curly_rate_limit_init(curly_rate_limit_t *limit) {
+    memset(limit, 0, sizeof(curly_rate_limit_t));
+    limit->burst_ms = DEFAULT_BURST_MS;
+}
+
+void curly_rate_limit_from_json(curly_rate_limit_t *limit, const json_t *object) {
+    if (!json_is_object(object)) {
+        return;
+    }
+
+    limit->bytes_per_sec = (curl_off_t)json_rate(json_object_get(object, "max_rate"), (double)limit->bytes_per_sec);
+    limit->host_bytes_per_sec = (curl_off_t)json_rate(json_object_get(object, "host_max_rate"),
+                                                      (double)limit->host_bytes_per_sec);
+    limit->requests_per_sec = json_rate(json_object_get(object, "max_requests"), limit->requests_per_sec);
+    limit->host_requests_per_sec = json_rate(json_object_get(object, "host_max_requests"),
+                                             limit->host_requests_per_sec);
+
+    double burst = json_rate(json_object_get(object, "burst"), -1);
+    if (burst > 0) {
+        limit->burst_ms = (long)(burst * 1000);
+    }
+}
+
+curly_error_t curly_parse_rate_limit(const char *json_str, curly_rate_limit_t *limit) {
+    json_error_t error;
+    json_t *root = json_loads(json_str, 0, &error);
+    if (!root || !json_is_object(root)) {
+        if (root) json_decref(root);
+        return CURLY_ERROR_INVALID_JSON;
+    }
+
+    json_t *object = json_object_get(root, "rate_limit");
+    curly_rate_limit_from_json(limit, object ? object : root);
+
+    json_decref(root);
+    return CURLY_OK;
+}
@@ -0,0 +1,70 @@
+#ifndef CURLY_RATELIMIT_H
+#define CURLY_RATELIMIT_H
+
+#include "curly.h"
+
+/**
+ * Token bucket shared by any number of threads, kept as a single atomic
+ * "theoretical arrival time" (the generic cell rate algorithm). Taking
+ * units pushes that time forward by units / rate; a caller may go ahead
+ * while it lies no more than the burst ahead of the clock, and otherwise
+ * learns how long to wait. Nothing ever sleeps inside the bucket, so
+ * callers can park work on a timer instead of blocking a thread.
+ */
+typedef struct {
+    long long tat_ns;       // Theoretical arrival time, accessed atomically
+    double ns_per_unit;     // 0 when the bucket does not limit anything
+    long long burst_ns;     // How far tat_ns may run ahead of the clock
+} curly_rate_bucket_t;
+
+/**
+ * Initialize a bucket
+ *
+ * @param bucket Bucket to initialize
+ * @param rate Units per second, 0 or less for no limit
+ * @param burst_ms How much of the rate may be used at once, in milliseconds
+ */
+void curly_rate_bucket_init(curly_rate_bucket_t *bucket, double rate, long burst_ms);
+
+/**
+ * Check whether a bucket limits anything
+ *
+ * @param bucket Bucket
+ * @return Non-zero if the bucket has a rate
+ */
+int curly_rate_bucket_active(const curly_rate_bucket_t *bucket);
+
+/**
+ * Get how long a caller must wait before it may take from the bucket
+ *
+ * @param bucket Bucket
+ * @param now_ns Current monotonic time in nanoseconds
+ * @return Delay in milliseconds, 0 if the caller may go ahead now
+ */
+long curly_rate_bucket_delay(const curly_rate_bucket_t *bucket, long long now_ns);
+
+/**
+ * Take units from the bucket, going into debt if need be. Later callers
+ * wait until the debt is paid off.
+ *
+ * @param bucket Bucket
+ * @param units Units consumed
+ * @param now_ns Current monotonic time in nanoseconds
+ */
+void curly_rate_bucket_take(curly_rate_bucket_t *bucket, double units, long long now_ns);
+
+/**
+ * Fill in rate limits from a parsed "rate_limit" object. Fields that are
+ * missing or invalid keep their values.
+ *
+ * @param limit Limits to update
+ * @param object Parsed "rate_limit" object, or NULL
+ */
+void curly_rate_limit_from_json(curly_rate_limit_t *limit, const json_t *object);
+
+/**
+ * Current monotonic time in nanoseconds
+ */
+long long curly_rate_now_ns(void);
+
+#endif /* CURLY_RATELIMIT_H */
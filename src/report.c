@@ -0,0 +1,389 @@
+#include "report.h"
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CACHE_LINE_SIZE 64
+#define REPORT_RING_SIZE 16384          // Results buffered between drains, a power of two
+#define REPORT_FLUSH_MS 50              // How often the reporter drains the ring
+#define REPORT_FULL_WAIT_NS 1000000L    // Back-off of a worker that found the ring full
+
+// Counters of one stripe, each on its own cache line
+typedef struct {
+    uint64_t queued;    // All accessed atomically
+    uint64_t started;
+    uint64_t done;
+    uint64_t failed;
+    uint64_t bytes;
+    char pad[CACHE_LINE_SIZE - 5 * sizeof(uint64_t)];
+} report_stripe_t;
+
+// Ring slot; sequence tells the workers and the reporter whose turn it is
+typedef struct {
+    size_t sequence;    // Accessed atomically
+    curly_result_kind_t kind;
+    curly_error_t error;
+    const char *url;
+    const char *destination;
+    void *owned;
+} report_slot_t;
+
+// Sums over all stripes
+typedef struct {
+    uint64_t queued;
+    uint64_t started;
+    uint64_t done;
+    uint64_t failed;
+    uint64_t bytes;
+} report_totals_t;
+
+struct curly_reporter {
+    report_stripe_t *stripes;
+    int stripe_count;
+
+    report_slot_t *ring;        // Multi-producer, single-consumer
+    char pad0[CACHE_LINE_SIZE];
+    size_t enqueue_pos;         // Accessed atomically
+    char pad1[CACHE_LINE_SIZE];
+    size_t dequeue_pos;         // Only touched by the reporter thread
+    int input_done;             // Accessed atomically
+
+    FILE *log;
+    void (*release)(void *);
+    long progress_interval_ms;
+    int progress_tty;           // Progress rewrites one line on a terminal
+    int progress_shown;         // A progress line is on screen without a newline
+
+    long long start_ns;
+    long long last_progress_ns;
+    report_totals_t last;       // Totals at the last progress line
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t wake;
+    int urgent;                 // A worker is waiting for room in the ring
+    int stopping;
+};
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static report_stripe_t *stripe_of(curly_reporter_t *reporter, int stripe) {
+    return &reporter->stripes[(unsigned)stripe % (unsigned)reporter->stripe_count];
+}
+
+static void sum_stripes(curly_reporter_t *reporter, report_totals_t *totals) {
+    memset(totals, 0, sizeof(*totals));
+    for (int i = 0; i < reporter->stripe_count; i++) {
+        report_stripe_t *s = &reporter->stripes[i];
+        totals->queued += __atomic_load_n(&s->queued, __ATOMIC_RELAXED);
+        totals->started += __atomic_load_n(&s->started, __ATOMIC_RELAXED);
+        totals->done += __atomic_load_n(&s->done, __ATOMIC_RELAXED);
+        totals->failed += __atomic_load_n(&s->failed, __ATOMIC_RELAXED);
+        totals->bytes += __atomic_load_n(&s->bytes, __ATOMIC_RELAXED);
+    }
+}
+
+static const char *kind_name(curly_result_kind_t kind) {
+    switch (kind) {
+        case CURLY_RESULT_DOWNLOADED:
+            return "downloaded";
+        case CURLY_RESULT_UNCHANGED:
+            return "unchanged";
+        case CURLY_RESULT_SKIPPED:
+            return "skipped";
+        default:
+            return "failed";
+    }
+}
+
+// Take the progress line off the terminal before printing over it
+static void clear_progress(curly_reporter_t *reporter) {
+    if (reporter->progress_shown) {
+        fputs("\r\033[K", stderr);
+        reporter->progress_shown = 0;
+    }
+}
+
+// Write one result where it belongs
+static void write_result(curly_reporter_t *reporter, const report_slot_t *slot) {
+    if (reporter->log) {
+        if (slot->kind == CURLY_RESULT_FAILED) {
+            fprintf(reporter->log, "%s\t%s\t%s\t%s\n", kind_name(slot->kind), slot->url, slot->destination,
+                    curly_strerror(slot->error));
+        } else {
+            fprintf(reporter->log, "%s\t%s\t%s\n", kind_name(slot->kind), slot->url, slot->destination);
+        }
+        return;
+    }
+
+    if (slot->kind == CURLY_RESULT_FAILED) {
+        clear_progress(reporter);
+        fprintf(stderr, "Failed to download %s: %s\n", slot->url, curly_strerror(slot->error));
+    } else if (reporter->progress_interval_ms <= 0) {
+        // The progress line stands in for the successes
+        const char *verb = slot->kind == CURLY_RESULT_DOWNLOADED ? "Downloaded" :
+                           slot->kind == CURLY_RESULT_UNCHANGED ? "Unchanged" : "Skipped";
+        fprintf(stdout, "%s %s -> %s\n", verb, slot->url, slot->destination);
+    }
+}
+
+// Write out every result in the ring, flushing once for the whole batch.
+// Returns the number written.
+static size_t drain_ring(curly_reporter_t *reporter) {
+    size_t count = 0;
+
+    for (;;) {
+        report_slot_t *slot = &reporter->ring[reporter->dequeue_pos & (REPORT_RING_SIZE - 1)];
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != reporter->dequeue_pos + 1) {
+            break;
+        }
+
+        write_result(reporter, slot);
+        if (slot->owned) {
+            reporter->release(slot->owned);
+        }
+        __atomic_store_n(&slot->sequence, reporter->dequeue_pos + REPORT_RING_SIZE, __ATOMIC_RELEASE);
+        reporter->dequeue_pos++;
+        count++;
+    }
+
+    if (count > 0) {
+        fflush(reporter->log ? reporter->log : stdout);
+        fflush(stderr);
+    }
+    return count;
+}
+
+// Format a duration as h:mm:ss or m:ss
+static void format_duration(double seconds, char *out, size_t size) {
+    long total = (long)(seconds + 0.5);
+    if (total >= 3600) {
+        snprintf(out, size, "%ld:%02ld:%02ld", total / 3600, total / 60 % 60, total % 60);
+    } else {
+        snprintf(out, size, "%ld:%02ld", total / 60, total % 60);
+    }
+}
+
+static void print_progress(curly_reporter_t *reporter, long long now) {
+    report_totals_t totals;
+    sum_stripes(reporter, &totals);
+
+    double interval = (now - reporter->last_progress_ns) / 1e9;
+    double elapsed = (now - reporter->start_ns) / 1e9;
+    uint64_t finished = totals.done + totals.failed;
+    uint64_t last_finished = reporter->last.done + reporter->last.failed;
+    double files_per_sec = interval > 0 ? (finished - last_finished) / interval : 0;
+    double mb_per_sec = interval > 0 ? (totals.bytes - reporter->last.bytes) / interval / 1e6 : 0;
+
+    // The ETA uses the average rate so far, which moves less than the
+    // current one
+    char total[32];
+    char eta[32];
+    if (__atomic_load_n(&reporter->input_done, __ATOMIC_ACQUIRE)) {
+        snprintf(total, sizeof(total), "%llu", (unsigned long long)totals.queued);
+        double average = elapsed > 0 ? finished / elapsed : 0;
+        if (finished >= totals.queued) {
+            snprintf(eta, sizeof(eta), "0:00");
+        } else if (average > 0) {
+            format_duration((totals.queued - finished) / average, eta, sizeof(eta));
+        } else {
+            snprintf(eta, sizeof(eta), "--");
+        }
+    } else {
+        snprintf(total, sizeof(total), "?");
+        snprintf(eta, sizeof(eta), "--");
+    }
+
+    uint64_t in_flight = totals.started > finished ? totals.started - finished : 0;
+    clear_progress(reporter);
+    fprintf(stderr, "%llu/%s files, %llu failed, %.1f files/s, %.1f MB/s, %llu in flight, ETA %s",
+            (unsigned long long)finished, total, (unsigned long long)totals.failed, files_per_sec, mb_per_sec,
+            (unsigned long long)in_flight, eta);
+    if (reporter->progress_tty) {
+        reporter->progress_shown = 1;
+    } else {
+        fputc('\n', stderr);
+    }
+    fflush(stderr);
+
+    reporter->last = totals;
+    reporter->last_progress_ns = now;
+}
+
+static void print_final(curly_reporter_t *reporter) {
+    report_totals_t totals;
+    sum_stripes(reporter, &totals);
+    double elapsed = (now_ns() - reporter->start_ns) / 1e9;
+    uint64_t finished = totals.done + totals.failed;
+
+    clear_progress(reporter);
+    fprintf(stderr, "Done: %llu files, %llu failed, %.1f MB in %.1f s (%.1f files/s, %.1f MB/s)\n",
+            (unsigned long long)finished, (unsigned long long)totals.failed, totals.bytes / 1e6, elapsed,
+            elapsed > 0 ? finished / elapsed : 0, elapsed > 0 ? totals.bytes / elapsed / 1e6 : 0);
+    fflush(stderr);
+}
+
+static void *reporter_thread(void *arg) {
+    curly_reporter_t *reporter = (curly_reporter_t *)arg;
+
+    for (;;) {
+        drain_ring(reporter);
+
+        long long now = now_ns();
+        if (reporter->progress_interval_ms > 0 &&
+            now - reporter->last_progress_ns >= reporter->progress_interval_ms * 1000000LL) {
+            print_progress(reporter, now);
+        }
+
+        pthread_mutex_lock(&reporter->mutex);
+        if (reporter->stopping) {
+            pthread_mutex_unlock(&reporter->mutex);
+            break;
+        }
+        if (!reporter->urgent) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_nsec += REPORT_FLUSH_MS * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&reporter->wake, &reporter->mutex, &deadline);
+        }
+        reporter->urgent = 0;
+        pthread_mutex_unlock(&reporter->mutex);
+    }
+
+    drain_ring(reporter);
+    if (reporter->progress_interval_ms > 0) {
+        print_final(reporter);
+    }
+    return NULL;
+}
+
+curly_reporter_t *curly_reporter_create(int stripes, FILE *log, long progress_interval_ms,
+                                        void (*release)(void *)) {
+    curly_reporter_t *reporter = (curly_reporter_t *)calloc(1, sizeof(curly_reporter_t));
+    if (!reporter) {
+        return NULL;
+    }
+
+    reporter->stripe_count = stripes > 0 ? stripes : 1;
+    void *memory = NULL;
+    if (posix_memalign(&memory, CACHE_LINE_SIZE, reporter->stripe_count * sizeof(report_stripe_t)) != 0) {
+        free(reporter);
+        return NULL;
+    }
+    reporter->stripes = (report_stripe_t *)memory;
+    memset(reporter->stripes, 0, reporter->stripe_count * sizeof(report_stripe_t));
+
+    reporter->ring = (report_slot_t *)malloc(REPORT_RING_SIZE * sizeof(report_slot_t));
+    if (!reporter->ring) {
+        free(reporter->stripes);
+        free(reporter);
+        return NULL;
+    }
+    for (size_t i = 0; i < REPORT_RING_SIZE; i++) {
+        reporter->ring[i].sequence = i;
+    }
+
+    reporter->log = log;
+    reporter->release = release;
+    reporter->progress_interval_ms = progress_interval_ms;
+    reporter->progress_tty = isatty(fileno(stderr));
+    reporter->start_ns = now_ns();
+    reporter->last_progress_ns = reporter->start_ns;
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&reporter->wake, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&reporter->mutex, NULL);
+
+    if (pthread_create(&reporter->thread, NULL, reporter_thread, reporter) != 0) {
+        pthread_cond_destroy(&reporter->wake);
+        pthread_mutex_destroy(&reporter->mutex);
+        free(reporter->ring);
+        free(reporter->stripes);
+        free(reporter);
+        return NULL;
+    }
+
+    return reporter;
+}
+
+void curly_reporter_destroy(curly_reporter_t *reporter) {
+    if (!reporter) return;
+
+    pthread_mutex_lock(&reporter->mutex);
+    reporter->stopping = 1;
+    pthread_cond_signal(&reporter->wake);
+    pthread_mutex_unlock(&reporter->mutex);
+    pthread_join(reporter->thread, NULL);
+
+    pthread_cond_destroy(&reporter->wake);
+    pthread_mutex_destroy(&reporter->mutex);
+    free(reporter->ring);
+    free(reporter->stripes);
+    free(reporter);
+}
+
+void curly_reporter_queued(curly_reporter_t *reporter, int stripe) {
+    __atomic_add_fetch(&stripe_of(reporter, stripe)->queued, 1, __ATOMIC_RELAXED);
+}
+
+void curly_reporter_input_done(curly_reporter_t *reporter) {
+    __atomic_store_n(&reporter->input_done, 1, __ATOMIC_RELEASE);
+}
+
+void curly_reporter_started(curly_reporter_t *reporter, int stripe) {
+    __atomic_add_fetch(&stripe_of(reporter, stripe)->started, 1, __ATOMIC_RELAXED);
+}
+
+void curly_reporter_bytes(curly_reporter_t *reporter, int stripe, size_t bytes) {
+    __atomic_add_fetch(&stripe_of(reporter, stripe)->bytes, (uint64_t)bytes, __ATOMIC_RELAXED);
+}
+
+void curly_reporter_result(curly_reporter_t *reporter, int stripe, curly_result_kind_t kind, curly_error_t error,
+                           const char *url, const char *destination, void *owned) {
+    report_stripe_t *counts = stripe_of(reporter, stripe);
+    if (kind == CURLY_RESULT_FAILED) {
+        __atomic_add_fetch(&counts->failed, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_add_fetch(&counts->done, 1, __ATOMIC_RELAXED);
+    }
+
+    for (;;) {
+        size_t pos = __atomic_load_n(&reporter->enqueue_pos, __ATOMIC_RELAXED);
+        report_slot_t *slot = &reporter->ring[pos & (REPORT_RING_SIZE - 1)];
+        size_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+
+        if (sequence == pos) {
+            if (__atomic_compare_exchange_n(&reporter->enqueue_pos, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                slot->kind = kind;
+                slot->error = error;
+                slot->url = url;
+                slot->destination = destination;
+                slot->owned = owned;
+                __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+                return;
+            }
+        } else if (sequence < pos) {
+            // Full: get the reporter draining and wait for room
+            pthread_mutex_lock(&reporter->mutex);
+            reporter->urgent = 1;
+            pthread_cond_signal(&reporter->wake);
+            pthread_mutex_unlock(&reporter->mutex);
+
+            struct timespec pause = {0, REPORT_FULL_WAIT_NS};
+            nanosleep(&pause, NULL);
+        }
+    }
+}
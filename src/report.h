@@ -0,0 +1,99 @@
+#ifndef CURLY_REPORT_H
+#define CURLY_REPORT_H
+
+#include "curly.h"
+
+/**
+ * Single output stage for parallel downloads. Worker threads only bump
+ * striped atomic counters and push results into a lock-free ring; one
+ * reporter thread drains the ring in batches into the results stream and
+ * periodically prints a progress line built from the counters. Workers
+ * never take a stdio lock.
+ */
+typedef struct curly_reporter curly_reporter_t;
+
+/**
+ * How a download ended
+ */
+typedef enum {
+    CURLY_RESULT_DOWNLOADED,
+    CURLY_RESULT_UNCHANGED,     // The server said the journal's copy is current
+    CURLY_RESULT_SKIPPED,       // The journal's copy was trusted without asking
+    CURLY_RESULT_FAILED
+} curly_result_kind_t;
+
+/**
+ * Create a reporter and start its thread
+ *
+ * @param stripes Number of counter stripes; give each worker thread its own
+ * @param log Stream for one TSV line per download, NULL to print results
+ *        as text to stdout (failures to stderr)
+ * @param progress_interval_ms How often to print a progress line to
+ *        stderr, 0 for never. With progress on and no log, only failures
+ *        are printed.
+ * @param release Frees the owned pointer of a written result
+ * @return New reporter, or NULL on failure
+ */
+curly_reporter_t *curly_reporter_create(int stripes, FILE *log, long progress_interval_ms,
+                                        void (*release)(void *));
+
+/**
+ * Write out every pending result, print the final progress line and stop
+ * the reporter thread. All workers must have stopped reporting.
+ *
+ * @param reporter Reporter to destroy, may be NULL
+ */
+void curly_reporter_destroy(curly_reporter_t *reporter);
+
+/**
+ * Count a job taken from the input
+ *
+ * @param reporter Reporter
+ * @param stripe Caller's counter stripe
+ */
+void curly_reporter_queued(curly_reporter_t *reporter, int stripe);
+
+/**
+ * Note that the input has ended, so the total is known and an ETA can be
+ * given
+ *
+ * @param reporter Reporter
+ */
+void curly_reporter_input_done(curly_reporter_t *reporter);
+
+/**
+ * Count a job a worker has started on. It stays in flight until its result
+ * is reported.
+ *
+ * @param reporter Reporter
+ * @param stripe Caller's counter stripe
+ */
+void curly_reporter_started(curly_reporter_t *reporter, int stripe);
+
+/**
+ * Count received body bytes
+ *
+ * @param reporter Reporter
+ * @param stripe Caller's counter stripe
+ * @param bytes Bytes received
+ */
+void curly_reporter_bytes(curly_reporter_t *reporter, int stripe, size_t bytes);
+
+/**
+ * Report how a download ended. The line is written later by the reporter
+ * thread, which then releases owned; url and destination must live until
+ * then, typically inside owned. Waits only when the ring is full.
+ *
+ * @param reporter Reporter
+ * @param stripe Caller's counter stripe
+ * @param kind How the download ended
+ * @param error Error for CURLY_RESULT_FAILED
+ * @param url URL of the download
+ * @param destination Destination path
+ * @param owned Passed to the release function once the line is written,
+ *        may be NULL
+ */
+void curly_reporter_result(curly_reporter_t *reporter, int stripe, curly_result_kind_t kind, curly_error_t error,
+                           const char *url, const char *destination, void *owned);
+
+#endif /* CURLY_REPORT_H */
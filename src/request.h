@@ -0,0 +1,80 @@
+#ifndef CURLY_REQUEST_H
+#define CURLY_REQUEST_H
+
+#include "curly.h"
+#include "retry.h"
+
+/**
+ * Resources libcurl keeps pointers to while a configured request runs.
+ * They must stay alive until the transfer is finished.
+ */
+typedef struct {
+    struct curl_slist *headers;
+    char *body;
+    curly_arena_t *arena;  // Arena holding headers and body, NULL if they are on the heap
+} curly_request_t;
+
+/**
+ * Initialize config from an already parsed JSON object
+ *
+ * @param root JSON object containing configuration
+ * @param config Pointer to config structure to be initialized
+ * @param arena Arena for the config, sharing root's fields; NULL to copy them to the heap
+ * @return CURLY_OK on success, error code otherwise
+ */
+curly_error_t curly_config_from_json(const json_t *root, curly_config_t *config, curly_arena_t *arena);
+
+/**
+ * Apply a request configuration to an easy handle. Output options (write
+ * callback and data) are left to the caller.
+ *
+ * @param curl Easy handle to configure
+ * @param config Request configuration
+ * @param arena Arena for the header list and body, NULL to allocate them on the heap
+ * @param request Receives the resources backing the configured options
+ * @return CURLY_OK on success, error code otherwise
+ */
+curly_error_t curly_request_setup(CURL *curl, const curly_config_t *config, curly_arena_t *arena,
+                                  curly_request_t *request);
+
+/**
+ * Perform a configured request into a sink, retrying transient failures
+ * with blocking sleeps as long as nothing has reached the sink. The sink
+ * is not finished.
+ *
+ * @param curl Configured easy handle
+ * @param policy Retry policy
+ * @param sink Destination for the response body
+ * @return Result of the last attempt
+ */
+CURLcode curly_request_perform(CURL *curl, const curly_retry_policy_t *policy, curly_sink_t *sink);
+
+/**
+ * Free resources held for a configured request
+ *
+ * @param request Request resources to free
+ */
+void curly_request_cleanup(curly_request_t *request);
+
+/**
+ * libcurl write callback delivering data to the curly_sink_t in userdata
+ */
+size_t curly_sink_write(char *ptr, size_t size, size_t nmemb, void *userdata);
+
+/**
+ * libcurl header callback for the curly_sink_t in userdata. Buffer sinks
+ * size their buffer from Content-Length before the body arrives.
+ */
+size_t curly_sink_header(char *ptr, size_t size, size_t nmemb, void *userdata);
+
+/**
+ * Finish a transfer into a sink. Buffer sinks are guaranteed a
+ * NUL-terminated body on success and are released on failure.
+ *
+ * @param sink Sink the transfer wrote to
+ * @param success Non-zero if the transfer succeeded
+ * @return CURLY_OK on success, error code otherwise
+ */
+curly_error_t curly_sink_finish(curly_sink_t *sink, int success);
+
+#endif /* CURLY_REQUEST_H */
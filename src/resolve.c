@@ -0,0 +1,389 @@
+#include "resolve.h"
+#include <ctype.h>
+#include <netdb.h>
+#include <stdint.h>
+#include <strings.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#define MAX_ADDRESSES 8          // Addresses kept per host
+#define MAX_RESOLVE_THREADS 64
+#define MAX_HOST_LENGTH 255
+#define MAX_KEY_LENGTH (MAX_HOST_LENGTH + 16)  // Host, colon and port
+#define INITIAL_SLOTS 64
+
+typedef struct {
+    char *key;          // "host:port", lowercased
+    size_t host_length; // Length of the host part of key
+    char *url;          // First URL seen for the host, NULL if only pinned statically
+    int pinned;         // Static entry or IP address, not looked up
+    struct curl_slist *entry;  // "HOST:PORT:ADDRESS[,ADDRESS]...", NULL until known
+} resolve_host_t;
+
+struct curly_resolver {
+    resolve_host_t *hosts;
+    size_t host_count;
+    size_t capacity;
+    size_t *slots;      // Open-addressing index of hosts by key, holding index + 1
+    size_t slot_count;
+    size_t next;        // Next host for a lookup thread, accessed atomically
+    size_t failed;      // Lookups that failed, accessed atomically
+    size_t *warm;       // Indexes of hosts with a URL
+    size_t warm_count;
+};
+
+// FNV-1a hash of a key
+static size_t hash_key(const char *key) {
+    uint64_t hash = 14695981039346656037ULL;
+    while (*key) {
+        hash ^= (unsigned char)*key++;
+        hash *= 1099511628211ULL;
+    }
+    return (size_t)hash;
+}
+
+// Find the slot holding a key, or the empty slot where it belongs
+static size_t *find_slot(const curly_resolver_t *resolver, size_t *slots, size_t slot_count, const char *key) {
+    size_t index = hash_key(key) & (slot_count - 1);
+    while (slots[index] && strcmp(resolver->hosts[slots[index] - 1].key, key) != 0) {
+        index = (index + 1) & (slot_count - 1);
+    }
+    return &slots[index];
+}
+
+// Host name prefixes from which libcurl guesses a scheme other than http
+static const char *const other_scheme_prefixes[] = {"ftp.", "dict.", "ldap.", "imap.", "smtp.", "pop3."};
+
+// Work out the "host:port" key of an http or https URL, or of a bare
+// "host[:port]", which is taken as http the way libcurl takes it. Returns
+// the length of the host part, or 0 for other schemes and malformed URLs.
+static size_t url_key(const char *url, size_t length, char key[MAX_KEY_LENGTH], int *literal, int *has_scheme) {
+    const char *end = url + length;
+    const char *start = url;
+    int port = 80;
+
+    *has_scheme = 0;
+    for (const char *p = url; p + 2 < end; p++) {
+        if (p[0] == ':' && p[1] == '/' && p[2] == '/') {
+            size_t scheme_length = (size_t)(p - url);
+            if (scheme_length == 5 && strncasecmp(url, "https", 5) == 0) {
+                port = 443;
+            } else if (scheme_length != 4 || strncasecmp(url, "http", 4) != 0) {
+                return 0;
+            }
+            start = p + 3;
+            *has_scheme = 1;
+            break;
+        }
+        if (!isalnum((unsigned char)*p) && *p != '+' && *p != '-' && *p != '.') {
+            break;
+        }
+    }
+
+    // Authority, without any user info
+    const char *authority_end = start;
+    while (authority_end < end && *authority_end != '/' && *authority_end != '?' && *authority_end != '#') {
+        authority_end++;
+    }
+    for (const char *p = start; p < authority_end; p++) {
+        if (*p == '@') {
+            start = p + 1;
+        }
+    }
+
+    // Host, with IPv6 addresses in brackets, and an optional port
+    const char *host_end = start;
+    *literal = 0;
+    if (start < authority_end && *start == '[') {
+        host_end = memchr(start, ']', (size_t)(authority_end - start));
+        if (!host_end) {
+            return 0;
+        }
+        host_end++;
+        *literal = 1;
+    } else {
+        while (host_end < authority_end && *host_end != ':') {
+            host_end++;
+        }
+    }
+    size_t host_length = (size_t)(host_end - start);
+    if (host_length == 0 || host_length > MAX_HOST_LENGTH) {
+        return 0;
+    }
+    if (host_end + 1 < authority_end && *host_end == ':') {
+        port = 0;
+        for (const char *p = host_end + 1; p < authority_end; p++) {
+            port = port * 10 + (*p - '0');
+            if (!isdigit((unsigned char)*p) || port > 65535) {
+                return 0;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < host_length; i++) {
+        key[i] = (char)tolower((unsigned char)start[i]);
+    }
+    key[host_length] = '\0';
+    if (!*has_scheme) {
+        for (size_t i = 0; i < sizeof(other_scheme_prefixes) / sizeof(other_scheme_prefixes[0]); i++) {
+            if (strncmp(key, other_scheme_prefixes[i], strlen(other_scheme_prefixes[i])) == 0) {
+                return 0;
+            }
+        }
+    }
+    if (!*literal) {
+        struct in_addr address;
+        *literal = inet_pton(AF_INET, key, &address) == 1;
+    }
+    snprintf(key + host_length, MAX_KEY_LENGTH - host_length, ":%d", port);
+    return host_length;
+}
+
+curly_resolver_t *curly_resolver_create(void) {
+    curly_resolver_t *resolver = (curly_resolver_t *)calloc(1, sizeof(curly_resolver_t));
+    if (!resolver) {
+        return NULL;
+    }
+    resolver->slot_count = INITIAL_SLOTS;
+    resolver->slots = (size_t *)calloc(resolver->slot_count, sizeof(size_t));
+    if (!resolver->slots) {
+        free(resolver);
+        return NULL;
+    }
+    return resolver;
+}
+
+void curly_resolver_destroy(curly_resolver_t *resolver) {
+    if (!resolver) return;
+
+    for (size_t i = 0; i < resolver->host_count; i++) {
+        free(resolver->hosts[i].key);
+        free(resolver->hosts[i].url);
+        curl_slist_free_all(resolver->hosts[i].entry);
+    }
+    free(resolver->hosts);
+    free(resolver->slots);
+    free(resolver->warm);
+    free(resolver);
+}
+
+// Find or add the host for a key. Returns NULL only when out of memory.
+static resolve_host_t *intern_host(curly_resolver_t *resolver, const char *key, size_t host_length) {
+    size_t *slot = find_slot(resolver, resolver->slots, resolver->slot_count, key);
+    if (*slot) {
+        return &resolver->hosts[*slot - 1];
+    }
+
+    // Keep the index at most half full
+    if ((resolver->host_count + 1) * 2 > resolver->slot_count) {
+        size_t slot_count = resolver->slot_count * 2;
+        size_t *slots = (size_t *)calloc(slot_count, sizeof(size_t));
+        if (!slots) {
+            return NULL;
+        }
+        for (size_t i = 0; i < resolver->host_count; i++) {
+            *find_slot(resolver, slots, slot_count, resolver->hosts[i].key) = i + 1;
+        }
+        free(resolver->slots);
+        resolver->slots = slots;
+        resolver->slot_count = slot_count;
+        slot = find_slot(resolver, slots, slot_count, key);
+    }
+    if (resolver->host_count == resolver->capacity) {
+        size_t capacity = resolver->capacity ? resolver->capacity * 2 : INITIAL_SLOTS;
+        resolve_host_t *hosts = (resolve_host_t *)realloc(resolver->hosts, capacity * sizeof(resolve_host_t));
+        if (!hosts) {
+            return NULL;
+        }
+        resolver->hosts = hosts;
+        resolver->capacity = capacity;
+    }
+
+    resolve_host_t *host = &resolver->hosts[resolver->host_count];
+    memset(host, 0, sizeof(resolve_host_t));
+    host->key = strdup(key);
+    if (!host->key) {
+        return NULL;
+    }
+    host->host_length = host_length;
+    *slot = ++resolver->host_count;
+    return host;
+}
+
+int curly_resolver_add_static(curly_resolver_t *resolver, const char *entry) {
+    // The key is everything before the second colon
+    const char *first = strchr(entry, ':');
+    const char *second = first ? strchr(first + 1, ':') : NULL;
+    if (!first || first == entry || first - entry > MAX_HOST_LENGTH || !second || second == first + 1 ||
+        second - first > 6 || !second[1]) {
+        return -1;
+    }
+
+    char key[MAX_KEY_LENGTH];
+    size_t length = (size_t)(second - entry);
+    for (size_t i = 0; i < length; i++) {
+        key[i] = (char)tolower((unsigned char)entry[i]);
+    }
+    key[length] = '\0';
+
+    resolve_host_t *host = intern_host(resolver, key, (size_t)(first - entry));
+    struct curl_slist *list = host ? curl_slist_append(NULL, entry) : NULL;
+    if (!list) {
+        return -1;
+    }
+    curl_slist_free_all(host->entry);
+    host->entry = list;
+    host->pinned = 1;
+    return 0;
+}
+
+int curly_resolver_add_url(curly_resolver_t *resolver, const char *url, size_t length) {
+    char key[MAX_KEY_LENGTH];
+    int literal, has_scheme;
+    size_t host_length = url_key(url, length, key, &literal, &has_scheme);
+    if (!host_length) {
+        return 0;
+    }
+
+    resolve_host_t *host = intern_host(resolver, key, host_length);
+    if (!host) {
+        return -1;
+    }
+    if (literal) {
+        host->pinned = 1;
+    }
+    if (!host->url) {
+        // A bare host gets a scheme so it can be warmed
+        size_t size = length + 9;
+        host->url = (char *)malloc(size);
+        if (!host->url) {
+            return -1;
+        }
+        snprintf(host->url, size, "%s%.*s", has_scheme ? "" : "http://", (int)length, url);
+    }
+    return 0;
+}
+
+// Format the addresses of a lookup as "ADDRESS,ADDRESS...", without duplicates
+static size_t format_addresses(const struct addrinfo *list, char *buffer, size_t size) {
+    size_t used = 0;
+    int count = 0;
+    buffer[0] = '\0';
+
+    for (const struct addrinfo *ai = list; ai && count < MAX_ADDRESSES; ai = ai->ai_next) {
+        char text[INET6_ADDRSTRLEN + 2];
+        if (ai->ai_family == AF_INET) {
+            inet_ntop(AF_INET, &((const struct sockaddr_in *)ai->ai_addr)->sin_addr, text, sizeof(text));
+        } else if (ai->ai_family == AF_INET6) {
+            text[0] = '[';
+            inet_ntop(AF_INET6, &((const struct sockaddr_in6 *)ai->ai_addr)->sin6_addr, text + 1, sizeof(text) - 2);
+            strcat(text, "]");
+        } else {
+            continue;
+        }
+
+        // Results for other socket types repeat an address
+        size_t text_length = strlen(text);
+        const char *found = strstr(buffer, text);
+        if (found && (found[text_length] == ',' || found[text_length] == '\0') &&
+            (found == buffer || found[-1] == ',')) {
+            continue;
+        }
+        used += (size_t)snprintf(buffer + used, size - used, "%s%s", count ? "," : "", text);
+        count++;
+    }
+    return used;
+}
+
+// Lookup thread: resolve hosts until none are left
+static void *resolve_thread(void *arg) {
+    curly_resolver_t *resolver = (curly_resolver_t *)arg;
+    size_t index;
+
+    while ((index = __atomic_fetch_add(&resolver->next, 1, __ATOMIC_RELAXED)) < resolver->host_count) {
+        resolve_host_t *host = &resolver->hosts[index];
+        if (host->pinned || host->entry) {
+            continue;
+        }
+
+        char name[MAX_HOST_LENGTH + 1];
+        memcpy(name, host->key, host->host_length);
+        name[host->host_length] = '\0';
+
+        struct addrinfo hints, *list = NULL;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(name, host->key + host->host_length + 1, &hints, &list) == 0) {
+            char entry[MAX_KEY_LENGTH + MAX_ADDRESSES * (INET6_ADDRSTRLEN + 3)];
+            size_t used = (size_t)snprintf(entry, sizeof(entry), "%s:", host->key);
+            if (format_addresses(list, entry + used, sizeof(entry) - used) > 0) {
+                host->entry = curl_slist_append(NULL, entry);
+            }
+            freeaddrinfo(list);
+        }
+        if (!host->entry) {
+            __atomic_add_fetch(&resolver->failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+size_t curly_resolver_run(curly_resolver_t *resolver, int threads) {
+    size_t pending = 0;
+    for (size_t i = 0; i < resolver->host_count; i++) {
+        if (!resolver->hosts[i].pinned && !resolver->hosts[i].entry) {
+            pending++;
+        }
+    }
+    if (threads > MAX_RESOLVE_THREADS) {
+        threads = MAX_RESOLVE_THREADS;
+    }
+    if ((size_t)threads > pending) {
+        threads = (int)pending;
+    }
+
+    // The calling thread takes a share of the lookups too
+    pthread_t workers[MAX_RESOLVE_THREADS];
+    int started = 0;
+    resolver->next = 0;
+    resolver->failed = 0;
+    while (started < threads - 1 && pthread_create(&workers[started], NULL, resolve_thread, resolver) == 0) {
+        started++;
+    }
+    if (pending > 0) {
+        resolve_thread(resolver);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    // Hosts worth a warm connection
+    free(resolver->warm);
+    resolver->warm_count = 0;
+    resolver->warm = (size_t *)malloc((resolver->host_count ? resolver->host_count : 1) * sizeof(size_t));
+    for (size_t i = 0; resolver->warm && i < resolver->host_count; i++) {
+        if (resolver->hosts[i].url) {
+            resolver->warm[resolver->warm_count++] = i;
+        }
+    }
+    return resolver->failed;
+}
+
+const struct curl_slist *curly_resolver_find(const curly_resolver_t *resolver, const char *url) {
+    char key[MAX_KEY_LENGTH];
+    int literal, has_scheme;
+    if (!url_key(url, strlen(url), key, &literal, &has_scheme)) {
+        return NULL;
+    }
+    size_t slot = *find_slot(resolver, resolver->slots, resolver->slot_count, key);
+    return slot ? resolver->hosts[slot - 1].entry : NULL;
+}
+
+size_t curly_resolver_host_count(const curly_resolver_t *resolver) {
+    return resolver->warm_count;
+}
+
+const char *curly_resolver_host_url(const curly_resolver_t *resolver, size_t index) {
+    return resolver->hosts[resolver->warm[index]].url;
+}
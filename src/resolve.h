@@ -0,0 +1,92 @@
+#ifndef CURLY_RESOLVE_H
+#define CURLY_RESOLVE_H
+
+#include "curly.h"
+
+/**
+ * Set of HTTP(S) hosts to resolve before a run. Every distinct host and
+ * port is looked up once, concurrently, and its addresses become a
+ * CURLOPT_RESOLVE entry; static entries pin hosts without a lookup. Each
+ * host also remembers the first URL seen for it, for warming up a
+ * connection. Not thread-safe until curly_resolver_run() has returned;
+ * lookups are read-only after that.
+ */
+typedef struct curly_resolver curly_resolver_t;
+
+/**
+ * Create an empty resolver
+ *
+ * @return New resolver, or NULL if out of memory
+ */
+curly_resolver_t *curly_resolver_create(void);
+
+/**
+ * Destroy a resolver and its entries
+ *
+ * @param resolver Resolver to destroy, may be NULL
+ */
+void curly_resolver_destroy(curly_resolver_t *resolver);
+
+/**
+ * Pin a host to fixed addresses instead of looking it up
+ *
+ * @param resolver Resolver
+ * @param entry "HOST:PORT:ADDRESS[,ADDRESS]...", as for CURLOPT_RESOLVE;
+ *        IPv6 addresses in brackets
+ * @return 0 on success, -1 if the entry is malformed or out of memory
+ */
+int curly_resolver_add_static(curly_resolver_t *resolver, const char *entry);
+
+/**
+ * Note the host of a URL. Only http and https URLs are kept; without a
+ * scheme, http is assumed as libcurl does, and names libcurl would take for
+ * another scheme, such as "ftp.example.com", are skipped. Hosts already
+ * known are ignored.
+ *
+ * @param resolver Resolver
+ * @param url URL or "host[:port]" (need not be NUL-terminated)
+ * @param length Length of url
+ * @return 0 on success or if the URL is ignored, -1 if out of memory
+ */
+int curly_resolver_add_url(curly_resolver_t *resolver, const char *url, size_t length);
+
+/**
+ * Look up every noted host that is not pinned, an IP address or already
+ * resolved
+ *
+ * @param resolver Resolver
+ * @param threads Lookups to run at once
+ * @return Number of hosts that could not be resolved
+ */
+size_t curly_resolver_run(curly_resolver_t *resolver, int threads);
+
+/**
+ * Find the CURLOPT_RESOLVE entry for the host of a URL. Setting it on a
+ * handle attached to a share that shares DNS pins the host for every
+ * handle of the share, for good.
+ *
+ * @param resolver Resolver
+ * @param url URL of a transfer
+ * @return One-entry list owned by the resolver, NULL if the host is not
+ *         pinned or could not be resolved
+ */
+const struct curl_slist *curly_resolver_find(const curly_resolver_t *resolver, const char *url);
+
+/**
+ * Get the number of hosts with a URL to warm a connection with
+ *
+ * @param resolver Resolver
+ * @return Number of hosts
+ */
+size_t curly_resolver_host_count(const curly_resolver_t *resolver);
+
+/**
+ * Get the first URL seen for a host
+ *
+ * @param resolver Resolver
+ * @param index Host index, below curly_resolver_host_count()
+ * @return URL owned by the resolver
+ */
+const char *curly_resolver_host_url(const curly_resolver_t *resolver, size_t index);
+
+#endif /* CURLY_RESOLVE_H */
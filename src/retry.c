@@ -0,0 +1,179 @@
+#include "retry.h"
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_MAX_DELAY_MS 30000L
+
+// Jitter state shared by all threads
+static uint64_t jitter_counter;
+
+// Next pseudo-random number (splitmix64 over an atomic counter). The
+// process id and clock are mixed in so separate runs do not jitter alike.
+static uint64_t next_random(void) {
+    uint64_t x = __atomic_add_fetch(&jitter_counter, 0x9E3779B97F4A7C15ULL, __ATOMIC_RELAXED);
+    x += ((uint64_t)getpid() << 32) ^ (uint64_t)time(NULL);
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+// Read a non-negative number of seconds from a JSON integer or real
+static long seconds_to_ms(const json_t *value, long fallback) {
+    if (json_is_integer(value) && json_integer_value(value) >= 0) {
+        return (long)json_integer_value(value) * 1000;
+    }
+    if (json_is_real(value) && json_real_value(value) >= 0) {
+        return (long)(json_real_value(value) * 1000);
+    }
+    return fallback;
+}
+
+void curly_retry_policy_init(curly_retry_policy_t *policy) {
+    policy->max_attempts = 1;
+    policy->delay_ms = 1000;
+    policy->max_delay_ms = DEFAULT_MAX_DELAY_MS;
+}
+
+void curly_retry_policy_from_json(curly_retry_policy_t *policy, const json_t *retry) {
+    curly_retry_policy_init(policy);
+    if (!json_is_object(retry)) {
+        return;
+    }
+
+    json_t *count = json_object_get(retry, "count");
+    if (json_is_integer(count) && json_integer_value(count) > 0) {
+        policy->max_attempts = (int)json_integer_value(count) + 1;
+    }
+
+    policy->delay_ms = seconds_to_ms(json_object_get(retry, "delay"), policy->delay_ms);
+    policy->max_delay_ms = seconds_to_ms(json_object_get(retry, "max_delay"), policy->max_delay_ms);
+    if (policy->max_delay_ms < policy->delay_ms) {
+        policy->max_delay_ms = policy->delay_ms;
+    }
+}
+
+int curly_retry_is_retryable(CURLcode result, long status) {
+    switch (status) {
+        case 408:  // Request Timeout
+        case 425:  // Too Early
+        case 429:  // Too Many Requests
+        case 500:  // Internal Server Error
+        case 502:  // Bad Gateway
+        case 503:  // Service Unavailable
+        case 504:  // Gateway Timeout
+            return result == CURLE_OK || result == CURLE_HTTP_RETURNED_ERROR;
+        default:
+            break;
+    }
+
+    switch (result) {
+        case CURLE_COULDNT_RESOLVE_HOST:
+        case CURLE_COULDNT_CONNECT:
+        case CURLE_OPERATION_TIMEDOUT:
+        case CURLE_SEND_ERROR:
+        case CURLE_RECV_ERROR:
+        case CURLE_GOT_NOTHING:
+        case CURLE_PARTIAL_FILE:
+        case CURLE_HTTP2:
+        case CURLE_HTTP2_STREAM:
+        case CURLE_SSL_CONNECT_ERROR:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+long curly_retry_delay(const curly_retry_policy_t *policy, int attempt, curl_off_t retry_after) {
+    if (attempt >= policy->max_attempts) {
+        return -1;
+    }
+
+    if (retry_after > 0) {
+        if (retry_after > policy->max_delay_ms / 1000) {
+            return -1;  // The server wants more patience than we have
+        }
+        return (long)retry_after * 1000;
+    }
+
+    // Exponential backoff, capped
+    long delay = policy->delay_ms;
+    for (int i = 1; i < attempt && delay < policy->max_delay_ms; i++) {
+        delay *= 2;
+    }
+    if (delay > policy->max_delay_ms) {
+        delay = policy->max_delay_ms;
+    }
+
+    // Wait between half and all of the backoff
+    if (delay > 1) {
+        delay = delay / 2 + (long)(next_random() % (uint64_t)(delay / 2 + 1));
+    }
+    return delay;
+}
+
+long curly_retry_next(const curly_retry_policy_t *policy, curly_retry_budget_t *budget,
+                      CURL *easy, CURLcode result, int attempt) {
+    if (attempt >= policy->max_attempts) {
+        return -1;
+    }
+
+    long status = 0;
+    curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &status);
+    if (!curly_retry_is_retryable(result, status)) {
+        return -1;
+    }
+
+    curl_off_t retry_after = 0;
+    curl_easy_getinfo(easy, CURLINFO_RETRY_AFTER, &retry_after);
+
+    long delay = curly_retry_delay(policy, attempt, retry_after);
+    if (delay < 0 || (budget && !curly_retry_budget_withdraw(budget))) {
+        return -1;
+    }
+    return delay;
+}
+
+void curly_retry_sleep(long delay_ms) {
+    struct timespec ts;
+    ts.tv_sec = delay_ms / 1000;
+    ts.tv_nsec = (delay_ms % 1000) * 1000000L;
+
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+        // Sleep out the remainder
+    }
+}
+
+void curly_retry_budget_init(curly_retry_budget_t *budget, double ratio, int burst) {
+    budget->ratio = (long)(ratio * 1000);
+    budget->limit = (long)burst * 1000;
+    budget->tokens = budget->limit;
+}
+
+void curly_retry_budget_deposit(curly_retry_budget_t *budget) {
+    long tokens = __atomic_load_n(&budget->tokens, __ATOMIC_RELAXED);
+    long next;
+
+    do {
+        if (tokens >= budget->limit) {
+            return;
+        }
+        next = tokens + budget->ratio;
+        if (next > budget->limit) {
+            next = budget->limit;
+        }
+    } while (!__atomic_compare_exchange_n(&budget->tokens, &tokens, next, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+int curly_retry_budget_withdraw(curly_retry_budget_t *budget) {
+    long tokens = __atomic_load_n(&budget->tokens, __ATOMIC_RELAXED);
+
+    do {
+        if (tokens < 1000) {
+            return 0;
+        }
+    } while (!__atomic_compare_exchange_n(&budget->tokens, &tokens, tokens - 1000, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    return 1;
+}
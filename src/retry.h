@@ -0,0 +1,117 @@
+#ifndef CURLY_RETRY_H
+#define CURLY_RETRY_H
+
+#include "curly.h"
+
+/**
+ * Retry policy: how often a failed transfer is attempted again and how long
+ * to wait in between. Delays grow exponentially from delay_ms up to
+ * max_delay_ms, with random jitter so that many transfers failing together
+ * do not come back together. A Retry-After sent by the server replaces the
+ * computed delay; if it asks for more than max_delay_ms the transfer is
+ * not retried.
+ */
+typedef struct {
+    int max_attempts;   // Total attempts including the first, 1 disables retries
+    long delay_ms;      // Delay before the first retry
+    long max_delay_ms;  // Upper bound on any single delay
+} curly_retry_policy_t;
+
+/**
+ * Process-wide cap on retries relative to requests. Every new request earns
+ * a fraction of a retry and every retry spends a whole one, so a failing
+ * server sees a bounded amount of extra load instead of every request
+ * multiplied by max_attempts.
+ */
+typedef struct {
+    long tokens;  // Thousandths of a retry, accessed atomically
+    long ratio;   // Thousandths of a retry earned per request
+    long limit;   // Maximum balance in thousandths of a retry
+} curly_retry_budget_t;
+
+/**
+ * Initialize a policy that never retries
+ *
+ * @param policy Policy to initialize
+ */
+void curly_retry_policy_init(curly_retry_policy_t *policy);
+
+/**
+ * Initialize a policy from a config "retry" object of the form
+ * {"count": 3, "delay": 2, "max_delay": 30}, where count is the number of
+ * retries and delays are in seconds. A NULL object disables retries.
+ *
+ * @param policy Policy to initialize
+ * @param retry Parsed "retry" object, or NULL
+ */
+void curly_retry_policy_from_json(curly_retry_policy_t *policy, const json_t *retry);
+
+/**
+ * Decide whether a failed attempt is worth repeating. Connection failures,
+ * timeouts, truncated responses and HTTP 408, 425, 429, 500, 502, 503 and
+ * 504 are retryable; anything else is treated as permanent.
+ *
+ * @param result Result of the transfer
+ * @param status HTTP response code, 0 if none was received
+ * @return Non-zero if the attempt may be retried
+ */
+int curly_retry_is_retryable(CURLcode result, long status);
+
+/**
+ * Compute the delay before the next attempt
+ *
+ * @param policy Retry policy
+ * @param attempt Number of attempts made so far (1 after the first)
+ * @param retry_after Server-requested delay in seconds, 0 if none
+ * @return Delay in milliseconds, or -1 if no further attempt should be made
+ */
+long curly_retry_delay(const curly_retry_policy_t *policy, int attempt, curl_off_t retry_after);
+
+/**
+ * Decide whether and when to repeat a finished attempt, combining the
+ * classification, the server's Retry-After, the backoff schedule and the
+ * budget
+ *
+ * @param policy Retry policy
+ * @param budget Budget to spend the retry from, or NULL for none
+ * @param easy Easy handle of the finished attempt
+ * @param result Result of the attempt
+ * @param attempt Number of attempts made so far
+ * @return Delay in milliseconds, or -1 if the attempt is final
+ */
+long curly_retry_next(const curly_retry_policy_t *policy, curly_retry_budget_t *budget,
+                      CURL *easy, CURLcode result, int attempt);
+
+/**
+ * Block the calling thread for a retry delay. Only for the blocking APIs;
+ * event loops schedule retries with curly_loop_add_delayed() instead.
+ *
+ * @param delay_ms Delay in milliseconds
+ */
+void curly_retry_sleep(long delay_ms);
+
+/**
+ * Initialize a retry budget
+ *
+ * @param budget Budget to initialize
+ * @param ratio Retries earned per request, e.g. 0.2
+ * @param burst Retries available before any request has been made
+ */
+void curly_retry_budget_init(curly_retry_budget_t *budget, double ratio, int burst);
+
+/**
+ * Credit the budget for a new request. Safe to call from any thread.
+ *
+ * @param budget Budget
+ */
+void curly_retry_budget_deposit(curly_retry_budget_t *budget);
+
+/**
+ * Spend one retry from the budget. Safe to call from any thread.
+ *
+ * @param budget Budget
+ * @return Non-zero if the retry may go ahead
+ */
+int curly_retry_budget_withdraw(curly_retry_budget_t *budget);
+
+#endif /* CURLY_RETRY_H */
@@ -0,0 +1,568 @@
+// For fopencookie()
+#define _GNU_SOURCE
+
+#include "curly.h"
+#include "batch.h"
+#include "loop.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+
+#define SERVE_BACKLOG 128
+#define SERVE_QUEUE_FACTOR 4         // Queued lines per request in flight before a client's reader waits
+#define SERVE_MAX_UNSENT (4 * 1024 * 1024)  // Unsent result bytes beyond which a client's lines wait
+#define SERVE_SEND_TIMEOUT_S 30      // A client that reads nothing for this long is dropped
+#define SERVE_POLL_MS 500            // How often the loop checks for a shutdown signal or stalled clients
+
+struct serve;
+struct serve_client;
+
+// A config line on its way from a reader thread to the loop
+typedef struct serve_job {
+    struct serve_client *client;
+    char *line;                 // NULL marks the end of the client's input
+    size_t length;
+    unsigned long line_no;
+    struct serve_job *next;
+} serve_job_t;
+
+// A connected client. The reader thread holds one reference until the
+// client's input ends, every started request holds one until its result
+// is written and unsent results hold one until the socket takes them; all
+// of them are dropped on the loop thread.
+typedef struct serve_client {
+    struct serve *serve;
+    int fd;
+    FILE *output;               // Result lines, collected into unsent by the loop thread
+    int refs;
+    serve_job_t end;            // Queued when the input ends, so that can't fail
+    serve_job_t *head;          // Lines waiting for a free request slot
+    serve_job_t *tail;
+    int queued;
+    pthread_cond_t room;        // Signalled when the client's queue has room again
+    int ready;                  // Set while in the server's ring of clients with lines
+    struct serve_client *next_ready;
+    struct serve_client *next;  // In the server's client list
+    struct serve_client *prev;
+
+    // Used by the loop thread only
+    char *unsent;               // Result bytes the socket has not taken yet
+    size_t unsent_length;
+    size_t unsent_capacity;
+    size_t sent;                // Bytes of unsent already sent
+    int watched;                // Set while waiting for the socket to drain
+    int dropped;                // Set once the client stopped reading or hung up
+    time_t stalled_since;       // When sending stopped making progress, 0 while it does
+    struct serve_client *next_stalled;
+} serve_client_t;
+
+// Daemon state
+typedef struct serve {
+    curly_batch_t *batch;
+    curly_loop_t *loop;
+    int listen_fd;
+    int max_concurrent;
+
+    pthread_mutex_t mutex;
+    serve_client_t *ready_head; // Clients with lines waiting, served round-robin
+    serve_client_t *ready_tail;
+    int ready_count;
+    int queued;                 // Lines waiting across all clients
+    int queue_limit;            // Lines a client may have waiting
+    serve_client_t *clients;    // Connected clients, for shutdown
+    int client_count;
+} serve_t;
+
+static volatile sig_atomic_t serve_stopping = 0;
+
+static void serve_signal(int sig) {
+    (void)sig;
+    serve_stopping = 1;
+}
+
+// Put a client at the end of the ring of clients with lines waiting
+static void append_ready(serve_t *serve, serve_client_t *client) {
+    client->next_ready = NULL;
+    if (serve->ready_tail) {
+        serve->ready_tail->next_ready = client;
+    } else {
+        serve->ready_head = client;
+    }
+    serve->ready_tail = client;
+}
+
+// Hand a job to the loop thread, waiting while the client's queue is full
+static void push_job(serve_t *serve, serve_job_t *job) {
+    serve_client_t *client = job->client;
+    pthread_mutex_lock(&serve->mutex);
+    while (job->line && client->queued >= serve->queue_limit) {
+        pthread_cond_wait(&client->room, &serve->mutex);
+    }
+    if (client->tail) {
+        client->tail->next = job;
+    } else {
+        client->head = job;
+    }
+    client->tail = job;
+    client->queued++;
+    serve->queued++;
+    if (!client->ready) {
+        client->ready = 1;
+        serve->ready_count++;
+        append_ready(serve, client);
+    }
+    pthread_mutex_unlock(&serve->mutex);
+
+    curly_loop_wake(serve->loop);
+}
+
+// Take the next line, one client at a time in turn, so a client sending a
+// flood of lines doesn't hold the others up. A client with too many results
+// it has not read is passed over until it catches up; its end of input
+// still comes through.
+static serve_job_t *pop_job(serve_t *serve) {
+    serve_job_t *job = NULL;
+    pthread_mutex_lock(&serve->mutex);
+    for (int tries = serve->ready_count; tries > 0 && !job; tries--) {
+        serve_client_t *client = serve->ready_head;
+        serve->ready_head = client->next_ready;
+        if (!serve->ready_head) {
+            serve->ready_tail = NULL;
+        }
+
+        if (client->unsent_length - client->sent < SERVE_MAX_UNSENT || !client->head->line) {
+            job = client->head;
+            client->head = job->next;
+            if (!client->head) {
+                client->tail = NULL;
+            }
+            client->queued--;
+            serve->queued--;
+            pthread_cond_signal(&client->room);
+        }
+
+        if (client->head) {
+            append_ready(serve, client);
+        } else {
+            client->ready = 0;
+            serve->ready_count--;
+        }
+    }
+    pthread_mutex_unlock(&serve->mutex);
+    return job;
+}
+
+// Drop a reference to a client, closing the connection with the last one
+static void release_client(void *arg) {
+    serve_client_t *client = (serve_client_t *)arg;
+    if (--client->refs > 0) {
+        return;
+    }
+
+    serve_t *serve = client->serve;
+    pthread_mutex_lock(&serve->mutex);
+    if (client->prev) {
+        client->prev->next = client->next;
+    } else {
+        serve->clients = client->next;
+    }
+    if (client->next) {
+        client->next->prev = client->prev;
+    }
+    serve->client_count--;
+    pthread_mutex_unlock(&serve->mutex);
+
+    fclose(client->output);
+    close(client->fd);
+    pthread_cond_destroy(&client->room);
+    free(client->unsent);
+    free(client);
+}
+
+// Stop serving a client that hung up or stopped reading: its unsent results
+// and waiting lines are dropped, and its reader sees the end of the input
+static void drop_client(serve_client_t *client) {
+    client->dropped = 1;
+    client->unsent_length = 0;
+    client->sent = 0;
+    shutdown(client->fd, SHUT_RDWR);
+    if (client->watched) {
+        client->watched = 0;
+        curly_loop_unwatch(client->serve->loop, client->fd);
+        release_client(client);
+    }
+}
+
+static void output_ready(curly_loop_t *loop, void *arg);
+
+// Send whatever results the socket takes without blocking. What it doesn't
+// take waits for the loop to see the socket writable, so a client that
+// reads slowly only holds up its own results.
+static void send_output(serve_client_t *client) {
+    while (client->sent < client->unsent_length) {
+        ssize_t sent = send(client->fd, client->unsent + client->sent, client->unsent_length - client->sent,
+                            MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent > 0) {
+            client->sent += (size_t)sent;
+            client->stalled_since = 0;
+        } else if (sent < 0 && errno == EINTR) {
+            continue;
+        } else if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (!client->stalled_since) {
+                client->stalled_since = time(NULL);
+            }
+            if (!client->watched) {
+                if (curly_loop_watch_writable(client->serve->loop, client->fd, output_ready, client) != 0) {
+                    drop_client(client);
+                    return;
+                }
+                client->watched = 1;
+                client->refs++;
+            }
+            return;
+        } else {
+            drop_client(client);
+            return;
+        }
+    }
+
+    client->unsent_length = 0;
+    client->sent = 0;
+    client->stalled_since = 0;
+    if (client->watched) {
+        client->watched = 0;
+        curly_loop_unwatch(client->serve->loop, client->fd);
+        release_client(client);
+    }
+}
+
+// Loop callback: a client's socket has room for more results
+static void output_ready(curly_loop_t *loop, void *arg) {
+    (void)loop;
+    send_output((serve_client_t *)arg);
+}
+
+// Stream write function collecting a client's result lines
+static ssize_t collect_output(void *cookie, const char *data, size_t size) {
+    serve_client_t *client = (serve_client_t *)cookie;
+    if (client->dropped) {
+        return (ssize_t)size;
+    }
+
+    // Reuse the space of what has been sent before growing
+    if (client->sent > 0) {
+        memmove(client->unsent, client->unsent + client->sent, client->unsent_length - client->sent);
+        client->unsent_length -= client->sent;
+        client->sent = 0;
+    }
+    if (client->unsent_length + size > client->unsent_capacity) {
+        size_t capacity = client->unsent_capacity ? client->unsent_capacity : 4096;
+        while (capacity < client->unsent_length + size) {
+            capacity *= 2;
+        }
+        char *unsent = (char *)realloc(client->unsent, capacity);
+        if (!unsent) {
+            return -1;
+        }
+        client->unsent = unsent;
+        client->unsent_capacity = capacity;
+    }
+    memcpy(client->unsent + client->unsent_length, data, size);
+    client->unsent_length += size;
+    return (ssize_t)size;
+}
+
+// Batch callback: a request's result line has been written
+static void request_done(void *arg) {
+    serve_client_t *client = (serve_client_t *)arg;
+    fflush(client->output);
+    send_output(client);
+    release_client(client);
+}
+
+// Drop clients whose sockets have taken nothing for too long
+static void drop_stalled_clients(serve_t *serve) {
+    time_t now = time(NULL);
+    serve_client_t *stalled = NULL;
+
+    // Clients are only freed on this thread, so the list can be let go of
+    pthread_mutex_lock(&serve->mutex);
+    for (serve_client_t *client = serve->clients; client; client = client->next) {
+        if (client->watched && client->stalled_since && now - client->stalled_since >= SERVE_SEND_TIMEOUT_S) {
+            client->next_stalled = stalled;
+            stalled = client;
+        }
+    }
+    pthread_mutex_unlock(&serve->mutex);
+
+    while (stalled) {
+        serve_client_t *next = stalled->next_stalled;
+        drop_client(stalled);
+        stalled = next;
+    }
+}
+
+// Reader thread: turn a client's input into jobs for the loop
+static void *client_reader(void *arg) {
+    serve_client_t *client = (serve_client_t *)arg;
+    serve_t *serve = client->serve;
+    int fd = dup(client->fd);
+    FILE *input = fd >= 0 ? fdopen(fd, "r") : NULL;
+    if (!input && fd >= 0) {
+        close(fd);
+    }
+
+    char *line = NULL;
+    size_t capacity = 0;
+    unsigned long line_no = 0;
+    ssize_t length;
+    while (input && (length = getline(&line, &capacity, input)) >= 0) {
+        line_no++;
+        while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+            length--;
+        }
+        if (length == 0) {
+            continue;
+        }
+
+        serve_job_t *job = (serve_job_t *)malloc(sizeof(serve_job_t));
+        char *copy = job ? (char *)malloc((size_t)length) : NULL;
+        if (!copy) {
+            free(job);
+            break;
+        }
+        memcpy(copy, line, (size_t)length);
+        job->client = client;
+        job->line = copy;
+        job->length = (size_t)length;
+        job->line_no = line_no;
+        job->next = NULL;
+        push_job(serve, job);
+    }
+    free(line);
+    if (input) {
+        fclose(input);
+    }
+
+    push_job(serve, &client->end);
+    return NULL;
+}
+
+// Accept thread: register clients and start their readers
+static void *accept_clients(void *arg) {
+    serve_t *serve = (serve_t *)arg;
+
+    for (;;) {
+        int fd = accept(serve->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            // The listening socket was shut down
+            break;
+        }
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+        // Results are collected in memory and sent as the socket takes them
+        serve_client_t *client = (serve_client_t *)calloc(1, sizeof(serve_client_t));
+        if (client) {
+            cookie_io_functions_t functions = {NULL, collect_output, NULL, NULL};
+            client->output = fopencookie(client, "w", functions);
+        }
+        if (!client || !client->output) {
+            free(client);
+            close(fd);
+            continue;
+        }
+        pthread_cond_init(&client->room, NULL);
+        client->serve = serve;
+        client->fd = fd;
+        client->refs = 1;
+        client->end.client = client;
+
+        pthread_mutex_lock(&serve->mutex);
+        client->next = serve->clients;
+        if (serve->clients) {
+            serve->clients->prev = client;
+        }
+        serve->clients = client;
+        serve->client_count++;
+        pthread_mutex_unlock(&serve->mutex);
+
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&thread, &attr, client_reader, client) != 0) {
+            // Nothing was started for it, so the loop thread won't touch it
+            release_client(client);
+        }
+        pthread_attr_destroy(&attr);
+    }
+    return NULL;
+}
+
+// Bind the listening socket, taking over a stale socket file but not a
+// live daemon's
+static int listen_unix(const char *path) {
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        close(fd);
+        errno = EADDRINUSE;
+        return -1;
+    }
+    if (errno == ECONNREFUSED) {
+        unlink(path);
+    }
+    close(fd);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    // Requests may read local files, so only the owner may connect
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || chmod(path, 0600) != 0 ||
+        listen(fd, SERVE_BACKLOG) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Start queued lines while there is room for more requests
+static void start_jobs(serve_t *serve) {
+    serve_job_t *job;
+    while (curly_loop_in_flight(serve->loop) < serve->max_concurrent && (job = pop_job(serve)) != NULL) {
+        serve_client_t *client = job->client;
+        if (job->line) {
+            // Lines of a dropped client are not run
+            if (!client->dropped) {
+                client->refs++;
+                curly_batch_start(serve->batch, job->line, job->length, job->line_no, client->output,
+                                  request_done, client);
+            }
+            free(job->line);
+            free(job);
+        } else {
+            release_client(client);
+        }
+    }
+}
+
+curly_error_t curly_serve(const char *socket_path, const curly_batch_options_t *options) {
+    if (!socket_path || !options) {
+        return CURLY_ERROR_UNKNOWN;
+    }
+
+    // Clients share the engine, so their bodies can't share a directory
+    // named by line number; results always carry the body inline. There is
+    // no end of the run to print a summary at.
+    curly_batch_options_t batch_options = *options;
+    batch_options.body_dir = NULL;
+    batch_options.summary = 0;
+
+    serve_t serve;
+    memset(&serve, 0, sizeof(serve));
+    serve.batch = curly_batch_create(&batch_options);
+    if (!serve.batch) {
+        return CURLY_ERROR_CURL_INIT;
+    }
+    serve.loop = curly_batch_loop(serve.batch);
+    serve.max_concurrent = curly_batch_max_concurrent(serve.batch);
+    serve.queue_limit = serve.max_concurrent * SERVE_QUEUE_FACTOR;
+    pthread_mutex_init(&serve.mutex, NULL);
+
+    serve.listen_fd = listen_unix(socket_path);
+    if (serve.listen_fd < 0) {
+        fprintf(stderr, "Cannot listen on %s: %s\n", socket_path, strerror(errno));
+        curly_batch_destroy(serve.batch);
+        return CURLY_ERROR_SOCKET;
+    }
+
+    // A client hanging up early must not kill the daemon
+    signal(SIGPIPE, SIG_IGN);
+    serve_stopping = 0;
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = serve_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    pthread_t acceptor;
+    if (pthread_create(&acceptor, NULL, accept_clients, &serve) != 0) {
+        close(serve.listen_fd);
+        unlink(socket_path);
+        curly_batch_destroy(serve.batch);
+        return CURLY_ERROR_THREAD_CREATE;
+    }
+
+    curly_error_t result = CURLY_OK;
+    int stopped = 0;
+    for (;;) {
+        start_jobs(&serve);
+        drop_stalled_clients(&serve);
+
+        if (serve_stopping && !stopped) {
+            // Stop taking clients and end the input of those connected;
+            // what they already sent still runs and gets its results
+            stopped = 1;
+            shutdown(serve.listen_fd, SHUT_RDWR);
+            pthread_join(acceptor, NULL);
+            pthread_mutex_lock(&serve.mutex);
+            for (serve_client_t *client = serve.clients; client; client = client->next) {
+                shutdown(client->fd, SHUT_RD);
+            }
+            pthread_mutex_unlock(&serve.mutex);
+        }
+
+        if (stopped) {
+            pthread_mutex_lock(&serve.mutex);
+            int idle = serve.client_count == 0 && serve.queued == 0;
+            pthread_mutex_unlock(&serve.mutex);
+            if (idle && curly_loop_in_flight(serve.loop) == 0 && curly_loop_delayed(serve.loop) == 0) {
+                break;
+            }
+        }
+
+        if (curly_loop_run_once(serve.loop, SERVE_POLL_MS) != 0) {
+            fprintf(stderr, "Event loop failed: %s\n", strerror(errno));
+            result = CURLY_ERROR_UNKNOWN;
+            break;
+        }
+    }
+
+    if (!stopped) {
+        shutdown(serve.listen_fd, SHUT_RDWR);
+        pthread_join(acceptor, NULL);
+    }
+    close(serve.listen_fd);
+    unlink(socket_path);
+
+    // After a loop failure, reader threads may still use the state
+    if (result == CURLY_OK) {
+        curly_batch_destroy(serve.batch);
+        pthread_mutex_destroy(&serve.mutex);
+    }
+
+    return result;
+}
@@ -0,0 +1,43 @@
+#ifndef CURLY_SHA256_H
+#define CURLY_SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CURLY_SHA256_SIZE 32
+
+/**
+ * Incremental SHA-256 (FIPS 180-4)
+ */
+typedef struct {
+    uint32_t state[8];
+    uint64_t length;        // Bytes hashed so far
+    unsigned char block[64];
+    size_t used;            // Bytes waiting in block
+} curly_sha256_t;
+
+/**
+ * Start a new hash
+ *
+ * @param ctx Hash state
+ */
+void curly_sha256_init(curly_sha256_t *ctx);
+
+/**
+ * Hash more data
+ *
+ * @param ctx Hash state
+ * @param data Data to hash
+ * @param length Number of bytes
+ */
+void curly_sha256_update(curly_sha256_t *ctx, const void *data, size_t length);
+
+/**
+ * Finish the hash
+ *
+ * @param ctx Hash state, unusable afterwards until initialized again
+ * @param digest Receives the CURLY_SHA256_SIZE byte digest
+ */
+void curly_sha256_final(curly_sha256_t *ctx, unsigned char digest[CURLY_SHA256_SIZE]);
+
+#endif /* CURLY_SHA256_H */
@@ -0,0 +1,67 @@
+#include "share.h"
+
+struct curly_share {
+    CURLSH *handle;
+    pthread_mutex_t locks[CURL_LOCK_DATA_LAST];
+};
+
+// libcurl callback: lock one kind of shared data
+static void share_lock(CURL *curl, curl_lock_data data, curl_lock_access access, void *userp) {
+    (void)curl;
+    (void)access;
+    curly_share_t *share = (curly_share_t *)userp;
+    pthread_mutex_lock(&share->locks[data]);
+}
+
+// libcurl callback: unlock one kind of shared data
+static void share_unlock(CURL *curl, curl_lock_data data, void *userp) {
+    (void)curl;
+    curly_share_t *share = (curly_share_t *)userp;
+    pthread_mutex_unlock(&share->locks[data]);
+}
+
+curly_share_t *curly_share_create(int share_connections) {
+    curly_share_t *share = (curly_share_t *)calloc(1, sizeof(curly_share_t));
+    if (!share) {
+        return NULL;
+    }
+
+    share->handle = curl_share_init();
+    if (!share->handle) {
+        free(share);
+        return NULL;
+    }
+
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+        pthread_mutex_init(&share->locks[i], NULL);
+    }
+
+    curl_share_setopt(share->handle, CURLSHOPT_LOCKFUNC, share_lock);
+    curl_share_setopt(share->handle, CURLSHOPT_UNLOCKFUNC, share_unlock);
+    curl_share_setopt(share->handle, CURLSHOPT_USERDATA, share);
+
+    curl_share_setopt(share->handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share->handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    if (share_connections) {
+        curl_share_setopt(share->handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+    }
+
+    return share;
+}
+
+void curly_share_destroy(curly_share_t *share) {
+    if (!share) return;
+
+    curl_share_cleanup(share->handle);
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+        pthread_mutex_destroy(&share->locks[i]);
+    }
+
+    free(share);
+}
+
+void curly_share_attach(curly_share_t *share, CURL *curl) {
+    if (share && curl) {
+        curl_easy_setopt(curl, CURLOPT_SHARE, share->handle);
+    }
+}
@@ -0,0 +1,40 @@
+#ifndef CURLY_SHARE_H
+#define CURLY_SHARE_H
+
+#include "curly.h"
+
+/**
+ * A libcurl share object with the locking needed to use it from several
+ * threads at once. Easy handles attached to it share the DNS cache and TLS
+ * session cache, so only the first transfer to a host pays for a full
+ * lookup and handshake. Cookies are not shared, so one response's
+ * Set-Cookie never reaches unrelated requests.
+ */
+typedef struct curly_share curly_share_t;
+
+/**
+ * Create a new share object
+ *
+ * @param share_connections Also share the connection cache. libcurl does not
+ *        support this across concurrently running threads, so only enable it
+ *        when every attached handle is driven from the same thread.
+ * @return New share object, or NULL on failure
+ */
+curly_share_t *curly_share_create(int share_connections);
+
+/**
+ * Destroy a share object. All attached easy handles must be cleaned up first.
+ *
+ * @param share Share object to destroy
+ */
+void curly_share_destroy(curly_share_t *share);
+
+/**
+ * Attach an easy handle to the share object
+ *
+ * @param share Share object
+ * @param curl Easy handle to attach
+ */
+void curly_share_attach(curly_share_t *share, CURL *curl);
+
+#endif /* CURLY_SHARE_H */
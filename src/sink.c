@@ -0,0 +1,185 @@
+#include "curly.h"
+#include "request.h"
+#include "arena.h"
+#include "bufpool.h"
+#include <errno.h>
+#include <unistd.h>
+
+#define MIN_BUFFER_CAPACITY 4096
+#define MAX_PRESIZE_CAPACITY (256 * 1024 * 1024)
+
+// Resize a response buffer to exactly capacity bytes. A pooled response
+// starts from a recycled buffer, which is kept if it is already big enough.
+static int buffer_resize(curly_response_t *response, size_t capacity) {
+    if (!response->data && response->pool) {
+        response->data = curly_buffer_pool_take(response->pool, &response->capacity);
+        if (capacity <= response->capacity) {
+            return 0;
+        }
+    }
+
+    char *new_data = response->arena
+                         ? curly_arena_grow(response->arena, response->data, response->size, capacity)
+                         : realloc(response->data, capacity);
+    if (!new_data) {
+        return -1;
+    }
+    response->data = new_data;
+    response->capacity = capacity;
+    return 0;
+}
+
+// Make room for at least needed bytes, growing geometrically
+static int buffer_reserve(curly_response_t *response, size_t needed) {
+    if (needed <= response->capacity) {
+        return 0;
+    }
+
+    size_t capacity = response->capacity ? response->capacity : MIN_BUFFER_CAPACITY;
+    while (capacity < needed) {
+        capacity *= 2;
+    }
+    return buffer_resize(response, capacity);
+}
+
+// Append data to a buffer sink
+static size_t buffer_write(curly_sink_t *sink, const char *data, size_t size) {
+    curly_response_t *response = sink->response;
+
+    if (buffer_reserve(response, response->size + size + 1) != 0) {
+        fprintf(stderr, "Failed to allocate memory for response data\n");
+        return 0;  // Signal error to libcurl
+    }
+
+    memcpy(response->data + response->size, data, size);
+    response->size += size;
+    response->data[response->size] = '\0';  // Null-terminate for text responses
+
+    return size;
+}
+
+// Write all data to a file descriptor, retrying short writes
+static size_t fd_write(curly_sink_t *sink, const char *data, size_t size) {
+    size_t written = 0;
+
+    while (written < size) {
+        ssize_t result = write(sink->fd, data + written, size - written);
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return written;
+        }
+        written += (size_t)result;
+    }
+
+    return written;
+}
+
+void curly_sink_init_buffer(curly_sink_t *sink, curly_response_t *response) {
+    memset(sink, 0, sizeof(curly_sink_t));
+    sink->type = CURLY_SINK_BUFFER;
+    sink->response = response;
+    sink->fd = -1;
+
+    response->data = NULL;
+    response->size = 0;
+    response->capacity = 0;
+    response->arena = NULL;
+    response->pool = NULL;
+    response->mapping = NULL;
+    response->mapping_size = 0;
+}
+
+void curly_sink_init_arena(curly_sink_t *sink, curly_response_t *response, curly_arena_t *arena) {
+    curly_sink_init_buffer(sink, response);
+    response->arena = arena;
+}
+
+void curly_sink_init_pooled(curly_sink_t *sink, curly_response_t *response, curly_buffer_pool_t *pool) {
+    curly_sink_init_buffer(sink, response);
+    response->pool = pool;
+}
+
+void curly_sink_init_fd(curly_sink_t *sink, int fd) {
+    memset(sink, 0, sizeof(curly_sink_t));
+    sink->type = CURLY_SINK_FD;
+    sink->fd = fd;
+}
+
+void curly_sink_init_callback(curly_sink_t *sink, curly_sink_callback_t callback, void *userdata) {
+    memset(sink, 0, sizeof(curly_sink_t));
+    sink->type = CURLY_SINK_CALLBACK;
+    sink->fd = -1;
+    sink->callback = callback;
+    sink->userdata = userdata;
+}
+
+size_t curly_sink_write(char *ptr, size_t size, size_t nmemb, void *userdata) {
+    curly_sink_t *sink = (curly_sink_t *)userdata;
+    size_t realsize = size * nmemb;
+
+    switch (sink->type) {
+        case CURLY_SINK_BUFFER:
+            return buffer_write(sink, ptr, realsize);
+        case CURLY_SINK_FD:
+            return fd_write(sink, ptr, realsize);
+        case CURLY_SINK_CALLBACK:
+            return sink->callback(ptr, realsize, sink->userdata);
+        default:
+            return 0;
+    }
+}
+
+size_t curly_sink_header(char *ptr, size_t size, size_t nmemb, void *userdata) {
+    static const char name[] = "Content-Length:";
+    curly_sink_t *sink = (curly_sink_t *)userdata;
+    size_t realsize = size * nmemb;
+
+    if (sink->type != CURLY_SINK_BUFFER || realsize < sizeof(name) - 1 ||
+        !curl_strnequal(ptr, name, sizeof(name) - 1)) {
+        return realsize;
+    }
+
+    size_t i = sizeof(name) - 1;
+    while (i < realsize && (ptr[i] == ' ' || ptr[i] == '\t')) {
+        i++;
+    }
+
+    // The length is only a hint; absurd values are left to geometric growth
+    size_t length = 0;
+    for (; i < realsize && ptr[i] >= '0' && ptr[i] <= '9'; i++) {
+        length = length * 10 + (size_t)(ptr[i] - '0');
+        if (length > MAX_PRESIZE_CAPACITY) {
+            return realsize;
+        }
+    }
+
+    curly_response_t *response = sink->response;
+    if (length > 0 && length + 1 > response->capacity) {
+        buffer_resize(response, length + 1);
+    }
+    return realsize;
+}
+
+curly_error_t curly_sink_finish(curly_sink_t *sink, int success) {
+    if (sink->type != CURLY_SINK_BUFFER) {
+        return CURLY_OK;
+    }
+
+    curly_response_t *response = sink->response;
+    if (!success) {
+        curly_free_response(response);
+        return CURLY_OK;
+    }
+
+    // Empty bodies are still returned as an empty string
+    if (!response->size) {
+        if (buffer_reserve(response, 1) != 0) {
+            return CURLY_ERROR_MEMORY_ALLOCATION;
+        }
+        response->data[0] = '\0';
+    }
+
+    return CURLY_OK;
+}
@@ -0,0 +1,416 @@
+#include "stats.h"
+#include "ratelimit.h"
+#include <stdint.h>
+
+// Log-linear histogram buckets: values below 64 get a bucket each, and
+// every further power of two is split into 32 buckets
+#define HIST_SUB_BITS 5
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_MAX_SHIFT 32  // Values beyond 2^38 us (about 3 days) share the last bucket
+#define HIST_BUCKETS (HIST_SUB_COUNT * (HIST_MAX_SHIFT + 2))
+
+#define INITIAL_HOST_SLOTS 64
+
+typedef enum {
+    PHASE_DNS = 0,
+    PHASE_CONNECT,
+    PHASE_TLS,
+    PHASE_WAIT,
+    PHASE_TRANSFER,
+    PHASE_TOTAL,
+    PHASE_COUNT
+} phase_t;
+
+static const char *phase_names[PHASE_COUNT] = {"dns", "connect", "tls", "wait", "transfer", "total"};
+
+typedef struct {
+    uint32_t counts[HIST_BUCKETS];
+    uint64_t count;
+    curl_off_t max;
+    double sum;
+} histogram_t;
+
+// Totals for one host. Only successful transfers enter the histograms.
+typedef struct {
+    uint64_t transfers;
+    uint64_t failures;
+    curl_off_t bytes;
+    histogram_t ttfb;
+    histogram_t total;
+    char name[];
+} host_stats_t;
+
+struct curly_stats {
+    pthread_mutex_t mutex;
+    long long start_ns;
+    uint64_t transfers;
+    uint64_t failures;
+    curl_off_t bytes;
+    histogram_t phases[PHASE_COUNT];
+    host_stats_t **slots;  // Open-addressing hash table keyed by host name
+    size_t slot_count;
+    size_t host_count;
+};
+
+// Bucket holding a value
+static int hist_index(curl_off_t value) {
+    uint64_t v = value > 0 ? (uint64_t)value : 0;
+    if (v < 2 * HIST_SUB_COUNT) {
+        return (int)v;
+    }
+
+    int shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    if (shift > HIST_MAX_SHIFT) {
+        return HIST_BUCKETS - 1;
+    }
+    return (shift + 1) * HIST_SUB_COUNT + (int)((v >> shift) - HIST_SUB_COUNT);
+}
+
+// Middle of the range of values a bucket holds
+static curl_off_t hist_value(int index) {
+    if (index < 2 * HIST_SUB_COUNT) {
+        return index;
+    }
+
+    int shift = index / HIST_SUB_COUNT - 1;
+    uint64_t top = (uint64_t)(HIST_SUB_COUNT + index % HIST_SUB_COUNT);
+    return (curl_off_t)((top << shift) + ((1ULL << shift) >> 1));
+}
+
+static void hist_add(histogram_t *hist, curl_off_t value) {
+    hist->counts[hist_index(value)]++;
+    hist->count++;
+    hist->sum += (double)value;
+    if (value > hist->max) {
+        hist->max = value;
+    }
+}
+
+// Value below which the given percentage of the recorded values lie
+static curl_off_t hist_percentile(const histogram_t *hist, double percent) {
+    if (hist->count == 0) {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t)(percent / 100.0 * (double)hist->count + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if (seen >= rank) {
+            curl_off_t value = hist_value(i);
+            return value < hist->max ? value : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+// Percentiles of a histogram in microseconds
+static json_t *hist_to_json(const histogram_t *hist) {
+    json_t *object = json_object();
+    if (!object) {
+        return NULL;
+    }
+
+    json_object_set_new(object, "p50", json_integer((json_int_t)hist_percentile(hist, 50)));
+    json_object_set_new(object, "p90", json_integer((json_int_t)hist_percentile(hist, 90)));
+    json_object_set_new(object, "p99", json_integer((json_int_t)hist_percentile(hist, 99)));
+    json_object_set_new(object, "p999", json_integer((json_int_t)hist_percentile(hist, 99.9)));
+    json_object_set_new(object, "max", json_integer((json_int_t)hist->max));
+    json_object_set_new(object, "mean", json_integer(hist->count ? (json_int_t)(hist->sum / (double)hist->count) : 0));
+    return object;
+}
+
+// Duration between two points in time, 0 if b is not after a
+static curl_off_t elapsed(curl_off_t a, curl_off_t b) {
+    return b > a ? b - a : 0;
+}
+
+void curly_timing_capture(CURL *curl, curly_timing_t *timing) {
+    curl_off_t namelookup = 0, connect = 0, appconnect = 0, starttransfer = 0, total = 0;
+
+    memset(timing, 0, sizeof(curly_timing_t));
+    curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &namelookup);
+    curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect);
+    curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &appconnect);
+    curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &starttransfer);
+    curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total);
+    curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &timing->bytes);
+    curl_easy_getinfo(curl, CURLINFO_SPEED_DOWNLOAD_T, &timing->bytes_per_sec);
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &timing->status);
+
+    // libcurl reports when each phase ended, counted from the start; phases
+    // that did not happen (reused connection, no TLS) read as 0
+    curl_off_t connected = connect > namelookup ? connect : namelookup;
+    curl_off_t handshaken = appconnect > connected ? appconnect : connected;
+    curl_off_t first_byte = starttransfer > handshaken ? starttransfer : handshaken;
+
+    timing->dns_us = namelookup;
+    timing->connect_us = elapsed(namelookup, connected);
+    timing->tls_us = elapsed(connected, handshaken);
+    timing->wait_us = elapsed(handshaken, first_byte);
+    timing->transfer_us = elapsed(first_byte, total);
+    timing->total_us = total > first_byte ? total : first_byte;
+}
+
+void curly_timing_to_json(json_t *object, const curly_timing_t *timing) {
+    json_object_set_new(object, "dns_us", json_integer((json_int_t)timing->dns_us));
+    json_object_set_new(object, "connect_us", json_integer((json_int_t)timing->connect_us));
+    json_object_set_new(object, "tls_us", json_integer((json_int_t)timing->tls_us));
+    json_object_set_new(object, "wait_us", json_integer((json_int_t)timing->wait_us));
+    json_object_set_new(object, "transfer_us", json_integer((json_int_t)timing->transfer_us));
+    json_object_set_new(object, "total_us", json_integer((json_int_t)timing->total_us));
+    json_object_set_new(object, "bytes", json_integer((json_int_t)timing->bytes));
+    json_object_set_new(object, "bytes_per_sec", json_integer((json_int_t)timing->bytes_per_sec));
+}
+
+curly_stats_t *curly_stats_create(void) {
+    curly_stats_t *stats = (curly_stats_t *)calloc(1, sizeof(curly_stats_t));
+    if (!stats) {
+        return NULL;
+    }
+
+    stats->slots = (host_stats_t **)calloc(INITIAL_HOST_SLOTS, sizeof(host_stats_t *));
+    if (!stats->slots) {
+        free(stats);
+        return NULL;
+    }
+    stats->slot_count = INITIAL_HOST_SLOTS;
+    stats->start_ns = curly_rate_now_ns();
+    pthread_mutex_init(&stats->mutex, NULL);
+    return stats;
+}
+
+void curly_stats_destroy(curly_stats_t *stats) {
+    if (!stats) return;
+
+    for (size_t i = 0; i < stats->slot_count; i++) {
+        free(stats->slots[i]);
+    }
+    free(stats->slots);
+    pthread_mutex_destroy(&stats->mutex);
+    free(stats);
+}
+
+// FNV-1a hash of a host name
+static size_t hash_name(const char *name) {
+    uint64_t hash = 14695981039346656037ULL;
+    while (*name) {
+        hash ^= (unsigned char)*name++;
+        hash *= 1099511628211ULL;
+    }
+    return (size_t)hash;
+}
+
+// Find the slot holding a host, or the empty slot where it belongs
+static host_stats_t **find_slot(host_stats_t **slots, size_t slot_count, const char *name) {
+    size_t index = hash_name(name) & (slot_count - 1);
+    while (slots[index] && strcmp(slots[index]->name, name) != 0) {
+        index = (index + 1) & (slot_count - 1);
+    }
+    return &slots[index];
+}
+
+// Double the host table. Returns 0 on success.
+static int grow_slots(curly_stats_t *stats) {
+    size_t slot_count = stats->slot_count * 2;
+    host_stats_t **slots = (host_stats_t **)calloc(slot_count, sizeof(host_stats_t *));
+    if (!slots) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < stats->slot_count; i++) {
+        if (stats->slots[i]) {
+            *find_slot(slots, slot_count, stats->slots[i]->name) = stats->slots[i];
+        }
+    }
+    free(stats->slots);
+    stats->slots = slots;
+    stats->slot_count = slot_count;
+    return 0;
+}
+
+// Find or add a host. Called with the mutex held.
+static host_stats_t *lookup_host(curly_stats_t *stats, const char *name) {
+    host_stats_t **slot = find_slot(stats->slots, stats->slot_count, name);
+    if (*slot) {
+        return *slot;
+    }
+
+    // Keep the table at most half full
+    if ((stats->host_count + 1) * 2 > stats->slot_count) {
+        if (grow_slots(stats) != 0) {
+            return NULL;
+        }
+        slot = find_slot(stats->slots, stats->slot_count, name);
+    }
+
+    size_t length = strlen(name) + 1;
+    host_stats_t *host = (host_stats_t *)calloc(1, sizeof(host_stats_t) + length);
+    if (!host) {
+        return NULL;
+    }
+    memcpy(host->name, name, length);
+    *slot = host;
+    stats->host_count++;
+    return host;
+}
+
+void curly_stats_record(curly_stats_t *stats, const char *host, const curly_timing_t *timing, int failed) {
+    curl_off_t ttfb = timing->dns_us + timing->connect_us + timing->tls_us + timing->wait_us;
+
+    pthread_mutex_lock(&stats->mutex);
+
+    stats->transfers++;
+    stats->bytes += timing->bytes;
+    if (failed) {
+        stats->failures++;
+    } else {
+        hist_add(&stats->phases[PHASE_DNS], timing->dns_us);
+        hist_add(&stats->phases[PHASE_CONNECT], timing->connect_us);
+        hist_add(&stats->phases[PHASE_TLS], timing->tls_us);
+        hist_add(&stats->phases[PHASE_WAIT], timing->wait_us);
+        hist_add(&stats->phases[PHASE_TRANSFER], timing->transfer_us);
+        hist_add(&stats->phases[PHASE_TOTAL], timing->total_us);
+    }
+
+    host_stats_t *entry = lookup_host(stats, host ? host : "");
+    if (entry) {
+        entry->transfers++;
+        entry->bytes += timing->bytes;
+        if (failed) {
+            entry->failures++;
+        } else {
+            hist_add(&entry->ttfb, ttfb);
+            hist_add(&entry->total, timing->total_us);
+        }
+    }
+
+    pthread_mutex_unlock(&stats->mutex);
+}
+
+// Busiest hosts first
+static int compare_hosts(const void *a, const void *b) {
+    const host_stats_t *ha = *(const host_stats_t *const *)a;
+    const host_stats_t *hb = *(const host_stats_t *const *)b;
+    if (ha->transfers != hb->transfers) {
+        return ha->transfers > hb->transfers ? -1 : 1;
+    }
+    return strcmp(ha->name, hb->name);
+}
+
+// Snapshot of the hosts, sorted. Called with the mutex held.
+static host_stats_t **sorted_hosts(curly_stats_t *stats) {
+    host_stats_t **hosts = (host_stats_t **)malloc((stats->host_count + 1) * sizeof(host_stats_t *));
+    if (!hosts) {
+        return NULL;
+    }
+
+    size_t count = 0;
+    for (size_t i = 0; i < stats->slot_count; i++) {
+        if (stats->slots[i]) {
+            hosts[count++] = stats->slots[i];
+        }
+    }
+    qsort(hosts, count, sizeof(host_stats_t *), compare_hosts);
+    return hosts;
+}
+
+// Average download rate of a host's transfers, in bytes per second
+static double host_rate(const host_stats_t *host) {
+    return host->total.sum > 0 ? (double)host->bytes * 1e6 / host->total.sum : 0;
+}
+
+void curly_stats_write_json(curly_stats_t *stats, FILE *output) {
+    pthread_mutex_lock(&stats->mutex);
+
+    double seconds = (curly_rate_now_ns() - stats->start_ns) / 1e9;
+    json_t *overall = json_object();
+    if (overall) {
+        json_object_set_new(overall, "summary", json_string("overall"));
+        json_object_set_new(overall, "transfers", json_integer((json_int_t)stats->transfers));
+        json_object_set_new(overall, "failures", json_integer((json_int_t)stats->failures));
+        json_object_set_new(overall, "bytes", json_integer((json_int_t)stats->bytes));
+        json_object_set_new(overall, "elapsed_us", json_integer((json_int_t)(seconds * 1e6)));
+        json_object_set_new(overall, "bytes_per_sec", json_integer((json_int_t)(seconds > 0 ? stats->bytes / seconds : 0)));
+        for (int i = 0; i < PHASE_COUNT; i++) {
+            char key[32];
+            snprintf(key, sizeof(key), "%s_us", phase_names[i]);
+            json_object_set_new(overall, key, hist_to_json(&stats->phases[i]));
+        }
+        curly_stats_write_line(overall, output);
+        json_decref(overall);
+    }
+
+    host_stats_t **hosts = sorted_hosts(stats);
+    for (size_t i = 0; hosts && i < stats->host_count; i++) {
+        json_t *line = json_object();
+        if (!line) {
+            break;
+        }
+        json_object_set_new(line, "summary", json_string("host"));
+        json_object_set_new(line, "host", json_string(hosts[i]->name));
+        json_object_set_new(line, "transfers", json_integer((json_int_t)hosts[i]->transfers));
+        json_object_set_new(line, "failures", json_integer((json_int_t)hosts[i]->failures));
+        json_object_set_new(line, "bytes", json_integer((json_int_t)hosts[i]->bytes));
+        json_object_set_new(line, "bytes_per_sec", json_integer((json_int_t)host_rate(hosts[i])));
+        json_object_set_new(line, "ttfb_us", hist_to_json(&hosts[i]->ttfb));
+        json_object_set_new(line, "total_us", hist_to_json(&hosts[i]->total));
+        curly_stats_write_line(line, output);
+        json_decref(line);
+    }
+    free(hosts);
+
+    pthread_mutex_unlock(&stats->mutex);
+    fflush(output);
+}
+
+void curly_stats_print(curly_stats_t *stats, FILE *output) {
+    pthread_mutex_lock(&stats->mutex);
+
+    double seconds = (curly_rate_now_ns() - stats->start_ns) / 1e9;
+    fprintf(output, "\n%llu transfers, %llu failed, %.1f MB in %.2f s (%.2f MB/s)\n",
+            (unsigned long long)stats->transfers, (unsigned long long)stats->failures,
+            stats->bytes / 1e6, seconds, seconds > 0 ? stats->bytes / 1e6 / seconds : 0);
+
+    fprintf(output, "\n%-10s %10s %10s %10s %10s %10s\n", "phase (ms)", "p50", "p90", "p99", "p99.9", "max");
+    for (int i = 0; i < PHASE_COUNT; i++) {
+        const histogram_t *hist = &stats->phases[i];
+        fprintf(output, "%-10s %10.2f %10.2f %10.2f %10.2f %10.2f\n", phase_names[i],
+                hist_percentile(hist, 50) / 1000.0, hist_percentile(hist, 90) / 1000.0,
+                hist_percentile(hist, 99) / 1000.0, hist_percentile(hist, 99.9) / 1000.0, hist->max / 1000.0);
+    }
+
+    host_stats_t **hosts = sorted_hosts(stats);
+    if (hosts && stats->host_count > 0) {
+        fprintf(output, "\n%-32s %9s %7s %10s %10s %10s %10s %9s\n", "host", "transfers", "failed",
+                "ttfb p50", "ttfb p99", "total p50", "total p99", "MB/s");
+        for (size_t i = 0; i < stats->host_count; i++) {
+            const host_stats_t *host = hosts[i];
+            fprintf(output, "%-32s %9llu %7llu %10.2f %10.2f %10.2f %10.2f %9.2f\n", host->name[0] ? host->name : "-",
+                    (unsigned long long)host->transfers, (unsigned long long)host->failures,
+                    hist_percentile(&host->ttfb, 50) / 1000.0, hist_percentile(&host->ttfb, 99) / 1000.0,
+                    hist_percentile(&host->total, 50) / 1000.0, hist_percentile(&host->total, 99) / 1000.0,
+                    host_rate(host) / 1e6);
+        }
+    }
+    free(hosts);
+
+    pthread_mutex_unlock(&stats->mutex);
+}
+
+void curly_stats_write_line(const json_t *object, FILE *output) {
+    char *line = json_dumps(object, JSON_COMPACT);
+    if (!line) {
+        return;
+    }
+
+    flockfile(output);
+    fputs(line, output);
+    fputc('\n', output);
+    funlockfile(output);
+    free(line);
+}
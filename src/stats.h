@@ -0,0 +1,101 @@
+#ifndef CURLY_STATS_H
+#define CURLY_STATS_H
+
+#include "curly.h"
+
+/**
+ * Where the time of one transfer went. Each phase is a duration in
+ * microseconds, so they add up to the total: DNS lookup, TCP connect, TLS
+ * handshake (0 for plain HTTP), waiting for the first byte, and receiving
+ * the body. A reused connection has no DNS, connect or TLS time.
+ */
+typedef struct {
+    curl_off_t dns_us;
+    curl_off_t connect_us;
+    curl_off_t tls_us;
+    curl_off_t wait_us;
+    curl_off_t transfer_us;
+    curl_off_t total_us;
+    curl_off_t bytes;           // Body bytes received
+    curl_off_t bytes_per_sec;   // Average download speed
+    long status;                // HTTP status, 0 if there was no response
+} curly_timing_t;
+
+/**
+ * Read the timing of a finished transfer from its easy handle
+ *
+ * @param curl Easy handle of the transfer
+ * @param timing Receives the timing
+ */
+void curly_timing_capture(CURL *curl, curly_timing_t *timing);
+
+/**
+ * Add the timing of a transfer to a JSON object as "dns_us", "connect_us",
+ * "tls_us", "wait_us", "transfer_us", "total_us" (all in microseconds),
+ * "bytes" and "bytes_per_sec"
+ *
+ * @param object Object to add the fields to
+ * @param timing Timing of the transfer
+ */
+void curly_timing_to_json(json_t *object, const curly_timing_t *timing);
+
+/**
+ * Latency and throughput statistics for a run: a log-linear histogram per
+ * phase over all transfers, and of the first-byte and total times per host.
+ * Histogram buckets keep about three percent precision from a microsecond
+ * up to hours, in constant memory. Safe to record into from any thread.
+ */
+typedef struct curly_stats curly_stats_t;
+
+/**
+ * Create an empty set of statistics. The run's wall clock starts now.
+ *
+ * @return New statistics, or NULL if out of memory
+ */
+curly_stats_t *curly_stats_create(void);
+
+/**
+ * Destroy statistics
+ *
+ * @param stats Statistics to destroy, may be NULL
+ */
+void curly_stats_destroy(curly_stats_t *stats);
+
+/**
+ * Record a finished transfer
+ *
+ * @param stats Statistics to add to
+ * @param host Host the transfer went to
+ * @param timing Timing of the transfer
+ * @param failed Non-zero if the transfer failed
+ */
+void curly_stats_record(curly_stats_t *stats, const char *host, const curly_timing_t *timing, int failed);
+
+/**
+ * Write the summary as JSON lines: one with "summary": "overall" holding
+ * percentiles of every phase, then one with "summary": "host" per host.
+ * Percentiles are in microseconds.
+ *
+ * @param stats Statistics to summarize
+ * @param output Stream to write to
+ */
+void curly_stats_write_json(curly_stats_t *stats, FILE *output);
+
+/**
+ * Print the summary as a table for people
+ *
+ * @param stats Statistics to summarize
+ * @param output Stream to write to
+ */
+void curly_stats_print(curly_stats_t *stats, FILE *output);
+
+/**
+ * Write one JSON object as a line. The line is written as a whole, so
+ * several threads can share the stream.
+ *
+ * @param object Object to write
+ * @param output Stream to write to
+ */
+void curly_stats_write_line(const json_t *object, FILE *output);
+
+#endif /* CURLY_STATS_H */
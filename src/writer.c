@@ -0,0 +1,357 @@
+// For fallocate() on Linux
+#define _GNU_SOURCE
+
+#include "writer.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+
+#define WRITE_BUFFER_ALIGNMENT 4096
+
+typedef enum {
+    WRITE_OP_WRITE,
+    WRITE_OP_PREALLOCATE,
+    WRITE_OP_CLOSE
+} write_op_type_t;
+
+// Operation queued for the writer threads
+typedef struct curly_write_op {
+    write_op_type_t type;
+    curly_wfile_t *file;
+    curly_wbuf_t *buffer;
+    curl_off_t offset;  // Write offset, or size to preallocate
+    unsigned generation;  // The file's generation when the write was queued
+    struct curly_write_op *next;
+} curly_write_op_t;
+
+struct curly_writer {
+    pthread_t *threads;
+    int thread_count;
+
+    // Operation queue
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    curly_write_op_t *head;
+    curly_write_op_t *tail;
+    int shutdown;
+
+    // Buffer pool
+    pthread_mutex_t pool_mutex;
+    curly_wbuf_t *buffers;
+    char *memory;
+    curly_wbuf_t *free_buffers;
+    int starved;  // Set (atomically) when a caller found the pool empty
+    void (*notify)(void *arg);
+    void *notify_arg;
+};
+
+// Add an operation to the queue
+static void push_op(curly_writer_t *writer, curly_write_op_t *op) {
+    op->next = NULL;
+
+    pthread_mutex_lock(&writer->mutex);
+    if (writer->tail) {
+        writer->tail->next = op;
+    } else {
+        writer->head = op;
+    }
+    writer->tail = op;
+    pthread_cond_signal(&writer->not_empty);
+    pthread_mutex_unlock(&writer->mutex);
+}
+
+// Take the next operation, blocking until one is available
+static curly_write_op_t *pop_op(curly_writer_t *writer) {
+    pthread_mutex_lock(&writer->mutex);
+
+    while (!writer->head && !writer->shutdown) {
+        pthread_cond_wait(&writer->not_empty, &writer->mutex);
+    }
+
+    curly_write_op_t *op = writer->head;
+    if (op) {
+        writer->head = op->next;
+        if (!writer->head) {
+            writer->tail = NULL;
+        }
+    }
+
+    pthread_mutex_unlock(&writer->mutex);
+    return op;
+}
+
+// Record the first error seen on a file
+static void set_file_error(curly_wfile_t *file, int error) {
+    int expected = 0;
+    __atomic_compare_exchange_n(&file->error, &expected, error, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+// Close a file whose last reference is gone and tell its owner
+static void complete_file(curly_wfile_t *file) {
+    if (file->sync && !curly_wfile_error(file) && fsync(file->fd) != 0) {
+        set_file_error(file, errno);
+    }
+    if (close(file->fd) != 0) {
+        set_file_error(file, errno);
+    }
+    free(file->close_op);
+    file->close_op = NULL;
+    file->complete(file);
+}
+
+// Drop a reference held by a finished operation
+static void unref_file(curly_wfile_t *file) {
+    if (__atomic_sub_fetch(&file->refs, 1, __ATOMIC_SEQ_CST) == 0) {
+        complete_file(file);
+    }
+}
+
+// Write a whole buffer at its offset
+static void write_buffer(curly_wfile_t *file, const curly_wbuf_t *buffer, curl_off_t offset) {
+    size_t written = 0;
+
+    while (written < buffer->length) {
+        ssize_t result = pwrite(file->fd, buffer->data + written, buffer->length - written, (off_t)(offset + written));
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            set_file_error(file, errno);
+            return;
+        }
+        written += (size_t)result;
+    }
+}
+
+// Reserve disk space without changing the visible file size
+static void preallocate_file(curly_wfile_t *file, curl_off_t size) {
+#ifdef __linux__
+    // Failure only costs fragmentation, so it is not reported
+    if (fallocate(file->fd, FALLOC_FL_KEEP_SIZE, 0, (off_t)size) != 0) {
+        return;
+    }
+#else
+    (void)file;
+    (void)size;
+#endif
+}
+
+// Writer thread function
+static void *writer_thread(void *arg) {
+    curly_writer_t *writer = (curly_writer_t *)arg;
+    curly_write_op_t *op;
+
+    while ((op = pop_op(writer)) != NULL) {
+        curly_wfile_t *file = op->file;
+
+        switch (op->type) {
+            case WRITE_OP_WRITE:
+                // Data queued before a truncation belongs to contents
+                // that are gone. Announcing the write before checking
+                // lets curly_wfile_truncate() wait for it.
+                __atomic_add_fetch(&file->writing, 1, __ATOMIC_SEQ_CST);
+                if (op->generation == __atomic_load_n(&file->generation, __ATOMIC_SEQ_CST) &&
+                    !curly_wfile_error(file)) {
+                    write_buffer(file, op->buffer, op->offset);
+                }
+                __atomic_sub_fetch(&file->writing, 1, __ATOMIC_SEQ_CST);
+                curly_writer_put_buffer(writer, op->buffer);
+                free(op);
+                unref_file(file);
+                break;
+            case WRITE_OP_PREALLOCATE:
+                preallocate_file(file, op->offset);
+                free(op);
+                unref_file(file);
+                break;
+            case WRITE_OP_CLOSE:
+                complete_file(file);
+                break;
+        }
+    }
+
+    return NULL;
+}
+
+curly_writer_t *curly_writer_create(int thread_count, int buffer_count, size_t buffer_size) {
+    if (thread_count <= 0 || buffer_count <= 0 || buffer_size == 0) {
+        return NULL;
+    }
+
+    curly_writer_t *writer = (curly_writer_t *)calloc(1, sizeof(curly_writer_t));
+    if (!writer) {
+        return NULL;
+    }
+
+    // One aligned block backs every buffer in the pool
+    writer->buffers = (curly_wbuf_t *)calloc(buffer_count, sizeof(curly_wbuf_t));
+    if (!writer->buffers ||
+        posix_memalign((void **)&writer->memory, WRITE_BUFFER_ALIGNMENT, (size_t)buffer_count * buffer_size) != 0) {
+        free(writer->buffers);
+        free(writer);
+        return NULL;
+    }
+
+    for (int i = 0; i < buffer_count; i++) {
+        curly_wbuf_t *buffer = &writer->buffers[i];
+        buffer->data = writer->memory + (size_t)i * buffer_size;
+        buffer->capacity = buffer_size;
+        buffer->next = writer->free_buffers;
+        writer->free_buffers = buffer;
+    }
+
+    pthread_mutex_init(&writer->mutex, NULL);
+    pthread_cond_init(&writer->not_empty, NULL);
+    pthread_mutex_init(&writer->pool_mutex, NULL);
+
+    writer->threads = (pthread_t *)malloc(thread_count * sizeof(pthread_t));
+    if (!writer->threads) {
+        curly_writer_destroy(writer);
+        return NULL;
+    }
+
+    for (int i = 0; i < thread_count; i++) {
+        if (pthread_create(&writer->threads[i], NULL, writer_thread, writer) != 0) {
+            curly_writer_destroy(writer);
+            return NULL;
+        }
+        writer->thread_count = i + 1;
+    }
+
+    return writer;
+}
+
+void curly_writer_destroy(curly_writer_t *writer) {
+    if (!writer) return;
+
+    // Let the threads drain the queue and exit
+    pthread_mutex_lock(&writer->mutex);
+    writer->shutdown = 1;
+    pthread_cond_broadcast(&writer->not_empty);
+    pthread_mutex_unlock(&writer->mutex);
+
+    for (int i = 0; i < writer->thread_count; i++) {
+        pthread_join(writer->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&writer->not_empty);
+    pthread_mutex_destroy(&writer->mutex);
+    pthread_mutex_destroy(&writer->pool_mutex);
+    free(writer->threads);
+    free(writer->memory);
+    free(writer->buffers);
+    free(writer);
+}
+
+void curly_writer_set_notify(curly_writer_t *writer, void (*notify)(void *arg), void *arg) {
+    writer->notify = notify;
+    writer->notify_arg = arg;
+}
+
+curly_wbuf_t *curly_writer_get_buffer(curly_writer_t *writer) {
+    pthread_mutex_lock(&writer->pool_mutex);
+    curly_wbuf_t *buffer = writer->free_buffers;
+    if (buffer) {
+        writer->free_buffers = buffer->next;
+    } else {
+        __atomic_store_n(&writer->starved, 1, __ATOMIC_SEQ_CST);
+    }
+    pthread_mutex_unlock(&writer->pool_mutex);
+
+    if (buffer) {
+        buffer->length = 0;
+        buffer->next = NULL;
+    }
+    return buffer;
+}
+
+void curly_writer_put_buffer(curly_writer_t *writer, curly_wbuf_t *buffer) {
+    pthread_mutex_lock(&writer->pool_mutex);
+    buffer->next = writer->free_buffers;
+    writer->free_buffers = buffer;
+    pthread_mutex_unlock(&writer->pool_mutex);
+
+    // Let paused transfers know there is room again
+    if (__atomic_load_n(&writer->starved, __ATOMIC_SEQ_CST) &&
+        __atomic_exchange_n(&writer->starved, 0, __ATOMIC_SEQ_CST) &&
+        writer->notify) {
+        writer->notify(writer->notify_arg);
+    }
+}
+
+int curly_wfile_init(curly_wfile_t *file, int fd, void (*complete)(curly_wfile_t *file)) {
+    // The close operation is allocated up front so releasing can never fail
+    file->close_op = (curly_write_op_t *)calloc(1, sizeof(curly_write_op_t));
+    if (!file->close_op) {
+        return -1;
+    }
+
+    file->fd = fd;
+    file->refs = 1;
+    file->error = 0;
+    file->sync = 0;
+    file->generation = 0;
+    file->writing = 0;
+    file->complete = complete;
+    return 0;
+}
+
+void curly_writer_submit(curly_writer_t *writer, curly_wfile_t *file, curly_wbuf_t *buffer, curl_off_t offset) {
+    curly_write_op_t *op = (curly_write_op_t *)malloc(sizeof(curly_write_op_t));
+    if (!op) {
+        set_file_error(file, ENOMEM);
+        curly_writer_put_buffer(writer, buffer);
+        return;
+    }
+
+    __atomic_add_fetch(&file->refs, 1, __ATOMIC_SEQ_CST);
+    op->type = WRITE_OP_WRITE;
+    op->file = file;
+    op->buffer = buffer;
+    op->offset = offset;
+    op->generation = __atomic_load_n(&file->generation, __ATOMIC_SEQ_CST);
+    push_op(writer, op);
+}
+
+void curly_writer_preallocate(curly_writer_t *writer, curly_wfile_t *file, curl_off_t size) {
+    curly_write_op_t *op = (curly_write_op_t *)malloc(sizeof(curly_write_op_t));
+    if (!op) {
+        return;  // Preallocation is only an optimization
+    }
+
+    __atomic_add_fetch(&file->refs, 1, __ATOMIC_SEQ_CST);
+    op->type = WRITE_OP_PREALLOCATE;
+    op->file = file;
+    op->buffer = NULL;
+    op->offset = size;
+    push_op(writer, op);
+}
+
+int curly_wfile_truncate(curly_wfile_t *file) {
+    // A write that starts after the bump sees it and is skipped; one that
+    // started before has to finish first
+    __atomic_add_fetch(&file->generation, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&file->writing, __ATOMIC_SEQ_CST) > 0) {
+        sched_yield();
+    }
+    return ftruncate(file->fd, 0);
+}
+
+void curly_wfile_retain(curly_wfile_t *file) {
+    __atomic_add_fetch(&file->refs, 1, __ATOMIC_SEQ_CST);
+}
+
+void curly_wfile_release(curly_writer_t *writer, curly_wfile_t *file) {
+    if (__atomic_sub_fetch(&file->refs, 1, __ATOMIC_SEQ_CST) == 0) {
+        // Closing may block, so leave it to a writer thread
+        curly_write_op_t *op = file->close_op;
+        op->type = WRITE_OP_CLOSE;
+        op->file = file;
+        push_op(writer, op);
+    }
+}
+
+int curly_wfile_error(curly_wfile_t *file) {
+    return __atomic_load_n(&file->error, __ATOMIC_SEQ_CST);
+}
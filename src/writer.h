@@ -0,0 +1,151 @@
+#ifndef CURLY_WRITER_H
+#define CURLY_WRITER_H
+
+#include "curly.h"
+
+/**
+ * Asynchronous disk writer. Network threads copy received data into large
+ * aligned buffers taken from a bounded pool and hand full buffers to
+ * dedicated writer threads, which pwrite() them at their file offsets. A
+ * slow disk therefore only ever delays the network side through buffer
+ * exhaustion, which callers turn into paused transfers.
+ */
+typedef struct curly_writer curly_writer_t;
+
+/**
+ * A file being written through the writer. Owners embed this as the first
+ * member of their own structure. The file is reference counted: the owner
+ * holds one reference and every queued operation holds another. Once all
+ * are gone a writer thread closes the descriptor and calls complete().
+ */
+typedef struct curly_wfile {
+    int fd;
+    int refs;    // Accessed atomically
+    int error;   // First errno seen by a writer thread, accessed atomically
+    int sync;    // fsync() the file before closing it
+    unsigned generation;  // Bumped by truncation, accessed atomically
+    int writing;          // Writes in progress, accessed atomically
+    void (*complete)(struct curly_wfile *file);
+    struct curly_write_op *close_op;
+} curly_wfile_t;
+
+/**
+ * A pooled write buffer
+ */
+typedef struct curly_wbuf {
+    char *data;
+    size_t length;    // Bytes filled
+    size_t capacity;
+    struct curly_wbuf *next;
+} curly_wbuf_t;
+
+/**
+ * Create a writer
+ *
+ * @param thread_count Number of writer threads
+ * @param buffer_count Number of buffers in the pool
+ * @param buffer_size Size of each buffer in bytes
+ * @return New writer, or NULL on failure
+ */
+curly_writer_t *curly_writer_create(int thread_count, int buffer_count, size_t buffer_size);
+
+/**
+ * Wait for all queued operations to finish and destroy the writer
+ *
+ * @param writer Writer to destroy
+ */
+void curly_writer_destroy(curly_writer_t *writer);
+
+/**
+ * Register a function called (from a writer thread) when a buffer is
+ * returned to a pool that a caller found empty
+ *
+ * @param writer Writer
+ * @param notify Function to call
+ * @param arg Argument passed to notify
+ */
+void curly_writer_set_notify(curly_writer_t *writer, void (*notify)(void *arg), void *arg);
+
+/**
+ * Take a buffer from the pool without blocking
+ *
+ * @param writer Writer
+ * @return Empty buffer, or NULL if the pool is exhausted
+ */
+curly_wbuf_t *curly_writer_get_buffer(curly_writer_t *writer);
+
+/**
+ * Return an unused buffer to the pool
+ *
+ * @param writer Writer
+ * @param buffer Buffer to return
+ */
+void curly_writer_put_buffer(curly_writer_t *writer, curly_wbuf_t *buffer);
+
+/**
+ * Initialize a file for writing through the writer. The caller holds the
+ * initial reference.
+ *
+ * @param file File to initialize
+ * @param fd Open file descriptor, closed by the writer
+ * @param complete Called once the file is closed
+ * @return 0 on success, -1 on failure
+ */
+int curly_wfile_init(curly_wfile_t *file, int fd, void (*complete)(curly_wfile_t *file));
+
+/**
+ * Queue a filled buffer to be written at the given offset. The buffer
+ * returns to the pool once written.
+ *
+ * @param writer Writer
+ * @param file Destination file
+ * @param buffer Buffer holding the data
+ * @param offset File offset of the first byte in the buffer
+ */
+void curly_writer_submit(curly_writer_t *writer, curly_wfile_t *file, curly_wbuf_t *buffer, curl_off_t offset);
+
+/**
+ * Queue preallocation of disk space for a file of the given size
+ *
+ * @param writer Writer
+ * @param file File to preallocate
+ * @param size Expected file size in bytes
+ */
+void curly_writer_preallocate(curly_writer_t *writer, curly_wfile_t *file, curl_off_t size);
+
+/**
+ * Empty a file from the owner's thread. Writes queued before the call are
+ * dropped, and a write already in progress is waited for, so no earlier
+ * data can land in the file afterwards.
+ *
+ * @param file File to truncate
+ * @return 0 on success, -1 with errno set on failure
+ */
+int curly_wfile_truncate(curly_wfile_t *file);
+
+/**
+ * Take an additional owner reference, e.g. for another transfer writing
+ * into the same file
+ *
+ * @param file File to retain
+ */
+void curly_wfile_retain(curly_wfile_t *file);
+
+/**
+ * Drop an owner reference. The file is closed once every queued
+ * operation on it has finished.
+ *
+ * @param writer Writer
+ * @param file File to release
+ */
+void curly_wfile_release(curly_writer_t *writer, curly_wfile_t *file);
+
+/**
+ * Check whether a write to the file has failed
+ *
+ * @param file File to check
+ * @return errno of the first failed write, 0 if none
+ */
+int curly_wfile_error(curly_wfile_t *file);
+
+#endif /* CURLY_WRITER_H */
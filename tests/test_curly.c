@@ -1,9 +1,36 @@
+// For mkstemp() when using strict C99
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/un.h>
 #include <curl/curl.h>
 #include "curly.h"
+#include "../src/retry.h"
+#include "../src/ratelimit.h"
+#include "../src/request.h"
+#include "../src/stats.h"
+#include "../src/ingest.h"
+#include "../src/sha256.h"
+#include "../src/resolve.h"
+#include "../src/output.h"
+#include "../src/encoding.h"
+#include "../src/dedup.h"
+#include "../src/queue.h"
+#include "../src/writer.h"
+#include "../src/loop.h"
 
 void test_parse_config_basic() {
     printf("Running test_parse_config_basic...\n");
@@ -75,9 +102,2243 @@ void test_error_handling() {
     
     assert(error == CURLY_ERROR_INVALID_JSON);
     
+    // Codes keep the values of the first release
+    assert(CURLY_ERROR_THREAD_CREATE == 7 && CURLY_ERROR_UNKNOWN == 8);
+    assert(CURLY_ERROR_FILE_WRITE > CURLY_ERROR_UNKNOWN);
+    
     printf("test_error_handling: PASSED\n");
 }
 
+void test_parallel_options_defaults() {
+    printf("Running test_parallel_options_defaults...\n");
+    
+    curly_parallel_options_t options;
+    curly_parallel_options_init(&options);
+    
+    assert(options.thread_count > 0);
+    assert(options.max_transfers >= options.thread_count);
+    assert(options.segments == 1);
+    assert(options.retries > 0);
+    assert(options.max_per_host > 0);
+    assert(options.http_version == CURLY_HTTP_1);
+    assert(options.max_streams > 0);
+    
+    printf("test_parallel_options_defaults: PASSED\n");
+}
+
+void test_retry_policy() {
+    printf("Running test_retry_policy...\n");
+    
+    // The documented config format: count retries, delays in seconds
+    json_t *retry = json_loads("{\"count\":3,\"delay\":2,\"max_delay\":5}", 0, NULL);
+    assert(retry != NULL);
+    curly_retry_policy_t policy;
+    curly_retry_policy_from_json(&policy, retry);
+    json_decref(retry);
+    assert(policy.max_attempts == 4);
+    assert(policy.delay_ms == 2000);
+    
+    // Jittered exponential backoff, capped, and only until attempts run out
+    long delay = curly_retry_delay(&policy, 1, 0);
+    assert(delay >= 1000 && delay <= 2000);
+    delay = curly_retry_delay(&policy, 3, 0);
+    assert(delay >= 2500 && delay <= 5000);
+    assert(curly_retry_delay(&policy, 4, 0) == -1);
+    
+    // Retry-After wins unless it asks for more than max_delay
+    assert(curly_retry_delay(&policy, 1, 3) == 3000);
+    assert(curly_retry_delay(&policy, 1, 60) == -1);
+    
+    assert(curly_retry_is_retryable(CURLE_HTTP_RETURNED_ERROR, 503));
+    assert(curly_retry_is_retryable(CURLE_OK, 429));
+    assert(curly_retry_is_retryable(CURLE_COULDNT_CONNECT, 0));
+    assert(!curly_retry_is_retryable(CURLE_HTTP_RETURNED_ERROR, 404));
+    assert(!curly_retry_is_retryable(CURLE_OK, 200));
+    
+    // Without a retry object nothing is retried
+    curly_retry_policy_from_json(&policy, NULL);
+    assert(curly_retry_delay(&policy, 1, 0) == -1);
+    
+    // The budget allows the burst, then a fraction of a retry per request
+    curly_retry_budget_t budget;
+    curly_retry_budget_init(&budget, 0.5, 1);
+    assert(curly_retry_budget_withdraw(&budget));
+    assert(!curly_retry_budget_withdraw(&budget));
+    curly_retry_budget_deposit(&budget);
+    assert(!curly_retry_budget_withdraw(&budget));
+    curly_retry_budget_deposit(&budget);
+    assert(curly_retry_budget_withdraw(&budget));
+    
+    printf("test_retry_policy: PASSED\n");
+}
+
+void test_rate_limit() {
+    printf("Running test_rate_limit...\n");
+    
+    // Both the config form and the options parsed from the CLI
+    curly_rate_limit_t limit;
+    curly_rate_limit_init(&limit);
+    limit.host_requests_per_sec = 2;
+    assert(curly_parse_rate_limit("{\"rate_limit\":{\"max_rate\":1000,\"burst\":0.5}}", &limit) == CURLY_OK);
+    assert(limit.bytes_per_sec == 1000);
+    assert(limit.burst_ms == 500);
+    assert(limit.host_requests_per_sec == 2);
+    assert(curly_parse_rate_limit("[1]", &limit) == CURLY_ERROR_INVALID_JSON);
+    
+    // 10 units per second with a 100 ms burst: one unit goes through at
+    // once, the next has to wait its turn
+    const long long ms = 1000000;
+    curly_rate_bucket_t bucket;
+    curly_rate_bucket_init(&bucket, 10, 100);
+    long long now = 1000 * ms;
+    assert(curly_rate_bucket_delay(&bucket, now) == 0);
+    curly_rate_bucket_take(&bucket, 1, now);
+    assert(curly_rate_bucket_delay(&bucket, now) == 0);
+    curly_rate_bucket_take(&bucket, 1, now);
+    assert(curly_rate_bucket_delay(&bucket, now) == 100);
+    assert(curly_rate_bucket_delay(&bucket, now + 100 * ms) == 0);
+    
+    // Idle time does not bank more than the burst
+    curly_rate_bucket_take(&bucket, 1, now + 10000 * ms);
+    curly_rate_bucket_take(&bucket, 1, now + 10000 * ms);
+    assert(curly_rate_bucket_delay(&bucket, now + 10000 * ms) == 100);
+    
+    // A bucket without a rate never holds anything back
+    curly_rate_bucket_init(&bucket, 0, 100);
+    curly_rate_bucket_take(&bucket, 1e9, now);
+    assert(curly_rate_bucket_delay(&bucket, now) == 0);
+    
+    printf("test_rate_limit: PASSED\n");
+}
+
+void test_batch_invalid_lines() {
+    printf("Running test_batch_invalid_lines...\n");
+    
+    FILE *input = tmpfile();
+    FILE *output = tmpfile();
+    assert(input != NULL && output != NULL);
+    
+    fputs("not json\n\n{\"id\":\"x\",\"method\":\"GET\"}\n", input);
+    rewind(input);
+    
+    curly_batch_options_t options;
+    curly_batch_options_init(&options);
+    curly_error_t error = curly_batch_run(&options, input, output);
+    assert(error == CURLY_ERROR_CURL_PERFORM);
+    
+    // One result line per request, blank lines skipped
+    char line[512];
+    rewind(output);
+    assert(fgets(line, sizeof(line), output) != NULL);
+    assert(strstr(line, "\"id\":1") != NULL);
+    assert(fgets(line, sizeof(line), output) != NULL);
+    assert(strstr(line, "\"id\":\"x\"") != NULL);
+    assert(strstr(line, "Missing URL") != NULL);
+    assert(fgets(line, sizeof(line), output) == NULL);
+    
+    fclose(input);
+    fclose(output);
+    printf("test_batch_invalid_lines: PASSED\n");
+}
+
+static size_t count_callback(const char *data, size_t size, void *userdata) {
+    (void)data;
+    *(size_t *)userdata += size;
+    return size;
+}
+
+void test_sink_binary_body() {
+    printf("Running test_sink_binary_body...\n");
+    
+    // Serve a body with embedded NUL bytes from a local file
+    char path[] = "/tmp/curly_test_XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    const char payload[] = "abc\0def\0ghi";
+    assert(write(fd, payload, sizeof(payload)) == (ssize_t)sizeof(payload));
+    close(fd);
+    
+    char json[256];
+    snprintf(json, sizeof(json), "{\"url\":\"file://%s\"}", path);
+    curly_config_t config;
+    assert(curly_parse_config(json, &config) == CURLY_OK);
+    
+    // Buffer sink keeps the full body including NUL bytes
+    curly_response_t response;
+    curly_sink_t sink;
+    curly_sink_init_buffer(&sink, &response);
+    assert(curly_perform_request_sink(&config, &sink) == CURLY_OK);
+    assert(response.size == sizeof(payload));
+    assert(memcmp(response.data, payload, sizeof(payload)) == 0);
+    curly_free_response(&response);
+    
+    // Callback sink sees every byte
+    size_t received = 0;
+    curly_sink_init_callback(&sink, count_callback, &received);
+    assert(curly_perform_request_sink(&config, &sink) == CURLY_OK);
+    assert(received == sizeof(payload));
+    
+    curly_free_config(&config);
+    unlink(path);
+    printf("test_sink_binary_body: PASSED\n");
+}
+
+void test_plan_execute() {
+    printf("Running test_plan_execute...\n");
+    
+    // Two local files reached through one templated URL
+    char first[] = "/tmp/curly_plan_XXXXXX";
+    char second[] = "/tmp/curly_plan_XXXXXX";
+    int fd = mkstemp(first);
+    assert(fd >= 0);
+    assert(write(fd, "first", 5) == 5);
+    close(fd);
+    fd = mkstemp(second);
+    assert(fd >= 0);
+    assert(write(fd, "second body", 11) == 11);
+    close(fd);
+    
+    curly_config_t config;
+    assert(curly_parse_config("{\"url\":\"file:///tmp/{{name}}\","
+                              "\"headers\":{\"X-Id\":\"{{id}}\"}}", &config) == CURLY_OK);
+    curly_plan_t *plan = NULL;
+    assert(curly_plan_compile(&config, &plan) == CURLY_OK);
+    curly_free_config(&config);
+    
+    curly_response_t response;
+    curly_sink_t sink;
+    curly_var_t vars[] = {{"name", first + 5}, {"id", "1"}};
+    curly_sink_init_buffer(&sink, &response);
+    assert(curly_plan_execute(plan, vars, 2, &sink) == CURLY_OK);
+    assert(response.size == 5 && memcmp(response.data, "first", 5) == 0);
+    curly_free_response(&response);
+    
+    vars[0].value = second + 5;
+    curly_sink_init_buffer(&sink, &response);
+    assert(curly_plan_execute(plan, vars, 2, &sink) == CURLY_OK);
+    assert(response.size == 11 && memcmp(response.data, "second body", 11) == 0);
+    curly_free_response(&response);
+    
+    // Missing values and header line breaks are refused before any transfer
+    assert(curly_plan_execute(plan, vars, 1, &sink) == CURLY_ERROR_MISSING_VARIABLE);
+    vars[1].value = "1\r\nX-Injected: yes";
+    assert(curly_plan_execute(plan, vars, 2, &sink) == CURLY_ERROR_MISSING_VARIABLE);
+    
+    curly_plan_free(plan);
+    unlink(first);
+    unlink(second);
+    printf("test_plan_execute: PASSED\n");
+}
+
+void test_download_file_ex_fallback() {
+    printf("Running test_download_file_ex_fallback...\n");
+    
+    // file:// has no Accept-Ranges, so the download must fall back to one connection
+    char source[] = "/tmp/curly_test_XXXXXX";
+    int fd = mkstemp(source);
+    assert(fd >= 0);
+    const char payload[] = "segmented download fallback";
+    assert(write(fd, payload, sizeof(payload)) == (ssize_t)sizeof(payload));
+    close(fd);
+    
+    char url[256];
+    char destination[256];
+    snprintf(url, sizeof(url), "file://%s", source);
+    snprintf(destination, sizeof(destination), "%s.out", source);
+    
+    assert(curly_download_file_ex(url, destination, 4, 1) == CURLY_OK);
+    
+    char copy[sizeof(payload)];
+    fd = open(destination, O_RDONLY);
+    assert(fd >= 0);
+    assert(read(fd, copy, sizeof(copy)) == (ssize_t)sizeof(payload));
+    assert(memcmp(copy, payload, sizeof(payload)) == 0);
+    close(fd);
+    
+    unlink(destination);
+    unlink(source);
+    printf("test_download_file_ex_fallback: PASSED\n");
+}
+
+void test_parallel_journal_skip() {
+    printf("Running test_parallel_journal_skip...\n");
+    
+    char source[] = "/tmp/curly_test_XXXXXX";
+    int fd = mkstemp(source);
+    assert(fd >= 0);
+    const char payload[] = "journaled download";
+    assert(write(fd, payload, sizeof(payload)) == (ssize_t)sizeof(payload));
+    close(fd);
+    
+    char destination[256];
+    char journal[256];
+    snprintf(destination, sizeof(destination), "%s.out", source);
+    snprintf(journal, sizeof(journal), "%s.journal", source);
+    
+    curly_parallel_options_t options;
+    curly_parallel_options_init(&options);
+    options.thread_count = 1;
+    options.journal_path = journal;
+    options.revalidate = 0;
+    
+    // The first run downloads and journals the file
+    FILE *input = tmpfile();
+    assert(input != NULL);
+    fprintf(input, "file://%s\t%s\n", source, destination);
+    rewind(input);
+    assert(curly_parallel_download_ex(&options, input) == CURLY_OK);
+    
+    struct stat st;
+    assert(stat(destination, &st) == 0 && st.st_size == (off_t)sizeof(payload));
+    
+    // With the source gone, the rerun must trust the journal and leave the file alone
+    unlink(source);
+    rewind(input);
+    assert(curly_parallel_download_ex(&options, input) == CURLY_OK);
+    assert(stat(destination, &st) == 0 && st.st_size == (off_t)sizeof(payload));
+    fclose(input);
+    
+    unlink(destination);
+    unlink(journal);
+    printf("test_parallel_journal_skip: PASSED\n");
+}
+
+void test_arena_config() {
+    printf("Running test_arena_config...\n");
+    
+    char path[] = "/tmp/curly_test_XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    assert(write(fd, "arena body", 10) == 10);
+    close(fd);
+    
+    curly_arena_t *arena = curly_arena_create(64);
+    assert(arena != NULL);
+    
+    // The same arena serves several requests, reset in between
+    for (int i = 0; i < 3; i++) {
+        char json[256];
+        snprintf(json, sizeof(json), "{\"url\":\"file://%s\",\"method\":\"GET\","
+                 "\"headers\":{\"X-Run\":\"%d\"},\"auth\":{\"type\":\"bearer\",\"token\":\"t\"}}",
+                 path, i);
+        curly_config_t config;
+        assert(curly_parse_config_arena(json, &config, arena) == CURLY_OK);
+        assert(config.arena == arena);
+        assert(strcmp(config.method, "GET") == 0);
+        assert(json_is_string(json_object_get(config.headers, "X-Run")));
+        
+        curly_response_t response;
+        curly_sink_t sink;
+        curly_sink_init_arena(&sink, &response, arena);
+        assert(curly_perform_request_sink(&config, &sink) == CURLY_OK);
+        assert(response.size == 10 && memcmp(response.data, "arena body", 10) == 0);
+        
+        curly_free_response(&response);
+        curly_free_config(&config);
+        curly_arena_reset(arena);
+    }
+    
+    // Missing URL still reports the error and leaves nothing to free
+    curly_config_t config;
+    assert(curly_parse_config_arena("{}", &config, arena) == CURLY_ERROR_MISSING_URL);
+    curly_free_config(&config);
+    
+    curly_arena_destroy(arena);
+    unlink(path);
+    printf("test_arena_config: PASSED\n");
+}
+
+void test_buffer_pool() {
+    printf("Running test_buffer_pool...\n");
+    
+    char path[] = "/tmp/curly_test_XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    assert(write(fd, "pooled body", 11) == 11);
+    close(fd);
+    
+    char json[256];
+    snprintf(json, sizeof(json), "{\"url\":\"file://%s\"}", path);
+    curly_config_t config;
+    assert(curly_parse_config(json, &config) == CURLY_OK);
+    curly_buffer_pool_t *pool = curly_buffer_pool_create(1);
+    assert(pool != NULL);
+    
+    // A freed response hands its buffer to the next one
+    curly_response_t response;
+    curly_sink_t sink;
+    curly_sink_init_pooled(&sink, &response, pool);
+    assert(curly_perform_request_sink(&config, &sink) == CURLY_OK);
+    assert(response.size == 11 && memcmp(response.data, "pooled body", 12) == 0);
+    char *first = response.data;
+    curly_free_response(&response);
+    
+    curly_sink_init_pooled(&sink, &response, pool);
+    assert(curly_perform_request_sink(&config, &sink) == CURLY_OK);
+    assert(response.data == first);
+    assert(response.size == 11 && memcmp(response.data, "pooled body", 12) == 0);
+    curly_free_response(&response);
+    
+    // Content-Length sizes the buffer before any body arrives
+    char header[] = "content-length: 1000000\r\n";
+    curly_sink_init_buffer(&sink, &response);
+    assert(curly_sink_header(header, 1, strlen(header), &sink) == strlen(header));
+    assert(response.capacity == 1000001 && response.size == 0);
+    curly_free_response(&response);
+    
+    curly_buffer_pool_destroy(pool);
+    curly_free_config(&config);
+    unlink(path);
+    printf("test_buffer_pool: PASSED\n");
+}
+
+void test_stats_summary() {
+    printf("Running test_stats_summary...\n");
+    
+    curly_stats_t *stats = curly_stats_create();
+    assert(stats != NULL);
+    
+    // 1..1000 ms of total time on one host, plus a failure on another
+    curly_timing_t timing;
+    memset(&timing, 0, sizeof(timing));
+    for (int i = 1; i <= 1000; i++) {
+        timing.total_us = (curl_off_t)i * 1000;
+        timing.wait_us = timing.total_us / 2;
+        timing.bytes = 100;
+        curly_stats_record(stats, "a.example", &timing, 0);
+    }
+    curly_stats_record(stats, "b.example", &timing, 1);
+    
+    FILE *output = tmpfile();
+    assert(output != NULL);
+    curly_stats_write_json(stats, output);
+    rewind(output);
+    
+    char line[4096];
+    assert(fgets(line, sizeof(line), output) != NULL);
+    json_t *overall = json_loads(line, 0, NULL);
+    assert(overall != NULL);
+    assert(json_integer_value(json_object_get(overall, "transfers")) == 1001);
+    assert(json_integer_value(json_object_get(overall, "failures")) == 1);
+    
+    // Percentiles are within the histogram's few percent of the exact values
+    json_t *total = json_object_get(overall, "total_us");
+    json_int_t p50 = json_integer_value(json_object_get(total, "p50"));
+    json_int_t p99 = json_integer_value(json_object_get(total, "p99"));
+    assert(p50 > 485000 && p50 < 515000);
+    assert(p99 > 960000 && p99 < 1020000);
+    assert(json_integer_value(json_object_get(total, "max")) == 1000000);
+    json_decref(overall);
+    
+    // The busiest host comes first
+    assert(fgets(line, sizeof(line), output) != NULL);
+    json_t *host = json_loads(line, 0, NULL);
+    assert(host != NULL);
+    assert(strcmp(json_string_value(json_object_get(host, "host")), "a.example") == 0);
+    assert(json_integer_value(json_object_get(host, "transfers")) == 1000);
+    json_decref(host);
+    
+    fclose(output);
+    curly_stats_destroy(stats);
+    printf("test_stats_summary: PASSED\n");
+}
+
+// Listen on a loopback port. Returns the socket and the port.
+static int listen_loopback(int backlog, int *port) {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    assert(listener >= 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(addr);
+    assert(bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    assert(listen(listener, backlog) == 0);
+    assert(getsockname(listener, (struct sockaddr *)&addr, &length) == 0);
+    *port = ntohs(addr.sin_port);
+    return listener;
+}
+
+// Read a request's headers into a NUL-terminated buffer
+static void read_request(int client, char *request, size_t size) {
+    size_t used = 0;
+    request[0] = '\0';
+    while (used < size - 1) {
+        ssize_t got = recv(client, request + used, size - 1 - used, 0);
+        if (got <= 0) {
+            break;
+        }
+        used += (size_t)got;
+        request[used] = '\0';
+        if (strstr(request, "\r\n\r\n")) {
+            break;
+        }
+    }
+}
+
+// Answer one HTTP connection after another with the given raw responses,
+// from a child process. Returns its pid and the port it listens on.
+static pid_t serve_responses(const char **responses, int count, int *port) {
+    int listener = listen_loopback(4, port);
+    
+    pid_t child = fork();
+    assert(child >= 0);
+    if (child == 0) {
+        for (int i = 0; i < count; i++) {
+            int client = accept(listener, NULL, NULL);
+            if (client < 0) {
+                _exit(1);
+            }
+            // Read the request headers, then answer and hang up
+            char request[4096];
+            read_request(client, request, sizeof(request));
+            ssize_t sent = send(client, responses[i], strlen(responses[i]), 0);
+            (void)sent;
+            close(client);
+        }
+        _exit(0);
+    }
+    close(listener);
+    return child;
+}
+
+// Loopback server answering a fixed number of connections, each on its own
+// thread, from a thread of the test process
+typedef struct loopback_server {
+    int listener;
+    int connections;
+    void (*answer)(struct loopback_server *server, int client, const char *request);
+    void *state;            // Guarded by mutex
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+    pthread_t thread;
+} loopback_server_t;
+
+typedef struct {
+    loopback_server_t *server;
+    int client;
+} loopback_connection_t;
+
+static void *loopback_connection_thread(void *arg) {
+    loopback_connection_t *connection = (loopback_connection_t *)arg;
+    char request[4096];
+    read_request(connection->client, request, sizeof(request));
+    connection->server->answer(connection->server, connection->client, request);
+    close(connection->client);
+    free(connection);
+    return NULL;
+}
+
+static void *loopback_server_thread(void *arg) {
+    loopback_server_t *server = (loopback_server_t *)arg;
+    pthread_t *threads = malloc((size_t)server->connections * sizeof(pthread_t));
+    assert(threads != NULL);
+    for (int i = 0; i < server->connections; i++) {
+        loopback_connection_t *connection = malloc(sizeof(loopback_connection_t));
+        assert(connection != NULL);
+        connection->server = server;
+        connection->client = accept(server->listener, NULL, NULL);
+        assert(connection->client >= 0);
+        assert(pthread_create(&threads[i], NULL, loopback_connection_thread, connection) == 0);
+    }
+    for (int i = 0; i < server->connections; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    return NULL;
+}
+
+// Start answering connections. Returns the port listened on.
+static int start_loopback_server(loopback_server_t *server, int connections,
+                                 void (*answer)(loopback_server_t *server, int client, const char *request),
+                                 void *state) {
+    int port;
+    server->listener = listen_loopback(64, &port);
+    server->connections = connections;
+    server->answer = answer;
+    server->state = state;
+    assert(pthread_mutex_init(&server->mutex, NULL) == 0);
+    assert(pthread_cond_init(&server->changed, NULL) == 0);
+    assert(pthread_create(&server->thread, NULL, loopback_server_thread, server) == 0);
+    return port;
+}
+
+// Wait for every connection to be answered and stop listening
+static void stop_loopback_server(loopback_server_t *server) {
+    pthread_join(server->thread, NULL);
+    close(server->listener);
+    pthread_cond_destroy(&server->changed);
+    pthread_mutex_destroy(&server->mutex);
+}
+
+// Send a whole buffer, ignoring a client that has hung up
+static void send_all(int client, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t sent = send(client, data, length, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            return;
+        }
+        data += sent;
+        length -= (size_t)sent;
+    }
+}
+
+typedef struct {
+    const char *socket_path;
+    curly_batch_options_t options;
+    curly_error_t result;
+} serve_thread_t;
+
+static void *serve_thread(void *arg) {
+    serve_thread_t *serve = (serve_thread_t *)arg;
+    serve->result = curly_serve(serve->socket_path, &serve->options);
+    return NULL;
+}
+
+void test_serve_client() {
+    printf("Running test_serve_client...\n");
+    
+    char dir[] = "/tmp/curly_test_XXXXXX";
+    assert(mkdtemp(dir) != NULL);
+    char socket_path[256], body_path[256];
+    snprintf(socket_path, sizeof(socket_path), "%s/curly.sock", dir);
+    snprintf(body_path, sizeof(body_path), "%s/body.txt", dir);
+    FILE *body = fopen(body_path, "w");
+    assert(body != NULL);
+    fputs("hello", body);
+    fclose(body);
+    
+    serve_thread_t serve;
+    serve.socket_path = socket_path;
+    curly_batch_options_init(&serve.options);
+    pthread_t thread;
+    assert(pthread_create(&thread, NULL, serve_thread, &serve) == 0);
+    struct stat st;
+    struct timespec pause = {0, 10000000};
+    for (int i = 0; i < 500 && stat(socket_path, &st) != 0; i++) {
+        nanosleep(&pause, NULL);
+    }
+    
+    // Two clients in a row share the daemon; results come back per client
+    for (int round = 0; round < 2; round++) {
+        FILE *input = tmpfile();
+        FILE *output = tmpfile();
+        assert(input != NULL && output != NULL);
+        fprintf(input, "{\"id\":\"a\",\"url\":\"file://%s\"}\nnot json\n", body_path);
+        rewind(input);
+        
+        assert(curly_client_run(socket_path, input, output) == CURLY_ERROR_CURL_PERFORM);
+        
+        int ok = 0, failed = 0;
+        char line[1024];
+        rewind(output);
+        while (fgets(line, sizeof(line), output)) {
+            if (strstr(line, "\"id\":\"a\"") && strstr(line, "\"body\":\"hello\"")) {
+                ok++;
+            } else if (strstr(line, "\"id\":2")) {
+                failed++;
+            }
+        }
+        assert(ok == 1 && failed == 1);
+        fclose(input);
+        fclose(output);
+    }
+    
+    // A client that sends lines but never reads its large results doesn't
+    // hold up the results of another
+    char big_path[256];
+    snprintf(big_path, sizeof(big_path), "%s/big.txt", dir);
+    FILE *big = fopen(big_path, "w");
+    assert(big != NULL);
+    for (int i = 0; i < 256 * 1024; i++) {
+        fputc('x', big);
+    }
+    fclose(big);
+    
+    int stalled = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert(stalled >= 0);
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    assert(strlen(socket_path) < sizeof(address.sun_path));
+    memcpy(address.sun_path, socket_path, strlen(socket_path) + 1);
+    assert(connect(stalled, (struct sockaddr *)&address, sizeof(address)) == 0);
+    char request[512];
+    int request_length = snprintf(request, sizeof(request), "{\"url\":\"file://%s\"}\n", big_path);
+    for (int i = 0; i < 64; i++) {
+        assert(write(stalled, request, (size_t)request_length) == request_length);
+    }
+    nanosleep(&pause, NULL);
+    
+    FILE *input = tmpfile();
+    FILE *output = tmpfile();
+    assert(input != NULL && output != NULL);
+    fprintf(input, "{\"id\":\"b\",\"url\":\"file://%s\"}\n", body_path);
+    rewind(input);
+    time_t started = time(NULL);
+    assert(curly_client_run(socket_path, input, output) == CURLY_OK);
+    assert(time(NULL) - started < 10);
+    char line[1024];
+    rewind(output);
+    assert(fgets(line, sizeof(line), output) && strstr(line, "\"body\":\"hello\""));
+    fclose(input);
+    fclose(output);
+    close(stalled);
+    unlink(big_path);
+    
+    // A second daemon on a live socket is refused
+    curly_batch_options_t options;
+    curly_batch_options_init(&options);
+    assert(curly_serve(socket_path, &options) == CURLY_ERROR_SOCKET);
+    
+    // SIGTERM shuts the daemon down and removes the socket
+    raise(SIGTERM);
+    pthread_join(thread, NULL);
+    assert(serve.result == CURLY_OK);
+    assert(stat(socket_path, &st) != 0);
+    
+    unlink(body_path);
+    rmdir(dir);
+    printf("test_serve_client: PASSED\n");
+}
+
+void test_parallel_log() {
+    printf("Running test_parallel_log...\n");
+    
+    char source[] = "/tmp/curly_test_XXXXXX";
+    int fd = mkstemp(source);
+    assert(fd >= 0);
+    const char payload[] = "logged download";
+    assert(write(fd, payload, sizeof(payload)) == (ssize_t)sizeof(payload));
+    close(fd);
+    
+    char destination[256];
+    char missing_destination[256];
+    char log[256];
+    snprintf(destination, sizeof(destination), "%s.out", source);
+    snprintf(missing_destination, sizeof(missing_destination), "%s.missing", source);
+    snprintf(log, sizeof(log), "%s.log", source);
+    
+    curly_parallel_options_t options;
+    curly_parallel_options_init(&options);
+    options.thread_count = 2;
+    options.retries = 0;
+    options.log_path = log;
+    
+    FILE *input = tmpfile();
+    assert(input != NULL);
+    fprintf(input, "file://%s\t%s\n", source, destination);
+    fprintf(input, "file://%s.gone\t%s\n", source, missing_destination);
+    rewind(input);
+    assert(curly_parallel_download_ex(&options, input) == CURLY_OK);
+    fclose(input);
+    
+    // One line per download, in whatever order they finished
+    char expected_ok[600];
+    char expected_failed[600];
+    snprintf(expected_ok, sizeof(expected_ok), "downloaded\tfile://%s\t%s\n", source, destination);
+    snprintf(expected_failed, sizeof(expected_failed), "failed\tfile://%s.gone\t%s\t", source, missing_destination);
+    
+    FILE *results = fopen(log, "r");
+    assert(results != NULL);
+    char line[1024];
+    int ok = 0, failed = 0, lines = 0;
+    while (fgets(line, sizeof(line), results)) {
+        lines++;
+        ok += strcmp(line, expected_ok) == 0;
+        failed += strncmp(line, expected_failed, strlen(expected_failed)) == 0;
+    }
+    fclose(results);
+    assert(lines == 2 && ok == 1 && failed == 1);
+    
+    unlink(source);
+    unlink(destination);
+    unlink(log);
+    printf("test_parallel_log: PASSED\n");
+}
+
+// Read a manifest through a reader and check every line of it
+static void check_ingest(FILE *input, const char *long_url) {
+    curly_ingest_t *ingest = curly_ingest_open(input);
+    assert(ingest != NULL);
+    curly_tsv_line_t line;
+    
+    assert(curly_ingest_next(ingest, &line) == 1);
+    assert(line.url_length == 3 && memcmp(line.url, "u:a", 3) == 0);
+    assert(line.destination_length == 5 && memcmp(line.destination, "out/a", 5) == 0);
+    
+    // Empty lines are skipped and a line without a tab is reported
+    assert(curly_ingest_next(ingest, &line) == -1);
+    assert(line.url_length == 11 && memcmp(line.url, "no tab here", 11) == 0 && !line.destination);
+    
+    // Lines are not cut at any length
+    assert(curly_ingest_next(ingest, &line) == 1);
+    assert(line.url_length == strlen(long_url) && memcmp(line.url, long_url, line.url_length) == 0);
+    assert(line.destination_length == 5 && memcmp(line.destination, "out/b", 5) == 0);
+    
+    // The last line may lack its newline
+    assert(curly_ingest_next(ingest, &line) == 1);
+    assert(line.url_length == 3 && memcmp(line.url, "u:c", 3) == 0);
+    assert(line.destination_length == 5 && memcmp(line.destination, "out/c", 5) == 0);
+    assert(curly_ingest_next(ingest, &line) == 0);
+    curly_ingest_close(ingest);
+}
+
+void test_ingest_lines() {
+    printf("Running test_ingest_lines...\n");
+    
+    size_t long_length = 3 * 1024 * 1024;
+    char *long_url = (char *)malloc(long_length + 1);
+    assert(long_url != NULL);
+    memset(long_url, 'x', long_length);
+    memcpy(long_url, "u:", 2);
+    long_url[long_length] = '\0';
+    
+    // A regular file is mapped
+    FILE *file = tmpfile();
+    assert(file != NULL);
+    fprintf(file, "u:a\tout/a\n\n\nno tab here\n%s\tout/b\nu:c\tout/c", long_url);
+    rewind(file);
+    check_ingest(file, long_url);
+    fclose(file);
+    
+    // A pipe is streamed, growing the buffer for the long line
+    int fds[2];
+    assert(pipe(fds) == 0);
+    pid_t child = fork();
+    assert(child >= 0);
+    if (child == 0) {
+        close(fds[0]);
+        FILE *out = fdopen(fds[1], "w");
+        fprintf(out, "u:a\tout/a\n\n\nno tab here\n%s\tout/b\nu:c\tout/c", long_url);
+        fclose(out);
+        _exit(0);
+    }
+    close(fds[1]);
+    FILE *pipe_input = fdopen(fds[0], "r");
+    assert(pipe_input != NULL);
+    check_ingest(pipe_input, long_url);
+    fclose(pipe_input);
+    waitpid(child, NULL, 0);
+    
+    free(long_url);
+    printf("test_ingest_lines: PASSED\n");
+}
+
+void test_parallel_dedup() {
+    printf("Running test_parallel_dedup...\n");
+    
+    // FIPS 180-4 test vectors, one of them spanning two blocks
+    const char *inputs[] = {"abc", "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq"};
+    const char *digests[] = {"ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad",
+                             "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1"};
+    for (int i = 0; i < 2; i++) {
+        curly_sha256_t ctx;
+        unsigned char digest[CURLY_SHA256_SIZE];
+        char hex[CURLY_SHA256_SIZE * 2 + 1];
+        curly_sha256_init(&ctx);
+        curly_sha256_update(&ctx, inputs[i], strlen(inputs[i]));
+        curly_sha256_final(&ctx, digest);
+        for (int j = 0; j < CURLY_SHA256_SIZE; j++) {
+            snprintf(hex + j * 2, 3, "%02x", digest[j]);
+        }
+        assert(strcmp(hex, digests[i]) == 0);
+    }
+    
+    char dir[] = "/tmp/curly_dedup_XXXXXX";
+    assert(mkdtemp(dir) != NULL);
+    char source[256], mirror[256], store[256], input_path[256];
+    snprintf(source, sizeof(source), "%s/source", dir);
+    snprintf(mirror, sizeof(mirror), "%s/mirror", dir);
+    snprintf(store, sizeof(store), "%s/store", dir);
+    snprintf(input_path, sizeof(input_path), "%s/input.tsv", dir);
+    
+    // The same payload behind two URLs
+    const char payload[] = "deduplicated payload";
+    FILE *f = fopen(source, "w");
+    assert(f && fwrite(payload, 1, sizeof(payload), f) == sizeof(payload) && fclose(f) == 0);
+    f = fopen(mirror, "w");
+    assert(f && fwrite(payload, 1, sizeof(payload), f) == sizeof(payload) && fclose(f) == 0);
+    
+    // The first URL for three destinations, one of them in a new directory
+    char destinations[4][256];
+    FILE *input = fopen(input_path, "w");
+    assert(input != NULL);
+    for (int i = 0; i < 4; i++) {
+        snprintf(destinations[i], sizeof(destinations[i]), "%s/out/%s%d", dir, i == 2 ? "sub/" : "", i);
+        fprintf(input, "file://%s\t%s\n", i < 3 ? source : mirror, destinations[i]);
+    }
+    fclose(input);
+    
+    curly_parallel_options_t options;
+    curly_parallel_options_init(&options);
+    assert(options.dedup == CURLY_DEDUP_COPY);
+    options.thread_count = 2;
+    options.dedup = CURLY_DEDUP_LINK;
+    options.store_path = store;
+    input = fopen(input_path, "r");
+    assert(input != NULL);
+    assert(curly_parallel_download_ex(&options, input) == CURLY_OK);
+    fclose(input);
+    
+    // Every destination is a link to the one stored object
+    struct stat first;
+    assert(stat(destinations[0], &first) == 0);
+    for (int i = 0; i < 4; i++) {
+        struct stat st;
+        assert(stat(destinations[i], &st) == 0 && st.st_size == (off_t)sizeof(payload));
+        assert(st.st_ino == first.st_ino && st.st_nlink == 5);
+    }
+    
+    // Without links the store only works where it can clone, never copy
+    curly_store_t *clones = curly_store_open(store, CURLY_DEDUP_COPY);
+    assert(clones != NULL || errno == EOPNOTSUPP);
+    curly_store_close(clones);
+    
+    // Rewriting one of them in place replaces it instead of writing through
+    // the link into its siblings and the stored object
+    const char changed[] = "changed";
+    f = fopen(source, "w");
+    assert(f && fwrite(changed, 1, sizeof(changed), f) == sizeof(changed) && fclose(f) == 0);
+    input = fopen(input_path, "w");
+    assert(input != NULL);
+    fprintf(input, "file://%s\t%s\n", source, destinations[0]);
+    fclose(input);
+    curly_parallel_options_init(&options);
+    options.in_place = 1;
+    input = fopen(input_path, "r");
+    assert(input != NULL);
+    assert(curly_parallel_download_ex(&options, input) == CURLY_OK);
+    fclose(input);
+    
+    struct stat st;
+    assert(stat(destinations[0], &st) == 0 && st.st_size == (off_t)sizeof(changed) && st.st_nlink == 1);
+    for (int i = 1; i < 4; i++) {
+        char contents[64] = {0};
+        f = fopen(destinations[i], "r");
+        assert(f && fread(contents, 1, sizeof(contents), f) == sizeof(payload) && fclose(f) == 0);
+        assert(strcmp(contents, payload) == 0);
+    }
+    
+    char command[512];
+    snprintf(command, sizeof(command), "rm -rf %s", dir);
+    assert(system(command) == 0);
+    printf("test_parallel_dedup: PASSED\n");
+}
+
+void test_request_cache() {
+    printf("Running test_request_cache...\n");
+    
+    char dir[] = "/tmp/curly_cache_XXXXXX";
+    assert(mkdtemp(dir) != NULL);
+    char source[256], cache[256];
+    snprintf(source, sizeof(source), "%s/source", dir);
+    snprintf(cache, sizeof(cache), "%s/cache", dir);
+    FILE *f = fopen(source, "w");
+    assert(f && fputs("first", f) >= 0 && fclose(f) == 0);
+    
+    // file:// sends no caching headers, so the configured max_age applies
+    char fresh_json[1024], stale_json[1024];
+    snprintf(fresh_json, sizeof(fresh_json), "{\"url\":\"file://%s\",\"cache\":{\"dir\":\"%s\",\"max_age\":3600}}",
+             source, cache);
+    snprintf(stale_json, sizeof(stale_json), "{\"url\":\"file://%s\",\"cache\":{\"dir\":\"%s\",\"max_age\":0}}",
+             source, cache);
+    curly_config_t fresh, stale;
+    assert(curly_parse_config(fresh_json, &fresh) == CURLY_OK && fresh.cache != NULL);
+    assert(curly_parse_config(stale_json, &stale) == CURLY_OK);
+    
+    // Entries stored with no lifetime are fetched again and replaced
+    curly_response_t response;
+    assert(curly_perform_request(&stale, &response) == CURLY_OK);
+    assert(strcmp(response.data, "first") == 0 && response.mapping == NULL);
+    curly_free_response(&response);
+    f = fopen(source, "w");
+    assert(f && fputs("second", f) >= 0 && fclose(f) == 0);
+    assert(curly_perform_request(&fresh, &response) == CURLY_OK);
+    assert(strcmp(response.data, "second") == 0 && response.mapping == NULL);
+    curly_free_response(&response);
+    
+    // A fresh entry is served from the mapped file even though the source changed
+    f = fopen(source, "w");
+    assert(f && fputs("third", f) >= 0 && fclose(f) == 0);
+    assert(curly_perform_request(&fresh, &response) == CURLY_OK);
+    assert(response.size == 6 && strcmp(response.data, "second") == 0 && response.mapping != NULL);
+    curly_free_response(&response);
+    
+    // Streaming sinks get the body written straight from the mapping
+    char out_path[256];
+    snprintf(out_path, sizeof(out_path), "%s/out", dir);
+    int fd = open(out_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    curly_sink_t sink;
+    curly_sink_init_fd(&sink, fd);
+    assert(curly_perform_request_sink(&fresh, &sink) == CURLY_OK);
+    char body[16] = {0};
+    assert(pread(fd, body, sizeof(body) - 1, 0) == 6 && strcmp(body, "second") == 0);
+    close(fd);
+    
+    curly_free_config(&fresh);
+    curly_free_config(&stale);
+    char command[512];
+    snprintf(command, sizeof(command), "rm -rf %s", dir);
+    assert(system(command) == 0);
+    printf("test_request_cache: PASSED\n");
+}
+
+void test_parallel_resolve() {
+    printf("Running test_parallel_resolve...\n");
+    
+    curly_resolver_t *resolver = curly_resolver_create();
+    assert(resolver != NULL);
+    assert(curly_resolver_add_static(resolver, "Mirror.Test:443:127.0.0.1,[::1]") == 0);
+    assert(curly_resolver_add_static(resolver, "no-port") == -1);
+    
+    // Other schemes are ignored, IP addresses need no lookup
+    const char *urls[] = {"file:///tmp/x", "http://127.0.0.1:8080/a", "https://user@mirror.test/b",
+                          "localhost:8443", "http://localhost/c", "ftp.mirror.test"};
+    for (int i = 0; i < 6; i++) {
+        assert(curly_resolver_add_url(resolver, urls[i], strlen(urls[i])) == 0);
+    }
+    assert(curly_resolver_run(resolver, 4) == 0);
+    
+    const struct curl_slist *entry = curly_resolver_find(resolver, "https://MIRROR.test/other");
+    assert(entry && strcmp(entry->data, "Mirror.Test:443:127.0.0.1,[::1]") == 0);
+    entry = curly_resolver_find(resolver, "http://localhost/d");
+    assert(entry && strncmp(entry->data, "localhost:80:", 13) == 0);
+    entry = curly_resolver_find(resolver, "http://localhost:8443/e");
+    assert(entry && strncmp(entry->data, "localhost:8443:", 15) == 0);
+    assert(curly_resolver_find(resolver, "localhost/f") == curly_resolver_find(resolver, "http://localhost/f"));
+    assert(curly_resolver_find(resolver, "http://127.0.0.1:8080/a") == NULL);
+    assert(curly_resolver_find(resolver, "file:///tmp/x") == NULL);
+    assert(curly_resolver_find(resolver, "https://mirror.test:8443/") == NULL);
+    
+    // Every host seen in a URL can be warmed, a bare one over http as curl
+    // would fetch it
+    assert(curly_resolver_host_count(resolver) == 4);
+    assert(strcmp(curly_resolver_host_url(resolver, 2), "http://localhost:8443") == 0);
+    curly_resolver_destroy(resolver);
+    
+    // File downloads run unchanged with lookups and warming on
+    char dir[] = "/tmp/curly_resolve_XXXXXX";
+    assert(mkdtemp(dir) != NULL);
+    char source[256], input_path[256], destination[256];
+    snprintf(source, sizeof(source), "%s/source", dir);
+    snprintf(input_path, sizeof(input_path), "%s/input.tsv", dir);
+    snprintf(destination, sizeof(destination), "%s/out", dir);
+    FILE *f = fopen(source, "w");
+    assert(f && fputs("resolved", f) >= 0 && fclose(f) == 0);
+    f = fopen(input_path, "w");
+    assert(f != NULL);
+    fprintf(f, "file://%s\t%s\n", source, destination);
+    fclose(f);
+    
+    struct curl_slist *resolve = curl_slist_append(NULL, "mirror.test:80:127.0.0.1");
+    curly_parallel_options_t options;
+    curly_parallel_options_init(&options);
+    assert(options.preresolve == 0 && options.prewarm == 0 && options.resolve == NULL);
+    options.thread_count = 2;
+    options.prewarm = 1;
+    options.resolve = resolve;
+    FILE *input = fopen(input_path, "r");
+    assert(input != NULL);
+    assert(curly_parallel_download_ex(&options, input) == CURLY_OK);
+    fclose(input);
+    curl_slist_free_all(resolve);
+    
+    struct stat st;
+    assert(stat(destination, &st) == 0 && st.st_size == 8);
+    
+    char command[512];
+    snprintf(command, sizeof(command), "rm -rf %s", dir);
+    assert(system(command) == 0);
+    printf("test_parallel_resolve: PASSED\n");
+}
+
+void test_parallel_output() {
+    printf("Running test_parallel_output...\n");
+    
+    char dir[] = "/tmp/curly_output_XXXXXX";
+    assert(mkdtemp(dir) != NULL);
+    char path[1024], command[1024];
+    struct stat st;
+    
+    // A new file only appears at its destination once committed, and
+    // directories beyond the descriptor cache still work
+    curly_output_t *output = curly_output_create(CURLY_FSYNC_FILE, 2);
+    assert(output != NULL);
+    snprintf(path, sizeof(path), "%s/a//b/c/file", dir);
+    curly_output_file_t target;
+    int fd = curly_output_open(output, path, 0, 0, &target);
+    assert(fd >= 0 && target.temp != NULL);
+    assert(write(fd, "new", 3) == 3 && close(fd) == 0);
+    assert(stat(path, &st) != 0);
+    assert(curly_output_commit(output, &target) == 0);
+    assert(stat(path, &st) == 0 && st.st_size == 3);
+    
+    // Discarding a replacement leaves the earlier file
+    fd = curly_output_open(output, path, 0, 0, &target);
+    assert(fd >= 0 && write(fd, "longer", 6) == 6 && close(fd) == 0);
+    curly_output_discard(output, &target, 1);
+    assert(stat(path, &st) == 0 && st.st_size == 3);
+    assert(curly_output_mkdirs(output, path) == 0);
+    
+    // A name as long as the filesystem allows still gets a temporary file
+    char long_path[1024];
+    int length = snprintf(long_path, sizeof(long_path), "%s/", dir);
+    memset(long_path + length, 'n', 255);
+    long_path[length + 255] = '\0';
+    fd = curly_output_open(output, long_path, 0, 0, &target);
+    assert(fd >= 0 && write(fd, "new", 3) == 3 && close(fd) == 0);
+    assert(curly_output_commit(output, &target) == 0);
+    assert(stat(long_path, &st) == 0 && st.st_size == 3);
+    curly_output_destroy(output);
+    
+    // A failed blocking download keeps what was there
+    snprintf(command, sizeof(command), "file://%s/missing", dir);
+    assert(curly_download_file(command, path) != CURLY_OK);
+    assert(stat(path, &st) == 0 && st.st_size == 3);
+    
+    // A run into a deep tree, synced in batches, leaves no temporary files
+    char input_path[1024];
+    snprintf(input_path, sizeof(input_path), "%s/input.tsv", dir);
+    FILE *input = fopen(input_path, "w");
+    assert(input != NULL);
+    for (int i = 0; i < 20; i++) {
+        fprintf(input, "file://%s\t%s/tree/%d/%d/%d/file%d\n", path, dir, i % 2, i % 3, i % 5, i);
+    }
+    fclose(input);
+    
+    curly_parallel_options_t options;
+    curly_parallel_options_init(&options);
+    assert(options.in_place == 0 && options.fsync_mode == CURLY_FSYNC_NONE);
+    options.thread_count = 2;
+    options.dedup = CURLY_DEDUP_OFF;
+    options.fsync_mode = CURLY_FSYNC_BATCH;
+    input = fopen(input_path, "r");
+    assert(input != NULL);
+    assert(curly_parallel_download_ex(&options, input) == CURLY_OK);
+    fclose(input);
+    
+    for (int i = 0; i < 20; i++) {
+        snprintf(path, sizeof(path), "%s/tree/%d/%d/%d/file%d", dir, i % 2, i % 3, i % 5, i);
+        assert(stat(path, &st) == 0 && st.st_size == 3);
+    }
+    snprintf(command, sizeof(command), "find %s -name '.curly-*' | grep -q .", dir);
+    assert(system(command) != 0);
+    
+    snprintf(command, sizeof(command), "rm -rf %s", dir);
+    assert(system(command) == 0);
+    printf("test_parallel_output: PASSED\n");
+}
+
+void test_compression() {
+    printf("Running test_compression...\n");
+    
+    // Extensions follow the codings in the order they were applied
+    char suffix[CURLY_ENCODING_SUFFIX_SIZE];
+    assert(curly_encoding_suffix("gzip", suffix, sizeof(suffix)) == 1 && strcmp(suffix, ".gz") == 0);
+    assert(curly_encoding_suffix("gzip, br", suffix, sizeof(suffix)) == 1 && strcmp(suffix, ".gz.br") == 0);
+    assert(curly_encoding_suffix("zstd", suffix, sizeof(suffix)) == 1 && strcmp(suffix, ".zst") == 0);
+    assert(curly_encoding_suffix("identity", suffix, sizeof(suffix)) == 0 && suffix[0] == '\0');
+    assert(curly_encoding_suffix(NULL, suffix, sizeof(suffix)) == 0);
+    assert(curly_encoding_suffix("../x", suffix, sizeof(suffix)) == -1 && suffix[0] == '\0');
+    
+    // Kept as sent, any coding can be asked for; decoding needs libcurl's support
+    char *accept = curly_encoding_accept(NULL, 0);
+    assert(accept != NULL && strcmp(accept, "gzip, deflate, br, zstd") == 0);
+    free(accept);
+    accept = curly_encoding_accept("lz4,  identity", 0);
+    assert(accept != NULL && strcmp(accept, "lz4") == 0);
+    free(accept);
+    accept = curly_encoding_accept("lz4 identity", 1);
+    assert(accept != NULL && accept[0] == '\0');
+    free(accept);
+    if (curl_version_info(CURLVERSION_NOW)->features & CURL_VERSION_LIBZ) {
+        accept = curly_encoding_accept("gzip,lz4", 1);
+        assert(accept != NULL && strcmp(accept, "gzip") == 0);
+        free(accept);
+    }
+    
+    curly_config_t config;
+    const char *json = "{\"url\":\"https://example.com\",\"compression\":{\"encodings\":\"gzip\",\"decode\":false}}";
+    assert(curly_parse_config(json, &config) == CURLY_OK);
+    assert(json_is_object(config.compression));
+    CURL *curl = curl_easy_init();
+    assert(curl != NULL);
+    assert(curly_encoding_setup_json(curl, config.compression) == CURLY_OK);
+    curl_easy_cleanup(curl);
+    curly_free_config(&config);
+    
+    // A suffix renames a file on commit, even one written in place
+    char dir[] = "/tmp/curly_encoding_XXXXXX";
+    assert(mkdtemp(dir) != NULL);
+    char path[1024], command[1024];
+    struct stat st;
+    curly_output_t *output = curly_output_create(CURLY_FSYNC_NONE, 4);
+    assert(output != NULL);
+    snprintf(path, sizeof(path), "%s/page", dir);
+    curly_output_file_t target;
+    int fd = curly_output_open(output, path, O_WRONLY | O_CREAT | O_TRUNC, 1, &target);
+    assert(fd >= 0 && write(fd, "abc", 3) == 3 && close(fd) == 0);
+    target.suffix = ".gz";
+    assert(curly_output_commit(output, &target) == 0);
+    assert(stat(path, &st) != 0);
+    snprintf(path, sizeof(path), "%s/page.gz", dir);
+    assert(stat(path, &st) == 0 && st.st_size == 3);
+    curly_output_destroy(output);
+    
+    // A body without a coding keeps its plain name
+    char input_path[1024];
+    snprintf(input_path, sizeof(input_path), "%s/input.tsv", dir);
+    FILE *input = fopen(input_path, "w");
+    assert(input != NULL);
+    fprintf(input, "file://%s\t%s/out/plain\n", path, dir);
+    fclose(input);
+    
+    curly_parallel_options_t options;
+    curly_parallel_options_init(&options);
+    assert(options.accept_encoding == NULL && options.keep_encoded == 0);
+    options.thread_count = 1;
+    options.keep_encoded = 1;
+    input = fopen(input_path, "r");
+    assert(input != NULL);
+    assert(curly_parallel_download_ex(&options, input) == CURLY_OK);
+    fclose(input);
+    snprintf(path, sizeof(path), "%s/out/plain", dir);
+    assert(stat(path, &st) == 0 && st.st_size == 3);
+    
+    // A body kept encoded is journaled under its destination, so a rerun
+    // finds it under the extension and skips it without asking the server
+    const char *responses[] = {
+        "HTTP/1.1 200 OK\r\nETag: \"z1\"\r\nContent-Encoding: gzip\r\nContent-Length: 4\r\n"
+        "Connection: close\r\n\r\nGZIP",
+    };
+    int port;
+    pid_t server = serve_responses(responses, 1, &port);
+    char journal[256], log[256];
+    snprintf(journal, sizeof(journal), "%s/journal", dir);
+    snprintf(log, sizeof(log), "%s/log", dir);
+    input = fopen(input_path, "w");
+    assert(input != NULL);
+    fprintf(input, "http://127.0.0.1:%d/archive\t%s/out/archive\n", port, dir);
+    fclose(input);
+    options.accept_encoding = "gzip";
+    options.journal_path = journal;
+    options.revalidate = 0;
+    options.log_path = log;
+    for (int run = 0; run < 2; run++) {
+        input = fopen(input_path, "r");
+        assert(input != NULL);
+        assert(curly_parallel_download_ex(&options, input) == CURLY_OK);
+        fclose(input);
+        waitpid(server, NULL, 0);
+    }
+    snprintf(path, sizeof(path), "%s/out/archive.gz", dir);
+    assert(stat(path, &st) == 0 && st.st_size == 4);
+    snprintf(command, sizeof(command), "grep -q '^complete.gz\t4\t.*/out/archive$' %s && grep -q '^skipped' %s",
+             journal, log);
+    assert(system(command) == 0);
+    
+    snprintf(command, sizeof(command), "rm -rf %s", dir);
+    assert(system(command) == 0);
+    printf("test_compression: PASSED\n");
+}
+
+void test_parallel_revalidate_failure() {
+    printf("Running test_parallel_revalidate_failure...\n");
+    
+    // A complete download, then a new version that breaks off part way
+    const char *responses[] = {
+        "HTTP/1.1 200 OK\r\nETag: \"v1\"\r\nContent-Length: 8\r\nConnection: close\r\n\r\nversion1",
+        "HTTP/1.1 200 OK\r\nETag: \"v2\"\r\nContent-Length: 100\r\nConnection: close\r\n\r\ntrunc",
+    };
+    int port;
+    pid_t server = serve_responses(responses, 2, &port);
+    
+    char dir[] = "/tmp/curly_revalidate_XXXXXX";
+    assert(mkdtemp(dir) != NULL);
+    char destination[256], journal[256], command[1024];
+    snprintf(destination, sizeof(destination), "%s/file", dir);
+    snprintf(journal, sizeof(journal), "%s/journal", dir);
+    
+    curly_parallel_options_t options;
+    curly_parallel_options_init(&options);
+    options.thread_count = 1;
+    options.retries = 0;
+    options.journal_path = journal;
+    options.revalidate = 1;
+    
+    FILE *input = tmpfile();
+    assert(input != NULL);
+    fprintf(input, "http://127.0.0.1:%d/file\t%s\n", port, destination);
+    rewind(input);
+    assert(curly_parallel_download_ex(&options, input) == CURLY_OK);
+    rewind(input);
+    curly_parallel_download_ex(&options, input);
+    fclose(input);
+    waitpid(server, NULL, 0);
+    
+    // The complete file and its journal entry survive the failed update
+    char contents[16] = {0};
+    FILE *file = fopen(destination, "r");
+    assert(file != NULL);
+    assert(fread(contents, 1, sizeof(contents) - 1, file) == 8);
+    fclose(file);
+    assert(strcmp(contents, "version1") == 0);
+    snprintf(command, sizeof(command), "grep -q '^complete' %s && ! grep -q partial %s", journal, journal);
+    assert(system(command) == 0);
+    
+    snprintf(command, sizeof(command), "rm -rf %s", dir);
+    assert(system(command) == 0);
+    printf("test_parallel_revalidate_failure: PASSED\n");
+}
+
+void test_parallel_resume_part() {
+    printf("Running test_parallel_resume_part...\n");
+    
+    // A body that breaks off part way, then the rest of it as a range
+    const char *responses[] = {
+        "HTTP/1.1 200 OK\r\nETag: \"v1\"\r\nAccept-Ranges: bytes\r\nContent-Length: 10\r\n"
+        "Connection: close\r\n\r\n01234",
+        "HTTP/1.1 206 Partial Content\r\nETag: \"v1\"\r\nContent-Range: bytes 5-9/10\r\nContent-Length: 5\r\n"
+        "Connection: close\r\n\r\n56789",
+    };
+    int port;
+    pid_t server = serve_responses(responses, 2, &port);
+    
+    char dir[] = "/tmp/curly_resume_XXXXXX";
+    assert(mkdtemp(dir) != NULL);
+    char destination[256], part[256], journal[256], command[1024];
+    snprintf(destination, sizeof(destination), "%s/file", dir);
+    snprintf(part, sizeof(part), "%s/file.part", dir);
+    snprintf(journal, sizeof(journal), "%s/journal", dir);
+    
+    // An older file at the destination that the journal knows nothing of
+    FILE *file = fopen(destination, "w");
+    assert(file && fputs("older", file) >= 0 && fclose(file) == 0);
+    
+    curly_parallel_options_t options;
+    curly_parallel_options_init(&options);
+    options.thread_count = 1;
+    options.retries = 0;
+    options.journal_path = journal;
+    
+    FILE *input = tmpfile();
+    assert(input != NULL);
+    fprintf(input, "http://127.0.0.1:%d/file\t%s\n", port, destination);
+    rewind(input);
+    curly_parallel_download_ex(&options, input);
+    
+    // The prefix waits under the side name; the destination is untouched
+    char contents[16] = {0};
+    file = fopen(destination, "r");
+    assert(file && fread(contents, 1, sizeof(contents) - 1, file) == 5 && fclose(file) == 0);
+    assert(strcmp(contents, "older") == 0);
+    struct stat st;
+    assert(stat(part, &st) == 0 && st.st_size == 5);
+    snprintf(command, sizeof(command), "grep -q '^partial.*file.part$' %s", journal);
+    assert(system(command) == 0);
+    
+    // The next run continues the prefix and puts the whole file in place
+    rewind(input);
+    assert(curly_parallel_download_ex(&options, input) == CURLY_OK);
+    fclose(input);
+    waitpid(server, NULL, 0);
+    
+    memset(contents, 0, sizeof(contents));
+    file = fopen(destination, "r");
+    assert(file && fread(contents, 1, sizeof(contents) - 1, file) == 10 && fclose(file) == 0);
+    assert(strcmp(contents, "0123456789") == 0);
+    assert(stat(part, &st) != 0);
+    
+    snprintf(command, sizeof(command), "rm -rf %s", dir);
+    assert(system(command) == 0);
+    printf("test_parallel_resume_part: PASSED\n");
+}
+
+#define QUEUE_PRODUCERS 4
+#define QUEUE_CONSUMERS 3
+#define QUEUE_ITEMS 20000
+
+typedef struct {
+    curly_queue_t *queue;
+    int producer;
+    int *seen;           // Times each item was taken, updated atomically
+    int order_errors;    // Items a consumer saw out of their producer's order
+    int result;          // What a single push returned
+} queue_worker_t;
+
+// Items are numbered from 1 so none is NULL
+static void *queue_producer(void *arg) {
+    queue_worker_t *worker = (queue_worker_t *)arg;
+    for (int i = 0; i < QUEUE_ITEMS; i++) {
+        size_t item = (size_t)worker->producer * QUEUE_ITEMS + (size_t)i + 1;
+        assert(curly_queue_push(worker->queue, (void *)item) == 0);
+    }
+    return NULL;
+}
+
+static void *queue_consumer(void *arg) {
+    queue_worker_t *worker = (queue_worker_t *)arg;
+    size_t last[QUEUE_PRODUCERS] = {0};
+    void *items[8];
+    int max = 1;
+    int count;
+    
+    // Vary the batch size so claims of different lengths overlap
+    while ((count = curly_queue_pop(worker->queue, items, max)) >= 0) {
+        max = max % 8 + 1;
+        if (count == 0) {
+            sched_yield();
+            continue;
+        }
+        for (int i = 0; i < count; i++) {
+            size_t item = (size_t)items[i] - 1;
+            size_t producer = item / QUEUE_ITEMS;
+            assert(producer < QUEUE_PRODUCERS);
+            __atomic_add_fetch(&worker->seen[item], 1, __ATOMIC_RELAXED);
+            // One producer's items reach any one consumer in the order pushed
+            if (item + 1 <= last[producer]) {
+                worker->order_errors++;
+            }
+            last[producer] = item + 1;
+        }
+    }
+    return NULL;
+}
+
+static void *queue_push_one(void *arg) {
+    queue_worker_t *worker = (queue_worker_t *)arg;
+    worker->result = curly_queue_push(worker->queue, (void *)(size_t)worker->producer);
+    return NULL;
+}
+
+// Wait until a producer has gone to sleep on a full queue
+static void wait_for_sleeping_producer(curly_queue_t *queue) {
+    while (!__atomic_load_n(&queue->writer_waiting, __ATOMIC_SEQ_CST)) {
+        sched_yield();
+    }
+    // It sets the flag under the mutex and only releases it in the wait
+    pthread_mutex_lock(&queue->mutex);
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+void test_job_queue() {
+    printf("Running test_job_queue...\n");
+    
+    curly_queue_t queue;
+    void *items[8];
+    
+    // A full queue refuses more, and a sleeping producer is woken by a pop
+    assert(curly_queue_init(&queue, 3) == 0);
+    assert(queue.mask == 3);
+    for (size_t i = 1; i <= 4; i++) {
+        assert(curly_queue_try_push(&queue, (void *)i) == 0);
+    }
+    assert(curly_queue_try_push(&queue, (void *)5) == -1);
+    
+    queue_worker_t blocked = {&queue, 5, NULL, 0, 1};
+    pthread_t thread;
+    assert(pthread_create(&thread, NULL, queue_push_one, &blocked) == 0);
+    wait_for_sleeping_producer(&queue);
+    assert(curly_queue_try_pop(&queue, items, 2) == 2);
+    assert(items[0] == (void *)1 && items[1] == (void *)2);
+    pthread_join(thread, NULL);
+    assert(blocked.result == 0);
+    assert(curly_queue_try_push(&queue, (void *)6) == 0);
+    
+    // Shutdown wakes a producer sleeping on a full queue and fails its push
+    queue_worker_t refused = {&queue, 7, NULL, 0, 0};
+    assert(pthread_create(&thread, NULL, queue_push_one, &refused) == 0);
+    wait_for_sleeping_producer(&queue);
+    curly_queue_shutdown(&queue);
+    pthread_join(thread, NULL);
+    assert(refused.result == -1);
+    
+    // What was queued before shutdown is still handed out, then the end
+    assert(curly_queue_pop(&queue, items, 8) == 4);
+    assert(items[0] == (void *)3 && items[1] == (void *)4);
+    assert(items[2] == (void *)5 && items[3] == (void *)6);
+    assert(curly_queue_pop(&queue, items, 8) == -1);
+    curly_queue_destroy(&queue);
+    
+    // Several producers and consumers through a small queue: every item is
+    // taken exactly once, with producers often sleeping on a full queue
+    int *seen = calloc(QUEUE_PRODUCERS * QUEUE_ITEMS, sizeof(int));
+    assert(seen != NULL);
+    assert(curly_queue_init(&queue, 4) == 0);
+    queue_worker_t producers[QUEUE_PRODUCERS];
+    queue_worker_t consumers[QUEUE_CONSUMERS];
+    pthread_t producer_threads[QUEUE_PRODUCERS];
+    pthread_t consumer_threads[QUEUE_CONSUMERS];
+    for (int i = 0; i < QUEUE_CONSUMERS; i++) {
+        consumers[i] = (queue_worker_t){&queue, i, seen, 0, 0};
+        assert(pthread_create(&consumer_threads[i], NULL, queue_consumer, &consumers[i]) == 0);
+    }
+    for (int i = 0; i < QUEUE_PRODUCERS; i++) {
+        producers[i] = (queue_worker_t){&queue, i, seen, 0, 0};
+        assert(pthread_create(&producer_threads[i], NULL, queue_producer, &producers[i]) == 0);
+    }
+    for (int i = 0; i < QUEUE_PRODUCERS; i++) {
+        pthread_join(producer_threads[i], NULL);
+    }
+    curly_queue_shutdown(&queue);
+    for (int i = 0; i < QUEUE_CONSUMERS; i++) {
+        pthread_join(consumer_threads[i], NULL);
+        assert(consumers[i].order_errors == 0);
+    }
+    for (int i = 0; i < QUEUE_PRODUCERS * QUEUE_ITEMS; i++) {
+        assert(seen[i] == 1);
+    }
+    assert(curly_queue_try_pop(&queue, items, 8) == 0);
+    curly_queue_destroy(&queue);
+    free(seen);
+    
+    printf("test_job_queue: PASSED\n");
+}
+
+#define HOST_COUNT 2
+#define HOST_JOBS 12
+
+#define HOST_COUNT 2
+#define HOST_JOBS 12
+
+// Connections open at once per Host header
+typedef struct {
+    int open[HOST_COUNT];
+    int peak[HOST_COUNT];
+    int peak_total;
+    int unknown;
+} host_counts_t;
+
+// Count the connection while holding it open briefly, then answer
+static void answer_counting(loopback_server_t *server, int client, const char *request) {
+    host_counts_t *counts = (host_counts_t *)server->state;
+    int host = strstr(request, "\r\nHost: a.test") ? 0 : strstr(request, "\r\nHost: b.test") ? 1 : -1;
+    pthread_mutex_lock(&server->mutex);
+    if (host < 0) {
+        counts->unknown++;
+    } else {
+        counts->open[host]++;
+        if (counts->open[host] > counts->peak[host]) {
+            counts->peak[host] = counts->open[host];
+        }
+        if (counts->open[0] + counts->open[1] > counts->peak_total) {
+            counts->peak_total = counts->open[0] + counts->open[1];
+        }
+    }
+    pthread_mutex_unlock(&server->mutex);
+    
+    struct timespec hold = {0, 50 * 1000000L};
+    nanosleep(&hold, NULL);
+    
+    // Stop counting before answering, as the client only frees its slot after
+    pthread_mutex_lock(&server->mutex);
+    if (host >= 0) {
+        counts->open[host]--;
+    }
+    pthread_mutex_unlock(&server->mutex);
+    const char *response = "HTTP/1.1 200 OK\r\nContent-Length: 2\r\nConnection: close\r\n\r\nok";
+    send_all(client, response, strlen(response));
+}
+
+void test_parallel_host_limit() {
+    printf("Running test_parallel_host_limit...\n");
+    
+    loopback_server_t server;
+    host_counts_t counts;
+    memset(&counts, 0, sizeof(counts));
+    int port = start_loopback_server(&server, HOST_COUNT * HOST_JOBS, answer_counting, &counts);
+    
+    // All of one host's lines come first, so the other host only gets its
+    // share if held-back jobs do not block the lines behind them
+    char dir[] = "/tmp/curly_hosts_XXXXXX";
+    assert(mkdtemp(dir) != NULL);
+    char input_path[256];
+    snprintf(input_path, sizeof(input_path), "%s/input.tsv", dir);
+    FILE *f = fopen(input_path, "w");
+    assert(f != NULL);
+    for (int host = 0; host < HOST_COUNT; host++) {
+        for (int i = 0; i < HOST_JOBS; i++) {
+            fprintf(f, "http://%c.test:%d/%d\t%s/out/%c%d\n", 'a' + host, port, i, dir, 'a' + host, i);
+        }
+    }
+    fclose(f);
+    
+    char entries[HOST_COUNT][64];
+    struct curl_slist *resolve = NULL;
+    for (int host = 0; host < HOST_COUNT; host++) {
+        snprintf(entries[host], sizeof(entries[host]), "%c.test:%d:127.0.0.1", 'a' + host, port);
+        resolve = curl_slist_append(resolve, entries[host]);
+    }
+    
+    // Two loops share each host's two slots, and a loop whose lane is
+    // waiting for a slot is woken when the other loop releases one
+    curly_parallel_options_t options;
+    curly_parallel_options_init(&options);
+    options.thread_count = 2;
+    options.max_transfers = 16;
+    options.max_per_host = 2;
+    options.http_version = CURLY_HTTP_1;
+    options.resolve = resolve;
+    FILE *input = fopen(input_path, "r");
+    assert(input != NULL);
+    assert(curly_parallel_download_ex(&options, input) == CURLY_OK);
+    fclose(input);
+    curl_slist_free_all(resolve);
+    stop_loopback_server(&server);
+    
+    assert(counts.unknown == 0);
+    for (int host = 0; host < HOST_COUNT; host++) {
+        assert(counts.peak[host] == options.max_per_host);
+    }
+    assert(counts.peak_total == HOST_COUNT * options.max_per_host);
+    
+    for (int host = 0; host < HOST_COUNT; host++) {
+        for (int i = 0; i < HOST_JOBS; i++) {
+            char path[256];
+            struct stat st;
+            snprintf(path, sizeof(path), "%s/out/%c%d", dir, 'a' + host, i);
+            assert(stat(path, &st) == 0 && st.st_size == 2);
+        }
+    }
+    
+    char command[512];
+    snprintf(command, sizeof(command), "rm -rf %s", dir);
+    assert(system(command) == 0);
+    printf("test_parallel_host_limit: PASSED\n");
+}
+
+#define WRITER_CHUNKS 16
+#define WRITER_CHUNK_SIZE 16
+
+typedef struct {
+    curly_wfile_t base;
+    int completed;  // Set atomically by the completion callback
+    int refs_at_completion;
+    int error_at_completion;
+} test_wfile_t;
+
+static void test_wfile_complete(curly_wfile_t *file) {
+    test_wfile_t *owner = (test_wfile_t *)file;
+    owner->refs_at_completion = __atomic_load_n(&file->refs, __ATOMIC_SEQ_CST);
+    owner->error_at_completion = curly_wfile_error(file);
+    __atomic_add_fetch(&owner->completed, 1, __ATOMIC_SEQ_CST);
+}
+
+static void test_writer_notify(void *arg) {
+    __atomic_add_fetch((int *)arg, 1, __ATOMIC_SEQ_CST);
+}
+
+static void wait_for_completion(test_wfile_t *owner) {
+    while (!__atomic_load_n(&owner->completed, __ATOMIC_SEQ_CST)) {
+        sched_yield();
+    }
+}
+
+// Take a buffer, waiting for the writer's notification if the pool is empty
+static curly_wbuf_t *take_write_buffer(curly_writer_t *writer, int *notified) {
+    int seen = __atomic_load_n(notified, __ATOMIC_SEQ_CST);
+    curly_wbuf_t *buffer = curly_writer_get_buffer(writer);
+    while (!buffer) {
+        while (__atomic_load_n(notified, __ATOMIC_SEQ_CST) == seen) {
+            sched_yield();
+        }
+        seen = __atomic_load_n(notified, __ATOMIC_SEQ_CST);
+        buffer = curly_writer_get_buffer(writer);
+    }
+    return buffer;
+}
+
+static void submit_text(curly_writer_t *writer, curly_wfile_t *file, const char *text, curl_off_t offset,
+                        int *notified) {
+    curly_wbuf_t *buffer = take_write_buffer(writer, notified);
+    buffer->length = strlen(text);
+    memcpy(buffer->data, text, buffer->length);
+    curly_writer_submit(writer, file, buffer, offset);
+}
+
+void test_writer() {
+    printf("Running test_writer...\n");
+    
+    char dir[] = "/tmp/curly_writer_XXXXXX";
+    assert(mkdtemp(dir) != NULL);
+    char paths[2][256];
+    test_wfile_t files[2];
+    memset(files, 0, sizeof(files));
+    for (int i = 0; i < 2; i++) {
+        snprintf(paths[i], sizeof(paths[i]), "%s/file%d", dir, i);
+        int fd = open(paths[i], O_RDWR | O_CREAT | O_TRUNC, 0644);
+        assert(fd >= 0);
+        assert(curly_wfile_init(&files[i].base, fd, test_wfile_complete) == 0);
+    }
+    
+    // Three threads share a pool of two buffers, so writes finish out of
+    // order and the pool runs dry again and again
+    curly_writer_t *writer = curly_writer_create(3, 2, WRITER_CHUNK_SIZE);
+    assert(writer != NULL);
+    int notified = 0;
+    curly_writer_set_notify(writer, test_writer_notify, &notified);
+    
+    // Giving a buffer back to a pool someone found empty notifies once
+    curly_wbuf_t *first = curly_writer_get_buffer(writer);
+    curly_wbuf_t *second = curly_writer_get_buffer(writer);
+    assert(first && second && curly_writer_get_buffer(writer) == NULL);
+    curly_writer_put_buffer(writer, first);
+    assert(notified == 1);
+    curly_writer_put_buffer(writer, second);
+    assert(notified == 1);
+    
+    // Chunks of both files interleaved, from the end of each file backwards
+    for (int chunk = WRITER_CHUNKS - 1; chunk >= 0; chunk--) {
+        for (int i = 0; i < 2; i++) {
+            char text[WRITER_CHUNK_SIZE + 1];
+            snprintf(text, sizeof(text), "%c%02d-------------", 'a' + i, chunk);
+            submit_text(writer, &files[i].base, text, (curl_off_t)chunk * WRITER_CHUNK_SIZE, &notified);
+        }
+    }
+    
+    // Once every write is done the files stay open while their owners
+    // hold references, including an extra one
+    first = take_write_buffer(writer, &notified);
+    second = take_write_buffer(writer, &notified);
+    curly_writer_put_buffer(writer, first);
+    curly_writer_put_buffer(writer, second);
+    curly_wfile_retain(&files[0].base);
+    curly_wfile_release(writer, &files[0].base);
+    for (int i = 0; i < 2; i++) {
+        assert(__atomic_load_n(&files[i].completed, __ATOMIC_SEQ_CST) == 0);
+    }
+    
+    // The last release closes each file once, on a writer thread
+    for (int i = 0; i < 2; i++) {
+        curly_wfile_release(writer, &files[i].base);
+        wait_for_completion(&files[i]);
+        assert(files[i].refs_at_completion == 0 && files[i].error_at_completion == 0);
+    
+        char expected[WRITER_CHUNKS * WRITER_CHUNK_SIZE + 1];
+        for (int chunk = 0; chunk < WRITER_CHUNKS; chunk++) {
+            snprintf(expected + chunk * WRITER_CHUNK_SIZE, WRITER_CHUNK_SIZE + 1, "%c%02d-------------", 'a' + i, chunk);
+        }
+        char contents[sizeof(expected)];
+        FILE *f = fopen(paths[i], "r");
+        assert(f != NULL);
+        size_t got = fread(contents, 1, sizeof(contents), f);
+        fclose(f);
+        assert(got == WRITER_CHUNKS * WRITER_CHUNK_SIZE);
+        assert(memcmp(contents, expected, got) == 0);
+    }
+    
+    // Truncation drops the writes queued before it
+    test_wfile_t restarted;
+    memset(&restarted, 0, sizeof(restarted));
+    int fd = open(paths[0], O_RDWR | O_TRUNC);
+    assert(fd >= 0);
+    assert(curly_wfile_init(&restarted.base, fd, test_wfile_complete) == 0);
+    for (int chunk = 0; chunk < WRITER_CHUNKS; chunk++) {
+        submit_text(writer, &restarted.base, "stale data here", (curl_off_t)chunk * WRITER_CHUNK_SIZE,
+                    &notified);
+    }
+    assert(curly_wfile_truncate(&restarted.base) == 0);
+    submit_text(writer, &restarted.base, "fresh", 0, &notified);
+    curly_wfile_release(writer, &restarted.base);
+    wait_for_completion(&restarted);
+    assert(restarted.error_at_completion == 0);
+    struct stat st;
+    assert(stat(paths[0], &st) == 0 && st.st_size == 5);
+    
+    // A failed write is reported on the file, and later writes are skipped
+    test_wfile_t failing;
+    memset(&failing, 0, sizeof(failing));
+    fd = open(paths[1], O_RDONLY);
+    assert(fd >= 0);
+    assert(curly_wfile_init(&failing.base, fd, test_wfile_complete) == 0);
+    submit_text(writer, &failing.base, "refused", 0, &notified);
+    while (curly_wfile_error(&failing.base) == 0) {
+        sched_yield();
+    }
+    assert(curly_wfile_error(&failing.base) == EBADF);
+    submit_text(writer, &failing.base, "skipped", 0, &notified);
+    curly_wfile_release(writer, &failing.base);
+    wait_for_completion(&failing);
+    assert(failing.error_at_completion == EBADF);
+    assert(stat(paths[1], &st) == 0 && st.st_size == WRITER_CHUNKS * WRITER_CHUNK_SIZE);
+    
+    curly_writer_destroy(writer);
+    for (int i = 0; i < 2; i++) {
+        assert(files[i].completed == 1);
+        unlink(paths[i]);
+    }
+    rmdir(dir);
+    printf("test_writer: PASSED\n");
+}
+
+#define RANGE_BODY_SIZE 40000
+#define RANGE_SEGMENTS 4
+
+// What a range server sends and what it was asked for
+typedef struct {
+    const char *body;
+    int advertise;       // Send Accept-Ranges: bytes
+    int honour;          // Answer a Range request with 206 and the range
+    int hold_tail;       // Send a whole body's first range, then junk once the other ranges are out
+    char ranges[RANGE_SEGMENTS + 1][64];
+    int range_count;
+    int requests;
+    int served;          // Ranges answered
+} range_state_t;
+
+static void answer_ranges(loopback_server_t *server, int client, const char *request) {
+    range_state_t *state = (range_state_t *)server->state;
+    char header[256];
+    long start = 0, end = RANGE_BODY_SIZE - 1;
+    const char *range = strstr(request, "\r\nRange: bytes=");
+    
+    pthread_mutex_lock(&server->mutex);
+    state->requests++;
+    if (range) {
+        assert(sscanf(range, "\r\nRange: bytes=%ld-%ld", &start, &end) == 2);
+        assert(state->range_count <= RANGE_SEGMENTS);
+        snprintf(state->ranges[state->range_count++], sizeof(state->ranges[0]), "%ld-%ld", start, end);
+    }
+    pthread_mutex_unlock(&server->mutex);
+    
+    if (range && state->honour) {
+        int length = snprintf(header, sizeof(header),
+                              "HTTP/1.1 206 Partial Content\r\nContent-Range: bytes %ld-%ld/%d\r\n"
+                              "Content-Length: %ld\r\nConnection: close\r\n\r\n",
+                              start, end, RANGE_BODY_SIZE, end - start + 1);
+        send_all(client, header, (size_t)length);
+        send_all(client, state->body + start, (size_t)(end - start + 1));
+        pthread_mutex_lock(&server->mutex);
+        state->served++;
+        pthread_cond_broadcast(&server->changed);
+        pthread_mutex_unlock(&server->mutex);
+        return;
+    }
+    
+    int length = snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\nContent-Length: %d\r\n%sConnection: close\r\n\r\n",
+                          RANGE_BODY_SIZE, state->advertise ? "Accept-Ranges: bytes\r\n" : "");
+    send_all(client, header, (size_t)length);
+    if (strncmp(request, "HEAD ", 5) == 0) {
+        return;
+    }
+    if (!state->hold_tail) {
+        send_all(client, state->body, RANGE_BODY_SIZE);
+        return;
+    }
+    
+    // A transfer cut off at the end of its range never writes the junk
+    // over the other ranges
+    size_t first = RANGE_BODY_SIZE / RANGE_SEGMENTS;
+    send_all(client, state->body, first);
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += 5;
+    pthread_mutex_lock(&server->mutex);
+    while (state->served < RANGE_SEGMENTS - 1 &&
+           pthread_cond_timedwait(&server->changed, &server->mutex, &deadline) == 0) {
+    }
+    pthread_mutex_unlock(&server->mutex);
+    char *junk = malloc(RANGE_BODY_SIZE - first);
+    assert(junk != NULL);
+    memset(junk, 'X', RANGE_BODY_SIZE - first);
+    send_all(client, junk, RANGE_BODY_SIZE - first);
+    free(junk);
+}
+
+// Serve one download and check that the file matches the body
+static range_state_t serve_segmented(const char *body, int advertise, int honour, int hold_tail,
+                                     int connections, int parallel, const char *dir) {
+    range_state_t state;
+    memset(&state, 0, sizeof(state));
+    state.body = body;
+    state.advertise = advertise;
+    state.honour = honour;
+    state.hold_tail = hold_tail;
+    loopback_server_t server;
+    int port = start_loopback_server(&server, connections, answer_ranges, &state);
+    
+    char url[128], destination[256];
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/large", port);
+    snprintf(destination, sizeof(destination), "%s/large", dir);
+    if (parallel) {
+        char input_path[256];
+        snprintf(input_path, sizeof(input_path), "%s/input.tsv", dir);
+        FILE *f = fopen(input_path, "w");
+        assert(f != NULL);
+        fprintf(f, "%s\t%s\n", url, destination);
+        fclose(f);
+    
+        curly_parallel_options_t options;
+        curly_parallel_options_init(&options);
+        options.thread_count = 1;
+        options.segments = RANGE_SEGMENTS;
+        options.min_segment_size = RANGE_BODY_SIZE / RANGE_SEGMENTS;
+        FILE *input = fopen(input_path, "r");
+        assert(input != NULL);
+        assert(curly_parallel_download_ex(&options, input) == CURLY_OK);
+        fclose(input);
+    } else {
+        assert(curly_download_file_ex(url, destination, RANGE_SEGMENTS, RANGE_BODY_SIZE / RANGE_SEGMENTS) == CURLY_OK);
+    }
+    stop_loopback_server(&server);
+    
+    char *contents = malloc(RANGE_BODY_SIZE + 1);
+    assert(contents != NULL);
+    FILE *f = fopen(destination, "r");
+    assert(f != NULL);
+    assert(fread(contents, 1, RANGE_BODY_SIZE + 1, f) == RANGE_BODY_SIZE);
+    fclose(f);
+    assert(memcmp(contents, body, RANGE_BODY_SIZE) == 0);
+    free(contents);
+    unlink(destination);
+    
+    assert(state.requests == connections);
+    return state;
+}
+
+// Check that the ranges asked for are the given segments, in any order
+static void check_ranges(const range_state_t *state, int first, int count) {
+    assert(state->range_count == count);
+    for (int i = first; i < first + count; i++) {
+        char expected[64];
+        long size = RANGE_BODY_SIZE / RANGE_SEGMENTS;
+        snprintf(expected, sizeof(expected), "%ld-%ld", size * i, size * (i + 1) - 1);
+        int found = 0;
+        for (int j = 0; j < state->range_count; j++) {
+            found += strcmp(state->ranges[j], expected) == 0;
+        }
+        assert(found == 1);
+    }
+}
+
+void test_segmented_download() {
+    printf("Running test_segmented_download...\n");
+    
+    char *body = malloc(RANGE_BODY_SIZE);
+    assert(body != NULL);
+    for (int i = 0; i < RANGE_BODY_SIZE; i++) {
+        body[i] = (char)('a' + (i * 7 + i / 26) % 26);
+    }
+    char dir[] = "/tmp/curly_ranges_XXXXXX";
+    assert(mkdtemp(dir) != NULL);
+    
+    // The engine's first transfer keeps the first range and stops there,
+    // and the others are fetched as ranges over their own connections
+    range_state_t state = serve_segmented(body, 1, 1, 1, RANGE_SEGMENTS, 1, dir);
+    check_ranges(&state, 1, RANGE_SEGMENTS - 1);
+    
+    // A server that ignores the ranges sends every transfer the whole body,
+    // of which each keeps its range
+    state = serve_segmented(body, 1, 0, 0, RANGE_SEGMENTS, 1, dir);
+    check_ranges(&state, 1, RANGE_SEGMENTS - 1);
+    
+    // Without Accept-Ranges the file comes over one connection
+    state = serve_segmented(body, 0, 1, 0, 1, 1, dir);
+    assert(state.range_count == 0);
+    
+    // The blocking download asks for the headers, then for every range
+    state = serve_segmented(body, 1, 1, 0, RANGE_SEGMENTS + 1, 0, dir);
+    check_ranges(&state, 0, RANGE_SEGMENTS);
+    state = serve_segmented(body, 1, 0, 0, RANGE_SEGMENTS + 1, 0, dir);
+    check_ranges(&state, 0, RANGE_SEGMENTS);
+    state = serve_segmented(body, 0, 1, 0, 2, 0, dir);
+    assert(state.range_count == 0);
+    
+    free(body);
+    char command[512];
+    snprintf(command, sizeof(command), "rm -rf %s", dir);
+    assert(system(command) == 0);
+    printf("test_segmented_download: PASSED\n");
+}
+
+#define HTTP2_JOBS 16
+
+// Run a batch of requests to one host and return the most connections open at once
+static int batch_peak_connections(curly_http_version_t version, int max_concurrent, int max_streams) {
+    loopback_server_t server;
+    host_counts_t counts;
+    memset(&counts, 0, sizeof(counts));
+    int port = start_loopback_server(&server, HTTP2_JOBS, answer_counting, &counts);
+    
+    FILE *input = tmpfile();
+    FILE *output = tmpfile();
+    assert(input != NULL && output != NULL);
+    for (int i = 0; i < HTTP2_JOBS; i++) {
+        fprintf(input, "{\"url\":\"http://127.0.0.1:%d/%d\",\"headers\":{\"Host\":\"a.test\"}}\n", port, i);
+    }
+    rewind(input);
+    
+    curly_batch_options_t options;
+    curly_batch_options_init(&options);
+    options.max_concurrent = max_concurrent;
+    options.http_version = version;
+    options.max_streams = max_streams;
+    assert(curly_batch_run(&options, input, output) == CURLY_OK);
+    stop_loopback_server(&server);
+    
+    char line[1024];
+    int results = 0;
+    rewind(output);
+    while (fgets(line, sizeof(line), output)) {
+        assert(strstr(line, "\"status\":200") != NULL);
+        results++;
+    }
+    assert(results == HTTP2_JOBS);
+    fclose(input);
+    fclose(output);
+    
+    assert(counts.unknown == 0);
+    return counts.peak[0];
+}
+
+void test_http_version() {
+    printf("Running test_http_version...\n");
+    
+    // Enough connections to carry the transfers as streams, and at least one
+    assert(curly_loop_host_connections(8, 4) == 2);
+    assert(curly_loop_host_connections(9, 4) == 3);
+    assert(curly_loop_host_connections(100, 100) == 1);
+    assert(curly_loop_host_connections(1, 100) == 1);
+    assert(curly_loop_host_connections(0, 100) == 1);
+    assert(curly_loop_host_connections(5, 0) == 5);
+    
+    // Without TLS to negotiate HTTP/2, requests fall back to HTTP/1.1 and
+    // each connection carries one at a time, so the connection limit set
+    // for HTTP/2 shows as the most requests in flight. HTTP/1.1 sets none.
+    assert(batch_peak_connections(CURLY_HTTP_1, 8, 4) == 8);
+    assert(batch_peak_connections(CURLY_HTTP_2, 8, 4) == 2);
+    assert(batch_peak_connections(CURLY_HTTP_2, 8, 3) == 3);
+    
+    // The engine allows max_streams transfers per connection to a host and
+    // leaves the connection count to the loop
+    loopback_server_t server;
+    host_counts_t counts;
+    memset(&counts, 0, sizeof(counts));
+    int port = start_loopback_server(&server, HTTP2_JOBS, answer_counting, &counts);
+    char dir[] = "/tmp/curly_http2_XXXXXX";
+    assert(mkdtemp(dir) != NULL);
+    char input_path[256];
+    snprintf(input_path, sizeof(input_path), "%s/input.tsv", dir);
+    FILE *f = fopen(input_path, "w");
+    assert(f != NULL);
+    for (int i = 0; i < HTTP2_JOBS; i++) {
+        fprintf(f, "http://a.test:%d/%d\t%s/out/%d\n", port, i, dir, i);
+    }
+    fclose(f);
+    char entry[64];
+    snprintf(entry, sizeof(entry), "a.test:%d:127.0.0.1", port);
+    struct curl_slist *resolve = curl_slist_append(NULL, entry);
+    
+    curly_parallel_options_t options;
+    curly_parallel_options_init(&options);
+    options.thread_count = 1;
+    options.max_transfers = HTTP2_JOBS;
+    options.max_per_host = 2;
+    options.http_version = CURLY_HTTP_2;
+    options.resolve = resolve;
+    FILE *input = fopen(input_path, "r");
+    assert(input != NULL);
+    assert(curly_parallel_download_ex(&options, input) == CURLY_OK);
+    fclose(input);
+    curl_slist_free_all(resolve);
+    stop_loopback_server(&server);
+    assert(counts.unknown == 0 && counts.peak[0] == options.max_per_host);
+    
+    for (int i = 0; i < HTTP2_JOBS; i++) {
+        char path[256];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/out/%d", dir, i);
+        assert(stat(path, &st) == 0 && st.st_size == 2);
+    }
+    char command[512];
+    snprintf(command, sizeof(command), "rm -rf %s", dir);
+    assert(system(command) == 0);
+    printf("test_http_version: PASSED\n");
+}
+
+typedef struct {
+    curly_loop_transfer_t base;
+    char tag;
+} tagged_transfer_t;
+
+// What the loop called back, in order
+typedef struct {
+    char order[16];
+    CURLcode results[16];
+    int count;
+} loop_events_t;
+
+static loop_events_t loop_events;
+
+static void record_transfer_done(curly_loop_transfer_t *xfer, CURLcode result) {
+    loop_events.results[loop_events.count] = result;
+    loop_events.order[loop_events.count++] = ((tagged_transfer_t *)xfer)->tag;
+}
+
+static void record_timer(curly_loop_t *loop, void *arg) {
+    (void)loop;
+    loop_events.order[loop_events.count++] = *(const char *)arg;
+}
+
+static void record_writable(curly_loop_t *loop, void *arg) {
+    curly_loop_unwatch(loop, *(int *)arg);
+    loop_events.order[loop_events.count++] = 'w';
+}
+
+static size_t discard_body(char *ptr, size_t size, size_t nmemb, void *userdata) {
+    (void)ptr;
+    (void)userdata;
+    return size * nmemb;
+}
+
+static void init_tagged_transfer(tagged_transfer_t *xfer, const char *url, char tag) {
+    xfer->base.easy = curl_easy_init();
+    assert(xfer->base.easy != NULL);
+    curl_easy_setopt(xfer->base.easy, CURLOPT_URL, url);
+    curl_easy_setopt(xfer->base.easy, CURLOPT_WRITEFUNCTION, discard_body);
+    xfer->base.done = record_transfer_done;
+    xfer->base.owner = NULL;
+    xfer->tag = tag;
+}
+
+void test_loop() {
+    printf("Running test_loop...\n");
+    
+    curly_loop_t *loop = curly_loop_create();
+    assert(loop != NULL);
+    memset(&loop_events, 0, sizeof(loop_events));
+    
+    char path[] = "/tmp/curly_loop_XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0 && write(fd, "loop", 4) == 4);
+    close(fd);
+    char url[128];
+    snprintf(url, sizeof(url), "file://%s", path);
+    
+    // Delayed transfers and timers run in the order they come due, and a
+    // delayed transfer is not in flight before it starts
+    tagged_transfer_t transfers[3];
+    const long delays[3] = {220, 20, 120};
+    for (int i = 0; i < 3; i++) {
+        init_tagged_transfer(&transfers[i], url, (char)('a' + i));
+        assert(curly_loop_add_delayed(loop, &transfers[i].base, delays[i]) == 0);
+    }
+    const char first_timer = 'x', second_timer = 'y';
+    assert(curly_loop_add_timer(loop, 170, record_timer, (void *)&second_timer) == 0);
+    assert(curly_loop_add_timer(loop, 70, record_timer, (void *)&first_timer) == 0);
+    assert(curly_loop_delayed(loop) == 5 && curly_loop_in_flight(loop) == 0);
+    
+    while (curly_loop_delayed(loop) > 0 || curly_loop_in_flight(loop) > 0) {
+        assert(curly_loop_run_once(loop, -1) == 0);
+    }
+    assert(loop_events.count == 5 && memcmp(loop_events.order, "bxcya", 5) == 0);
+    assert(loop_events.results[0] == CURLE_OK && loop_events.results[2] == CURLE_OK &&
+           loop_events.results[4] == CURLE_OK);
+    
+    // A transfer libcurl cannot finish by itself is finished by hand
+    int port;
+    int listener = listen_loopback(1, &port);
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/silent", port);
+    tagged_transfer_t silent;
+    init_tagged_transfer(&silent, url, 's');
+    assert(curly_loop_add(loop, &silent.base) == 0);
+    assert(curly_loop_run_once(loop, 50) == 0);
+    assert(curly_loop_in_flight(loop) == 1 && loop_events.count == 5);
+    curly_loop_finish(loop, &silent.base, CURLE_ABORTED_BY_CALLBACK);
+    assert(curly_loop_in_flight(loop) == 0);
+    assert(loop_events.count == 6 && loop_events.order[5] == 's');
+    assert(loop_events.results[5] == CURLE_ABORTED_BY_CALLBACK);
+    close(listener);
+    
+    // A watched descriptor is reported once it has room, not while full
+    int fds[2];
+    assert(pipe(fds) == 0);
+    assert(fcntl(fds[0], F_SETFL, O_NONBLOCK) == 0 && fcntl(fds[1], F_SETFL, O_NONBLOCK) == 0);
+    char block[4096];
+    memset(block, 'p', sizeof(block));
+    while (write(fds[1], block, sizeof(block)) > 0) {
+    }
+    assert(errno == EAGAIN);
+    assert(curly_loop_watch_writable(loop, fds[1], record_writable, &fds[1]) == 0);
+    assert(curly_loop_run_once(loop, 50) == 0);
+    assert(loop_events.count == 6);
+    while (read(fds[0], block, sizeof(block)) > 0) {
+    }
+    assert(curly_loop_run_once(loop, 1000) == 0);
+    assert(loop_events.count == 7 && loop_events.order[6] == 'w');
+    
+    // The ready function stopped the watch
+    assert(curly_loop_run_once(loop, 50) == 0);
+    assert(loop_events.count == 7);
+    close(fds[0]);
+    close(fds[1]);
+    
+    curly_loop_destroy(loop);
+    for (int i = 0; i < 3; i++) {
+        curl_easy_cleanup(transfers[i].base.easy);
+    }
+    curl_easy_cleanup(silent.base.easy);
+    unlink(path);
+    printf("test_loop: PASSED\n");
+}
+
+void test_parallel_resume_refused() {
+    printf("Running test_parallel_resume_refused...\n");
+    
+    // A body that breaks off, then a refusal of the rest once the file has
+    // shrunk below the prefix, then the new, shorter file
+    const char *responses[] = {
+        "HTTP/1.1 200 OK\r\nETag: \"v1\"\r\nAccept-Ranges: bytes\r\nContent-Length: 10\r\n"
+        "Connection: close\r\n\r\n01234",
+        "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */3\r\nContent-Length: 0\r\n"
+        "Connection: close\r\n\r\n",
+        "HTTP/1.1 200 OK\r\nETag: \"v2\"\r\nContent-Length: 3\r\nConnection: close\r\n\r\nabc",
+    };
+    int port;
+    pid_t server = serve_responses(responses, 3, &port);
+    
+    char dir[] = "/tmp/curly_refused_XXXXXX";
+    assert(mkdtemp(dir) != NULL);
+    char destination[256], part[256], journal[256], command[1024];
+    snprintf(destination, sizeof(destination), "%s/file", dir);
+    snprintf(part, sizeof(part), "%s/file.part", dir);
+    snprintf(journal, sizeof(journal), "%s/journal", dir);
+    
+    curly_parallel_options_t options;
+    curly_parallel_options_init(&options);
+    options.thread_count = 1;
+    options.retries = 0;
+    options.journal_path = journal;
+    
+    FILE *input = tmpfile();
+    assert(input != NULL);
+    fprintf(input, "http://127.0.0.1:%d/file\t%s\n", port, destination);
+    rewind(input);
+    curly_parallel_download_ex(&options, input);
+    struct stat st;
+    assert(stat(part, &st) == 0 && st.st_size == 5);
+    
+    // Without a retry to spend, the 416 still leads to the whole new file
+    rewind(input);
+    assert(curly_parallel_download_ex(&options, input) == CURLY_OK);
+    fclose(input);
+    waitpid(server, NULL, 0);
+    
+    char contents[16] = {0};
+    FILE *file = fopen(destination, "r");
+    assert(file && fread(contents, 1, sizeof(contents) - 1, file) == 3 && fclose(file) == 0);
+    assert(strcmp(contents, "abc") == 0);
+    assert(stat(part, &st) != 0);
+    snprintf(command, sizeof(command), "grep -q '^complete' %s", journal);
+    assert(system(command) == 0);
+    
+    snprintf(command, sizeof(command), "rm -rf %s", dir);
+    assert(system(command) == 0);
+    printf("test_parallel_resume_refused: PASSED\n");
+}
+
 int main(int argc, char *argv[]) {
     // If a specific test was specified
     if (argc > 1) {
@@ -92,6 +2353,90 @@ int main(int argc, char *argv[]) {
         } else if (strcmp(test_name, "test_error_handling") == 0) {
             test_error_handling();
             return 0;
+        } else if (strcmp(test_name, "test_parallel_options_defaults") == 0) {
+            test_parallel_options_defaults();
+            return 0;
+        } else if (strcmp(test_name, "test_retry_policy") == 0) {
+            test_retry_policy();
+            return 0;
+        } else if (strcmp(test_name, "test_rate_limit") == 0) {
+            test_rate_limit();
+            return 0;
+        } else if (strcmp(test_name, "test_batch_invalid_lines") == 0) {
+            test_batch_invalid_lines();
+            return 0;
+        } else if (strcmp(test_name, "test_sink_binary_body") == 0) {
+            test_sink_binary_body();
+            return 0;
+        } else if (strcmp(test_name, "test_plan_execute") == 0) {
+            test_plan_execute();
+            return 0;
+        } else if (strcmp(test_name, "test_download_file_ex_fallback") == 0) {
+            test_download_file_ex_fallback();
+            return 0;
+        } else if (strcmp(test_name, "test_parallel_journal_skip") == 0) {
+            test_parallel_journal_skip();
+            return 0;
+        } else if (strcmp(test_name, "test_arena_config") == 0) {
+            test_arena_config();
+            return 0;
+        } else if (strcmp(test_name, "test_buffer_pool") == 0) {
+            test_buffer_pool();
+            return 0;
+        } else if (strcmp(test_name, "test_stats_summary") == 0) {
+            test_stats_summary();
+            return 0;
+        } else if (strcmp(test_name, "test_serve_client") == 0) {
+            test_serve_client();
+            return 0;
+        } else if (strcmp(test_name, "test_parallel_log") == 0) {
+            test_parallel_log();
+            return 0;
+        } else if (strcmp(test_name, "test_ingest_lines") == 0) {
+            test_ingest_lines();
+            return 0;
+        } else if (strcmp(test_name, "test_parallel_dedup") == 0) {
+            test_parallel_dedup();
+            return 0;
+        } else if (strcmp(test_name, "test_request_cache") == 0) {
+            test_request_cache();
+            return 0;
+        } else if (strcmp(test_name, "test_parallel_resolve") == 0) {
+            test_parallel_resolve();
+            return 0;
+        } else if (strcmp(test_name, "test_parallel_output") == 0) {
+            test_parallel_output();
+            return 0;
+        } else if (strcmp(test_name, "test_compression") == 0) {
+            test_compression();
+            return 0;
+        } else if (strcmp(test_name, "test_parallel_revalidate_failure") == 0) {
+            test_parallel_revalidate_failure();
+            return 0;
+        } else if (strcmp(test_name, "test_parallel_resume_part") == 0) {
+            test_parallel_resume_part();
+            return 0;
+        } else if (strcmp(test_name, "test_job_queue") == 0) {
+            test_job_queue();
+            return 0;
+        } else if (strcmp(test_name, "test_parallel_host_limit") == 0) {
+            test_parallel_host_limit();
+            return 0;
+        } else if (strcmp(test_name, "test_writer") == 0) {
+            test_writer();
+            return 0;
+        } else if (strcmp(test_name, "test_segmented_download") == 0) {
+            test_segmented_download();
+            return 0;
+        } else if (strcmp(test_name, "test_http_version") == 0) {
+            test_http_version();
+            return 0;
+        } else if (strcmp(test_name, "test_loop") == 0) {
+            test_loop();
+            return 0;
+        } else if (strcmp(test_name, "test_parallel_resume_refused") == 0) {
+            test_parallel_resume_refused();
+            return 0;
         } else {
             fprintf(stderr, "Unknown test: %s\n", test_name);
             return 1;
@@ -104,6 +2449,34 @@ int main(int argc, char *argv[]) {
     test_parse_config_basic();
     test_parse_config_full();
     test_error_handling();
+    test_parallel_options_defaults();
+    test_retry_policy();
+    test_rate_limit();
+    test_batch_invalid_lines();
+    test_sink_binary_body();
+    test_plan_execute();
+    test_download_file_ex_fallback();
+    test_parallel_journal_skip();
+    test_arena_config();
+    test_buffer_pool();
+    test_stats_summary();
+    test_serve_client();
+    test_parallel_log();
+    test_ingest_lines();
+    test_parallel_dedup();
+    test_request_cache();
+    test_parallel_resolve();
+    test_parallel_output();
+    test_compression();
+    test_parallel_revalidate_failure();
+    test_parallel_resume_part();
+    test_job_queue();
+    test_parallel_host_limit();
+    test_writer();
+    test_segmented_download();
+    test_http_version();
+    test_loop();
+    test_parallel_resume_refused();
     
     curl_global_cleanup();
     